@@ -26,7 +26,17 @@
 #include <seastar/core/app-template.hh>
 #include <seastar/core/distributed.hh>
 #include <seastar/core/semaphore.hh>
+#include <seastar/core/condition-variable.hh>
+#include <seastar/core/sleep.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/when_all.hh>
+#include <seastar/core/bitops.hh>
+#include <boost/algorithm/string.hpp>
 #include <chrono>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <random>
 
 using namespace seastar;
 
@@ -37,25 +47,163 @@ void http_debug(const char* fmt, Args&&... args) {
 #endif
 }
 
+// A latency histogram in the manner of HdrHistogram: values below
+// 2^sub_bucket_bits are counted exactly, larger ones with
+// sub_bucket_bits - 1 significant bits, so whatever their magnitude the
+// percentiles are within 1/64 of the true values. Histograms are merged by
+// adding their counts.
+class hdr_histogram {
+    static constexpr unsigned sub_bucket_bits = 7;
+    static constexpr uint64_t half = uint64_t(1) << (sub_bucket_bits - 1);
+    std::vector<uint64_t> _counts = std::vector<uint64_t>((64 - sub_bucket_bits + 2) * half);
+    uint64_t _count = 0;
+    uint64_t _min = std::numeric_limits<uint64_t>::max();
+    uint64_t _max = 0;
+    double _sum = 0;
+
+    static size_t index(uint64_t v) {
+        if (v < 2 * half) {
+            return v;
+        }
+        auto shift = log2floor(v) - (sub_bucket_bits - 1);
+        return shift * half + (v >> shift);
+    }
+    // the highest value counted in a bucket
+    static uint64_t highest(size_t i) {
+        if (i < 2 * half) {
+            return i;
+        }
+        auto shift = i / half - 1;
+        auto mantissa = i - shift * half;
+        return ((mantissa + 1) << shift) - 1;
+    }
+public:
+    void record(uint64_t v) {
+        _counts[index(v)]++;
+        _count++;
+        _min = std::min(_min, v);
+        _max = std::max(_max, v);
+        _sum += v;
+    }
+    hdr_histogram& operator+=(const hdr_histogram& o) {
+        for (size_t i = 0; i < _counts.size(); i++) {
+            _counts[i] += o._counts[i];
+        }
+        _count += o._count;
+        _min = std::min(_min, o._min);
+        _max = std::max(_max, o._max);
+        _sum += o._sum;
+        return *this;
+    }
+    uint64_t count() const {
+        return _count;
+    }
+    uint64_t min() const {
+        return _count ? _min : 0;
+    }
+    uint64_t max() const {
+        return _max;
+    }
+    double mean() const {
+        return _count ? _sum / _count : 0;
+    }
+    // the value below which p percent of the values are
+    uint64_t percentile(double p) const {
+        auto target = std::max<uint64_t>(std::ceil(p / 100 * _count), 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < _counts.size(); i++) {
+            seen += _counts[i];
+            if (seen >= target) {
+                return std::min(highest(i), _max);
+            }
+        }
+        return _max;
+    }
+};
+
+struct run_stats {
+    uint64_t responses = 0;
+    // responses with a status other than 2xx
+    uint64_t bad_status = 0;
+    // requests lost with a connection
+    uint64_t errors = 0;
+    // the most requests that waited for a connection at once
+    size_t max_backlog = 0;
+    // from when a request was due until its response was read, in ns
+    hdr_histogram latency;
+
+    run_stats& operator+=(const run_stats& o) {
+        responses += o.responses;
+        bad_status += o.bad_status;
+        errors += o.errors;
+        max_backlog = std::max(max_backlog, o.max_backlog);
+        latency += o.latency;
+        return *this;
+    }
+};
+
+struct request_kind {
+    // the request, formatted
+    sstring data;
+    double weight;
+};
+
+struct load_options {
+    unsigned duration;
+    unsigned total_conn;
+    unsigned reqs_per_conn;
+    // requests per second across all shards, 0 for a closed loop
+    double rate;
+    bool poisson;
+    // requests in flight per connection
+    unsigned pipeline;
+    std::vector<request_kind> mix;
+};
+
+// In a closed loop, every connection sends a request as soon as it gets a
+// response. That measures throughput but hides the queueing delay of a slow
+// server, which also slows the requests down. In an open loop requests are
+// due at a target rate whatever the server does, and their latency is
+// taken from when they were due, so that time spent waiting for a
+// connection counts too.
 class http_client {
 private:
     unsigned _duration;
     unsigned _conn_per_core;
     unsigned _reqs_per_conn;
+    double _rate;
+    bool _poisson;
+    unsigned _pipeline;
+    std::vector<request_kind> _mix;
+    std::discrete_distribution<size_t> _pick_request;
+    std::exponential_distribution<double> _exponential{1.0};
+    std::default_random_engine _rng{std::random_device()()};
     std::vector<connected_socket> _sockets;
     semaphore _conn_connected{0};
-    semaphore _conn_finished{0};
     timer<> _run_timer;
     bool _timer_based;
     bool _timer_done{false};
-    uint64_t _total_reqs{0};
+    run_stats _stats;
+    // open loop: the due times of requests waiting for a connection
+    std::deque<steady_clock_type::time_point> _backlog;
+    bool _schedule_done{false};
+    size_t _next_conn = 0;
 public:
-    http_client(unsigned duration, unsigned total_conn, unsigned reqs_per_conn)
-        : _duration(duration)
-        , _conn_per_core(total_conn / smp::count)
-        , _reqs_per_conn(reqs_per_conn)
+    http_client(load_options o)
+        : _duration(o.duration)
+        , _conn_per_core(o.total_conn / smp::count)
+        , _reqs_per_conn(o.reqs_per_conn)
+        , _rate(o.rate / smp::count)
+        , _poisson(o.poisson)
+        , _pipeline(std::max(o.pipeline, 1u))
+        , _mix(std::move(o.mix))
         , _run_timer([this] { _timer_done = true; })
-        , _timer_based(reqs_per_conn == 0) {
+        , _timer_based(o.reqs_per_conn == 0) {
+        std::vector<double> weights;
+        for (auto& r : _mix) {
+            weights.push_back(r.weight);
+        }
+        _pick_request = std::discrete_distribution<size_t>(weights.begin(), weights.end());
     }
 
     class connection {
@@ -65,7 +213,12 @@ class http_client {
         output_stream<char> _write_buf;
         http_response_parser _parser;
         http_client* _http_client;
-        uint64_t _nr_done{0};
+        // when the requests sent and not yet answered were due, in order
+        std::deque<steady_clock_type::time_point> _inflight;
+        condition_variable _has_inflight;
+        future<> _writes = make_ready_future<>();
+        uint64_t _nr_sent{0};
+        bool _failed{false};
     public:
         connection(connected_socket&& fd, http_client* client)
             : _fd(std::move(fd))
@@ -74,56 +227,172 @@ class http_client {
             , _http_client(client){
         }
 
-        uint64_t nr_done() {
-            return _nr_done;
+        uint64_t nr_sent() const {
+            return _nr_sent;
         }
 
-        future<> do_req() {
-            return _write_buf.write("GET / HTTP/1.1\r\nHost: 127.0.0.1:10000\r\n\r\n").then([this] {
-                return _write_buf.flush();
-            }).then([this] {
-                _parser.init();
-                return _read_buf.consume(_parser).then([this] {
-                    // Read HTTP response header first
-                    if (_parser.eof()) {
-                        return make_ready_future<>();
-                    }
-                    auto _rsp = _parser.get_parsed_response();
-                    auto it = _rsp->_headers.find("Content-Length");
-                    if (it == _rsp->_headers.end()) {
-                        fmt::print("Error: HTTP response does not contain: Content-Length\n");
-                        return make_ready_future<>();
+        size_t inflight() const {
+            return _inflight.size();
+        }
+
+        bool failed() const {
+            return _failed;
+        }
+
+        void wake() {
+            _has_inflight.signal();
+        }
+
+        void send(steady_clock_type::time_point due) {
+            auto& req = _http_client->pick_request();
+            _inflight.push_back(due);
+            _nr_sent++;
+            // requests are pipelined, each written once the one before is
+            _writes = _writes.then([this, &req] {
+                return _write_buf.write(req.data).then([this] {
+                    return _write_buf.flush();
+                });
+            });
+            _has_inflight.signal();
+        }
+
+        future<> read_response() {
+            _parser.init();
+            return _read_buf.consume(_parser).then([this] {
+                if (_parser.eof()) {
+                    return make_exception_future<>(std::runtime_error("connection closed by the server"));
+                }
+                auto rsp = _parser.get_parsed_response();
+                if (rsp->_status < 200 || rsp->_status >= 300) {
+                    _http_client->_stats.bad_status++;
+                }
+                // responses without a body, such as to HEAD, have none
+                auto it = rsp->_headers.find("Content-Length");
+                auto content_len = it == rsp->_headers.end() ? 0 : std::stoul(it->second);
+                return _read_buf.skip(content_len);
+            });
+        }
+
+        // reads the responses until the client is done with the connection
+        future<> read_responses() {
+            return repeat([this] {
+                return _has_inflight.wait([this] {
+                    return !_inflight.empty() || _http_client->done(*this);
+                }).then([this] {
+                    if (_inflight.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
                     }
-                    auto content_len = std::stoi(it->second);
-                    http_debug("Content-Length = %d\n", content_len);
-                    // Read HTTP response body
-                    return _read_buf.read_exactly(content_len).then([this] (temporary_buffer<char> buf) {
-                        _nr_done++;
-                        http_debug("%s\n", buf.get());
-                        if (_http_client->done(_nr_done)) {
-                            return make_ready_future();
-                        } else {
-                            return do_req();
-                        }
+                    return read_response().then([this] {
+                        auto due = _inflight.front();
+                        _inflight.pop_front();
+                        _http_client->complete(*this, due);
+                        return stop_iteration::no;
                     });
                 });
+            }).handle_exception([this] (std::exception_ptr ep) {
+                fmt::print("http request error: {}\n", ep);
+                _failed = true;
+                _http_client->_stats.errors += _inflight.size();
+                _inflight.clear();
+            });
+        }
+
+        future<> close() {
+            return std::move(_writes).then([this] {
+                return _write_buf.close();
+            }).handle_exception([] (std::exception_ptr) {
+                // reported by read_responses()
             });
         }
     };
 
-    future<uint64_t> total_reqs() {
-        fmt::print("Requests on cpu {:2d}: {:d}\n", this_shard_id(), _total_reqs);
-        return make_ready_future<uint64_t>(_total_reqs);
+    const request_kind& pick_request() {
+        return _mix[_pick_request(_rng)];
     }
 
-    bool done(uint64_t nr_done) {
+    bool can_send(const connection& c) const {
         if (_timer_based) {
-            return _timer_done;
+            return !_timer_done;
         } else {
-            return nr_done >= _reqs_per_conn;
+            return c.nr_sent() < _reqs_per_conn;
         }
     }
 
+    bool done(const connection& c) const {
+        if (_rate > 0) {
+            return _schedule_done && _backlog.empty();
+        }
+        return !can_send(c);
+    }
+
+    void complete(connection& c, steady_clock_type::time_point due) {
+        auto now = steady_clock_type::now();
+        _stats.responses++;
+        _stats.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count());
+        if (_rate == 0) {
+            if (can_send(c)) {
+                c.send(now);
+            }
+            return;
+        }
+        if (!_backlog.empty()) {
+            c.send(_backlog.front());
+            _backlog.pop_front();
+            if (_schedule_done && _backlog.empty()) {
+                wake_all();
+            }
+        }
+    }
+
+    // open loop: sends a request that is due on a connection with room in
+    // its pipeline, or keeps it for the first to have some
+    void dispatch(steady_clock_type::time_point due) {
+        for (size_t i = 0; i < _connections.size(); i++) {
+            auto& c = *_connections[_next_conn];
+            _next_conn = (_next_conn + 1) % _connections.size();
+            if (!c.failed() && c.inflight() < _pipeline) {
+                c.send(due);
+                return;
+            }
+        }
+        _backlog.push_back(due);
+        _stats.max_backlog = std::max(_stats.max_backlog, _backlog.size());
+    }
+
+    void wake_all() {
+        for (auto& c : _connections) {
+            c->wake();
+        }
+    }
+
+    // open loop: dispatches the requests as they fall due until the end of
+    // the run, catching up on those it is late for
+    future<> schedule() {
+        auto start = steady_clock_type::now();
+        auto end = start + std::chrono::seconds(_duration);
+        // the mean time between requests, in ns
+        auto interval = 1e9 / _rate;
+        return do_with(start, 0.0, [this, start, end, interval] (steady_clock_type::time_point& next, double& offset) {
+            return do_until([&next, end] { return next >= end; }, [this, &next, &offset, start, end, interval] {
+                auto now = steady_clock_type::now();
+                while (next <= now && next < end) {
+                    dispatch(next);
+                    offset += _poisson ? _exponential(_rng) * interval : interval;
+                    next = start + std::chrono::nanoseconds(std::llround(offset));
+                }
+                return seastar::sleep(std::min(next, end) - now);
+            });
+        }).then([this] {
+            _schedule_done = true;
+            wake_all();
+        });
+    }
+
+    future<run_stats> stats() {
+        fmt::print("Requests on cpu {:2d}: {:d}\n", this_shard_id(), _stats.responses);
+        return make_ready_future<run_stats>(_stats);
+    }
+
     future<> connect(ipv4_addr server_addr) {
         // Establish all the TCP connections first
         for (unsigned i = 0; i < _conn_per_core; i++) {
@@ -140,37 +409,70 @@ class http_client {
     future<> run() {
         // All connected, start HTTP request
         http_debug("Established all %6d tcp connections on cpu %3d\n", _conn_per_core, this_shard_id());
-        if (_timer_based) {
-            _run_timer.arm(std::chrono::seconds(_duration));
-        }
         for (auto&& fd : _sockets) {
-            auto conn = new connection(std::move(fd), this);
-            // Run in the background, signal _conn_finished when done.
-            (void)conn->do_req().then_wrapped([this, conn] (auto&& f) {
-                http_debug("Finished connection %6d on cpu %3d\n", _conn_finished.current(), this_shard_id());
-                _total_reqs += conn->nr_done();
-                _conn_finished.signal();
-                delete conn;
-                // FIXME: should _conn_finished.signal be called only after this?
-                // nothing seems to synchronize with this background work.
-                try {
-                    f.get();
-                } catch (std::exception& ex) {
-                    fmt::print("http request error: {}\n", ex.what());
+            _connections.push_back(std::make_unique<connection>(std::move(fd), this));
+        }
+        _sockets.clear();
+        future<> scheduled = make_ready_future<>();
+        if (_rate > 0) {
+            scheduled = schedule();
+        } else {
+            if (_timer_based) {
+                _run_timer.arm(std::chrono::seconds(_duration));
+            }
+            auto now = steady_clock_type::now();
+            for (auto& c : _connections) {
+                for (unsigned i = 0; i < _pipeline && can_send(*c); i++) {
+                    c->send(now);
                 }
-            });
+            }
         }
-
-        // All finished
-        return _conn_finished.wait(_conn_per_core);
+        auto read = parallel_for_each(_connections, [] (std::unique_ptr<connection>& c) {
+            return c->read_responses();
+        });
+        return when_all_succeed(std::move(scheduled), std::move(read)).discard_result().then([this] {
+            // left when every connection failed
+            _stats.errors += _backlog.size();
+            _backlog.clear();
+            return parallel_for_each(_connections, [] (std::unique_ptr<connection>& c) {
+                return c->close();
+            });
+        });
     }
     future<> stop() {
+        _connections.clear();
         return make_ready_future();
     }
+private:
+    std::vector<std::unique_ptr<connection>> _connections;
 };
 
 namespace bpo = boost::program_options;
 
+// "METHOD PATH [WEIGHT]"
+static request_kind parse_request(const std::string& spec, const std::string& host) {
+    std::vector<std::string> words;
+    boost::split(words, spec, boost::is_space(), boost::token_compress_on);
+    if (words.size() < 2 || words.size() > 3) {
+        throw std::invalid_argument(format("bad request \"{}\", expected METHOD PATH [WEIGHT]", spec));
+    }
+    auto weight = words.size() == 3 ? std::stod(words[2]) : 1.0;
+    return request_kind{format("{} {} HTTP/1.1\r\nHost: {}\r\nContent-Length: 0\r\n\r\n", words[0], words[1], host), weight};
+}
+
+static void print_latency(const hdr_histogram& h) {
+    auto us = [] (double ns) {
+        return ns / 1000;
+    };
+    fmt::print("Latency (us):\n");
+    fmt::print("  min    {:12.1f}\n", us(h.min()));
+    fmt::print("  mean   {:12.1f}\n", us(h.mean()));
+    for (auto p : {50.0, 90.0, 99.0, 99.9, 99.99}) {
+        fmt::print("  p{:<6g}{:12.1f}\n", p, us(h.percentile(p)));
+    }
+    fmt::print("  max    {:12.1f}\n", us(h.max()));
+}
+
 int main(int ac, char** av) {
     app_template::config app_cfg;
     app_cfg.auto_handle_sigint_sigterm = false;
@@ -180,7 +482,12 @@ int main(int ac, char** av) {
         ("server,s", bpo::value<std::string>()->default_value("192.168.66.100:10000"), "Server address")
         ("conn,c", bpo::value<unsigned>()->default_value(100), "total connections")
         ("reqs,r", bpo::value<unsigned>()->default_value(0), "reqs per connection")
-        ("duration,d", bpo::value<unsigned>()->default_value(10), "duration of the test in seconds)");
+        ("duration,d", bpo::value<unsigned>()->default_value(10), "duration of the test in seconds)")
+        ("rate", bpo::value<double>()->default_value(0), "target requests/sec across all cpus for an open loop, 0 for a closed loop")
+        ("arrival", bpo::value<std::string>()->default_value("poisson"), "open loop arrivals: poisson or uniform")
+        ("pipeline,p", bpo::value<unsigned>()->default_value(1), "requests in flight per connection")
+        ("request", bpo::value<std::vector<std::string>>()->composing(),
+                "a request of the mix, as \"METHOD PATH [WEIGHT]\", may be repeated (default \"GET /\")");
 
     return app.run(ac, av, [&app] () -> future<int> {
         auto& config = app.configuration();
@@ -188,11 +495,31 @@ int main(int ac, char** av) {
         auto reqs_per_conn = config["reqs"].as<unsigned>();
         auto total_conn= config["conn"].as<unsigned>();
         auto duration = config["duration"].as<unsigned>();
+        auto rate = config["rate"].as<double>();
+        auto arrival = config["arrival"].as<std::string>();
+        auto pipeline = config["pipeline"].as<unsigned>();
+        std::vector<std::string> specs = {"GET /"};
+        if (config.count("request")) {
+            specs = config["request"].as<std::vector<std::string>>();
+        }
 
         if (total_conn % smp::count != 0) {
             fmt::print("Error: conn needs to be n * cpu_nr\n");
             return make_ready_future<int>(-1);
         }
+        if (arrival != "poisson" && arrival != "uniform") {
+            fmt::print("Error: arrival needs to be poisson or uniform\n");
+            return make_ready_future<int>(-1);
+        }
+        std::vector<request_kind> mix;
+        try {
+            for (auto& spec : specs) {
+                mix.push_back(parse_request(spec, server));
+            }
+        } catch (std::exception& e) {
+            fmt::print("Error: {}\n", e.what());
+            return make_ready_future<int>(-1);
+        }
 
         auto http_clients = new distributed<http_client>;
 
@@ -201,22 +528,40 @@ int main(int ac, char** av) {
         fmt::print("========== http_client ============\n");
         fmt::print("Server: {}\n", server);
         fmt::print("Connections: {:d}\n", total_conn);
-        fmt::print("Requests/connection: {}\n", reqs_per_conn == 0 ? "dynamic (timer based)" : std::to_string(reqs_per_conn));
-        return http_clients->start(std::move(duration), std::move(total_conn), std::move(reqs_per_conn)).then([http_clients, server] {
+        fmt::print("Pipeline depth: {:d}\n", pipeline);
+        if (rate > 0) {
+            fmt::print("Open loop: {:g} requests/sec, {} arrivals\n", rate, arrival);
+        } else {
+            fmt::print("Requests/connection: {}\n", reqs_per_conn == 0 ? "dynamic (timer based)" : std::to_string(reqs_per_conn));
+        }
+        for (auto& spec : specs) {
+            fmt::print("Request: {}\n", spec);
+        }
+        load_options options{duration, total_conn, reqs_per_conn, rate, arrival == "poisson", pipeline, std::move(mix)};
+        return http_clients->start(std::move(options)).then([http_clients, server] {
             return http_clients->invoke_on_all(&http_client::connect, ipv4_addr{server});
         }).then([http_clients] {
             return http_clients->invoke_on_all(&http_client::run);
         }).then([http_clients] {
-            return http_clients->map_reduce(adder<uint64_t>(), &http_client::total_reqs);
-        }).then([http_clients, started] (auto total_reqs) {
+            return http_clients->map_reduce0(std::mem_fn(&http_client::stats), run_stats(), [] (run_stats a, const run_stats& b) {
+                a += b;
+                return a;
+            });
+        }).then([http_clients, started, rate] (run_stats stats) {
            // All the http requests are finished
            auto finished = steady_clock_type::now();
            auto elapsed = finished - started;
            auto secs = static_cast<double>(elapsed.count() / 1000000000.0);
            fmt::print("Total cpus: {:d}\n", smp::count);
-           fmt::print("Total requests: {:d}\n", total_reqs);
+           fmt::print("Total requests: {:d}\n", stats.responses);
            fmt::print("Total time: {:f}\n", secs);
-           fmt::print("Requests/sec: {:f}\n", static_cast<double>(total_reqs) / secs);
+           fmt::print("Requests/sec: {:f}\n", static_cast<double>(stats.responses) / secs);
+           if (rate > 0) {
+               fmt::print("Most requests waiting for a connection on a cpu: {:d}\n", stats.max_backlog);
+           }
+           fmt::print("Non-2xx responses: {:d}\n", stats.bad_status);
+           fmt::print("Failed requests: {:d}\n", stats.errors);
+           print_latency(stats.latency);
            fmt::print("==========     done     ============\n");
            return http_clients->stop().then([http_clients] {
                // FIXME: If we call engine().exit(0) here to exit when
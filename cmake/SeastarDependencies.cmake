@@ -66,7 +66,9 @@ macro (seastar_find_dependencies)
     lksctp-tools # No version information published.
     numactl # No version information published.
     rt
-    yaml-cpp)
+    yaml-cpp
+    ZLIB
+    zstd)
 
   # Arguments to `find_package` for each 3rd-party dependency.
   # Note that the version specification is a "minimal" version requirement.
@@ -93,6 +95,8 @@ macro (seastar_find_dependencies)
   set (_seastar_dep_args_lksctp-tools REQUIRED)
   set (_seastar_dep_args_rt REQUIRED)
   set (_seastar_dep_args_yaml-cpp 0.5.1 REQUIRED)
+  set (_seastar_dep_args_zstd 1.4.0 REQUIRED)
+  set (_seastar_dep_args_ZLIB 1.2 REQUIRED)
 
   foreach (third_party ${_seastar_all_dependencies})
     find_package ("${third_party}" ${_seastar_dep_args_${third_party}})
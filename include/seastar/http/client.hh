@@ -0,0 +1,220 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/http/response_parser.hh>
+#include <seastar/http/request.hh>
+#include <seastar/core/condition-variable.hh>
+#include <seastar/core/gate.hh>
+#include <seastar/core/iostream.hh>
+#include <seastar/core/shared_ptr.hh>
+#include <seastar/core/timer.hh>
+#include <seastar/net/api.hh>
+#include <seastar/net/tls.hh>
+#include <seastar/util/noncopyable_function.hh>
+#include <optional>
+#include <vector>
+
+namespace seastar {
+
+namespace http {
+
+using header_map = httpd::header_map;
+
+/**
+ * A request to be sent by \ref client.
+ */
+struct request {
+    sstring method;
+    /// the request target, path and query
+    sstring url;
+    /// "Host" is filled in by the client unless set here; "Content-Length"
+    /// and "Transfer-Encoding" are always set by the client
+    header_map headers;
+    /// the request body, unless \ref body_writer is set
+    sstring content;
+    /**
+     * Writes the request body, which is then sent with chunked transfer
+     * encoding. The writer is called with the stream and must not close it.
+     * A request with a body writer is never retried.
+     */
+    noncopyable_function<future<> (output_stream<char>&)> body_writer;
+
+    request(sstring method, sstring url) : method(std::move(method)), url(std::move(url)) {
+    }
+
+    request& add_header(const sstring& name, const sstring& value) {
+        headers[name] = value;
+        return *this;
+    }
+    request& set_content(sstring body) {
+        content = std::move(body);
+        return *this;
+    }
+};
+
+/**
+ * The status line and headers of a response received by \ref client.
+ */
+struct response {
+    int status = 0;
+    sstring version;
+    header_map headers;
+    /// the body, only filled by client::make_request(request)
+    sstring content;
+
+    sstring get_header(const sstring& name) const {
+        auto it = headers.find(name);
+        return it == headers.end() ? sstring() : it->second;
+    }
+};
+
+/**
+ * Makes the connections of a \ref client.
+ */
+class connection_factory {
+public:
+    virtual ~connection_factory() {}
+    virtual future<connected_socket> make() = 0;
+};
+
+/**
+ * Connects over TCP, or over TLS when given credentials.
+ */
+class basic_connection_factory : public connection_factory {
+    socket_address _addr;
+    shared_ptr<tls::certificate_credentials> _creds;
+    sstring _server_name;
+public:
+    explicit basic_connection_factory(socket_address addr) : _addr(addr) {
+    }
+    /// \param server_name the name the server certificate is verified against
+    basic_connection_factory(socket_address addr, shared_ptr<tls::certificate_credentials> creds, sstring server_name)
+        : _addr(addr), _creds(std::move(creds)), _server_name(std::move(server_name)) {
+    }
+    virtual future<connected_socket> make() override;
+};
+
+struct client_options {
+    /// the "Host" header of requests that do not set one; defaults to the
+    /// server address for a client constructed with one
+    sstring host;
+    /// connections open at most, idle or not
+    unsigned max_connections = 100;
+    /**
+     * How many requests may be sent on a connection before the response to
+     * the first of them arrives (HTTP/1.1 pipelining). Only use more than 1
+     * with servers known to handle pipelining, and with requests that are
+     * safe to repeat, as a connection failure fails all requests on it.
+     */
+    unsigned pipeline_depth = 1;
+    /// time to wait for a connection to be established
+    std::optional<steady_clock_type::duration> connect_timeout;
+    /**
+     * Time for a request to complete, from the call to make_request()
+     * until the response handler returns. When it expires, the connection
+     * the request is on is shut down and the request fails with
+     * timed_out_error.
+     */
+    std::optional<steady_clock_type::duration> request_timeout;
+};
+
+/**
+ * An HTTP/1.1 client.
+ *
+ * A client sends requests to one server over a pool of keep-alive
+ * connections. A request takes an idle connection, opens a new one if
+ * there are fewer than client_options::max_connections, or waits for one
+ * to be released. An idempotent request (GET, HEAD, OPTIONS, PUT or DELETE,
+ * RFC 7231, section 4.2.2) that fails because the server closed an idle
+ * connection it reused is retried once on a new connection. Other requests
+ * may have been handled already, so their error is returned.
+ *
+ * Like everything in seastar, a client belongs to the shard it was created
+ * on, and so does its pool; use a sharded<client> or a client per shard to
+ * send requests from several shards.
+ */
+class client {
+public:
+    /**
+     * Handles a response. The body is streamed from the connection, with
+     * chunked transfer encoding decoded; it may only be read until the
+     * returned future resolves, and whatever is left unread then is skipped.
+     */
+    using response_handler = noncopyable_function<future<> (const response&, input_stream<char>&)>;
+private:
+    class connection;
+
+    std::unique_ptr<connection_factory> _factory;
+    client_options _options;
+    std::vector<lw_shared_ptr<connection>> _connections;
+    unsigned _connecting = 0;
+    // signalled when a connection becomes available
+    condition_variable _wait_con;
+    future<> _closing = make_ready_future<>();
+    gate _gate;
+    uint64_t _total_connections = 0;
+public:
+    explicit client(socket_address addr, client_options options = {});
+    client(std::unique_ptr<connection_factory> factory, client_options options = {});
+    ~client();
+
+    /**
+     * Sends a request and passes its response to handle.
+     *
+     * Responses with a 1xx status other than 101 are skipped. The future
+     * fails if the request could not be sent or the response could not be
+     * parsed, or with the handler's exception.
+     */
+    future<> make_request(request req, response_handler handle);
+
+    /**
+     * Sends a request and returns its response, with the body read into
+     * response::content.
+     */
+    future<response> make_request(request req);
+
+    /**
+     * Waits for the requests in progress and closes all connections.
+     * No requests may be made afterwards.
+     */
+    future<> close();
+
+    /// connections currently open
+    unsigned connections() const;
+    /// open connections with no requests on them
+    unsigned idle_connections() const;
+    /// connections opened since the client was created
+    uint64_t total_new_connections() const {
+        return _total_connections;
+    }
+private:
+    future<> do_make_request(request& req, response_handler& handle, std::optional<steady_clock_type::time_point> deadline, bool retry);
+    future<lw_shared_ptr<connection>> get_connection(std::optional<steady_clock_type::time_point> deadline);
+    lw_shared_ptr<connection> find_connection(bool idle) const;
+    future<lw_shared_ptr<connection>> make_connection(std::optional<steady_clock_type::time_point> deadline);
+    void put_connection(lw_shared_ptr<connection> con);
+};
+
+}
+
+}
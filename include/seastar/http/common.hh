@@ -69,6 +69,13 @@ enum operation_type {
  */
 operation_type str2type(const sstring& type);
 
+/**
+ * Translate an operation type to its command
+ * @param type the operation type
+ * @return the string, "GET" for GET
+ */
+sstring type2str(operation_type type);
+
 }
 
 }
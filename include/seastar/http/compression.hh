@@ -0,0 +1,100 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/core/iostream.hh>
+#include <seastar/core/sstring.hh>
+#include <string_view>
+#include <vector>
+
+namespace seastar {
+
+namespace httpd {
+
+struct reply;
+
+/**
+ * The content codings of RFC 7231, section 3.1.2.1, that replies can be
+ * compressed with.
+ */
+enum class content_encoding {
+    identity,
+    gzip,
+    deflate,
+    zstd,
+};
+
+/// the name of a content coding, as in Content-Encoding
+const char* content_encoding_name(content_encoding e);
+
+struct compression_options {
+    /// replies with a body known to be smaller are sent as they are
+    size_t min_size = 1024;
+    /// in-memory bodies up to this size are compressed whole, larger ones
+    /// as they are sent, a piece at a time
+    size_t inline_max_size = 64 * 1024;
+    /// the codings to use, most preferred first
+    std::vector<content_encoding> encodings = { content_encoding::zstd, content_encoding::gzip, content_encoding::deflate };
+    /// 1 (fastest) to 9 (smallest), for gzip and deflate
+    int zlib_level = 6;
+    /// 1 (fastest) to 19 (smallest), for zstd
+    int zstd_level = 3;
+};
+
+/**
+ * Pick a coding from the value of an Accept-Encoding header (RFC 7231,
+ * section 5.3.4): the one the client gives the highest weight, the first
+ * of those in encodings on a tie.
+ * @return the coding, or identity if the client accepts none of them
+ */
+content_encoding select_content_encoding(std::string_view accept_encoding, const std::vector<content_encoding>& encodings);
+
+/**
+ * Make a stream that compresses what is written to it into out.
+ * Closing the stream closes out.
+ */
+output_stream<char> make_compressed_output_stream(output_stream<char> out, content_encoding e, const compression_options& options);
+
+/**
+ * Compress a buffer whole.
+ */
+sstring compress(std::string_view data, content_encoding e, const compression_options& options);
+
+/**
+ * Compress a reply's body, if its content type compresses well, it is
+ * not too small, and the client accepts one of the codings.
+ *
+ * Text, JSON, JavaScript and XML are compressed. Content set with
+ * reply::write_body(content_type, content) is compressed right away if it
+ * is at most compression_options::inline_max_size bytes, so that it keeps
+ * its Content-Length. Larger content, and a body writer's output, is
+ * compressed as it is written, in which case the reply is sent with
+ * chunked transfer encoding. Replies that have a Content-Encoding
+ * already, and partial or empty replies, are left alone.
+ *
+ * @param accept_encoding the request's Accept-Encoding header
+ */
+void compress_reply(reply& rep, std::string_view accept_encoding, const compression_options& options);
+
+}
+
+}
@@ -23,6 +23,11 @@
 
 #include <seastar/http/handlers.hh>
 #include <seastar/core/iostream.hh>
+#include <seastar/core/temporary_buffer.hh>
+#include <chrono>
+#include <list>
+#include <optional>
+#include <unordered_map>
 
 namespace seastar {
 
@@ -53,6 +58,86 @@ class file_transformer {
     virtual ~file_transformer() = default;
 };
 
+/**
+ * An in-memory cache of small files, for a file_interaction_handler.
+ *
+ * Files of up to max_file_size bytes are kept, up to capacity bytes in all,
+ * evicting the least recently used. An entry is checked against the file on
+ * disk when it is older than validity, so changes to the file are seen
+ * within that time.
+ *
+ * Like the handler that owns it, a cache belongs to a single shard.
+ */
+class file_cache {
+public:
+    using clock = std::chrono::steady_clock;
+    struct entry {
+        temporary_buffer<char> content;
+        sstring etag;
+        clock::time_point validated;
+    };
+private:
+    struct cached_file : public entry {
+        std::list<sstring>::iterator lru;
+    };
+    size_t _capacity;
+    size_t _max_file_size;
+    clock::duration _validity;
+    size_t _size = 0;
+    std::unordered_map<sstring, cached_file> _files;
+    // most recently used first
+    std::list<sstring> _lru;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+public:
+    file_cache(size_t capacity, size_t max_file_size, clock::duration validity)
+            : _capacity(capacity), _max_file_size(max_file_size), _validity(validity) {
+    }
+
+    /**
+     * A cached file that is recent enough to be used without checking the
+     * file on disk.
+     * @return the entry, valid until the cache is next changed, or nullptr
+     */
+    entry* get_fresh(const sstring& name);
+
+    /**
+     * Whether a file is cached and recent enough, like get_fresh(), but
+     * without using the entry.
+     */
+    bool has_fresh(const sstring& name) const;
+
+    /**
+     * The content of a file, read and cached unless cached already.
+     * @param size the size of the file on disk
+     * @param etag the file's current ETag, which tells whether a cached
+     * entry is still valid
+     */
+    future<temporary_buffer<char>> get(const sstring& name, uint64_t size, const sstring& etag);
+
+    bool fresh(const entry& e) const {
+        return clock::now() - e.validated < _validity;
+    }
+    size_t max_file_size() const {
+        return _max_file_size;
+    }
+    /// bytes cached
+    size_t size() const {
+        return _size;
+    }
+    /// requests served without reading the file
+    uint64_t hits() const {
+        return _hits;
+    }
+    /// requests for which the file was read
+    uint64_t misses() const {
+        return _misses;
+    }
+private:
+    void put(const sstring& name, temporary_buffer<char> content, sstring etag);
+    void evict(std::unordered_map<sstring, cached_file>::iterator i);
+};
+
 /**
  * A base class for handlers that interact with files.
  * directory and file handlers both share some common logic
@@ -79,6 +164,36 @@ class file_interaction_handler : public handler_base {
         return this;
     }
 
+    /**
+     * Keep small files in memory, see \ref file_cache. Files that are
+     * transformed are not cached.
+     * @param capacity the total size of the cached files
+     * @param max_file_size the size of the largest file to cache
+     * @param validity how long a cached file is served before the file on
+     * disk is checked for changes
+     * @return this
+     */
+    file_interaction_handler* enable_cache(size_t capacity, size_t max_file_size = 64 * 1024,
+            std::chrono::milliseconds validity = std::chrono::seconds(1)) {
+        cache = std::make_unique<file_cache>(capacity, max_file_size, validity);
+        return this;
+    }
+
+    const file_cache* get_cache() const {
+        return cache.get();
+    }
+
+    /**
+     * Serve file.gz, where there is one, in place of a file, to clients
+     * that accept gzip. The server's compression (see
+     * http_server::set_compression()) then leaves the reply alone.
+     * @return this
+     */
+    file_interaction_handler* set_precompressed(bool b) {
+        precompressed = b;
+        return this;
+    }
+
     /**
      * if the url ends without a slash redirect
      * @param req the request
@@ -98,6 +213,10 @@ class file_interaction_handler : public handler_base {
 
     /**
      * read a file from the disk and return it in the replay.
+     *
+     * Unless the file is transformed, the reply carries an ETag and honors
+     * If-None-Match and single byte ranges, and the file is sent without
+     * being copied.
      * @param file the full path to a file on the disk
      * @param req the reuest
      * @param rep the reply
@@ -105,9 +224,26 @@ class file_interaction_handler : public handler_base {
     future<std::unique_ptr<reply> > read(sstring file,
             std::unique_ptr<request> req, std::unique_ptr<reply> rep);
     file_transformer* transformer;
+    std::unique_ptr<file_cache> cache;
+    bool precompressed = false;
 
     output_stream<char> get_stream(std::unique_ptr<request> req,
             const sstring& extension, output_stream<char>&& s);
+
+private:
+    future<std::unique_ptr<reply>> read_transformed(sstring file_name,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+    future<std::unique_ptr<reply>> read_file(sstring file_name, sstring extension,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+    static std::unique_ptr<reply> reply_content(const sstring& extension, temporary_buffer<char> content,
+            const sstring& etag, const request& req, std::unique_ptr<reply> rep);
+    /**
+     * Set up the reply for a file of the given size and ETag, according
+     * to the request's If-None-Match, Range and If-Range headers.
+     * @return the offset and length of the part of the file to send, if any
+     */
+    static std::optional<std::pair<uint64_t, uint64_t>> select_range(const request& req,
+            reply& rep, uint64_t size, const sstring& etag);
 };
 
 /**
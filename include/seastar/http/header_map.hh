@@ -0,0 +1,136 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/core/sstring.hh>
+#include <boost/container/small_vector.hpp>
+#include <string_view>
+#include <utility>
+#include <strings.h>
+
+namespace seastar {
+
+namespace httpd {
+
+/**
+ * The header fields of a request or a reply.
+ *
+ * A message carries a dozen fields or so, which are looked up a handful of
+ * times, so they are kept in insertion order in a flat vector with room for
+ * the common case inline, and looked up by a linear scan: no allocation
+ * besides the values that do not fit in an sstring, and no hashing.
+ *
+ * Names are compared case insensitively (RFC 7230, section 3.2). The
+ * interface is the part of std::unordered_map's that is used with headers.
+ */
+class header_map {
+public:
+    using value_type = std::pair<sstring, sstring>;
+    static constexpr size_t inline_fields = 16;
+    /// Requests with more field lines are refused, which also keeps the
+    /// linear lookups of parsing them from adding up.
+    static constexpr size_t max_request_fields = 100;
+private:
+    using container = boost::container::small_vector<value_type, inline_fields>;
+    container _fields;
+public:
+    using iterator = container::iterator;
+    using const_iterator = container::const_iterator;
+
+    header_map() = default;
+    header_map(const header_map&) = default;
+    header_map& operator=(const header_map&) = default;
+    // small_vector does not promise it, but only moves the fields, which
+    // cannot throw; futures need it
+    header_map(header_map&& o) noexcept : _fields(std::move(o._fields)) {}
+    header_map& operator=(header_map&& o) noexcept {
+        _fields = std::move(o._fields);
+        return *this;
+    }
+
+    static bool name_equal(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && ::strncasecmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+    iterator begin() { return _fields.begin(); }
+    iterator end() { return _fields.end(); }
+    const_iterator begin() const { return _fields.begin(); }
+    const_iterator end() const { return _fields.end(); }
+    size_t size() const { return _fields.size(); }
+    bool empty() const { return _fields.empty(); }
+    void clear() { _fields.clear(); }
+    void reserve(size_t n) { _fields.reserve(n); }
+
+    iterator find(std::string_view name) {
+        for (auto i = _fields.begin(); i != _fields.end(); ++i) {
+            if (name_equal(i->first, name)) {
+                return i;
+            }
+        }
+        return _fields.end();
+    }
+    const_iterator find(std::string_view name) const {
+        return const_cast<header_map&>(*this).find(name);
+    }
+    size_t count(std::string_view name) const {
+        return find(name) != end();
+    }
+
+    /// the value of a field, added with an empty value if missing
+    sstring& operator[](std::string_view name) {
+        auto i = find(name);
+        if (i == _fields.end()) {
+            i = _fields.emplace(_fields.end(), sstring(name.data(), name.size()), sstring());
+        }
+        return i->second;
+    }
+
+    /// adds a field, unless there is one of that name already
+    std::pair<iterator, bool> emplace(sstring name, sstring value) {
+        auto i = find(name);
+        if (i != _fields.end()) {
+            return {i, false};
+        }
+        return {_fields.emplace(_fields.end(), std::move(name), std::move(value)), true};
+    }
+
+    /// adds a field the caller knows is not there yet
+    void emplace_back(sstring name, sstring value) {
+        _fields.emplace_back(std::move(name), std::move(value));
+    }
+
+    iterator erase(const_iterator i) {
+        return _fields.erase(i);
+    }
+    size_t erase(std::string_view name) {
+        auto i = find(name);
+        if (i == _fields.end()) {
+            return 0;
+        }
+        _fields.erase(i);
+        return 1;
+    }
+};
+
+}
+
+}
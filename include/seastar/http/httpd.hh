@@ -38,10 +38,12 @@
 #include <queue>
 #include <bitset>
 #include <limits>
+#include <optional>
 #include <cctype>
 #include <vector>
 #include <boost/intrusive/list.hpp>
 #include <seastar/http/routes.hh>
+#include <seastar/http/compression.hh>
 #include <seastar/net/tls.hh>
 #include <seastar/core/shared_ptr.hh>
 
@@ -53,6 +55,8 @@ class http_server;
 class http_stats;
 struct reply;
 
+class http2_connection;
+
 using namespace std::chrono_literals;
 
 class http_stats {
@@ -73,7 +77,18 @@ class connection : public boost::intrusive::list_base_hook<> {
     std::unique_ptr<reply> _resp;
     // null element marks eof
     queue<std::unique_ptr<reply>> _replies { 10 };
+    // body of the request being handled, if it has one, see
+    // request::content_stream
+    std::optional<input_stream<char>> _req_body;
     bool _done = false;
+    // set once the connection is to switch to HTTP/2
+    bool _http2 = false;
+    // for a switch by an "Upgrade: h2c" request
+    std::unique_ptr<request> _upgrade_req;
+    sstring _upgrade_settings;
+    // set once a handler took the connection over, see
+    // reply::switch_protocols()
+    noncopyable_function<future<>(input_stream<char>&, output_stream<char>&)> _switch_protocols;
 public:
     connection(http_server& server, connected_socket&& fd,
             socket_address addr)
@@ -85,16 +100,16 @@ class connection : public boost::intrusive::list_base_hook<> {
     void on_new_connection();
 
     future<> process();
+    future<> process_http1();
+    future<> process_http2(bool read_preface);
+    future<> close_streams();
     void shutdown();
     future<> read();
     future<> read_one();
     future<> respond();
     future<> do_response_loop();
 
-    void set_headers(reply& resp);
-
     future<> start_response();
-    future<> write_reply_headers(std::unordered_map<sstring, sstring>::iterator hi);
 
     static short hex_to_byte(char c);
 
@@ -120,6 +135,8 @@ class connection : public boost::intrusive::list_base_hook<> {
      */
     static sstring set_query_param(request& req);
 
+    future<std::unique_ptr<request>> read_request_body(std::unique_ptr<request> req);
+    future<> skip_request_body();
     future<bool> generate_reply(std::unique_ptr<request> req);
     void generate_error_reply_and_close(std::unique_ptr<request> req, reply::status_type status, const sstring& msg);
 
@@ -140,13 +157,22 @@ class http_server {
     uint64_t _respond_errors = 0;
     shared_ptr<seastar::tls::server_credentials> _credentials;
     sstring _date = http_date();
-    timer<> _date_format_timer { [this] {_date = http_date();} };
+    // the "Server" and "Date" fields of every HTTP/1.1 reply, preformatted
+    sstring _common_headers = common_headers(_date);
+    timer<> _date_format_timer { [this] {
+        _date = http_date();
+        _common_headers = common_headers(_date);
+    } };
     size_t _content_length_limit = std::numeric_limits<size_t>::max();
+    bool _content_streaming = false;
+    bool _http2 = false;
+    std::optional<compression_options> _compression;
     gate _task_gate;
 public:
     routes _routes;
     using connection = seastar::httpd::connection;
     explicit http_server(const sstring& name) : _stats(*this, name) {
+        _routes.enable_metrics(name);
         _date_format_timer.arm_periodic(1s);
     }
     /*!
@@ -181,6 +207,43 @@ class http_server {
 
     void set_content_length_limit(size_t limit);
 
+    /*!
+     * \brief stream request bodies to handlers
+     * When enabled, request bodies are not read into request::content;
+     * handlers read them from request::content_stream instead, as they
+     * arrive, so their size is only bounded by what the handler does with
+     * them. The content length limit does not apply then.
+     */
+    void set_content_streaming(bool b);
+
+    bool get_content_streaming() const;
+
+    /*!
+     * \brief serve HTTP/2 too
+     * When enabled, clients can switch a connection to HTTP/2 with an
+     * "Upgrade: h2c" request (plain text only, and only for requests without
+     * a body), by starting it with the HTTP/2 connection preface ("prior
+     * knowledge"), or, with TLS, by negotiating "h2" in the handshake. For
+     * the latter, the server sets the ALPN protocols of its credentials when
+     * it starts listening.
+     *
+     * Requests over HTTP/2 go to the same routes, with version "2.0". Many
+     * of them can be in flight on a connection at once, and their replies
+     * are sent as each becomes ready.
+     */
+    void set_http2(bool b);
+
+    bool get_http2() const;
+
+    /*!
+     * \brief compress replies
+     * Reply bodies are compressed with a content coding the client accepts,
+     * see compress_reply().
+     */
+    void set_compression(compression_options options);
+
+    const std::optional<compression_options>& get_compression() const;
+
     future<> listen(socket_address addr, listen_options lo);
     future<> listen(socket_address addr);
     future<> stop();
@@ -195,10 +258,12 @@ class http_server {
     // Write the current date in the specific "preferred format" defined in
     // RFC 7231, Section 7.1.1.1.
     static sstring http_date();
+    static sstring common_headers(const sstring& date);
 private:
     future<> do_accept_one(int which);
     boost::intrusive::list<connection> _connections;
     friend class seastar::httpd::connection;
+    friend class http2_connection;
     friend class http_server_tester;
 };
 
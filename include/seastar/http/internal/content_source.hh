@@ -0,0 +1,259 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/core/iostream.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/http/exception.hh>
+
+namespace seastar {
+
+namespace httpd {
+
+namespace internal {
+
+// Data sources that read a message body off the connection's input stream,
+// leaving the stream positioned right after the body. They never read past
+// the body, so the next message can be parsed from the same stream.
+
+// A body whose length is given by the Content-Length header.
+class content_length_source_impl : public data_source_impl {
+    input_stream<char>& _inp;
+    size_t _remaining;
+public:
+    content_length_source_impl(input_stream<char>& inp, size_t length)
+        : _inp(inp), _remaining(length) {
+    }
+
+    virtual future<temporary_buffer<char>> get() override {
+        if (!_remaining) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        return _inp.read_up_to(_remaining).then([this] (temporary_buffer<char> buf) {
+            if (buf.empty()) {
+                throw bad_request_exception("Connection closed before the end of the message body");
+            }
+            _remaining -= buf.size();
+            return buf;
+        });
+    }
+
+    virtual future<temporary_buffer<char>> skip(uint64_t n) override {
+        auto len = std::min<uint64_t>(n, _remaining);
+        _remaining -= len;
+        return _inp.skip(len).then([] {
+            return temporary_buffer<char>();
+        });
+    }
+};
+
+// A body sent with "Transfer-Encoding: chunked" (RFC 7230, section 4.1).
+// Chunk extensions and trailer fields are accepted and ignored.
+class chunked_source_impl : public data_source_impl {
+    // parses everything but the chunk data
+    class chunk_parser {
+        enum class state {
+            size,
+            extension,
+            size_lf,
+            data,
+            data_cr,
+            data_lf,
+            trailer,
+            trailer_lf,
+            done,
+        };
+        static constexpr size_t max_line = 8192;
+        state _state = state::size;
+        size_t _chunk_size = 0;
+        size_t _size_digits = 0;
+        size_t _line_length = 0;
+        bool _eof = false;
+
+        static int hex_value(char c) {
+            if (c >= '0' && c <= '9') {
+                return c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                return c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                return c - 'A' + 10;
+            }
+            return -1;
+        }
+        void count_line() {
+            if (++_line_length > max_line) {
+                throw bad_request_exception("Chunk header or trailer too long");
+            }
+        }
+        void end_size_line() {
+            if (!_size_digits) {
+                throw bad_request_exception("Missing chunk size");
+            }
+            _state = _chunk_size ? state::data : state::trailer;
+            _line_length = 0;
+        }
+    public:
+        bool in_data() const {
+            return _state == state::data && _chunk_size;
+        }
+        bool done() const {
+            return _state == state::done;
+        }
+        bool eof() const {
+            return _eof;
+        }
+        size_t chunk_size() const {
+            return _chunk_size;
+        }
+        void consumed(size_t n) {
+            _chunk_size -= n;
+            if (!_chunk_size) {
+                _state = state::data_cr;
+            }
+        }
+
+        future<consumption_result<char>> operator()(temporary_buffer<char> buf) {
+            if (buf.empty()) {
+                _eof = true;
+                return make_ready_future<consumption_result<char>>(stop_consuming<char>(std::move(buf)));
+            }
+            size_t pos = 0;
+            while (pos < buf.size()) {
+                char c = buf[pos++];
+                switch (_state) {
+                case state::size: {
+                    count_line();
+                    auto v = hex_value(c);
+                    if (v >= 0) {
+                        if (++_size_digits > sizeof(size_t) * 2 - 1) {
+                            throw bad_request_exception("Chunk size too large");
+                        }
+                        _chunk_size = _chunk_size * 16 + v;
+                    } else if (c == ';') {
+                        _state = state::extension;
+                    } else if (c == '\r') {
+                        _state = state::size_lf;
+                    } else if (c == '\n') {
+                        end_size_line();
+                    } else if (c != ' ' && c != '\t') {
+                        throw bad_request_exception("Invalid chunk size");
+                    }
+                    break;
+                }
+                case state::extension:
+                    count_line();
+                    if (c == '\r') {
+                        _state = state::size_lf;
+                    } else if (c == '\n') {
+                        end_size_line();
+                    }
+                    break;
+                case state::size_lf:
+                    if (c != '\n') {
+                        throw bad_request_exception("Invalid chunk header");
+                    }
+                    end_size_line();
+                    break;
+                case state::data_cr:
+                    if (c == '\n') {
+                        _state = state::size;
+                        _size_digits = 0;
+                        break;
+                    }
+                    if (c != '\r') {
+                        throw bad_request_exception("Missing CRLF after chunk data");
+                    }
+                    _state = state::data_lf;
+                    break;
+                case state::data_lf:
+                    if (c != '\n') {
+                        throw bad_request_exception("Missing CRLF after chunk data");
+                    }
+                    _state = state::size;
+                    _size_digits = 0;
+                    break;
+                case state::trailer:
+                    if (c == '\r') {
+                        _state = state::trailer_lf;
+                    } else if (c == '\n') {
+                        if (!_line_length) {
+                            _state = state::done;
+                        }
+                        _line_length = 0;
+                    } else {
+                        count_line();
+                    }
+                    break;
+                case state::trailer_lf:
+                    if (c != '\n') {
+                        throw bad_request_exception("Invalid trailer field");
+                    }
+                    _state = _line_length ? state::trailer : state::done;
+                    _line_length = 0;
+                    break;
+                case state::data:
+                case state::done:
+                    // not reached, we stop consuming before these
+                    break;
+                }
+                if (in_data() || done()) {
+                    buf.trim_front(pos);
+                    return make_ready_future<consumption_result<char>>(stop_consuming<char>(std::move(buf)));
+                }
+            }
+            return make_ready_future<consumption_result<char>>(continue_consuming{});
+        }
+    };
+
+    input_stream<char>& _inp;
+    chunk_parser _parser;
+public:
+    explicit chunked_source_impl(input_stream<char>& inp) : _inp(inp) {
+    }
+
+    virtual future<temporary_buffer<char>> get() override {
+        if (_parser.done()) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        if (_parser.in_data()) {
+            return _inp.read_up_to(_parser.chunk_size()).then([this] (temporary_buffer<char> buf) {
+                if (buf.empty()) {
+                    throw bad_request_exception("Connection closed in the middle of a chunk");
+                }
+                _parser.consumed(buf.size());
+                return buf;
+            });
+        }
+        return _inp.consume(_parser).then([this] {
+            if (_parser.eof()) {
+                throw bad_request_exception("Connection closed in the middle of a chunked message body");
+            }
+            return get();
+        });
+    }
+};
+
+}
+
+}
+
+}
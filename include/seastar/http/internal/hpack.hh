@@ -0,0 +1,93 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/core/sstring.hh>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace seastar {
+
+namespace httpd {
+
+// HPACK, the header compression of HTTP/2 (RFC 7541).
+
+// A malformed header block. The decoder's state is unusable afterwards,
+// which makes this a connection error (COMPRESSION_ERROR).
+class hpack_error : public std::runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
+
+using header_field = std::pair<sstring, sstring>;
+
+class hpack_decoder {
+    // dynamic table, newest entry first
+    std::deque<header_field> _table;
+    size_t _table_size = 0;
+    // as last set by the encoder, at most _table_size_limit
+    size_t _max_table_size;
+    // the SETTINGS_HEADER_TABLE_SIZE we advertised
+    size_t _table_size_limit;
+    size_t _max_header_list_size;
+public:
+    explicit hpack_decoder(size_t table_size_limit = 4096, size_t max_header_list_size = 64 * 1024);
+
+    // Decodes a complete header block (HEADERS and CONTINUATION frames put
+    // together). Returns nothing if the decoded header list is larger than
+    // max_header_list_size (counted as in SETTINGS_MAX_HEADER_LIST_SIZE),
+    // in which case the block is still processed to keep the dynamic table
+    // in sync with the peer's.
+    std::optional<std::vector<header_field>> decode(std::string_view block);
+
+    size_t table_size() const {
+        return _table_size;
+    }
+private:
+    header_field get(uint64_t index) const;
+    void add(header_field f);
+    void evict(size_t room);
+};
+
+// Encodes with the static table only: fields are either indexed or literals
+// that are never added to the dynamic table, so the encoder is stateless and
+// the peer's SETTINGS_HEADER_TABLE_SIZE does not matter. String literals are
+// Huffman coded when that makes them shorter.
+class hpack_encoder {
+public:
+    // appends the representation of the field to out; name must be lower case
+    void encode(std::string& out, std::string_view name, std::string_view value) const;
+};
+
+// Huffman coding of string literals (RFC 7541, appendix B)
+sstring huffman_decode(std::string_view in);
+sstring huffman_encode(std::string_view in);
+size_t huffman_encoded_size(std::string_view in);
+
+}
+
+}
@@ -0,0 +1,210 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/core/circular_buffer.hh>
+#include <seastar/core/condition-variable.hh>
+#include <seastar/core/gate.hh>
+#include <seastar/core/iostream.hh>
+#include <seastar/core/semaphore.hh>
+#include <seastar/core/shared_ptr.hh>
+#include <seastar/http/internal/hpack.hh>
+#include <seastar/http/reply.hh>
+#include <seastar/http/request.hh>
+#include <seastar/util/noncopyable_function.hh>
+#include <string_view>
+#include <unordered_map>
+
+namespace seastar {
+
+namespace httpd {
+
+class http_server;
+
+// The server side of an HTTP/2 connection (RFC 7540).
+//
+// Requests arrive on streams multiplexed over the connection and are handed
+// to the server's routes as they complete, so a slow handler holds up only
+// its own stream. Replies are sent as a HEADERS frame followed by DATA
+// frames, subject to the peer's flow control windows; frames of different
+// streams are interleaved in the order they become ready.
+//
+// The request body is received subject to our own flow control: without
+// content streaming it is read into request::content (and credited back to
+// the peer right away), with content streaming it is credited as the
+// handler reads request::content_stream.
+//
+// Server push and stream priorities are not supported; PRIORITY frames are
+// accepted and ignored.
+class http2_connection {
+public:
+    static constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+    enum class frame_type : uint8_t {
+        data = 0x0,
+        headers = 0x1,
+        priority = 0x2,
+        rst_stream = 0x3,
+        settings = 0x4,
+        push_promise = 0x5,
+        ping = 0x6,
+        goaway = 0x7,
+        window_update = 0x8,
+        continuation = 0x9,
+    };
+
+    enum class error_code : uint32_t {
+        no_error = 0x0,
+        protocol_error = 0x1,
+        internal_error = 0x2,
+        flow_control_error = 0x3,
+        settings_timeout = 0x4,
+        stream_closed = 0x5,
+        frame_size_error = 0x6,
+        refused_stream = 0x7,
+        cancel = 0x8,
+        compression_error = 0x9,
+        connect_error = 0xa,
+        enhance_your_calm = 0xb,
+        inadequate_security = 0xc,
+        http_1_1_required = 0xd,
+    };
+
+    static constexpr size_t frame_header_size = 9;
+    static constexpr uint32_t default_window = 65535;
+    static constexpr uint32_t max_window = 0x7fffffff;
+    static constexpr size_t default_max_frame_size = 16384;
+    // what we advertise
+    static constexpr uint32_t max_concurrent_streams = 100;
+    static constexpr uint32_t connection_window = 1 << 20;
+    static constexpr size_t max_header_list_size = 64 * 1024;
+private:
+    struct stream {
+        uint32_t id;
+        std::unique_ptr<request> req;
+        // END_STREAM received
+        bool remote_closed = false;
+        // reset by either side, or closed after the reply was sent
+        bool closed = false;
+        // the request body exceeded the content length limit
+        bool too_large = false;
+        // a handler runs for the stream
+        bool running = false;
+        // reset by the peer
+        bool peer_reset = false;
+        int64_t send_window;
+        int64_t recv_window;
+        // received and consumed, but not credited back to the peer yet
+        uint32_t unacked = 0;
+        std::vector<temporary_buffer<char>> body;
+        size_t body_size = 0;
+        // content streaming
+        circular_buffer<temporary_buffer<char>> body_queue;
+        condition_variable body_cond;
+        input_stream<char> content;
+    };
+    class body_source_impl;
+    class data_sink_impl;
+
+    struct connection_error : public std::runtime_error {
+        error_code code;
+        connection_error(error_code c, const char* msg) : runtime_error(msg), code(c) {}
+    };
+
+    http_server& _server;
+    input_stream<char>& _in;
+    output_stream<char>& _out;
+    hpack_decoder _decoder{4096, max_header_list_size};
+    hpack_encoder _encoder;
+    std::unordered_map<uint32_t, lw_shared_ptr<stream>> _streams;
+    uint32_t _last_stream_id = 0;
+    // Handlers keep running after their stream is reset, so they are
+    // counted apart from _streams to bound them.
+    unsigned _running_handlers = 0;
+    // of which for streams the peer reset
+    unsigned _reset_handlers = 0;
+    // the streams we reset last, whose frames in flight are ignored
+    circular_buffer<uint32_t> _reset_streams;
+    // peer settings
+    uint32_t _peer_initial_window = default_window;
+    size_t _peer_max_frame_size = default_max_frame_size;
+    // connection level flow control
+    int64_t _send_window = default_window;
+    int64_t _recv_window = default_window;
+    uint32_t _recv_unacked = 0;
+    // wakes up senders waiting for flow control credit
+    condition_variable _send_cond;
+    // frames of a stream's header block and its DATA frames must not be
+    // interleaved with other frames, so writes go one at a time
+    semaphore _write_sem{1};
+    // a header block in progress
+    std::string _header_block;
+    uint32_t _header_stream = 0;
+    bool _header_end_stream = false;
+    bool _got_settings = false;
+    bool _peer_goaway = false;
+    bool _closed = false;
+    gate _gate;
+public:
+    http2_connection(http_server& server, input_stream<char>& in, output_stream<char>& out);
+    ~http2_connection();
+
+    // Runs the connection until the peer closes it, or it fails. The
+    // preface is expected first unless already read (prior knowledge is
+    // detected by the HTTP/1.1 parser). A connection upgraded from HTTP/1.1
+    // passes the request that asked for it, to be answered on stream 1,
+    // and its HTTP2-Settings header.
+    future<> process(bool read_preface, std::unique_ptr<request> upgrade_req = {}, sstring upgrade_settings = {});
+private:
+    future<> read_loop();
+    future<> handle_frame(frame_type type, uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload);
+    future<> handle_data(uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload);
+    future<> handle_headers(uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload);
+    future<> handle_continuation(uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload);
+    future<> handle_header_block();
+    future<> handle_settings(uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload);
+    future<> handle_window_update(uint32_t stream_id, temporary_buffer<char> payload);
+    void handle_rst_stream(uint32_t stream_id, temporary_buffer<char> payload);
+    void apply_settings(std::string_view payload);
+
+    std::unique_ptr<request> make_request(std::vector<header_field> headers);
+    lw_shared_ptr<stream> make_stream(uint32_t id, std::unique_ptr<request> req);
+    void dispatch(lw_shared_ptr<stream> s);
+    void reply_error(lw_shared_ptr<stream> s, reply::status_type status, const sstring& msg);
+    void run_stream(lw_shared_ptr<stream> s, noncopyable_function<future<std::unique_ptr<reply>> ()> handle);
+    future<> send_reply(lw_shared_ptr<stream> s, std::unique_ptr<reply> rep);
+    future<> send_data(lw_shared_ptr<stream> s, temporary_buffer<char> buf, bool end_stream);
+    future<> close_stream(lw_shared_ptr<stream> s);
+    future<> reset_stream(uint32_t stream_id, error_code code);
+    void credit_stream(stream& s, size_t n);
+    future<> maybe_send_credit(stream& s);
+    void close_all();
+
+    future<> write_frame(frame_type type, uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload = {});
+    future<> write_header_block(uint32_t stream_id, std::string block, bool end_stream);
+    future<> put_frame(frame_type type, uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload);
+    future<> write_goaway(error_code code);
+};
+
+}
+
+}
@@ -0,0 +1,104 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/core/iostream.hh>
+#include <seastar/core/semaphore.hh>
+#include <seastar/http/websocket.hh>
+#include <string_view>
+#include <vector>
+
+namespace seastar {
+
+namespace httpd {
+
+// The server side of a WebSocket connection (RFC 6455), once the handshake
+// is done.
+//
+// Frames are read as the session asks for messages, so control frames
+// from the client are only answered while it does. Frames are written
+// whole, one at a time, and share a flush when they queue up.
+class websocket_connection {
+public:
+    enum class opcode : uint8_t {
+        continuation = 0,
+        text = 1,
+        binary = 2,
+        close = 8,
+        ping = 9,
+        pong = 10,
+    };
+    // close codes (RFC 6455, section 7.4.1)
+    static constexpr uint16_t normal_closure = 1000;
+    static constexpr uint16_t protocol_error = 1002;
+    static constexpr uint16_t invalid_payload = 1007;
+    static constexpr uint16_t message_too_big = 1009;
+    static constexpr uint16_t internal_error = 1011;
+private:
+    struct frame_header {
+        bool fin;
+        uint8_t rsv;
+        opcode op;
+        uint64_t length;
+        char mask[4];
+    };
+    // the client went away without a close frame
+    struct connection_closed {};
+
+    input_stream<char>& _in;
+    output_stream<char>& _out;
+    websocket::options _options;
+    // permessage-deflate was negotiated
+    bool _deflate;
+    semaphore _write_sem{1};
+    bool _close_sent = false;
+    bool _close_received = false;
+
+    class source_impl;
+    class sink_impl;
+public:
+    websocket_connection(input_stream<char>& in, output_stream<char>& out, websocket::options options, bool deflate)
+            : _in(in), _out(out), _options(std::move(options)), _deflate(deflate) {
+    }
+
+    // Runs the session, then closes the connection with a close frame, if
+    // none was sent.
+    future<> process(std::unique_ptr<request> req, const websocket_handler::session_function& session);
+
+    // the next data message, or an empty buffer once the connection closed
+    future<temporary_buffer<char>> read_message();
+    future<> send_message(net::packet p);
+    future<> send_close(uint16_t code);
+
+    // the Sec-WebSocket-Accept value for a Sec-WebSocket-Key
+    static sstring accept_key(std::string_view key);
+private:
+    future<frame_header> read_frame_header();
+    future<temporary_buffer<char>> read_payload(const frame_header& h);
+    // handles a control frame, true for a close frame
+    future<bool> handle_control(opcode op, temporary_buffer<char> payload);
+    future<> write_frame(opcode op, bool compressed, std::vector<temporary_buffer<char>> payload);
+};
+
+}
+
+}
@@ -112,6 +112,20 @@ class match_rule {
         return *this;
     }
 
+    /**
+     * The matchers of the rule, in the order they are applied
+     */
+    const std::vector<matcher*>& matchers() const {
+        return _match_list;
+    }
+
+    /**
+     * The handler returned when the rule matches
+     */
+    handler_base* handler() const {
+        return _handler;
+    }
+
 private:
     std::vector<matcher*> _match_list;
     handler_base* _handler;
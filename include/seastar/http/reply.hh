@@ -33,7 +33,10 @@
 
 #include <seastar/core/sstring.hh>
 #include <unordered_map>
+#include <string_view>
+#include <optional>
 #include <seastar/http/mime_types.hh>
+#include <seastar/http/header_map.hh>
 #include <seastar/core/iostream.hh>
 #include <seastar/util/noncopyable_function.hh>
 
@@ -43,6 +46,8 @@ namespace httpd {
 
 class connection;
 class routes;
+class http2_connection;
+struct compression_options;
 
 /**
  * A reply to be sent to a client.
@@ -53,10 +58,12 @@ struct reply {
      */
     enum class status_type {
         continue_ = 100, //!< continue
+        switching_protocols = 101, //!< switching_protocols
         ok = 200, //!< ok
         created = 201, //!< created
         accepted = 202, //!< accepted
         no_content = 204, //!< no_content
+        partial_content = 206, //!< partial_content
         multiple_choices = 300, //!< multiple_choices
         moved_permanently = 301, //!< moved_permanently
         moved_temporarily = 302, //!< moved_temporarily
@@ -67,6 +74,9 @@ struct reply {
         not_found = 404, //!< not_found
         length_required = 411, //!< length_required
         payload_too_large = 413, //!< payload_too_large
+        range_not_satisfiable = 416, //!< range_not_satisfiable
+        upgrade_required = 426, //!< upgrade_required
+        request_header_fields_too_large = 431, //!< request_header_fields_too_large
         internal_server_error = 500, //!< internal_server_error
         not_implemented = 501, //!< not_implemented
         bad_gateway = 502, //!< bad_gateway
@@ -76,7 +86,7 @@ struct reply {
     /**
      * The headers to be included in the reply.
      */
-    std::unordered_map<sstring, sstring> _headers;
+    header_map _headers;
 
     sstring _version;
     /**
@@ -157,6 +167,19 @@ struct reply {
 
     void write_body(const sstring& content_type, noncopyable_function<future<>(output_stream<char>&&)>&& body_writer);
 
+    /*!
+     * \brief use an output stream to write a message body of a known length
+     *
+     * Like the above, but the reply is sent with a Content-Length instead of
+     * chunked transfer encoding, and buffers the body writer writes with
+     * output_stream::write(temporary_buffer) are passed on to the connection
+     * without being copied.
+     *
+     * \param length - the exact length of the body; the connection is closed
+     *  if the body writer writes a different amount.
+     */
+    void write_body(const sstring& content_type, size_t length, noncopyable_function<future<>(output_stream<char>&&)>&& body_writer);
+
     /*!
      * \brief Write a string as the reply
      *
@@ -168,13 +191,33 @@ struct reply {
      */
     void write_body(const sstring& content_type, const sstring& content);
 
+    /*!
+     * \brief take the connection over once the reply is sent
+     *
+     * For a 101 (Switching Protocols) reply: once it is sent, the connection
+     * stops serving HTTP and hands its streams to \c fn, which may use them
+     * until the future it returns resolves. Only HTTP/1.1 connections can
+     * switch protocols.
+     */
+    void switch_protocols(noncopyable_function<future<>(input_stream<char>&, output_stream<char>&)>&& fn) {
+        _upgrade = std::move(fn);
+    }
+
 private:
-    future<> write_reply_to_connection(connection& con);
-    future<> write_reply_headers(connection& connection);
+    future<> write_reply_to_connection(connection& con, std::string_view common_headers);
+    // The response line and the header fields, ending with the empty line,
+    // in a single buffer. common_headers are preformatted fields, sent
+    // unless the handler set a field of the same name.
+    temporary_buffer<char> serialize_head(std::string_view common_headers) const;
 
     noncopyable_function<future<>(output_stream<char>&&)> _body_writer;
+    // the length of what _body_writer writes, if known
+    std::optional<size_t> _body_length;
+    noncopyable_function<future<>(input_stream<char>&, output_stream<char>&)> _upgrade;
     friend class routes;
     friend class connection;
+    friend class http2_connection;
+    friend void compress_reply(reply& rep, std::string_view accept_encoding, const compression_options& options);
 };
 
 } // namespace httpd
@@ -31,10 +31,12 @@
 #pragma once
 
 #include <seastar/core/sstring.hh>
+#include <seastar/core/iostream.hh>
 #include <string>
 #include <vector>
 #include <strings.h>
 #include <seastar/http/common.hh>
+#include <seastar/http/header_map.hh>
 
 namespace seastar {
 
@@ -71,11 +73,19 @@ struct request {
     int http_version_minor;
     ctclass content_type_class;
     size_t content_length = 0;
-    std::unordered_map<sstring, sstring, case_insensitive_hash, case_insensitive_cmp> _headers;
+    header_map _headers;
     std::unordered_map<sstring, sstring> query_parameters;
     connection* connection_ptr;
     parameters param;
     sstring content;
+    /**
+     * The request body, if the server streams request content (see
+     * http_server::set_content_streaming()), in which case \ref content is
+     * left empty. Chunked transfer encoding is already decoded. The stream
+     * may only be used until the handler's reply is ready; whatever is left
+     * unread by then is skipped. Null if an HTTP/1 request has no body.
+     */
+    input_stream<char>* content_stream = nullptr;
     sstring protocol_name = "http";
 
     /**
@@ -127,6 +137,16 @@ struct request {
         return content_type_class == ctclass::app_x_www_urlencoded;
     }
 
+    /**
+     * Whether the body is sent with chunked transfer encoding, in which case
+     * its length is not known in advance.
+     */
+    bool is_chunked() const {
+        auto te = get_header("Transfer-Encoding");
+        std::transform(te.begin(), te.end(), te.begin(), ::tolower);
+        return te.find("chunked") != sstring::npos;
+    }
+
 };
 
 } // namespace httpd
@@ -25,8 +25,13 @@
 #include <seastar/http/handlers.hh>
 #include <seastar/http/common.hh>
 #include <seastar/http/reply.hh>
+#include <seastar/core/metrics_registration.hh>
+#include <seastar/core/shared_ptr.hh>
+#include <seastar/util/latency_histogram.hh>
 
 #include <boost/program_options/variables_map.hpp>
+#include <array>
+#include <optional>
 #include <unordered_map>
 
 namespace seastar {
@@ -66,6 +71,23 @@ class url {
 };
 
 struct path_description;
+class route_tree;
+
+/**
+ * The accounting of the requests a route, that is a path registered for
+ * an operation type, served on this shard. Routes with the same path share
+ * it, routes with the same handler do not.
+ */
+struct route_stats {
+    /// requests passed to the handler
+    uint64_t requests = 0;
+    /// replies by status class, 1xx first and 5xx last
+    std::array<uint64_t, 5> replies{};
+    /// time from calling the handler until its reply was ready
+    latency_histogram latency;
+
+    void add(const reply& rep, std::chrono::steady_clock::duration latency);
+};
 
 /**
  * routes object do the request dispatching according to the url.
@@ -73,6 +95,13 @@ struct path_description;
  * (an optional leading slash is permitted) it is choosen
  * If not, the matching rules are used.
  * matching rules are evaluated by their insertion order
+ *
+ * Rules made of string and parameter matchers are indexed in a radix tree,
+ * so the url is matched against all of them in a single walk; rules with
+ * other matchers are tried one by one. Either way the result is that of
+ * evaluating the rules by their insertion order. The tree is built on the
+ * first lookup after the rules change, so a rule must not be modified once
+ * it was added.
  */
 class routes {
 public:
@@ -105,10 +134,7 @@ class routes {
      * @param type the operation type
      * @return it self
      */
-    routes& add(match_rule* rule, operation_type type = GET) {
-        _rules[type][_rover++] = rule;
-        return *this;
-    }
+    routes& add(match_rule* rule, operation_type type = GET);
 
     /**
      * Add a url match to a handler:
@@ -152,6 +178,23 @@ class routes {
     handler_base* get_handler(operation_type type, const sstring& url,
             parameters& params);
 
+    /**
+     * Export the statistics of every route, now and as they are added, as
+     * metrics of the httpd group, labelled with service set to name and
+     * with the route's method and path. http_server does it for its routes,
+     * with its name.
+     * @param name the service label
+     */
+    void enable_metrics(const sstring& name);
+
+    /**
+     * The statistics of a route registered for an operation type
+     * @param path the url of put(), or the path of a rule with its
+     * parameters in braces, as in the metrics' route label
+     * @return the statistics, or nullptr if no route has the path
+     */
+    const route_stats* get_stats(operation_type type, const sstring& path) const;
+
 private:
     /**
      * Normalize the url to remove the last / if exists
@@ -162,12 +205,40 @@ class routes {
      */
     sstring normalize_url(const sstring& url);
 
+    future<std::unique_ptr<reply>> call_handler(handler_base* handler, const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+
+    struct route_metrics {
+        route_stats stats;
+        sstring path;
+        // the routes registered with the path
+        unsigned registrations = 0;
+        metrics::metric_groups metrics;
+    };
+    lw_shared_ptr<route_metrics> register_route(operation_type type, const sstring& path);
+    void unregister_route(operation_type type, const sstring& path);
+    void add_metrics(operation_type type, route_metrics& m);
+
     std::unordered_map<sstring, handler_base*> _map[NUM_OPERATION];
+    // shared with the requests in progress, which may outlive the route
+    std::unordered_map<sstring, lw_shared_ptr<route_metrics>> _route_metrics[NUM_OPERATION];
+    std::optional<sstring> _metrics_name;
 public:
     using rule_cookie = uint64_t;
 private:
     rule_cookie _rover = 0;
     std::map<rule_cookie, match_rule*> _rules[NUM_OPERATION];
+    std::unordered_map<rule_cookie, lw_shared_ptr<route_metrics>> _rule_metrics[NUM_OPERATION];
+    // built from _rules on demand, reset when they change
+    std::unique_ptr<route_tree> _rule_trees[NUM_OPERATION];
+
+    struct route_match {
+        handler_base* handler = nullptr;
+        // the url of the exact match, or nullptr if a rule matched
+        const sstring* url = nullptr;
+        rule_cookie cookie = 0;
+    };
+    route_match find_route(operation_type type, const sstring& url, parameters& params);
 public:
     using exception_handler_fun = std::function<std::unique_ptr<reply>(std::exception_ptr eptr)>;
     using exception_handler_id = size_t;
@@ -212,11 +283,7 @@ class routes {
      * @param type the operation type
      * @return a cookie using which the rule can be removed
      */
-    rule_cookie add_cookie(match_rule* rule, operation_type type) {
-        auto pos = _rover++;
-        _rules[type][pos] = rule;
-        return pos;
-    }
+    rule_cookie add_cookie(match_rule* rule, operation_type type);
 
     /**
      * Del a rule by cookie
@@ -0,0 +1,106 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/http/handlers.hh>
+#include <seastar/core/iostream.hh>
+#include <functional>
+#include <stdexcept>
+
+namespace seastar {
+
+namespace httpd {
+
+namespace websocket {
+
+/// the kind of data message the sink sends
+enum class message_type {
+    text,
+    binary,
+};
+
+struct options {
+    /// longer messages from the client fail the connection
+    size_t max_message_size = 1 << 20;
+    /// the kind of the messages put in the sink
+    message_type type = message_type::binary;
+    /// compress messages with permessage-deflate (RFC 7692) if the client
+    /// offers it
+    bool deflate = true;
+    /// messages put in the sink that are shorter are sent uncompressed
+    size_t deflate_min_size = 64;
+};
+
+/**
+ * The client broke the protocol, so the connection was failed with a close
+ * frame carrying code (RFC 6455, section 7.4.1).
+ */
+class protocol_error : public std::runtime_error {
+    uint16_t _code;
+public:
+    protocol_error(uint16_t code, const std::string& msg)
+            : std::runtime_error(msg), _code(code) {
+    }
+    uint16_t code() const {
+        return _code;
+    }
+};
+
+}
+
+/**
+ * A handler that switches connections to the WebSocket protocol
+ * (RFC 6455), to run a session on them.
+ *
+ * The session gets the request and a data_source and data_sink pair.
+ * Each buffer the source returns is a message from the client, whole:
+ * fragments are joined and compressed messages inflated, and text and
+ * binary messages alike are returned. Pings are answered and a close frame
+ * is echoed, after which the source returns an empty buffer, as it does if
+ * the client goes away. Each put() on the sink sends a message, closing it
+ * sends a close frame.
+ *
+ * The connection is closed once the session's future resolves, and the
+ * source and sink must not be used after that. While idle, a connection
+ * holds no compression state: with permessage-deflate, messages are
+ * compressed without context takeover, by streams shared by the shard.
+ *
+ * Only HTTP/1.1 connections can switch, requests over HTTP/2 are refused.
+ */
+class websocket_handler : public handler_base {
+public:
+    using session_function = std::function<future<>(std::unique_ptr<request> req, data_source in, data_sink out)>;
+private:
+    session_function _session;
+    websocket::options _options;
+public:
+    explicit websocket_handler(session_function session, websocket::options options = {})
+            : _session(std::move(session)), _options(std::move(options)) {
+    }
+
+    virtual future<std::unique_ptr<reply>> handle(const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep) override;
+};
+
+}
+
+}
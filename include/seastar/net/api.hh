@@ -292,6 +292,14 @@ class server_socket {
         port,
         // This algorithm distributes all new connections to listen_options::fixed_cpu shard only.
         fixed,
+        // This algorithm sends new connections to the shard running on the CPU that received
+        // them, so that softirq, TCP and reactor processing of a connection stay on one core.
+        // On the posix stack (TCP), every shard must listen: each gets its own SO_REUSEPORT
+        // socket and the kernel is asked to steer by receiving CPU, using an eBPF program
+        // (needs CAP_BPF or similar) or SO_INCOMING_CPU (Linux 6.2+). Without either, or for
+        // CPUs without a shard, the kernel picks a socket by hash. Elsewhere it behaves as
+        // connection_distribution.
+        incoming_cpu,
         default_ = connection_distribution
     };
     /// Constructs a \c server_socket not corresponding to a connection
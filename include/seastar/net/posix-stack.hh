@@ -108,6 +108,10 @@ class posix_data_source_impl final : public data_source_impl, private internal::
     std::pmr::polymorphic_allocator<char>* _buffer_allocator;
     pollable_fd _fd;
     connected_socket_input_stream_config _config;
+    // Set once the buffer size estimate has decayed to its minimum, i.e. the
+    // connection is mostly idle: size the next buffer by asking the kernel
+    // how much is queued instead of guessing.
+    bool _probe_readable = false;
 private:
     virtual temporary_buffer<char> allocate_buffer() override;
 public:
@@ -175,14 +179,23 @@ class posix_server_socket_impl : public server_socket_impl {
     virtual socket_address local_address() const override;
 };
 
+class reuseport_cpu_steering;
+
 class posix_reuseport_server_socket_impl : public server_socket_impl {
     socket_address _sa;
     int _protocol;
     pollable_fd _lfd;
     std::pmr::polymorphic_allocator<char>* _allocator;
+    // shared by all shards listening on _sa with load_balancing_algorithm::incoming_cpu
+    std::shared_ptr<reuseport_cpu_steering> _steering;
 public:
     explicit posix_reuseport_server_socket_impl(int protocol, socket_address sa, pollable_fd lfd,
         std::pmr::polymorphic_allocator<char>* allocator=memory::malloc_allocator) : _sa(sa), _protocol(protocol), _lfd(std::move(lfd)), _allocator(allocator) {}
+    // Asks the kernel to hand connections received on this CPU to this socket
+    void steer_by_incoming_cpu();
+    // Listens on sa, with load_balancing_algorithm::incoming_cpu
+    static std::unique_ptr<posix_reuseport_server_socket_impl> listen_by_incoming_cpu(int protocol, socket_address sa,
+            listen_options opt, std::pmr::polymorphic_allocator<char>* allocator);
     virtual future<accept_result> accept() override;
     virtual void abort_accept() override;
     virtual socket_address local_address() const override;
@@ -218,6 +231,15 @@ class posix_ap_network_stack : public posix_network_stack {
 };
 
 void register_posix_stack();
+
+/// Limits the memory the calling shard may hold in posix socket receive
+/// buffers. Once the budget is exhausted new reads get buffers of
+/// \ref connected_socket_input_stream_config::min_buffer_size, so connections
+/// keep making progress but stop growing. While a budget is set, current
+/// usage is exported in the \c posix_network metrics group.
+///
+/// \param bytes the budget in bytes; 0 means unlimited (the default)
+void set_receive_buffer_memory_budget(size_t bytes);
 }
 
 }
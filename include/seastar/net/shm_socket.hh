@@ -0,0 +1,72 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/net/api.hh>
+
+namespace seastar {
+
+namespace net {
+
+/// \addtogroup networking-module
+/// @{
+
+/// Options for shared memory connections, see \ref shm_listen().
+struct shm_listen_options {
+    /// Capacity of each direction's ring buffer, rounded up to a power of
+    /// two of at least a page. At most 1GB.
+    size_t ring_size = 1 << 20;
+};
+
+/// Listens for shared memory connections from processes on the same host.
+///
+/// Connections are established over the given unix domain socket, which is
+/// then only used to hand a shared memory segment and two eventfd doorbells
+/// over to the client and to notice the peer going away. Data is exchanged
+/// through a pair of single producer, single consumer ring buffers in the
+/// shared segment, without system calls while both sides are busy; a side
+/// that runs out of data or space rings the peer's doorbell and sleeps in
+/// the reactor until its own one rings.
+///
+/// Each connection is owned by the shard that accepted or opened it. Since a
+/// unix socket can only be bound once, a server wanting a connection per
+/// shard pair should listen on a separate address on every shard, and
+/// clients should connect to the address matching their shard.
+///
+/// The returned sockets can be used anywhere a TCP socket can, in particular
+/// for \ref rpc::server and \ref rpc::client (including stream connections,
+/// via \ref rpc::client::make_stream_sink(socket)).
+///
+/// \param sa a unix domain socket address
+server_socket shm_listen(socket_address sa, shm_listen_options opts = {});
+
+/// Creates a socket that connects to a \ref shm_listen() server.
+///
+/// \ref socket::connect() must be given the unix domain address the
+/// server listens on; the local address and transport are ignored.
+::seastar::socket make_shm_socket();
+
+/// @}
+
+}
+
+}
@@ -46,6 +46,11 @@ class connected_socket_impl {
     virtual keepalive_params get_keepalive_parameters() const = 0;
     virtual void set_sockopt(int level, int optname, const void* data, size_t len) = 0;
     virtual int get_sockopt(int level, int optname, void* data, size_t len) const = 0;
+    // Sends a single record of the given TLS content type through a kernel
+    // TLS (kTLS) transmit path previously configured via set_sockopt().
+    // Used for non-application-data records (alerts) once the kernel owns
+    // the record layer. Default implementation fails with ENOTSUP.
+    virtual future<> send_tls_record(uint8_t content_type, temporary_buffer<char> payload);
 };
 
 class socket_impl {
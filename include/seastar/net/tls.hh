@@ -20,6 +20,7 @@
  */
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <unordered_set>
 
@@ -28,6 +29,7 @@
 #include <seastar/core/future.hh>
 #include <seastar/core/sstring.hh>
 #include <seastar/core/shared_ptr.hh>
+#include <seastar/core/scheduling.hh>
 #include <seastar/net/socket_defs.hh>
 #include <seastar/util/std-compat.hh>
 #include <seastar/net/api.hh>
@@ -210,6 +212,36 @@ namespace tls {
          */
         void set_dn_verification_callback(dn_callback);
 
+        /**
+         * Enables handing the negotiated session keys to the kernel (kTLS)
+         * once the handshake is done, so that record encryption of outgoing
+         * data is done by the kernel instead of gnutls. This avoids copying
+         * data through gnutls buffers on every write.
+         *
+         * Only takes effect on the posix network stack, for TLS 1.2/1.3 using
+         * AES-GCM or ChaCha20-Poly1305, on kernels with the tls module.
+         * Otherwise sessions silently fall back to userspace encryption.
+         */
+        void set_kernel_tls_offload(bool);
+
+        /**
+         * Enables a client side cache of session data, keyed by server name,
+         * used to resume sessions on subsequent connections to the same
+         * server instead of doing a full handshake. Only connections
+         * created with a server name are cached.
+         *
+         * \param size max number of servers to remember. 0 (default) disables.
+         */
+        void set_session_cache_size(size_t size);
+
+        /**
+         * Sets the application protocols (e.g. "h2", "http/1.1") offered,
+         * for a client, or accepted, for a server, in the TLS handshake
+         * (ALPN, RFC 7301). A server picks the first protocol of its own
+         * list that the client offers. See \ref get_alpn_protocol().
+         */
+        void set_alpn_protocols(std::vector<sstring> protocols);
+
     private:
         class impl;
         friend class session;
@@ -248,8 +280,50 @@ namespace tls {
         server_credentials& operator=(const server_credentials&) = delete;
 
         void set_client_auth(client_auth);
+
+        /**
+         * Enables stateless session resumption using session tickets
+         * (RFC 5077, and TLS 1.3 tickets) encrypted by the given key.
+         *
+         * The key given is a master key; the key actually used to encrypt
+         * tickets is derived from it and rotated every \p lifetime, which
+         * is also the validity of the tickets. Servers (shards, or processes)
+         * that share the master key rotate in step, and can resume each
+         * other's sessions.
+         *
+         * \param key A key created by generate_session_ticket_key()
+         */
+        void enable_session_tickets(const blob& key, std::chrono::seconds lifetime = std::chrono::hours(6));
+        void disable_session_tickets();
+
+        /**
+         * Runs handshakes of sessions created from these credentials in the
+         * given scheduling group, so that the (expensive) handshake crypto
+         * competes for CPU with its own shares, and not with the processing
+         * of already established connections.
+         */
+        void set_handshake_scheduling_group(scheduling_group);
+
+        /**
+         * Limits the number of handshakes in progress at any given time for
+         * sessions created from these credentials (i.e. per shard, since
+         * credentials are). Sessions beyond that wait for their turn.
+         * 0 (default) means unlimited.
+         *
+         * A handshake holds its turn while waiting for the peer, so that
+         * peers which stall cannot keep others from their turn for long,
+         * handshakes taking longer than timeout once started fail, and
+         * their connection is shut down.
+         */
+        void set_max_concurrent_handshakes(size_t, std::chrono::milliseconds timeout = std::chrono::seconds(10));
     };
 
+    /**
+     * Creates a new random master key for session ticket encryption.
+     * \see server_credentials::enable_session_tickets
+     */
+    sstring generate_session_ticket_key();
+
     class reloadable_credentials_base;
 
     using reload_callback = std::function<void(const std::unordered_set<sstring>&, std::exception_ptr)>;
@@ -281,6 +355,14 @@ namespace tls {
         future<> set_system_trust();
         void set_client_auth(client_auth);
         void set_priority_string(const sstring&);
+        void set_kernel_tls_offload(bool);
+        void set_session_cache_size(size_t);
+        void set_alpn_protocols(std::vector<sstring>);
+        // generates a new ticket key, shared by all credentials built
+        // from this object (and copies of it).
+        void enable_session_tickets(std::chrono::seconds lifetime = std::chrono::hours(6));
+        void set_handshake_scheduling_group(scheduling_group);
+        void set_max_concurrent_handshakes(size_t, std::chrono::milliseconds timeout = std::chrono::seconds(10));
 
         void apply_to(certificate_credentials&) const;
 
@@ -297,6 +379,14 @@ namespace tls {
         std::multimap<sstring, boost::any> _blobs;
         client_auth _client_auth = client_auth::NONE;
         sstring _priority;
+        bool _kernel_tls = false;
+        size_t _session_cache_size = 0;
+        std::vector<sstring> _alpn_protocols;
+        sstring _ticket_key;
+        std::chrono::seconds _ticket_lifetime {};
+        std::optional<scheduling_group> _handshake_sg;
+        size_t _max_concurrent_handshakes = 0;
+        std::chrono::milliseconds _handshake_timeout = std::chrono::seconds(10);
     };
 
     /**
@@ -330,6 +420,14 @@ namespace tls {
     future<connected_socket> wrap_server(shared_ptr<server_credentials>, connected_socket&&);
     /// @}
 
+    /**
+     * Returns the application protocol negotiated for a TLS connection
+     * (see \ref certificate_credentials::set_alpn_protocols()), waiting for
+     * the handshake to complete if it has not yet. Returns nothing if no
+     * protocol was negotiated, or the socket is not a TLS one.
+     */
+    future<std::optional<sstring>> get_alpn_protocol(connected_socket&);
+
     /**
      * Creates a server socket that accepts SSL/TLS clients using default network stack
      * and the supplied credentials.
@@ -24,6 +24,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <list>
+#include <array>
 #include <seastar/core/future.hh>
 #include <seastar/core/seastar.hh>
 #include <seastar/net/api.hh>
@@ -39,6 +40,9 @@
 #include <seastar/core/scheduling.hh>
 #include <seastar/util/backtrace.hh>
 #include <seastar/util/log.hh>
+#include <seastar/core/metrics_registration.hh>
+#include <seastar/core/metrics_types.hh>
+#include <seastar/util/latency_histogram.hh>
 
 namespace seastar {
 
@@ -99,11 +103,65 @@ struct resource_limits {
     std::function<isolation_config (sstring isolation_cookie)> isolate_connection = default_isolate_connection;
 };
 
+/// \brief Adaptive compression configuration
+///
+/// When enabled, and if the peer supports it, frames are sent uncompressed
+/// when compressing them is unlikely to pay off: frames smaller than
+/// \ref min_size, and frames of verbs whose recent compression ratio
+/// (compressed size / uncompressed size) is above \ref max_ratio. Such
+/// verbs are still compressed every \ref probe_interval frames, so that a
+/// change in their payload is noticed.
+///
+/// \see stats::compression
+struct adaptive_compression_options {
+    bool enabled = false;
+    size_t min_size = 0;         ///< Frames smaller than this are never compressed
+    double max_ratio = 0.9;      ///< Verbs compressing worse than this are bypassed
+    unsigned probe_interval = 32; ///< Compress one in this many bypassed frames to re-sample the ratio
+};
+
+/// \brief Outgoing write coalescing configuration
+///
+/// By default every outgoing frame is flushed to the socket on its own. With
+/// batching enabled, all frames queued by the time the connection is ready to
+/// write are written together and flushed once; if \ref window is non-zero,
+/// the connection also waits that long for more frames before flushing. This
+/// trades latency for fewer syscalls when many small messages are sent.
+///
+/// \see stats::write_batch_sizes
+struct write_batching_options {
+    bool enabled = false;
+    std::chrono::microseconds window{0}; ///< How long to wait for more frames before flushing
+    size_t max_bytes = 128 * 1024;       ///< Flush once this many bytes are batched
+};
+
+/// \brief Stream multiplexing configuration
+///
+/// By default every stream (see \ref client::make_stream_sink()) opens a
+/// connection of its own. With multiplexing enabled, and if the server has a
+/// streaming domain, streams are carried over the client's connection
+/// instead, as channels interleaved with ordinary messages. A channel may
+/// have at most \ref window bytes the receiver has not consumed yet in
+/// flight, and sends its data at most \ref max_chunk bytes at a time, so a
+/// busy stream neither exhausts the receiver's memory nor delays messages
+/// and other streams by more than a chunk.
+struct stream_multiplexing_options {
+    bool enabled = false;
+    size_t window = 256 * 1024;   ///< Per channel flow control window, in bytes
+    size_t max_chunk = 64 * 1024; ///< Largest piece of channel data sent at once
+};
+
 struct client_options {
     std::optional<net::tcp_keepalive_params> keepalive;
     bool tcp_nodelay = true;
     bool reuseaddr = false;
     compressor::factory* compressor_factory = nullptr;
+    adaptive_compression_options adaptive_compression;
+    write_batching_options write_batching;
+    stream_multiplexing_options stream_multiplexing;
+    /// Share the connection between scheduling groups on the wire, see
+    /// server_options::fair_outgoing_queue.
+    bool fair_outgoing_queue = false;
     bool send_timeout_data = true;
     connection_id stream_parent = invalid_connection_id;
     /// Configures how this connection is isolated from other connection on the same server.
@@ -140,6 +198,36 @@ class streaming_domain_type {
 
 struct server_options {
     compressor::factory* compressor_factory = nullptr;
+    adaptive_compression_options adaptive_compression;
+    write_batching_options write_batching;
+    /// Drop requests that cannot complete before the deadline the client sent
+    /// with them (see client_options::send_timeout_data) instead of running
+    /// them: requests arriving after their deadline, and requests that would
+    /// have to wait for resources longer than the time left, judging by how
+    /// long recently queued requests waited. Requests without a deadline are
+    /// never dropped. The client of a request dropped on arrival is replied
+    /// an overloaded_error, so it can fail fast; one whose deadline passed
+    /// times out as it would anyway.
+    ///
+    /// Queued requests whose deadline passes are dropped either way.
+    bool load_shedding = false;
+    /// Queue outgoing frames separately for each scheduling group they are
+    /// sent from (the group of the verb handler or of the connection, see
+    /// isolation_config), and take turns between the groups in proportion to
+    /// their shares, charging each for the bytes it sends. Without it frames
+    /// are sent in the order they were queued, so a group sending large
+    /// frames delays everyone else's small ones.
+    ///
+    /// A frame is never split, so a group may still have to wait for one
+    /// frame of another group to be sent. Stream frames, on stream
+    /// connections or multiplexed, are always sent in order.
+    bool fair_outgoing_queue = false;
+    /// The largest flow control window and chunk size accepted from a client
+    /// that multiplexes its streams (see stream_multiplexing_options). Larger
+    /// proposals are lowered to these, which bounds what a client can make
+    /// the server buffer for each channel. Must not be zero.
+    size_t max_stream_window = 1024 * 1024;
+    size_t max_stream_chunk = 64 * 1024;
     bool tcp_nodelay = true;
     std::optional<streaming_domain_type> streaming_domain;
     server_socket::load_balancing_algorithm load_balancing_algorithm = server_socket::load_balancing_algorithm::default_;
@@ -164,11 +252,15 @@ enum class protocol_features : uint32_t {
     CONNECTION_ID = 2,
     STREAM_PARENT = 3,
     ISOLATION = 4,
+    UNCOMPRESSED_FRAMES = 5,
+    STREAM_MULTIPLEX = 6,
 };
 
 // internal representation of feature data
 using feature_map = std::map<protocol_features, sstring>;
 
+class stream_mux;
+
 // An rpc signature, in the form signature<Ret (In0, In1, In2)>.
 template <typename Function>
 struct signature;
@@ -237,8 +329,9 @@ class connection {
         snd_buf buf;
         std::optional<promise<>> p = promise<>();
         cancellable* pcancel = nullptr;
-        outgoing_entry(snd_buf b) : buf(std::move(b)) {}
-        outgoing_entry(outgoing_entry&& o) noexcept : t(std::move(o.t)), buf(std::move(o.buf)), p(std::move(o.p)), pcancel(o.pcancel) {
+        uint64_t verb;
+        outgoing_entry(snd_buf b, uint64_t v) : buf(std::move(b)), verb(v) {}
+        outgoing_entry(outgoing_entry&& o) noexcept : t(std::move(o.t)), buf(std::move(o.buf)), p(std::move(o.p)), pcancel(o.pcancel), verb(o.verb) {
             o.p = std::nullopt;
         }
         ~outgoing_entry() {
@@ -252,16 +345,61 @@ class connection {
         }
     };
     friend outgoing_entry;
-    std::list<outgoing_entry> _outgoing_queue;
+    // Frames waiting to be sent, in a FIFO per scheduling group. pop()
+    // serves the group with the lowest virtual time, which advances by the
+    // size of each frame sent divided by the group's shares.
+    class outgoing_queue {
+    public:
+        using iterator = std::list<outgoing_entry>::iterator;
+    private:
+        struct group_queue {
+            std::list<outgoing_entry> entries;
+            float shares = 1;
+            double vtime = 0;
+        };
+        std::array<group_queue, max_scheduling_groups()> _groups;
+        double _vtime = 0;
+        size_t _size = 0;
+    public:
+        iterator push(unsigned group, float shares, snd_buf buf, uint64_t verb);
+        void erase(unsigned group, iterator it);
+        outgoing_entry pop();
+        void clear();
+        bool empty() const {
+            return !_size;
+        }
+        size_t size() const {
+            return _size;
+        }
+    };
+    outgoing_queue _outgoing_queue;
+    bool _fair_outgoing_queue = false;
     condition_variable _outgoing_queue_cond;
     future<> _send_loop_stopped = make_ready_future<>();
     std::unique_ptr<compressor> _compressor;
     bool _timeout_negotiated = false;
+    bool _uncompressed_frames_negotiated = false;
+    adaptive_compression_options _adaptive_compression;
+    // Compression accounting of a verb, and its recent compression ratio,
+    // see adaptive_compression_options. A connection sends few verbs, so
+    // they are kept in a flat vector, the last one used looked at first.
+    struct verb_compression {
+        uint64_t verb;
+        stats::compression_stats accounting;
+        double ratio = 0;
+        unsigned skipped = 0;
+        explicit verb_compression(uint64_t v) : verb(v) {}
+    };
+    std::vector<verb_compression> _verb_compression;
+    size_t _last_verb_compression = 0;
+    write_batching_options _write_batching;
     // stream related fields
     bool _is_stream = false;
     connection_id _id = invalid_connection_id;
 
     std::unordered_map<connection_id, xshard_connection_ptr> _streams;
+    // set if stream multiplexing was negotiated, see stream_multiplexing_options
+    std::shared_ptr<stream_mux> _stream_mux;
     queue<rcv_buf> _stream_queue = queue<rcv_buf>(max_queued_stream_buffers);
     semaphore _stream_sem = semaphore(max_stream_buffers_memory);
     bool _sink_closed = true;
@@ -274,7 +412,9 @@ class connection {
         return _is_stream;
     }
 
-    snd_buf compress(snd_buf buf);
+    verb_compression& get_verb_compression(uint64_t verb);
+    bool should_compress(verb_compression& vc, size_t size);
+    snd_buf compress(snd_buf buf, uint64_t verb);
     future<> send_buffer(snd_buf buf);
 
     enum class outgoing_queue_type {
@@ -283,6 +423,8 @@ class connection {
         stream = response
     };
 
+    template<outgoing_queue_type QueueType> outgoing_entry pop_outgoing();
+    template<outgoing_queue_type QueueType> future<> send_batch();
     template<outgoing_queue_type QueueType> void send_loop();
     future<> stop_send_loop();
     future<std::optional<rcv_buf>>  read_stream_frame_compressed(input_stream<char>& in);
@@ -298,12 +440,12 @@ class connection {
         set_socket(std::move(fd));
     }
     connection(const logger& l, void* s, connection_id id = invalid_connection_id) : _logger(l), _serializer(s), _id(id) {}
-    virtual ~connection() {}
+    virtual ~connection();
     void set_socket(connected_socket&& fd);
     future<> send_negotiation_frame(feature_map features);
     // functions below are public because they are used by external heavily templated functions
     // and I am not smart enough to know how to define them as friends
-    future<> send(snd_buf buf, std::optional<rpc_clock_type::time_point> timeout = {}, cancellable* cancel = nullptr);
+    future<> send(snd_buf buf, std::optional<rpc_clock_type::time_point> timeout = {}, cancellable* cancel = nullptr, uint64_t verb = stats::no_verb);
     bool error() { return _error; }
     void abort();
     future<> stop();
@@ -331,6 +473,9 @@ class connection {
     xshard_connection_ptr get_stream(connection_id id) const;
     void register_stream(connection_id id, xshard_connection_ptr c);
     virtual socket_address peer_address() const = 0;
+    /// Outgoing frame compression accounting, by verb (stats::no_verb for
+    /// frames of no verb); empty unless compression was negotiated.
+    std::unordered_map<uint64_t, stats::compression_stats> get_compression_stats() const;
 
     const logger& get_logger() const {
         return _logger;
@@ -462,6 +607,9 @@ class client : public rpc::connection, public weakly_referencable<client> {
     void wait_timed_out(id_type id);
     future<> stop();
     void abort_all_streams();
+    // the socket a new stream connection should use: s itself, or a channel
+    // of this connection if stream multiplexing was negotiated
+    socket stream_socket(socket s);
     void deregister_this_stream();
     socket_address peer_address() const override {
         return _server_addr;
@@ -482,7 +630,8 @@ class client : public rpc::connection, public weakly_referencable<client> {
             client_options o = _options;
             o.stream_parent = this->get_connection_id();
             o.send_timeout_data = false;
-            auto c = make_shared<client>(_logger, _serializer, o, std::move(socket), _server_addr);
+            o.stream_multiplexing.enabled = false;
+            auto c = make_shared<client>(_logger, _serializer, o, stream_socket(std::move(socket)), _server_addr);
             c->_parent = this->weak_from_this();
             c->_is_stream = true;
             return c->await_connection().then([c, this] {
@@ -524,9 +673,11 @@ class server {
         }
         future<> send_unknown_verb_reply(std::optional<rpc_clock_type::time_point> timeout, int64_t msg_id, uint64_t type);
     public:
+        // Replies to a request shed by wait_for_resources(), in the background.
+        void send_overloaded_reply(std::optional<rpc_clock_type::time_point> timeout, int64_t msg_id, uint64_t verb);
         connection(server& s, connected_socket&& fd, socket_address&& addr, const logger& l, void* seralizer, connection_id id);
         future<> process();
-        future<> respond(int64_t msg_id, snd_buf&& data, std::optional<rpc_clock_type::time_point> timeout);
+        future<> respond(int64_t msg_id, snd_buf&& data, std::optional<rpc_clock_type::time_point> timeout, uint64_t verb = stats::no_verb);
         client_info& info() { return _info; }
         const client_info& info() const { return _info; }
         stats get_stats() const {
@@ -541,14 +692,20 @@ class server {
         socket_address peer_address() const override {
             return _info.addr;
         }
-        // Resources will be released when this goes out of scope
+        // Resources will be released when this goes out of scope.
+        // Fails with semaphore_timed_out if the request should be dropped, or
+        // with overloaded_error if load shedding drops it before its deadline.
         future<resource_permit> wait_for_resources(size_t memory_consumed,  std::optional<rpc_clock_type::time_point> timeout) {
             if (timeout) {
+                if (_server._options.load_shedding) {
+                    return wait_for_resources_or_shed(memory_consumed, *timeout);
+                }
                 return get_units(_server._resources_available, memory_consumed, *timeout);
             } else {
                 return get_units(_server._resources_available, memory_consumed);
             }
         }
+        future<resource_permit> wait_for_resources_or_shed(size_t memory_consumed, rpc_clock_type::time_point timeout);
         size_t estimate_request_size(size_t serialized_size) {
             return rpc::estimate_request_size(_server._limits, serialized_size);
         }
@@ -569,8 +726,19 @@ class server {
     promise<> _ss_stopped;
     gate _reply_gate;
     server_options _options;
+    // moving average of how long requests waited for resources, as of
+    // _queue_wait_sampled
+    rpc_clock_type::duration _queue_wait_estimate{0};
+    rpc_clock_type::time_point _queue_wait_sampled;
     uint64_t _next_client_id = 1;
 
+    // Without new samples, e.g. because everything that would queue is
+    // shed, the estimate halves every queue_wait_half_life, so that the
+    // server recovers once the backlog clears.
+    static constexpr rpc_clock_type::duration queue_wait_half_life = std::chrono::milliseconds(100);
+    rpc_clock_type::duration queue_wait_estimate(rpc_clock_type::time_point now) const;
+    void sample_queue_wait(rpc_clock_type::time_point now, rpc_clock_type::duration waited);
+    void add_connection(connected_socket fd, socket_address addr);
 public:
     server(protocol_base* proto, const socket_address& addr, resource_limits memory_limit = resource_limits());
     server(protocol_base* proto, server_options opts, const socket_address& addr, resource_limits memory_limit = resource_limits());
@@ -587,6 +755,9 @@ class server {
     gate& reply_gate() {
         return _reply_gate;
     }
+    protocol_base* get_protocol() {
+        return _proto;
+    }
     friend connection;
     friend client;
 };
@@ -600,10 +771,55 @@ struct rpc_handler {
     gate use_gate;
 };
 
+/// \addtogroup rpc
+/// @{
+
+using seastar::latency_histogram;
+
+/// Per verb statistics of a protocol on this shard, across all its servers
+/// and clients.
+///
+/// \see protocol_base::enable_verb_metrics()
+struct verb_stats {
+    latency_histogram queue_wait;  ///< Server: time waiting for resource_limits memory before the handler runs
+    latency_histogram handler;     ///< Server: time from calling the handler until its result is ready
+    latency_histogram round_trip;  ///< Client: time from sending a request until its reply arrived
+    uint64_t server_in_flight = 0; ///< Server: handlers currently running
+    uint64_t client_in_flight = 0; ///< Client: requests waiting for a reply
+};
+
+class verb_metrics {
+    sstring _name;
+    std::unordered_map<uint64_t, std::unique_ptr<verb_stats>> _verbs;
+    metrics::metric_groups _metrics;
+public:
+    explicit verb_metrics(sstring name) : _name(std::move(name)) {}
+    /// Returns the statistics of a verb, registering its metrics on first use.
+    verb_stats& get(uint64_t verb);
+    /// Returns the statistics of a verb, or nullptr if it was not used yet.
+    const verb_stats* find(uint64_t verb) const;
+};
+
+/// @}
+
 class protocol_base {
+    std::unique_ptr<verb_metrics> _verb_metrics;
 public:
     virtual ~protocol_base() {};
     virtual shared_ptr<server::connection> make_server_connection(rpc::server& server, connected_socket fd, socket_address addr, connection_id id) = 0;
+
+    /// Starts collecting per verb latency histograms and in-flight counts of
+    /// this protocol's servers and clients on this shard.
+    ///
+    /// They are exported in the `rpc` metrics group, labelled with
+    /// `protocol` set to \c name and `verb` set to the verb's id. May only
+    /// be called once.
+    void enable_verb_metrics(sstring name);
+    /// Returns the per verb statistics, or nullptr if
+    /// \ref enable_verb_metrics() was not called.
+    verb_metrics* get_verb_metrics() {
+        return _verb_metrics.get();
+    }
 protected:
     friend class server;
 
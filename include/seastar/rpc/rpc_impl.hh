@@ -38,6 +38,7 @@ namespace rpc {
 enum class exception_type : uint32_t {
     USER = 0,
     UNKNOWN_VERB = 1,
+    OVERLOADED = 2,
 };
 
 template<typename T>
@@ -213,8 +214,12 @@ template <typename Serializer, typename Output>
 struct marshall_one {
     template <typename T> struct helper {
         static void doit(Serializer& serializer, Output& out, const T& arg) {
-            using serialize_helper_type = serialize_helper<is_smart_ptr<typename std::remove_reference<T>::type>::value>;
-            serialize_helper_type::serialize(serializer, out, arg);
+            if constexpr (std::is_same_v<T, fragmented_bytes>) {
+                put_fragmented_bytes(arg, out);
+            } else {
+                using serialize_helper_type = serialize_helper<is_smart_ptr<typename std::remove_reference<T>::type>::value>;
+                serialize_helper_type::serialize(serializer, out, arg);
+            }
         }
     };
     template<typename T> struct helper<std::reference_wrapper<const T>> {
@@ -222,6 +227,13 @@ struct marshall_one {
             helper<T>::doit(serializer, out, arg.get());
         }
     };
+    static void put_fragmented_bytes(const fragmented_bytes& arg, Output& out) {
+        auto size = cpu_to_le(uint32_t(arg.size()));
+        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        for (auto&& f : arg) {
+            out.write(f.get(), f.size());
+        }
+    }
     static void put_connection_id(const connection_id& cid, Output& out) {
         sstring id = serialize_connection_id(cid);
         out.write(id.c_str(), id.size());
@@ -274,19 +286,40 @@ inline snd_buf marshall(Serializer& serializer, size_t head_space, const T&... a
 }
 
 template <typename Serializer, typename Input>
-inline std::tuple<> do_unmarshall(connection& c, Input& in) {
+inline std::tuple<> do_unmarshall(connection& c, rcv_buf& data, Input& in) {
     return std::make_tuple();
 }
 
+// Output for Input::copy_to() that collects views of the bytes instead of
+// copying them
+struct fragment_sharer {
+    rcv_buf& data;
+    std::vector<temporary_buffer<char>> fragments;
+    void write(const char* p, size_t size) {
+        if (size) {
+            fragments.push_back(share_rcv_buf(data, p, size));
+        }
+    }
+};
+
 template<typename Serializer, typename Input>
 struct unmarshal_one {
     template<typename T> struct helper {
-        static T doit(connection& c, Input& in) {
-            return read(c.serializer<Serializer>(), in, type<T>());
+        static T doit(connection& c, rcv_buf& data, Input& in) {
+            if constexpr (std::is_same_v<T, fragmented_bytes>) {
+                uint32_t size;
+                in.read(reinterpret_cast<char*>(&size), sizeof(size));
+                auto bytes = in.read_substream(le_to_cpu(size));
+                fragment_sharer sharer{data};
+                bytes.copy_to(sharer);
+                return fragmented_bytes(std::move(sharer.fragments));
+            } else {
+                return read(c.serializer<Serializer>(), in, type<T>());
+            }
         }
     };
     template<typename T> struct helper<optional<T>> {
-        static optional<T> doit(connection& c, Input& in) {
+        static optional<T> doit(connection& c, rcv_buf& data, Input& in) {
             if (in.size()) {
                 return optional<T>(read(c.serializer<Serializer>(), in, type<typename remove_optional<T>::type>()));
             } else {
@@ -295,8 +328,8 @@ struct unmarshal_one {
         }
     };
     template<typename T> struct helper<std::reference_wrapper<const T>> {
-        static T doit(connection& c, Input& in) {
-            return helper<T>::doit(c, in);
+        static T doit(connection& c, rcv_buf& data, Input& in) {
+            return helper<T>::doit(c, data, in);
         }
     };
     static connection_id get_connection_id(Input& in) {
@@ -305,34 +338,34 @@ struct unmarshal_one {
         return deserialize_connection_id(id);
     }
     template<typename... T> struct helper<sink<T...>> {
-        static sink<T...> doit(connection& c, Input& in) {
+        static sink<T...> doit(connection& c, rcv_buf& data, Input& in) {
             return sink<T...>(make_shared<sink_impl<Serializer, T...>>(c.get_stream(get_connection_id(in))));
         }
     };
     template<typename... T> struct helper<source<T...>> {
-        static source<T...> doit(connection& c, Input& in) {
+        static source<T...> doit(connection& c, rcv_buf& data, Input& in) {
             return source<T...>(make_shared<source_impl<Serializer, T...>>(c.get_stream(get_connection_id(in))));
         }
     };
     template <typename... T> struct helper<tuple<T...>> {
-        static tuple<T...> doit(connection& c, Input& in) {
-            return do_unmarshall<Serializer, Input, T...>(c, in);
+        static tuple<T...> doit(connection& c, rcv_buf& data, Input& in) {
+            return do_unmarshall<Serializer, Input, T...>(c, data, in);
         }
     };
 };
 
 template <typename Serializer, typename Input, typename T0, typename... Trest>
-inline std::tuple<T0, Trest...> do_unmarshall(connection& c, Input& in) {
+inline std::tuple<T0, Trest...> do_unmarshall(connection& c, rcv_buf& data, Input& in) {
     // FIXME: something less recursive
-    auto first = std::make_tuple(unmarshal_one<Serializer, Input>::template helper<T0>::doit(c, in));
-    auto rest = do_unmarshall<Serializer, Input, Trest...>(c, in);
+    auto first = std::make_tuple(unmarshal_one<Serializer, Input>::template helper<T0>::doit(c, data, in));
+    auto rest = do_unmarshall<Serializer, Input, Trest...>(c, data, in);
     return std::tuple_cat(std::move(first), std::move(rest));
 }
 
 template <typename Serializer, typename... T>
 inline std::tuple<T...> unmarshall(connection& c, rcv_buf input) {
     auto in = make_deserializer_stream(input);
-    return do_unmarshall<Serializer, decltype(in), T...>(c, in);
+    return do_unmarshall<Serializer, decltype(in), T...>(c, input, in);
 }
 
 inline std::exception_ptr unmarshal_exception(rcv_buf& d) {
@@ -358,6 +391,9 @@ inline std::exception_ptr unmarshal_exception(rcv_buf& d) {
         ex = std::make_exception_ptr(unknown_verb_error(le_to_cpu(v64)));
         break;
     }
+    case exception_type::OVERLOADED:
+        ex = std::make_exception_ptr(overloaded_error());
+        break;
     default:
         ex = std::make_exception_ptr(unknown_exception_error());
         break;
@@ -447,15 +483,22 @@ relative_timeout_to_absolute(rpc_clock_type::duration relative) {
     return now + std::min(relative, rpc_clock_type::time_point::max() - now);
 }
 
+// Returns the statistics to update for a verb, if the protocol collects them.
+inline verb_stats* get_verb_stats(protocol_base* proto, uint64_t verb) {
+    auto vm = proto->get_verb_metrics();
+    return vm ? &vm->get(verb) : nullptr;
+}
+
 // Returns lambda that can be used to send rpc messages.
 // The lambda gets client connection and rpc parameters as arguments, marshalls them sends
 // to a server and waits for a reply. After receiving reply it unmarshalls it and signal completion
 // to a caller.
 template<typename Serializer, typename MsgType, typename Ret, typename... InArgs>
-auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
+auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig, protocol_base* xproto) {
     struct shelper {
         MsgType t;
         signature<Ret (InArgs...)> sig;
+        protocol_base* proto;
         auto send(rpc::client& dst, std::optional<rpc_clock_type::time_point> timeout, cancellable* cancel, const InArgs&... args) {
             if (dst.error()) {
                 using cleaned_ret_type = typename wait_signature<Ret>::cleaned_type;
@@ -473,9 +516,17 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
 
             // prepare reply handler, if return type is now_wait_type this does nothing, since no reply will be sent
             using wait = wait_signature_t<Ret>;
-            return when_all(dst.send(std::move(data), timeout, cancel), wait_for_reply<Serializer>(wait(), timeout, cancel, dst, msg_id, sig)).then([] (auto r) {
+            auto f = when_all(dst.send(std::move(data), timeout, cancel, uint64_t(t)), wait_for_reply<Serializer>(wait(), timeout, cancel, dst, msg_id, sig)).then([] (auto r) {
                     return std::move(std::get<1>(r)); // return future of wait_for_reply
             });
+            if (auto vs = get_verb_stats(proto, uint64_t(t))) {
+                vs->client_in_flight++;
+                return std::move(f).finally([vs, sent = std::chrono::steady_clock::now()] {
+                    vs->client_in_flight--;
+                    vs->round_trip.add(std::chrono::steady_clock::now() - sent);
+                });
+            }
+            return f;
         }
         auto operator()(rpc::client& dst, const InArgs&... args) {
             return send(dst, {}, nullptr, args...);
@@ -491,12 +542,12 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
         }
 
     };
-    return shelper{xt, xsig};
+    return shelper{xt, xsig, xproto};
 }
 
 template<typename Serializer, typename SEASTAR_ELLIPSIS RetTypes>
 inline future<> reply(wait_type, future<RetTypes SEASTAR_ELLIPSIS>&& ret, int64_t msg_id, shared_ptr<server::connection> client,
-        std::optional<rpc_clock_type::time_point> timeout) {
+        std::optional<rpc_clock_type::time_point> timeout, uint64_t verb) {
     if (!client->error()) {
         snd_buf data;
         try {
@@ -523,7 +574,7 @@ inline future<> reply(wait_type, future<RetTypes SEASTAR_ELLIPSIS>&& ret, int64_
             msg_id = -msg_id;
         }
 
-        return client->respond(msg_id, std::move(data), timeout);
+        return client->respond(msg_id, std::move(data), timeout, verb);
     } else {
         ret.ignore_ready_future();
         return make_ready_future<>();
@@ -532,7 +583,7 @@ inline future<> reply(wait_type, future<RetTypes SEASTAR_ELLIPSIS>&& ret, int64_
 
 // specialization for no_wait_type which does not send a reply
 template<typename Serializer>
-inline future<> reply(no_wait_type, future<no_wait_type>&& r, int64_t msgid, shared_ptr<server::connection> client, std::optional<rpc_clock_type::time_point> timeout) {
+inline future<> reply(no_wait_type, future<no_wait_type>&& r, int64_t msgid, shared_ptr<server::connection> client, std::optional<rpc_clock_type::time_point> timeout, uint64_t verb) {
     try {
         r.get();
     } catch (std::exception& ex) {
@@ -565,10 +616,10 @@ auto lref_to_cref(T& x) {
 // Creates lambda to handle RPC message on a server.
 // The lambda unmarshalls all parameters, calls a handler, marshall return values and sends them back to a client
 template <typename Serializer, typename Func, typename Ret, typename... InArgs, typename WantClientInfo, typename WantTimePoint>
-auto recv_helper(signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci, WantTimePoint wtp) {
+auto recv_helper(signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci, WantTimePoint wtp, uint64_t verb) {
     using signature = decltype(sig);
     using wait_style = wait_signature_t<Ret>;
-    return [func = lref_to_cref(std::forward<Func>(func))](shared_ptr<server::connection> client,
+    return [func = lref_to_cref(std::forward<Func>(func)), verb](shared_ptr<server::connection> client,
                                                            std::optional<rpc_clock_type::time_point> timeout,
                                                            int64_t msg_id,
                                                            rcv_buf data) mutable {
@@ -577,21 +628,35 @@ auto recv_helper(signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci
             auto err = format("request size {:d} large than memory limit {:d}", memory_consumed, client->max_request_size());
             client->get_logger()(client->peer_address(), err);
             // FIXME: future is discarded
-            (void)try_with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, err = std::move(err)] {
-                return reply<Serializer>(wait_style(), futurize<Ret>::make_exception_future(std::runtime_error(err.c_str())), msg_id, client, timeout).handle_exception([client, msg_id] (std::exception_ptr eptr) {
+            (void)try_with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, verb, err = std::move(err)] {
+                return reply<Serializer>(wait_style(), futurize<Ret>::make_exception_future(std::runtime_error(err.c_str())), msg_id, client, timeout, verb).handle_exception([client, msg_id] (std::exception_ptr eptr) {
                     client->get_logger()(client->info(), msg_id, format("got exception while processing an oversized message: {}", eptr));
                 });
             }).handle_exception_type([] (gate_closed_exception&) {/* ignore */});
             return make_ready_future();
         }
+        auto vs = get_verb_stats(client->get_server().get_protocol(), verb);
+        auto queued = vs ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
         // note: apply is executed asynchronously with regards to networking so we cannot chain futures here by doing "return apply()"
-        auto f = client->wait_for_resources(memory_consumed, timeout).then([client, timeout, msg_id, data = std::move(data), &func] (auto permit) mutable {
+        auto f = client->wait_for_resources(memory_consumed, timeout).then([client, timeout, msg_id, verb, vs, queued, data = std::move(data), &func] (auto permit) mutable {
+                if (vs) {
+                    vs->queue_wait.add(std::chrono::steady_clock::now() - queued);
+                }
                 // FIXME: future is discarded
-                (void)try_with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, data = std::move(data), permit = std::move(permit), &func] () mutable {
+                (void)try_with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, verb, vs, data = std::move(data), permit = std::move(permit), &func] () mutable {
                     try {
                         auto args = unmarshall<Serializer, InArgs...>(*client, std::move(data));
-                        return apply(func, client->info(), timeout, WantClientInfo(), WantTimePoint(), signature(), std::move(args)).then_wrapped([client, timeout, msg_id, permit = std::move(permit)] (futurize_t<Ret> ret) mutable {
-                            return reply<Serializer>(wait_style(), std::move(ret), msg_id, client, timeout).handle_exception([permit = std::move(permit), client, msg_id] (std::exception_ptr eptr) {
+                        auto started = std::chrono::steady_clock::time_point();
+                        if (vs) {
+                            vs->server_in_flight++;
+                            started = std::chrono::steady_clock::now();
+                        }
+                        return apply(func, client->info(), timeout, WantClientInfo(), WantTimePoint(), signature(), std::move(args)).then_wrapped([client, timeout, msg_id, verb, vs, started, permit = std::move(permit)] (futurize_t<Ret> ret) mutable {
+                            if (vs) {
+                                vs->server_in_flight--;
+                                vs->handler.add(std::chrono::steady_clock::now() - started);
+                            }
+                            return reply<Serializer>(wait_style(), std::move(ret), msg_id, client, timeout, verb).handle_exception([permit = std::move(permit), client, msg_id] (std::exception_ptr eptr) {
                                 client->get_logger()(client->info(), msg_id, format("got exception while processing a message: {}", eptr));
                             });
                         });
@@ -603,7 +668,11 @@ auto recv_helper(signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci
         });
 
         if (timeout) {
-            f = f.handle_exception_type([] (semaphore_timed_out&) { /* ignore */ });
+            f = f.handle_exception_type([client, timeout, msg_id, verb] (overloaded_error&) {
+                if constexpr (!std::is_same_v<wait_style, no_wait_type>) {
+                    client->send_overloaded_reply(timeout, msg_id, verb);
+                }
+            }).handle_exception_type([] (semaphore_timed_out&) { /* ignore */ });
         }
 
         return f;
@@ -654,7 +723,7 @@ template<typename Serializer, typename MsgType>
 template<typename Ret, typename... In>
 auto protocol<Serializer, MsgType>::make_client(signature<Ret(In...)> clear_sig, MsgType t) {
     using sig_type = signature<typename client_function_type<Ret, In...>::type>;
-    return send_helper<Serializer>(t, sig_type());
+    return send_helper<Serializer>(t, sig_type(), this);
 }
 
 template<typename Serializer, typename MsgType>
@@ -671,7 +740,7 @@ auto protocol<Serializer, MsgType>::register_handler(MsgType t, scheduling_group
     using want_client_info = typename sig_type::want_client_info;
     using want_time_point = typename sig_type::want_time_point;
     auto recv = recv_helper<Serializer>(clean_sig_type(), std::forward<Func>(func),
-            want_client_info(), want_time_point());
+            want_client_info(), want_time_point(), uint64_t(t));
     register_receiver(t, rpc_handler{sg, make_copyable_function(std::move(recv))});
     return make_client(clean_sig_type(), t);
 }
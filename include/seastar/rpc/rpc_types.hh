@@ -23,6 +23,9 @@
 
 #include <seastar/net/api.hh>
 #include <stdexcept>
+#include <array>
+#include <limits>
+#include <unordered_map>
 #include <string>
 #include <boost/any.hpp>
 #include <boost/type.hpp>
@@ -53,6 +56,40 @@ struct stats {
     counter_type sent_messages = 0;
     counter_type wait_reply = 0;
     counter_type timeout = 0;
+    /// Server: requests dropped by load shedding because their deadline
+    /// passed before they arrived.
+    counter_type shed_expired = 0;
+    /// Server: requests dropped by load shedding on arrival because they
+    /// were expected to wait for resources past their deadline; their
+    /// clients are replied an overloaded_error.
+    counter_type shed_overloaded = 0;
+    /// Server: requests dropped because their deadline passed while waiting
+    /// for resources; only counted with load shedding enabled.
+    counter_type shed_timed_out = 0;
+
+    /// Verb of frames that do not belong to a verb (stream frames,
+    /// protocol level error replies), see connection::get_compression_stats().
+    static constexpr uint64_t no_verb = std::numeric_limits<uint64_t>::max();
+    /// Accounting of a verb's outgoing frame compression.
+    struct compression_stats {
+        counter_type compressed = 0;         ///< frames sent compressed
+        counter_type bypassed = 0;           ///< frames sent uncompressed by adaptive compression
+        counter_type uncompressed_bytes = 0; ///< size of the compressed frames before compression
+        counter_type compressed_bytes = 0;   ///< size of the compressed frames after compression
+        std::chrono::nanoseconds wall_time{0}; ///< wall clock time spent compressing
+        /// Compressed to uncompressed size ratio, 1 if nothing was compressed.
+        double ratio() const {
+            return uncompressed_bytes ? double(compressed_bytes) / uncompressed_bytes : 1.0;
+        }
+    };
+    /// Wall clock time spent decompressing incoming frames.
+    std::chrono::nanoseconds decompression_time{0};
+
+    /// Number of times outgoing frames were flushed to the socket.
+    counter_type write_batches = 0;
+    /// Histogram of frames per flush: bucket i counts flushes of
+    /// [2^i, 2^(i+1)) frames, the last bucket counts everything above.
+    std::array<counter_type, 8> write_batch_sizes{};
 };
 
 
@@ -106,6 +143,11 @@ class rpc_protocol_error : public error {
     rpc_protocol_error() : error("rpc protocol exception") {}
 };
 
+class overloaded_error : public error {
+public:
+    overloaded_error() : error("rpc server is overloaded") {}
+};
+
 class canceled_error : public error {
 public:
     canceled_error() : error("rpc call was canceled") {}
@@ -206,6 +248,10 @@ struct snd_buf {
     temporary_buffer<char>& front();
 };
 
+/// Returns a buffer referring to the \c size bytes at \c p, which must lie
+/// within one of \c buf's fragments, and sharing its deleter.
+temporary_buffer<char> share_rcv_buf(rcv_buf& buf, const char* p, size_t size);
+
 static inline memory_input_stream<rcv_buf::iterator> make_deserializer_stream(rcv_buf& input) {
     auto* b = std::get_if<temporary_buffer<char>>(&input.bufs);
     if (b) {
@@ -356,6 +402,63 @@ class tuple : public std::tuple<T...> {
     tuple(std::tuple<T...>&& x) : std::tuple<T...>(std::move(x)) {}
 };
 
+/// A blob of bytes marshalled by rpc itself, without a copy on the
+/// receiving side.
+///
+/// When used as a verb argument or return type, the bytes are written to
+/// the frame as a 32-bit length followed by the data, and on the receiving
+/// side the fragments refer directly to the buffers the frame was read (or
+/// decompressed) into. This makes it suitable for bulk transfers, where
+/// copying the payload out of the frame would dominate the cost.
+///
+/// Keeping the fragments alive keeps the whole underlying receive buffers
+/// alive, and the memory is no longer accounted for by the server's
+/// \ref resource_limits once the handler completes; copy small payloads
+/// that need to be kept for long (see \ref linearize()).
+///
+/// The sending side still copies the data into the outgoing frame.
+class fragmented_bytes {
+    std::vector<temporary_buffer<char>> _fragments;
+    size_t _size = 0;
+public:
+    using const_iterator = std::vector<temporary_buffer<char>>::const_iterator;
+
+    fragmented_bytes() = default;
+    explicit fragmented_bytes(temporary_buffer<char> buf);
+    explicit fragmented_bytes(std::vector<temporary_buffer<char>> fragments);
+
+    size_t size() const noexcept {
+        return _size;
+    }
+    bool empty() const noexcept {
+        return !_size;
+    }
+    /// The fragments, none of which are empty.
+    const std::vector<temporary_buffer<char>>& fragments() const noexcept {
+        return _fragments;
+    }
+    const_iterator begin() const noexcept {
+        return _fragments.begin();
+    }
+    const_iterator end() const noexcept {
+        return _fragments.end();
+    }
+    std::vector<temporary_buffer<char>> release() && noexcept {
+        _size = 0;
+        return std::move(_fragments);
+    }
+    /// Returns another view of the same bytes.
+    fragmented_bytes share();
+    /// Returns the bytes in a single buffer, copying them only if there is
+    /// more than one fragment.
+    temporary_buffer<char> linearize();
+
+    bool operator==(const fragmented_bytes& x) const noexcept;
+    bool operator!=(const fragmented_bytes& x) const noexcept {
+        return !(*this == x);
+    }
+};
+
 /// @}
 
 template <typename... T>
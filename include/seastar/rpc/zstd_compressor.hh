@@ -0,0 +1,99 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <seastar/core/sstring.hh>
+#include <seastar/core/temporary_buffer.hh>
+#include <seastar/rpc/rpc_types.hh>
+
+namespace seastar {
+namespace rpc {
+
+/// A zstd dictionary shared by both ends of a connection.
+///
+/// Small messages give the compressor too little history to find
+/// repetitions in; a dictionary trained on typical traffic supplies that
+/// history up front. Dictionaries are identified by the id zstd stores in
+/// them, so both peers must load byte-identical contents. Copies are cheap
+/// and may be used from any shard.
+class zstd_dictionary {
+public:
+    struct impl;
+private:
+    std::shared_ptr<const impl> _impl;
+public:
+    /// Loads a dictionary produced by \ref train() or by `zstd --train`.
+    ///
+    /// \throws std::invalid_argument if \c content is not a zstd dictionary
+    explicit zstd_dictionary(temporary_buffer<char> content);
+    /// Trains a dictionary of at most \c max_size bytes from sample messages.
+    static zstd_dictionary train(const std::vector<temporary_buffer<char>>& samples, size_t max_size = 16 * 1024);
+    /// The id negotiated with the peer.
+    uint32_t id() const;
+    /// The raw dictionary, e.g. to persist it or ship it to other nodes.
+    const temporary_buffer<char>& content() const;
+    const impl& get_impl() const {
+        return *_impl;
+    }
+};
+
+/// Compressor using zstd, optionally primed with a \ref zstd_dictionary.
+///
+/// The factory offers one feature name per dictionary, in the order given,
+/// followed by plain `ZSTD`; the server picks the first one it also has.
+/// Data is streamed through zstd fragment by fragment, so large messages
+/// are never linearized. A frame that decompresses to more than
+/// \c max_decompressed_size bytes fails the connection instead of
+/// exhausting memory.
+class zstd_compressor final : public compressor {
+public:
+    static constexpr int default_level = 3;
+    static constexpr size_t default_max_decompressed_size = 128 << 20;
+    struct prepared_dictionary;
+
+    class factory final : public rpc::compressor::factory {
+        int _level;
+        size_t _max_decompressed_size;
+        std::vector<std::shared_ptr<const prepared_dictionary>> _dictionaries;
+        sstring _features;
+    public:
+        explicit factory(int level = default_level, std::vector<zstd_dictionary> dictionaries = {},
+                size_t max_decompressed_size = default_max_decompressed_size);
+        virtual const sstring& supported() const override;
+        virtual std::unique_ptr<rpc::compressor> negotiate(sstring feature, bool is_server) const override;
+    };
+private:
+    int _level;
+    size_t _max_decompressed_size;
+    std::shared_ptr<const prepared_dictionary> _dictionary;
+public:
+    explicit zstd_compressor(int level = default_level, std::shared_ptr<const prepared_dictionary> dictionary = nullptr,
+            size_t max_decompressed_size = default_max_decompressed_size);
+    virtual snd_buf compress(size_t head_space, snd_buf data) override;
+    virtual rcv_buf decompress(rcv_buf data) override;
+    sstring name() const override;
+};
+
+}
+}
@@ -0,0 +1,76 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/core/bitops.hh>
+#include <seastar/core/metrics_types.hh>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace seastar {
+
+/// Latency histogram with power of two buckets, starting at 1us.
+///
+/// Adding a sample is a few instructions, so it can be kept for every
+/// request of a server.
+class latency_histogram {
+public:
+    static constexpr size_t nr_buckets = 24;
+private:
+    std::array<uint64_t, nr_buckets> _buckets{};
+    uint64_t _count = 0;
+    std::chrono::microseconds _sum{0};
+public:
+    void add(std::chrono::steady_clock::duration latency) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency);
+        auto n = uint64_t(std::max<int64_t>(us.count(), 1));
+        // bucket i holds latencies up to 2^i us
+        auto bucket = std::min<size_t>(log2ceil(n), nr_buckets - 1);
+        _buckets[bucket]++;
+        _count++;
+        _sum += us;
+    }
+    uint64_t count() const {
+        return _count;
+    }
+    std::chrono::microseconds sum() const {
+        return _sum;
+    }
+    /// Bucket upper bounds are in microseconds.
+    metrics::histogram to_metrics_histogram() const {
+        metrics::histogram h;
+        h.sample_count = _count;
+        h.sample_sum = _sum.count();
+        h.buckets.resize(nr_buckets);
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < nr_buckets; i++) {
+            cumulative += _buckets[i];
+            h.buckets[i].count = cumulative;
+            h.buckets[i].upper_bound = double(uint64_t(1) << i);
+        }
+        return h;
+    }
+};
+
+}
@@ -39,6 +39,8 @@ debian_packages=(
     xfslibs-dev
     libgnutls28-dev
     liblz4-dev
+    libzstd-dev
+    zlib1g-dev
     libsctp-dev
     gcc
     make
@@ -75,6 +77,8 @@ redhat_packages=(
     gnutls-devel
     lksctp-tools-devel
     lz4-devel
+    libzstd-devel
+    zlib-devel
     gcc
     make
     protobuf-devel
@@ -149,6 +153,8 @@ arch_packages=(
     gnutls
     lksctp-tools
     lz4
+    zstd
+    zlib
     make
     protobuf
     libtool
@@ -188,6 +194,8 @@ opensuse_packages=(
     libgnutls-devel
     libgnutlsxx28
     liblz4-devel
+    libzstd-devel
+    zlib-devel
     libnuma-devel
     lksctp-tools-devel
     ninja protobuf-devel
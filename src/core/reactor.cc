@@ -1359,7 +1359,7 @@ reactor::posix_listen(socket_address sa, listen_options opts) {
     if (opts.reuse_address) {
         fd.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1);
     }
-    if (_reuseport && !sa.is_af_unix())
+    if ((_reuseport || opts.lba == server_socket::load_balancing_algorithm::incoming_cpu) && !sa.is_af_unix())
         fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
 
     try {
@@ -4256,6 +4256,11 @@ scheduling_group::set_shares(float shares) noexcept {
     engine()._task_queues[_id]->set_shares(shares);
 }
 
+float
+scheduling_group::get_shares() const noexcept {
+    return engine()._task_queues[_id]->_shares;
+}
+
 future<scheduling_group>
 create_scheduling_group(sstring name, float shares) noexcept {
     auto aid = allocate_scheduling_group_id();
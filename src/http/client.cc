@@ -0,0 +1,504 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#include <seastar/http/client.hh>
+#include <seastar/http/internal/content_source.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/print.hh>
+#include <seastar/core/seastar.hh>
+#include <seastar/core/semaphore.hh>
+#include <seastar/core/timed_out_error.hh>
+#include <seastar/core/with_timeout.hh>
+#include <algorithm>
+
+namespace seastar {
+
+namespace http {
+
+namespace {
+
+// The connection was closed, or failed, before any part of the response
+// arrived. A reused keep-alive connection may have been closed by the
+// server while idle, so the request is retried.
+class connection_lost_error : public std::runtime_error {
+public:
+    connection_lost_error() : runtime_error("Connection closed before the response") {}
+};
+
+// The body of a response that is delimited by the end of the connection.
+class until_eof_source_impl : public data_source_impl {
+    input_stream<char>& _inp;
+public:
+    explicit until_eof_source_impl(input_stream<char>& inp) : _inp(inp) {
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        return _inp.read();
+    }
+};
+
+// Sends a request body with chunked transfer encoding; closing the stream
+// sends the last chunk.
+class chunked_sink_impl : public data_sink_impl {
+    output_stream<char>& _out;
+public:
+    explicit chunked_sink_impl(output_stream<char>& out) : _out(out) {
+    }
+    virtual future<> put(net::packet data) override { abort(); }
+    using data_sink_impl::put;
+    virtual future<> put(temporary_buffer<char> buf) override {
+        if (buf.empty()) {
+            return make_ready_future<>();
+        }
+        auto size = format("{:x}\r\n", buf.size());
+        return _out.write(size).then([this, buf = std::move(buf)] {
+            return _out.write(buf.get(), buf.size());
+        }).then([this] {
+            return _out.write("\r\n", 2);
+        });
+    }
+    virtual future<> close() override {
+        return _out.write("0\r\n\r\n", 5);
+    }
+};
+
+sstring to_lower(sstring s) {
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+size_t parse_content_length(const sstring& s) {
+    size_t len = 0;
+    if (s.empty() || s.size() > 18) {
+        throw std::runtime_error(format("Invalid Content-Length in response: {}", s));
+    }
+    for (auto c : s) {
+        if (c < '0' || c > '9') {
+            throw std::runtime_error(format("Invalid Content-Length in response: {}", s));
+        }
+        len = len * 10 + (c - '0');
+    }
+    return len;
+}
+
+}
+
+class client::connection : public enable_lw_shared_from_this<connection> {
+    connected_socket _fd;
+    input_stream<char> _read_buf;
+    output_stream<char> _write_buf;
+    http_response_parser _parser;
+    // requests are written one at a time...
+    semaphore _write_sem{1};
+    // ...and their responses read in the same order
+    future<> _read_tail = make_ready_future<>();
+    unsigned _in_flight = 0;
+    uint64_t _served = 0;
+    bool _keep_alive = true;
+public:
+    explicit connection(connected_socket fd)
+        : _fd(std::move(fd))
+        , _read_buf(_fd.input())
+        , _write_buf(_fd.output()) {
+        _fd.set_nodelay(true);
+    }
+
+    unsigned in_flight() const {
+        return _in_flight;
+    }
+    uint64_t served() const {
+        return _served;
+    }
+    bool reusable() const {
+        return _keep_alive;
+    }
+    void acquire() {
+        ++_in_flight;
+    }
+    void release() {
+        --_in_flight;
+    }
+
+    // Sends the request and hands its response to handle. With pipelining
+    // this may be called again before the returned future resolves.
+    future<> make_request(request& req, const sstring& host, response_handler& handle) {
+        promise<> read_done;
+        auto prev = std::exchange(_read_tail, read_done.get_future());
+        auto written = with_semaphore(_write_sem, 1, [this, &req, &host] {
+            return write_request(req, host).handle_exception([&req] (std::exception_ptr ex) {
+                if (req.body_writer) {
+                    return make_exception_future<>(std::move(ex));
+                }
+                return make_exception_future<>(connection_lost_error());
+            });
+        });
+        // wait for the previous response even if our write failed, the
+        // input stream must not be read by two requests at once
+        return std::move(written).then_wrapped([prev = std::move(prev)] (future<> f) mutable {
+            return prev.then([f = std::move(f)] () mutable {
+                return std::move(f);
+            });
+        }).then([this, &req, &handle] {
+            return read_response(req, handle);
+        }).then_wrapped([this, read_done = std::move(read_done)] (future<> f) mutable {
+            if (f.failed()) {
+                // responses to later requests cannot be found anymore
+                _keep_alive = false;
+                shutdown();
+            } else {
+                ++_served;
+            }
+            read_done.set_value();
+            return f;
+        });
+    }
+
+    void shutdown() {
+        _keep_alive = false;
+        _fd.shutdown_input();
+        _fd.shutdown_output();
+    }
+
+    future<> close() {
+        return _write_buf.close().handle_exception([] (std::exception_ptr) {}).then([this] {
+            return _read_buf.close();
+        }).handle_exception([] (std::exception_ptr) {});
+    }
+private:
+    future<> write_request(request& req, const sstring& host) {
+        // the framing fields are ours to set
+        auto is_framing = [] (const sstring& name) {
+            return header_map::name_equal(name, "Content-Length") || header_map::name_equal(name, "Transfer-Encoding");
+        };
+        bool add_host = !host.empty() && !req.headers.count("Host");
+        sstring length;
+        if (!req.body_writer && (!req.content.empty() || req.method == "POST" || req.method == "PUT" || req.method == "PATCH")) {
+            length = to_sstring(req.content.size());
+        }
+        std::string_view chunked = req.body_writer ? "Transfer-Encoding: chunked\r\n" : "";
+        // built in one go, as this is done for every request
+        size_t size = req.method.size() + req.url.size() + 12 + chunked.size() + 2;
+        if (add_host) {
+            size += host.size() + 8;
+        }
+        if (!length.empty()) {
+            size += length.size() + 18;
+        }
+        for (auto& h : req.headers) {
+            if (!is_framing(h.first)) {
+                size += h.first.size() + h.second.size() + 4;
+            }
+        }
+        auto head = uninitialized_string(size);
+        auto p = head.data();
+        auto put = [&p] (std::string_view s) {
+            p = std::copy(s.begin(), s.end(), p);
+        };
+        put(req.method);
+        put(" ");
+        put(req.url);
+        put(" HTTP/1.1\r\n");
+        if (add_host) {
+            put("Host: ");
+            put(host);
+            put("\r\n");
+        }
+        for (auto& h : req.headers) {
+            if (!is_framing(h.first)) {
+                put(h.first);
+                put(": ");
+                put(h.second);
+                put("\r\n");
+            }
+        }
+        put(chunked);
+        if (!length.empty()) {
+            put("Content-Length: ");
+            put(length);
+            put("\r\n");
+        }
+        put("\r\n");
+        return _write_buf.write(head).then([this, &req] {
+            if (!req.body_writer) {
+                return _write_buf.write(req.content);
+            }
+            auto out = output_stream<char>(data_sink(std::make_unique<chunked_sink_impl>(_write_buf)), 32000, true);
+            return do_with(std::move(out), [&req] (output_stream<char>& out) {
+                return req.body_writer(out).then_wrapped([&out] (future<> f) {
+                    return out.close().then([f = std::move(f)] () mutable {
+                        return std::move(f);
+                    });
+                });
+            });
+        }).then([this] {
+            return _write_buf.flush();
+        });
+    }
+
+    future<> read_response(request& req, response_handler& handle) {
+        _parser.init();
+        return _read_buf.consume(_parser).then([this, &req, &handle] {
+            if (_parser.eof()) {
+                throw connection_lost_error();
+            }
+            if (_parser._state != http_response_parser::state::done) {
+                throw std::runtime_error("Malformed HTTP response");
+            }
+            auto parsed = _parser.get_parsed_response();
+            if (parsed->_status >= 100 && parsed->_status < 200 && parsed->_status != 101) {
+                return read_response(req, handle);
+            }
+            response rsp;
+            rsp.status = parsed->_status;
+            rsp.version = std::move(parsed->_version);
+            rsp.headers = std::move(parsed->_headers);
+
+            auto conn = to_lower(rsp.get_header("Connection"));
+            if (conn.find("close") != sstring::npos
+                    || (rsp.version == "1.0" && conn.find("keep-alive") == sstring::npos)) {
+                _keep_alive = false;
+            }
+            std::unique_ptr<data_source_impl> body;
+            if (rsp.status == 101) {
+                // the connection now speaks another protocol
+                _keep_alive = false;
+                body = std::make_unique<until_eof_source_impl>(_read_buf);
+            } else if (req.method == "HEAD" || rsp.status == 204 || rsp.status == 304) {
+                body = std::make_unique<httpd::internal::content_length_source_impl>(_read_buf, 0);
+            } else if (to_lower(rsp.get_header("Transfer-Encoding")).find("chunked") != sstring::npos) {
+                body = std::make_unique<httpd::internal::chunked_source_impl>(_read_buf);
+            } else if (rsp.headers.count("Content-Length")) {
+                body = std::make_unique<httpd::internal::content_length_source_impl>(_read_buf, parse_content_length(rsp.get_header("Content-Length")));
+            } else {
+                _keep_alive = false;
+                body = std::make_unique<until_eof_source_impl>(_read_buf);
+            }
+            return do_with(std::move(rsp), input_stream<char>(data_source(std::move(body))),
+                    [this, &handle] (response& rsp, input_stream<char>& body) {
+                return handle(rsp, body).then([this, &body] {
+                    if (!_keep_alive) {
+                        return make_ready_future<>();
+                    }
+                    // skip what the handler did not read
+                    return repeat([&body] {
+                        return body.read().then([] (temporary_buffer<char> buf) {
+                            return stop_iteration(buf.empty());
+                        });
+                    });
+                });
+            });
+        });
+    }
+};
+
+future<connected_socket> basic_connection_factory::make() {
+    if (_creds) {
+        return tls::connect(_creds, _addr, _server_name);
+    }
+    return seastar::connect(_addr);
+}
+
+client::client(socket_address addr, client_options options)
+    : client(std::make_unique<basic_connection_factory>(addr), std::move(options)) {
+    if (_options.host.empty()) {
+        _options.host = format("{}", addr);
+    }
+}
+
+client::client(std::unique_ptr<connection_factory> factory, client_options options)
+    : _factory(std::move(factory))
+    , _options(std::move(options)) {
+}
+
+client::~client() = default;
+
+unsigned client::connections() const {
+    return _connections.size();
+}
+
+unsigned client::idle_connections() const {
+    return std::count_if(_connections.begin(), _connections.end(), [] (auto& con) {
+        return !con->in_flight();
+    });
+}
+
+future<> client::make_request(request req, response_handler handle) {
+    return with_gate(_gate, [this, req = std::move(req), handle = std::move(handle)] () mutable {
+        std::optional<steady_clock_type::time_point> deadline;
+        if (_options.request_timeout) {
+            deadline = steady_clock_type::now() + *_options.request_timeout;
+        }
+        return do_with(std::move(req), std::move(handle), [this, deadline] (request& req, response_handler& handle) {
+            return do_make_request(req, handle, deadline, true);
+        });
+    });
+}
+
+future<response> client::make_request(request req) {
+    return do_with(response(), [this, req = std::move(req)] (response& result) mutable {
+        return make_request(std::move(req), [&result] (const response& rsp, input_stream<char>& body) {
+            result.status = rsp.status;
+            result.version = rsp.version;
+            result.headers = rsp.headers;
+            return repeat([&result, &body] {
+                return body.read().then([&result] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        return stop_iteration::yes;
+                    }
+                    result.content.append(buf.get(), buf.size());
+                    return stop_iteration::no;
+                });
+            });
+        }).then([&result] {
+            return std::move(result);
+        });
+    });
+}
+
+// Whether a request can be sent again without changing what it does
+// (RFC 7231, section 4.2.2): a pipelined request that failed on a lost
+// connection may have been handled.
+static bool is_idempotent(std::string_view method) {
+    return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "PUT" || method == "DELETE";
+}
+
+future<> client::do_make_request(request& req, response_handler& handle, std::optional<steady_clock_type::time_point> deadline, bool retry) {
+    return get_connection(deadline).then([this, &req, &handle, deadline, retry] (lw_shared_ptr<connection> con) {
+        bool reused = con->served();
+        return do_with(false, timer<>(), [this, &req, &handle, deadline, retry, con, reused] (bool& timed_out, timer<>& t) {
+            if (deadline) {
+                t.set_callback([con, &timed_out] {
+                    timed_out = true;
+                    con->shutdown();
+                });
+                t.arm(*deadline);
+            }
+            return con->make_request(req, _options.host, handle).then_wrapped([this, &req, &handle, &timed_out, &t, deadline, retry, con, reused] (future<> f) {
+                t.cancel();
+                put_connection(con);
+                if (!f.failed()) {
+                    return make_ready_future<>();
+                }
+                auto ex = f.get_exception();
+                if (timed_out) {
+                    return make_exception_future<>(timed_out_error());
+                }
+                if (retry && reused && !req.body_writer && is_idempotent(req.method)) {
+                    try {
+                        std::rethrow_exception(ex);
+                    } catch (connection_lost_error&) {
+                        return do_make_request(req, handle, deadline, false);
+                    } catch (...) {
+                    }
+                }
+                return make_exception_future<>(std::move(ex));
+            });
+        });
+    });
+}
+
+future<lw_shared_ptr<client::connection>> client::get_connection(std::optional<steady_clock_type::time_point> deadline) {
+    auto con = find_connection(true);
+    if (!con && _connections.size() + _connecting < _options.max_connections) {
+        return make_connection(deadline);
+    }
+    if (!con) {
+        con = find_connection(false);
+    }
+    if (con) {
+        con->acquire();
+        return make_ready_future<lw_shared_ptr<connection>>(std::move(con));
+    }
+    auto f = deadline ? _wait_con.wait(*deadline) : _wait_con.wait();
+    return f.handle_exception_type([] (condition_variable_timed_out&) {
+        return make_exception_future<>(timed_out_error());
+    }).then([this, deadline] {
+        return get_connection(deadline);
+    });
+}
+
+lw_shared_ptr<client::connection> client::find_connection(bool idle) const {
+    lw_shared_ptr<connection> best;
+    for (auto& con : _connections) {
+        if (!con->reusable() || con->in_flight() >= std::max(_options.pipeline_depth, 1u) || (idle && con->in_flight())) {
+            continue;
+        }
+        if (!best || con->in_flight() < best->in_flight()) {
+            best = con;
+        }
+    }
+    return best;
+}
+
+future<lw_shared_ptr<client::connection>> client::make_connection(std::optional<steady_clock_type::time_point> deadline) {
+    ++_connecting;
+    auto f = _factory->make();
+    if (_options.connect_timeout) {
+        auto timeout = steady_clock_type::now() + *_options.connect_timeout;
+        f = with_timeout(deadline ? std::min(timeout, *deadline) : timeout, std::move(f));
+    } else if (deadline) {
+        f = with_timeout(*deadline, std::move(f));
+    }
+    return f.then_wrapped([this] (future<connected_socket> f) {
+        --_connecting;
+        if (f.failed()) {
+            // someone else may open a connection instead
+            _wait_con.broadcast();
+            return make_exception_future<lw_shared_ptr<connection>>(f.get_exception());
+        }
+        auto con = make_lw_shared<connection>(f.get0());
+        con->acquire();
+        _connections.push_back(con);
+        ++_total_connections;
+        return make_ready_future<lw_shared_ptr<connection>>(std::move(con));
+    });
+}
+
+void client::put_connection(lw_shared_ptr<connection> con) {
+    con->release();
+    if (!con->reusable()) {
+        auto it = std::find(_connections.begin(), _connections.end(), con);
+        if (it != _connections.end()) {
+            _connections.erase(it);
+        }
+        if (!con->in_flight()) {
+            _closing = _closing.then([con] {
+                return con->close();
+            });
+        }
+    }
+    _wait_con.broadcast();
+}
+
+future<> client::close() {
+    return _gate.close().then([this] {
+        return do_with(std::move(_connections), [] (std::vector<lw_shared_ptr<connection>>& cons) {
+            return parallel_for_each(cons, [] (lw_shared_ptr<connection>& con) {
+                return con->close();
+            });
+        });
+    }).then([this] {
+        return std::move(_closing);
+    });
+}
+
+}
+
+}
@@ -20,6 +20,7 @@
  */
 
 #include <seastar/http/common.hh>
+#include <iterator>
 
 namespace seastar {
 
@@ -50,6 +51,14 @@ operation_type str2type(const sstring& type) {
     return GET;
 }
 
+sstring type2str(operation_type type) {
+    static const char* names[] = {
+        "GET", "POST", "PUT", "DELETE", "HEAD", "OPTIONS", "TRACE", "CONNECT"
+    };
+    static_assert(std::size(names) == NUM_OPERATION);
+    return type < NUM_OPERATION ? names[type] : "GET";
+}
+
 }
 
 }
@@ -0,0 +1,379 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#include <seastar/http/compression.hh>
+#include <seastar/http/header_map.hh>
+#include <seastar/http/reply.hh>
+#include <seastar/http/internal/header_value.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/print.hh>
+
+#include <cctype>
+#include <utility>
+#include <zlib.h>
+#include <zstd.h>
+
+namespace seastar {
+
+namespace httpd {
+
+namespace {
+
+using internal::trim;
+
+constexpr size_t output_chunk_size = 16384;
+// the most that is compressed at a time, without a chance to yield
+constexpr size_t input_chunk_size = 32768;
+
+// Compresses a stream, in pieces.
+class stream_compressor {
+public:
+    virtual ~stream_compressor() {}
+    // Compresses size bytes of data, and ends the stream if finish is set,
+    // appending the output produced so far to out.
+    virtual void compress(const char* data, size_t size, bool finish, std::vector<temporary_buffer<char>>& out) = 0;
+};
+
+class zlib_compressor : public stream_compressor {
+    z_stream _zs = {};
+public:
+    zlib_compressor(content_encoding e, int level) {
+        // the gzip wrapper is selected by adding 16 to the window bits;
+        // "deflate" is the zlib format (RFC 7230, section 4.2.2)
+        int window_bits = e == content_encoding::gzip ? 15 + 16 : 15;
+        if (deflateInit2(&_zs, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("zlib initialization failed");
+        }
+    }
+    ~zlib_compressor() {
+        deflateEnd(&_zs);
+    }
+    virtual void compress(const char* data, size_t size, bool finish, std::vector<temporary_buffer<char>>& out) override {
+        _zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        _zs.avail_in = size;
+        while (true) {
+            temporary_buffer<char> buf(output_chunk_size);
+            _zs.next_out = reinterpret_cast<Bytef*>(buf.get_write());
+            _zs.avail_out = buf.size();
+            auto ret = deflate(&_zs, finish ? Z_FINISH : Z_NO_FLUSH);
+            if (ret == Z_STREAM_ERROR) {
+                throw std::runtime_error("zlib compression failed");
+            }
+            buf.trim(buf.size() - _zs.avail_out);
+            bool done = finish ? ret == Z_STREAM_END : _zs.avail_out != 0;
+            if (!buf.empty()) {
+                out.push_back(std::move(buf));
+            }
+            if (done) {
+                return;
+            }
+        }
+    }
+};
+
+struct cctx_deleter {
+    void operator()(ZSTD_CCtx* ctx) const noexcept {
+        ZSTD_freeCCtx(ctx);
+    }
+};
+
+size_t check_zstd(size_t ret) {
+    if (ZSTD_isError(ret)) {
+        throw std::runtime_error(format("zstd compression failed: {}", ZSTD_getErrorName(ret)));
+    }
+    return ret;
+}
+
+class zstd_stream_compressor : public stream_compressor {
+    std::unique_ptr<ZSTD_CCtx, cctx_deleter> _ctx;
+public:
+    explicit zstd_stream_compressor(int level) : _ctx(ZSTD_createCCtx()) {
+        if (!_ctx) {
+            throw std::bad_alloc();
+        }
+        check_zstd(ZSTD_CCtx_setParameter(_ctx.get(), ZSTD_c_compressionLevel, level));
+    }
+    virtual void compress(const char* data, size_t size, bool finish, std::vector<temporary_buffer<char>>& out) override {
+        ZSTD_inBuffer in{data, size, 0};
+        while (true) {
+            temporary_buffer<char> buf(output_chunk_size);
+            ZSTD_outBuffer o{buf.get_write(), buf.size(), 0};
+            auto remaining = check_zstd(ZSTD_compressStream2(_ctx.get(), &o, &in, finish ? ZSTD_e_end : ZSTD_e_continue));
+            buf.trim(o.pos);
+            if (!buf.empty()) {
+                out.push_back(std::move(buf));
+            }
+            if (finish ? remaining == 0 : in.pos == in.size) {
+                return;
+            }
+        }
+    }
+};
+
+std::unique_ptr<stream_compressor> make_compressor(content_encoding e, int level) {
+    switch (e) {
+    case content_encoding::gzip:
+    case content_encoding::deflate:
+        return std::make_unique<zlib_compressor>(e, level);
+    case content_encoding::zstd:
+        return std::make_unique<zstd_stream_compressor>(level);
+    default:
+        throw std::invalid_argument("not a compressed content coding");
+    }
+}
+
+int level_for(content_encoding e, const compression_options& options) {
+    return e == content_encoding::zstd ? options.zstd_level : options.zlib_level;
+}
+
+class compressing_sink_impl : public data_sink_impl {
+    output_stream<char> _out;
+    std::unique_ptr<stream_compressor> _compressor;
+
+    future<> write(std::vector<temporary_buffer<char>> bufs) {
+        return do_with(std::move(bufs), [this] (std::vector<temporary_buffer<char>>& bufs) {
+            return do_for_each(bufs, [this] (temporary_buffer<char>& buf) {
+                return _out.write(buf.get(), buf.size());
+            });
+        });
+    }
+public:
+    compressing_sink_impl(output_stream<char> out, std::unique_ptr<stream_compressor> compressor)
+        : _out(std::move(out)), _compressor(std::move(compressor)) {
+    }
+    virtual future<> put(net::packet data) override {
+        std::vector<temporary_buffer<char>> out;
+        try {
+            for (auto& f : data.fragments()) {
+                _compressor->compress(f.base, f.size, false, out);
+            }
+        } catch (...) {
+            return current_exception_as_future();
+        }
+        return write(std::move(out));
+    }
+    using data_sink_impl::put;
+    virtual future<> put(temporary_buffer<char> buf) override {
+        std::vector<temporary_buffer<char>> out;
+        try {
+            _compressor->compress(buf.get(), buf.size(), false, out);
+        } catch (...) {
+            return current_exception_as_future();
+        }
+        return write(std::move(out));
+    }
+    virtual future<> close() override {
+        std::vector<temporary_buffer<char>> out;
+        try {
+            _compressor->compress(nullptr, 0, true, out);
+        } catch (...) {
+            return current_exception_as_future().finally([this] {
+                return _out.close();
+            });
+        }
+        return write(std::move(out)).finally([this] {
+            return _out.close();
+        });
+    }
+};
+
+output_stream<char> make_compressed_output_stream(output_stream<char> out, std::unique_ptr<stream_compressor> compressor) {
+    return output_stream<char>(data_sink(std::make_unique<compressing_sink_impl>(std::move(out), std::move(compressor))), input_chunk_size);
+}
+
+// writes content to a stream a chunk at a time, so that a compressing
+// stream does not compress it all in one go
+future<> write_in_chunks(output_stream<char>& out, const sstring& content) {
+    return do_with(size_t(0), [&out, &content] (size_t& pos) {
+        return repeat([&out, &content, &pos] {
+            if (pos == content.size()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto n = std::min(content.size() - pos, input_chunk_size);
+            pos += n;
+            return out.write(content.data() + pos - n, n).then([] {
+                return stop_iteration::no;
+            });
+        });
+    });
+}
+
+bool starts_with(std::string_view s, std::string_view prefix) {
+    return s.substr(0, prefix.size()) == prefix;
+}
+
+bool ends_with(std::string_view s, std::string_view suffix) {
+    return s.size() >= suffix.size() && s.substr(s.size() - suffix.size()) == suffix;
+}
+
+bool compressible(std::string_view type) {
+    type = trim(type.substr(0, type.find(';')));
+    return starts_with(type, "text/") || type == "application/json" || type == "application/javascript"
+            || type == "application/xml" || ends_with(type, "+xml") || ends_with(type, "+json");
+}
+
+// a weight (RFC 7231, section 5.3.1), in thousandths
+int parse_qvalue(std::string_view s) {
+    if (s.empty() || (s[0] != '0' && s[0] != '1')) {
+        return 0;
+    }
+    int q = (s[0] - '0') * 1000;
+    if (s.size() > 1 && s[1] == '.') {
+        int scale = 100;
+        for (size_t i = 2; i < s.size() && i < 5 && isdigit(s[i]); ++i, scale /= 10) {
+            q += (s[i] - '0') * scale;
+        }
+    }
+    return std::min(q, 1000);
+}
+
+}
+
+const char* content_encoding_name(content_encoding e) {
+    switch (e) {
+    case content_encoding::gzip:
+        return "gzip";
+    case content_encoding::deflate:
+        return "deflate";
+    case content_encoding::zstd:
+        return "zstd";
+    default:
+        return "identity";
+    }
+}
+
+content_encoding select_content_encoding(std::string_view accept_encoding, const std::vector<content_encoding>& encodings) {
+    // weights of the codings listed, and of "*", or -1 where not listed
+    std::vector<int> weights(encodings.size(), -1);
+    int any = -1;
+    while (!accept_encoding.empty()) {
+        auto comma = accept_encoding.find(',');
+        auto element = accept_encoding.substr(0, comma);
+        accept_encoding.remove_prefix(comma == std::string_view::npos ? accept_encoding.size() : comma + 1);
+        auto semicolon = element.find(';');
+        auto name = trim(element.substr(0, semicolon));
+        int q = 1000;
+        while (semicolon != std::string_view::npos) {
+            element.remove_prefix(semicolon + 1);
+            semicolon = element.find(';');
+            auto param = trim(element.substr(0, semicolon));
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = parse_qvalue(param.substr(2));
+            }
+        }
+        if (name == "*") {
+            any = q;
+            continue;
+        }
+        for (size_t i = 0; i < encodings.size(); ++i) {
+            auto e = encodings[i];
+            if (header_map::name_equal(name, content_encoding_name(e))
+                    || (e == content_encoding::gzip && header_map::name_equal(name, "x-gzip"))) {
+                weights[i] = q;
+            }
+        }
+    }
+    auto best = content_encoding::identity;
+    int best_weight = 0;
+    for (size_t i = 0; i < encodings.size(); ++i) {
+        auto w = weights[i] >= 0 ? weights[i] : any;
+        if (w > best_weight) {
+            best = encodings[i];
+            best_weight = w;
+        }
+    }
+    return best;
+}
+
+output_stream<char> make_compressed_output_stream(output_stream<char> out, content_encoding e, const compression_options& options) {
+    return make_compressed_output_stream(std::move(out), make_compressor(e, level_for(e, options)));
+}
+
+sstring compress(std::string_view data, content_encoding e, const compression_options& options) {
+    std::vector<temporary_buffer<char>> out;
+    make_compressor(e, level_for(e, options))->compress(data.data(), data.size(), true, out);
+    size_t size = 0;
+    for (auto& b : out) {
+        size += b.size();
+    }
+    auto ret = uninitialized_string(size);
+    auto p = ret.data();
+    for (auto& b : out) {
+        p = std::copy(b.begin(), b.end(), p);
+    }
+    return ret;
+}
+
+void compress_reply(reply& rep, std::string_view accept_encoding, const compression_options& options) {
+    if (int(rep._status) < 200 || rep._status == reply::status_type::no_content
+            || rep._status == reply::status_type::partial_content || rep._status == reply::status_type::not_modified
+            || rep._headers.count("Content-Encoding") || rep._headers.count("Content-Range")) {
+        return;
+    }
+    auto type = rep._headers.find("Content-Type");
+    if (type == rep._headers.end() || !compressible(type->second)) {
+        return;
+    }
+    // caches must tell replies to clients that accept different codings apart
+    auto& vary = rep._headers["Vary"];
+    if (vary.empty()) {
+        vary = "Accept-Encoding";
+    } else if (vary.find("Accept-Encoding") == sstring::npos && vary != "*") {
+        vary += ", Accept-Encoding";
+    }
+    auto size = rep._body_writer ? rep._body_length.value_or(options.min_size) : rep._content.size();
+    if (size < options.min_size) {
+        return;
+    }
+    auto e = select_content_encoding(accept_encoding, options.encodings);
+    if (e == content_encoding::identity) {
+        return;
+    }
+    rep._headers["Content-Encoding"] = content_encoding_name(e);
+    // the validator of the uncompressed content is only a weak one of
+    // the compressed content, yet still good for conditional requests
+    auto etag = rep._headers.find("ETag");
+    if (etag != rep._headers.end() && !starts_with(etag->second, "W/")) {
+        etag->second = "W/" + etag->second;
+    }
+    if (!rep._body_writer) {
+        if (rep._content.size() <= options.inline_max_size) {
+            rep._content = compress(rep._content, e, options);
+            return;
+        }
+        rep._body_writer = [content = std::exchange(rep._content, sstring())] (output_stream<char>&& out) mutable {
+            return do_with(std::move(out), std::move(content), [] (output_stream<char>& out, sstring& content) {
+                return write_in_chunks(out, content).finally([&out] {
+                    return out.close();
+                });
+            });
+        };
+    }
+    rep._body_length.reset();
+    rep._headers.erase("Content-Length");
+    rep._body_writer = [writer = std::move(rep._body_writer), e, level = level_for(e, options)] (output_stream<char>&& out) mutable {
+        return writer(make_compressed_output_stream(std::move(out), make_compressor(e, level)));
+    };
+}
+
+}
+
+}
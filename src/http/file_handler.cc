@@ -28,11 +28,113 @@
 #include <seastar/core/shared_ptr.hh>
 #include <seastar/core/app-template.hh>
 #include <seastar/http/exception.hh>
+#include <seastar/http/compression.hh>
+#include <seastar/http/internal/header_value.hh>
+#include <seastar/core/loop.hh>
 
 namespace seastar {
 
 namespace httpd {
 
+bool file_cache::has_fresh(const sstring& name) const {
+    auto i = _files.find(name);
+    return i != _files.end() && fresh(i->second);
+}
+
+file_cache::entry* file_cache::get_fresh(const sstring& name) {
+    auto i = _files.find(name);
+    if (i == _files.end() || !fresh(i->second)) {
+        return nullptr;
+    }
+    ++_hits;
+    _lru.splice(_lru.begin(), _lru, i->second.lru);
+    return &i->second;
+}
+
+future<temporary_buffer<char>> file_cache::get(const sstring& name, uint64_t size, const sstring& etag) {
+    auto i = _files.find(name);
+    if (i != _files.end() && i->second.etag == etag) {
+        ++_hits;
+        i->second.validated = clock::now();
+        _lru.splice(_lru.begin(), _lru, i->second.lru);
+        return make_ready_future<temporary_buffer<char>>(i->second.content.share());
+    }
+    ++_misses;
+    if (!size) {
+        put(name, temporary_buffer<char>(), etag);
+        return make_ready_future<temporary_buffer<char>>();
+    }
+    return open_file_dma(name, open_flags::ro).then([size] (file f) {
+        return do_with(std::move(f), [size] (file& f) {
+            return f.dma_read<char>(0, size).finally([&f] {
+                return f.close();
+            });
+        });
+    }).then([this, name, etag] (temporary_buffer<char> content) {
+        put(name, content.share(), etag);
+        return content;
+    });
+}
+
+void file_cache::put(const sstring& name, temporary_buffer<char> content, sstring etag) {
+    auto i = _files.find(name);
+    if (i != _files.end()) {
+        evict(i);
+    }
+    if (content.size() > _max_file_size || content.size() > _capacity) {
+        return;
+    }
+    while (_size + content.size() > _capacity) {
+        evict(_files.find(_lru.back()));
+    }
+    _size += content.size();
+    _lru.push_front(name);
+    auto& f = _files[name];
+    f.content = std::move(content);
+    f.etag = std::move(etag);
+    f.validated = clock::now();
+    f.lru = _lru.begin();
+}
+
+void file_cache::evict(std::unordered_map<sstring, cached_file>::iterator i) {
+    _size -= i->second.content.size();
+    _lru.erase(i->second.lru);
+    _files.erase(i);
+}
+
+static sstring make_etag(const stat_data& st) {
+    auto mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(st.time_modified.time_since_epoch());
+    return format("\"{:x}-{:x}\"", mtime.count(), st.size);
+}
+
+// RFC 7232, section 3.2: If-None-Match is "*" or a list of entity tags,
+// compared weakly
+static bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+    while (!if_none_match.empty()) {
+        auto comma = if_none_match.find(',');
+        auto tag = internal::trim(if_none_match.substr(0, comma));
+        if_none_match.remove_prefix(comma == std::string_view::npos ? if_none_match.size() : comma + 1);
+        if (tag.substr(0, 2) == "W/") {
+            tag.remove_prefix(2);
+        }
+        if (tag == "*" || tag == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::optional<uint64_t> parse_position(std::string_view s) {
+    if (s.empty() || s.size() > 19 || !std::all_of(s.begin(), s.end(), ::isdigit)) {
+        return std::nullopt;
+    }
+    uint64_t v = 0;
+    for (auto c : s) {
+        v = v * 10 + (c - '0');
+    }
+    return v;
+}
+
 directory_handler::directory_handler(const sstring& doc_root,
         file_transformer* transformer)
         : file_interaction_handler(transformer), doc_root(doc_root) {
@@ -81,9 +183,160 @@ output_stream<char> file_interaction_handler::get_stream(std::unique_ptr<request
     return std::move(s);
 }
 
+std::optional<std::pair<uint64_t, uint64_t>> file_interaction_handler::select_range(const request& req,
+        reply& rep, uint64_t size, const sstring& etag) {
+    rep._headers["ETag"] = etag;
+    rep._headers["Accept-Ranges"] = "bytes";
+    auto if_none_match = req.get_header("If-None-Match");
+    if (!if_none_match.empty() && etag_matches(if_none_match, etag)) {
+        rep.set_status(reply::status_type::not_modified).done();
+        return std::nullopt;
+    }
+    std::pair<uint64_t, uint64_t> all(0, size);
+    auto range_header = req.get_header("Range");
+    std::string_view range = range_header;
+    auto if_range = req.get_header("If-Range");
+    // RFC 7233: a server may ignore a range; we ignore malformed ones,
+    // multiple ranges, and ranges of a file that has changed since
+    if (range.substr(0, 6) != "bytes=" || range.find(',') != std::string_view::npos
+            || (!if_range.empty() && if_range != etag)) {
+        return all;
+    }
+    range.remove_prefix(6);
+    auto dash = range.find('-');
+    if (dash == std::string_view::npos) {
+        return all;
+    }
+    auto first = parse_position(range.substr(0, dash));
+    auto last = parse_position(range.substr(dash + 1));
+    uint64_t from, to;
+    if (first) {
+        if (last && *last < *first) {
+            return all;
+        }
+        from = *first;
+        to = last ? std::min(*last, size - 1) : size - 1;
+    } else if (last && dash == 0) {
+        // a suffix: the last bytes of the file
+        if (*last == 0) {
+            from = size;
+        } else {
+            from = size > *last ? size - *last : 0;
+        }
+        to = size - 1;
+    } else {
+        return all;
+    }
+    if (from >= size) {
+        rep._headers["Content-Range"] = format("bytes */{}", size);
+        rep.set_status(reply::status_type::range_not_satisfiable).done();
+        return std::nullopt;
+    }
+    rep._headers["Content-Range"] = format("bytes {}-{}/{}", from, to, size);
+    rep.set_status(reply::status_type::partial_content);
+    return std::make_pair(from, to - from + 1);
+}
+
 future<std::unique_ptr<reply>> file_interaction_handler::read(
         sstring file_name, std::unique_ptr<request> req,
         std::unique_ptr<reply> rep) {
+    if (transformer) {
+        return read_transformed(std::move(file_name), std::move(req), std::move(rep));
+    }
+    sstring extension = get_extension(file_name);
+    if (!precompressed) {
+        return read_file(std::move(file_name), std::move(extension), std::move(req), std::move(rep));
+    }
+    // with a compressed copy or without, the reply depends on Accept-Encoding
+    rep->_headers["Vary"] = "Accept-Encoding";
+    static const std::vector<content_encoding> gzip_only = { content_encoding::gzip };
+    if (select_content_encoding(req->get_header("Accept-Encoding"), gzip_only) != content_encoding::gzip) {
+        return read_file(std::move(file_name), std::move(extension), std::move(req), std::move(rep));
+    }
+    auto gz_name = file_name + ".gz";
+    auto exists = cache && cache->has_fresh(gz_name) ? make_ready_future<bool>(true) : file_exists(gz_name);
+    return exists.then([this, file_name = std::move(file_name), gz_name = std::move(gz_name), extension = std::move(extension),
+            req = std::move(req), rep = std::move(rep)] (bool exists) mutable {
+        if (!exists) {
+            return read_file(std::move(file_name), std::move(extension), std::move(req), std::move(rep));
+        }
+        rep->_headers["Content-Encoding"] = "gzip";
+        return read_file(std::move(gz_name), std::move(extension), std::move(req), std::move(rep));
+    });
+}
+
+future<std::unique_ptr<reply>> file_interaction_handler::read_file(sstring file_name, sstring extension,
+        std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+    if (cache) {
+        auto e = cache->get_fresh(file_name);
+        if (e) {
+            return make_ready_future<std::unique_ptr<reply>>(reply_content(extension, e->content.share(), e->etag, *req, std::move(rep)));
+        }
+    }
+    return file_stat(file_name).then([this, file_name, extension, req = std::move(req), rep = std::move(rep)] (stat_data st) mutable {
+        auto etag = make_etag(st);
+        if (cache && st.size <= cache->max_file_size()) {
+            return cache->get(file_name, st.size, etag).then([extension, etag, req = std::move(req), rep = std::move(rep)] (temporary_buffer<char> content) mutable {
+                return reply_content(extension, std::move(content), etag, *req, std::move(rep));
+            });
+        }
+        auto range = select_range(*req, *rep, st.size, etag);
+        if (!range) {
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        }
+        // The file is read with DMA into buffers that are passed on to
+        // the connection as they are.
+        rep->write_body(extension, range->second, [file_name, range = *range] (output_stream<char>&& s) {
+            return do_with(std::move(s), [file_name, range] (output_stream<char>& os) {
+                return open_file_dma(file_name, open_flags::ro).then([&os, range] (file f) {
+                    return do_with(make_file_input_stream(std::move(f), range.first, range.second), [&os] (input_stream<char>& is) {
+                        return repeat([&is, &os] {
+                            return is.read().then([&os] (temporary_buffer<char> buf) {
+                                if (buf.empty()) {
+                                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                                }
+                                return os.write(std::move(buf)).then([] {
+                                    return stop_iteration::no;
+                                });
+                            });
+                        }).then([&os] {
+                            return os.close();
+                        }).finally([&is] {
+                            return is.close();
+                        });
+                    });
+                });
+            });
+        });
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }).handle_exception_type([] (const std::system_error& e) -> future<std::unique_ptr<reply>> {
+        if (e.code().value() == ENOENT) {
+            throw not_found_exception();
+        }
+        throw e;
+    });
+}
+
+std::unique_ptr<reply> file_interaction_handler::reply_content(const sstring& extension, temporary_buffer<char> content,
+        const sstring& etag, const request& req, std::unique_ptr<reply> rep) {
+    auto range = select_range(req, *rep, content.size(), etag);
+    if (!range) {
+        return rep;
+    }
+    content = content.share(range->first, range->second);
+    rep->write_body(extension, content.size(), [content = std::move(content)] (output_stream<char>&& s) mutable {
+        return do_with(std::move(s), [content = std::move(content)] (output_stream<char>& os) mutable {
+            return os.write(std::move(content)).then([&os] {
+                return os.close();
+            });
+        });
+    });
+    return rep;
+}
+
+future<std::unique_ptr<reply>> file_interaction_handler::read_transformed(
+        sstring file_name, std::unique_ptr<request> req,
+        std::unique_ptr<reply> rep) {
     sstring extension = get_extension(file_name);
     rep->write_body(extension, [req = std::move(req), extension, file_name, this] (output_stream<char>&& s) mutable {
         return do_with(output_stream<char>(get_stream(std::move(req), extension, std::move(s))),
@@ -0,0 +1,489 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#include <seastar/http/internal/hpack.hh>
+#include <array>
+
+namespace seastar {
+
+namespace httpd {
+
+namespace {
+
+struct static_entry {
+    std::string_view name;
+    std::string_view value;
+};
+
+// RFC 7541, appendix A
+constexpr std::array<static_entry, 61> static_table = {{
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+}};
+
+// the per entry overhead of the dynamic table (RFC 7541, section 4.1)
+constexpr size_t entry_overhead = 32;
+
+struct huffman_code {
+    uint32_t code;
+    uint8_t bits;
+};
+
+// RFC 7541, appendix B, indexed by symbol. EOS is left out, a decoder
+// must treat it as an error anyway.
+constexpr std::array<huffman_code, 256> huffman_codes = {{
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+}};
+
+// Decodes a byte at a time: the entry for the next 8 input bits either is
+// the symbol whose code they begin with, or points to the table for the
+// bits that follow.
+class huffman_decode_table {
+public:
+    struct entry {
+        uint16_t next = 0; // index of the next table, 0 for a symbol
+        uint8_t sym = 0;
+        uint8_t bits = 0;  // code bits in this table, 0 for no symbol
+    };
+    std::vector<std::array<entry, 256>> tables;
+
+    huffman_decode_table() : tables(1) {
+        for (unsigned sym = 0; sym < huffman_codes.size(); ++sym) {
+            auto code = huffman_codes[sym].code;
+            unsigned bits = huffman_codes[sym].bits;
+            size_t t = 0;
+            while (bits > 8) {
+                bits -= 8;
+                auto& e = tables[t][(code >> bits) & 0xff];
+                if (!e.next) {
+                    e.next = tables.size();
+                    tables.emplace_back();
+                }
+                t = tables[t][(code >> bits) & 0xff].next;
+            }
+            auto shift = 8 - bits;
+            auto start = (code << shift) & 0xff;
+            for (unsigned i = 0; i < (1u << shift); ++i) {
+                tables[t][start | i] = entry{0, uint8_t(sym), uint8_t(bits)};
+            }
+        }
+    }
+};
+
+const huffman_decode_table& get_huffman_decode_table() {
+    static const huffman_decode_table table;
+    return table;
+}
+
+uint64_t decode_integer(const char*& p, const char* end, unsigned prefix_bits) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    uint64_t v = uint8_t(*p++) & max_prefix;
+    if (v < max_prefix) {
+        return v;
+    }
+    unsigned shift = 0;
+    while (true) {
+        if (p == end) {
+            throw hpack_error("Truncated integer");
+        }
+        uint8_t b = *p++;
+        // nothing we deal with comes anywhere close to 2^32
+        if (shift > 28) {
+            throw hpack_error("Integer too large");
+        }
+        v += uint64_t(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+}
+
+void encode_integer(std::string& out, uint8_t first, unsigned prefix_bits, uint64_t v) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (v < max_prefix) {
+        out.push_back(char(first | v));
+        return;
+    }
+    out.push_back(char(first | max_prefix));
+    v -= max_prefix;
+    while (v >= 0x80) {
+        out.push_back(char(0x80 | (v & 0x7f)));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
+
+sstring decode_string(const char*& p, const char* end) {
+    if (p == end) {
+        throw hpack_error("Missing string literal");
+    }
+    bool huffman = *p & 0x80;
+    auto len = decode_integer(p, end, 7);
+    if (len > uint64_t(end - p)) {
+        throw hpack_error("Truncated string literal");
+    }
+    std::string_view s(p, len);
+    p += len;
+    return huffman ? huffman_decode(s) : sstring(s.data(), s.size());
+}
+
+// dst must have room for huffman_encoded_size(in)
+void huffman_encode_to(char* dst, std::string_view in) {
+    uint64_t cur = 0;
+    unsigned cur_bits = 0;
+    for (char c : in) {
+        auto& code = huffman_codes[uint8_t(c)];
+        cur = (cur << code.bits) | code.code;
+        cur_bits += code.bits;
+        while (cur_bits >= 8) {
+            cur_bits -= 8;
+            *dst++ = char(cur >> cur_bits);
+        }
+    }
+    if (cur_bits) {
+        auto pad = 8 - cur_bits;
+        *dst++ = char((cur << pad) | ((1u << pad) - 1));
+    }
+}
+
+void encode_string(std::string& out, std::string_view s) {
+    auto huffman_size = huffman_encoded_size(s);
+    if (huffman_size < s.size()) {
+        encode_integer(out, 0x80, 7, huffman_size);
+        auto pos = out.size();
+        out.resize(pos + huffman_size);
+        huffman_encode_to(out.data() + pos, s);
+    } else {
+        encode_integer(out, 0, 7, s.size());
+        out.append(s.data(), s.size());
+    }
+}
+
+}
+
+sstring huffman_decode(std::string_view in) {
+    auto& table = get_huffman_decode_table().tables;
+    // the shortest code is 5 bits
+    auto out = uninitialized_string(in.size() * 8 / 5);
+    size_t n = 0;
+    uint64_t cur = 0;
+    unsigned cur_bits = 0;
+    // bits of the symbol being decoded so far
+    unsigned sym_bits = 0;
+    size_t t = 0;
+    for (char c : in) {
+        cur = (cur << 8) | uint8_t(c);
+        cur_bits += 8;
+        sym_bits += 8;
+        while (cur_bits >= 8) {
+            auto& e = table[t][(cur >> (cur_bits - 8)) & 0xff];
+            if (e.next) {
+                t = e.next;
+                cur_bits -= 8;
+            } else if (e.bits) {
+                out[n++] = e.sym;
+                cur_bits -= e.bits;
+                sym_bits = cur_bits;
+                t = 0;
+            } else {
+                throw hpack_error("Invalid Huffman code");
+            }
+        }
+    }
+    // the remaining bits are either whole codes or padding
+    while (cur_bits > 0) {
+        auto& e = table[t][(cur << (8 - cur_bits)) & 0xff];
+        if (e.next || !e.bits || e.bits > cur_bits) {
+            break;
+        }
+        out[n++] = e.sym;
+        cur_bits -= e.bits;
+        sym_bits = cur_bits;
+        t = 0;
+    }
+    // padding is the most significant bits of EOS, i.e. all ones, and
+    // shorter than 8 bits
+    uint64_t mask = (uint64_t(1) << cur_bits) - 1;
+    if (sym_bits > 7 || (cur & mask) != mask) {
+        throw hpack_error("Invalid Huffman padding");
+    }
+    out.resize(n);
+    return out;
+}
+
+size_t huffman_encoded_size(std::string_view in) {
+    size_t bits = 0;
+    for (char c : in) {
+        bits += huffman_codes[uint8_t(c)].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+sstring huffman_encode(std::string_view in) {
+    auto out = uninitialized_string(huffman_encoded_size(in));
+    huffman_encode_to(out.data(), in);
+    return out;
+}
+
+hpack_decoder::hpack_decoder(size_t table_size_limit, size_t max_header_list_size)
+    : _max_table_size(table_size_limit)
+    , _table_size_limit(table_size_limit)
+    , _max_header_list_size(max_header_list_size) {
+}
+
+header_field hpack_decoder::get(uint64_t index) const {
+    if (index == 0) {
+        throw hpack_error("Invalid index 0");
+    }
+    if (index <= static_table.size()) {
+        auto& e = static_table[index - 1];
+        return header_field(sstring(e.name.data(), e.name.size()), sstring(e.value.data(), e.value.size()));
+    }
+    index -= static_table.size() + 1;
+    if (index >= _table.size()) {
+        throw hpack_error("Index out of range");
+    }
+    return _table[index];
+}
+
+void hpack_decoder::evict(size_t room) {
+    while (!_table.empty() && _table_size + room > _max_table_size) {
+        auto& e = _table.back();
+        _table_size -= e.first.size() + e.second.size() + entry_overhead;
+        _table.pop_back();
+    }
+}
+
+void hpack_decoder::add(header_field f) {
+    auto size = f.first.size() + f.second.size() + entry_overhead;
+    evict(size);
+    // an entry larger than the table just empties it
+    if (size <= _max_table_size) {
+        _table_size += size;
+        _table.push_front(std::move(f));
+    }
+}
+
+std::optional<std::vector<header_field>> hpack_decoder::decode(std::string_view block) {
+    std::vector<header_field> headers;
+    size_t list_size = 0;
+    bool too_large = false;
+    // table size updates may only come first in a block
+    bool first = true;
+    auto p = block.data();
+    auto end = p + block.size();
+    while (p != end) {
+        uint8_t b = *p;
+        header_field f;
+        if (b & 0x80) {
+            // indexed header field
+            f = get(decode_integer(p, end, 7));
+        } else if ((b & 0xe0) == 0x20) {
+            // dynamic table size update
+            if (!first) {
+                throw hpack_error("Table size update after the first header field");
+            }
+            auto size = decode_integer(p, end, 5);
+            if (size > _table_size_limit) {
+                throw hpack_error("Table size update above the limit");
+            }
+            _max_table_size = size;
+            evict(0);
+            continue;
+        } else {
+            // literal header field, with incremental indexing (01), without
+            // indexing (0000) or never indexed (0001)
+            bool indexing = (b & 0xc0) == 0x40;
+            auto index = decode_integer(p, end, indexing ? 6 : 4);
+            if (index) {
+                f.first = get(index).first;
+            } else {
+                f.first = decode_string(p, end);
+            }
+            f.second = decode_string(p, end);
+            if (indexing) {
+                add(f);
+            }
+        }
+        first = false;
+        list_size += f.first.size() + f.second.size() + entry_overhead;
+        if (list_size > _max_header_list_size) {
+            too_large = true;
+            headers.clear();
+        }
+        if (!too_large) {
+            headers.push_back(std::move(f));
+        }
+    }
+    if (too_large) {
+        return std::nullopt;
+    }
+    return headers;
+}
+
+void hpack_encoder::encode(std::string& out, std::string_view name, std::string_view value) const {
+    size_t name_index = 0;
+    for (size_t i = 0; i < static_table.size(); ++i) {
+        if (static_table[i].name != name) {
+            continue;
+        }
+        if (static_table[i].value == value) {
+            encode_integer(out, 0x80, 7, i + 1);
+            return;
+        }
+        if (!name_index) {
+            name_index = i + 1;
+        }
+    }
+    // literal header field without indexing
+    encode_integer(out, 0, 4, name_index);
+    if (!name_index) {
+        encode_string(out, name);
+    }
+    encode_string(out, value);
+}
+
+}
+
+}
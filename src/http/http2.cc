@@ -0,0 +1,922 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#include <seastar/http/internal/http2.hh>
+#include <seastar/http/httpd.hh>
+#include <seastar/core/byteorder.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/print.hh>
+#include <seastar/util/log.hh>
+
+namespace seastar {
+
+extern logger hlogger;
+
+namespace httpd {
+
+namespace {
+
+constexpr uint8_t flag_end_stream = 0x1;
+constexpr uint8_t flag_ack = 0x1;
+constexpr uint8_t flag_end_headers = 0x4;
+constexpr uint8_t flag_padded = 0x8;
+constexpr uint8_t flag_priority = 0x20;
+
+enum class setting : uint16_t {
+    header_table_size = 0x1,
+    enable_push = 0x2,
+    max_concurrent_streams = 0x3,
+    initial_window_size = 0x4,
+    max_frame_size = 0x5,
+    max_header_list_size = 0x6,
+};
+
+// The stream was reset, or the connection closed, while sending its reply.
+class stream_closed_error : public std::runtime_error {
+public:
+    stream_closed_error() : runtime_error("HTTP/2 stream closed") {}
+};
+
+// Strips the padding off a DATA or HEADERS frame, returns false if it is
+// longer than the frame.
+bool strip_padding(uint8_t flags, temporary_buffer<char>& payload) {
+    if (!(flags & flag_padded)) {
+        return true;
+    }
+    if (payload.empty()) {
+        return false;
+    }
+    size_t pad = uint8_t(payload[0]);
+    payload.trim_front(1);
+    if (pad > payload.size()) {
+        return false;
+    }
+    payload.trim(payload.size() - pad);
+    return true;
+}
+
+bool is_connection_specific(const sstring& name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+            || name == "transfer-encoding" || name == "upgrade";
+}
+
+// base64url without padding, as used by the HTTP2-Settings header
+std::optional<sstring> base64url_decode(std::string_view in) {
+    auto value = [] (char c) {
+        if (c >= 'A' && c <= 'Z') {
+            return c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            return c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            return c - '0' + 52;
+        } else if (c == '-') {
+            return 62;
+        } else if (c == '_') {
+            return 63;
+        }
+        return -1;
+    };
+    while (!in.empty() && in.back() == '=') {
+        in.remove_suffix(1);
+    }
+    sstring out;
+    out.resize(in.size() * 3 / 4);
+    size_t n = 0;
+    uint32_t cur = 0;
+    unsigned bits = 0;
+    for (char c : in) {
+        auto v = value(c);
+        if (v < 0) {
+            return std::nullopt;
+        }
+        cur = (cur << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = char(cur >> bits);
+        }
+    }
+    out.resize(n);
+    return out;
+}
+
+}
+
+// Feeds request::content_stream from the stream's DATA frames. The stream
+// owns the input_stream, hence this source.
+class http2_connection::body_source_impl : public seastar::data_source_impl {
+    http2_connection& _conn;
+    stream& _s;
+public:
+    body_source_impl(http2_connection& conn, stream& s) : _conn(conn), _s(s) {
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        return _s.body_cond.wait([this] {
+            return !_s.body_queue.empty() || _s.remote_closed || _s.closed;
+        }).then([this] {
+            if (_s.body_queue.empty()) {
+                if (!_s.remote_closed) {
+                    throw stream_closed_error();
+                }
+                return make_ready_future<temporary_buffer<char>>();
+            }
+            auto buf = std::move(_s.body_queue.front());
+            _s.body_queue.pop_front();
+            _conn.credit_stream(_s, buf.size());
+            return _conn.maybe_send_credit(_s).then([buf = std::move(buf)] () mutable {
+                return std::move(buf);
+            });
+        });
+    }
+};
+
+// Sends what reply::write_body()'s body writer writes as DATA frames.
+class http2_connection::data_sink_impl : public seastar::data_sink_impl {
+    http2_connection& _conn;
+    lw_shared_ptr<stream> _s;
+public:
+    data_sink_impl(http2_connection& conn, lw_shared_ptr<stream> s) : _conn(conn), _s(std::move(s)) {
+    }
+    virtual future<> put(net::packet p) override {
+        return do_with(p.release(), [this] (std::vector<temporary_buffer<char>>& bufs) {
+            return do_for_each(bufs, [this] (temporary_buffer<char>& buf) {
+                return put(std::move(buf));
+            });
+        });
+    }
+    using seastar::data_sink_impl::put;
+    virtual future<> put(temporary_buffer<char> buf) override {
+        if (buf.empty()) {
+            return make_ready_future<>();
+        }
+        return _conn.send_data(_s, std::move(buf), false);
+    }
+    virtual future<> close() override {
+        // END_STREAM is sent once the body writer is done
+        return make_ready_future<>();
+    }
+};
+
+http2_connection::http2_connection(http_server& server, input_stream<char>& in, output_stream<char>& out)
+    : _server(server), _in(in), _out(out) {
+}
+
+http2_connection::~http2_connection() {
+}
+
+future<> http2_connection::process(bool read_preface, std::unique_ptr<request> upgrade_req, sstring upgrade_settings) {
+    if (upgrade_req) {
+        auto settings = base64url_decode(upgrade_settings);
+        if (!settings) {
+            return make_exception_future<>(std::runtime_error("Invalid HTTP2-Settings header"));
+        }
+        try {
+            apply_settings(*settings);
+        } catch (...) {
+            return make_exception_future<>(std::current_exception());
+        }
+    }
+    // our connection preface: SETTINGS, and credit for a connection window
+    // larger than the default
+    temporary_buffer<char> settings(2 * 6);
+    auto p = settings.get_write();
+    auto put_setting = [&p] (setting id, uint32_t value) {
+        produce_be<uint16_t>(p, uint16_t(id));
+        produce_be<uint32_t>(p, value);
+    };
+    put_setting(setting::max_concurrent_streams, max_concurrent_streams);
+    put_setting(setting::max_header_list_size, max_header_list_size);
+    temporary_buffer<char> credit(4);
+    write_be<uint32_t>(credit.get_write(), connection_window - default_window);
+    _recv_window = connection_window;
+    auto f = write_frame(frame_type::settings, 0, 0, std::move(settings)).then([this, credit = std::move(credit)] () mutable {
+        return write_frame(frame_type::window_update, 0, 0, std::move(credit));
+    }).then([this, read_preface] {
+        if (!read_preface) {
+            return make_ready_future<>();
+        }
+        return _in.read_exactly(preface.size()).then([] (temporary_buffer<char> buf) {
+            if (std::string_view(buf.get(), buf.size()) != preface) {
+                throw std::runtime_error("Invalid HTTP/2 connection preface");
+            }
+        });
+    }).then([this, upgrade_req = std::move(upgrade_req)] () mutable {
+        if (upgrade_req) {
+            // answered on stream 1, which is half closed (remote) already
+            _last_stream_id = 1;
+            auto s = make_stream(1, std::move(upgrade_req));
+            s->remote_closed = true;
+            dispatch(std::move(s));
+        }
+        return read_loop();
+    });
+    return f.handle_exception([this] (std::exception_ptr ep) {
+        auto code = error_code::protocol_error;
+        try {
+            std::rethrow_exception(ep);
+        } catch (const connection_error& e) {
+            code = e.code;
+        } catch (const hpack_error&) {
+            code = error_code::compression_error;
+        } catch (...) {
+        }
+        ++_server._read_errors;
+        hlogger.debug("HTTP/2 connection error: {}", ep);
+        return write_goaway(code).handle_exception([] (std::exception_ptr) {});
+    }).finally([this] {
+        close_all();
+        return _gate.close();
+    });
+}
+
+future<> http2_connection::read_loop() {
+    return repeat([this] {
+        return _in.read_exactly(frame_header_size).then([this] (temporary_buffer<char> header) {
+            if (header.size() < frame_header_size) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            auto length_type = read_be<uint32_t>(header.get());
+            size_t length = length_type >> 8;
+            auto type = frame_type(length_type & 0xff);
+            uint8_t flags = header[4];
+            auto stream_id = read_be<uint32_t>(header.get() + 5) & max_window;
+            if (length > default_max_frame_size) {
+                throw connection_error(error_code::frame_size_error, "Frame too large");
+            }
+            return _in.read_exactly(length).then([this, length, type, flags, stream_id] (temporary_buffer<char> payload) {
+                if (payload.size() < length) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return handle_frame(type, flags, stream_id, std::move(payload)).then([] {
+                    return stop_iteration::no;
+                });
+            });
+        });
+    });
+}
+
+future<> http2_connection::handle_frame(frame_type type, uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    if (!_got_settings && type != frame_type::settings) {
+        throw connection_error(error_code::protocol_error, "Expected SETTINGS");
+    }
+    if (_header_stream && type != frame_type::continuation) {
+        throw connection_error(error_code::protocol_error, "Expected CONTINUATION");
+    }
+    switch (type) {
+    case frame_type::data:
+        return handle_data(flags, stream_id, std::move(payload));
+    case frame_type::headers:
+        return handle_headers(flags, stream_id, std::move(payload));
+    case frame_type::continuation:
+        return handle_continuation(flags, stream_id, std::move(payload));
+    case frame_type::settings:
+        return handle_settings(flags, stream_id, std::move(payload));
+    case frame_type::window_update:
+        return handle_window_update(stream_id, std::move(payload));
+    case frame_type::rst_stream:
+        handle_rst_stream(stream_id, std::move(payload));
+        return make_ready_future<>();
+    case frame_type::priority:
+        if (!stream_id) {
+            throw connection_error(error_code::protocol_error, "PRIORITY on stream 0");
+        }
+        if (payload.size() != 5) {
+            return reset_stream(stream_id, error_code::frame_size_error);
+        }
+        return make_ready_future<>();
+    case frame_type::ping:
+        if (stream_id) {
+            throw connection_error(error_code::protocol_error, "PING on a stream");
+        }
+        if (payload.size() != 8) {
+            throw connection_error(error_code::frame_size_error, "Invalid PING");
+        }
+        if (flags & flag_ack) {
+            return make_ready_future<>();
+        }
+        return write_frame(frame_type::ping, flag_ack, 0, std::move(payload));
+    case frame_type::goaway:
+        if (stream_id) {
+            throw connection_error(error_code::protocol_error, "GOAWAY on a stream");
+        }
+        // streams in flight are still served, the peer closes the
+        // connection once it has their replies
+        _peer_goaway = true;
+        return make_ready_future<>();
+    case frame_type::push_promise:
+        throw connection_error(error_code::protocol_error, "PUSH_PROMISE from a client");
+    }
+    // unknown frame types are ignored
+    return make_ready_future<>();
+}
+
+future<> http2_connection::handle_settings(uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    if (stream_id) {
+        throw connection_error(error_code::protocol_error, "SETTINGS on a stream");
+    }
+    if (flags & flag_ack) {
+        if (!payload.empty()) {
+            throw connection_error(error_code::frame_size_error, "SETTINGS ack with payload");
+        }
+        return make_ready_future<>();
+    }
+    if (payload.size() % 6) {
+        throw connection_error(error_code::frame_size_error, "Invalid SETTINGS");
+    }
+    _got_settings = true;
+    apply_settings(std::string_view(payload.get(), payload.size()));
+    return write_frame(frame_type::settings, flag_ack, 0);
+}
+
+void http2_connection::apply_settings(std::string_view payload) {
+    for (auto p = payload.data(); p + 6 <= payload.data() + payload.size(); ) {
+        auto id = setting(consume_be<uint16_t>(p));
+        auto value = consume_be<uint32_t>(p);
+        switch (id) {
+        case setting::enable_push:
+            if (value > 1) {
+                throw connection_error(error_code::protocol_error, "Invalid SETTINGS_ENABLE_PUSH");
+            }
+            break;
+        case setting::initial_window_size: {
+            if (value > max_window) {
+                throw connection_error(error_code::flow_control_error, "Invalid SETTINGS_INITIAL_WINDOW_SIZE");
+            }
+            // applies to the windows of all open streams
+            int64_t delta = int64_t(value) - _peer_initial_window;
+            for (auto& s : _streams) {
+                s.second->send_window += delta;
+                if (s.second->send_window > max_window) {
+                    throw connection_error(error_code::flow_control_error, "Stream window overflow");
+                }
+            }
+            _peer_initial_window = value;
+            _send_cond.broadcast();
+            break;
+        }
+        case setting::max_frame_size:
+            if (value < default_max_frame_size || value > 0xffffff) {
+                throw connection_error(error_code::protocol_error, "Invalid SETTINGS_MAX_FRAME_SIZE");
+            }
+            _peer_max_frame_size = value;
+            break;
+        default:
+            // we never use the dynamic table, nor push, nor initiate streams
+            break;
+        }
+    }
+}
+
+future<> http2_connection::handle_window_update(uint32_t stream_id, temporary_buffer<char> payload) {
+    if (payload.size() != 4) {
+        throw connection_error(error_code::frame_size_error, "Invalid WINDOW_UPDATE");
+    }
+    auto increment = read_be<uint32_t>(payload.get()) & max_window;
+    if (!stream_id) {
+        if (!increment) {
+            throw connection_error(error_code::protocol_error, "Zero WINDOW_UPDATE");
+        }
+        _send_window += increment;
+        if (_send_window > max_window) {
+            throw connection_error(error_code::flow_control_error, "Connection window overflow");
+        }
+        _send_cond.broadcast();
+        return make_ready_future<>();
+    }
+    if (stream_id > _last_stream_id) {
+        throw connection_error(error_code::protocol_error, "WINDOW_UPDATE on an idle stream");
+    }
+    auto i = _streams.find(stream_id);
+    if (i == _streams.end()) {
+        // closed already
+        return make_ready_future<>();
+    }
+    auto& s = *i->second;
+    if (!increment) {
+        return reset_stream(stream_id, error_code::protocol_error);
+    }
+    s.send_window += increment;
+    if (s.send_window > max_window) {
+        return reset_stream(stream_id, error_code::flow_control_error);
+    }
+    _send_cond.broadcast();
+    return make_ready_future<>();
+}
+
+void http2_connection::handle_rst_stream(uint32_t stream_id, temporary_buffer<char> payload) {
+    if (payload.size() != 4) {
+        throw connection_error(error_code::frame_size_error, "Invalid RST_STREAM");
+    }
+    if (!stream_id || stream_id > _last_stream_id) {
+        throw connection_error(error_code::protocol_error, "RST_STREAM on an idle stream");
+    }
+    auto i = _streams.find(stream_id);
+    if (i == _streams.end()) {
+        return;
+    }
+    auto s = i->second;
+    _streams.erase(i);
+    s->closed = true;
+    if (s->running) {
+        s->peer_reset = true;
+        ++_reset_handlers;
+    }
+    s->body_cond.broadcast();
+    _send_cond.broadcast();
+}
+
+future<> http2_connection::handle_headers(uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    if (!stream_id || !(stream_id & 1)) {
+        throw connection_error(error_code::protocol_error, "HEADERS on an invalid stream");
+    }
+    if (!strip_padding(flags, payload)) {
+        throw connection_error(error_code::protocol_error, "Invalid padding");
+    }
+    if (flags & flag_priority) {
+        if (payload.size() < 5) {
+            throw connection_error(error_code::frame_size_error, "Invalid HEADERS");
+        }
+        payload.trim_front(5);
+    }
+    _header_block.assign(payload.get(), payload.size());
+    _header_stream = stream_id;
+    _header_end_stream = flags & flag_end_stream;
+    if (!(flags & flag_end_headers)) {
+        return make_ready_future<>();
+    }
+    return handle_header_block();
+}
+
+future<> http2_connection::handle_continuation(uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    if (!_header_stream || stream_id != _header_stream) {
+        throw connection_error(error_code::protocol_error, "Unexpected CONTINUATION");
+    }
+    if (_header_block.size() + payload.size() > max_header_list_size) {
+        throw connection_error(error_code::enhance_your_calm, "Header block too large");
+    }
+    _header_block.append(payload.get(), payload.size());
+    if (!(flags & flag_end_headers)) {
+        return make_ready_future<>();
+    }
+    return handle_header_block();
+}
+
+future<> http2_connection::handle_header_block() {
+    auto stream_id = std::exchange(_header_stream, 0);
+    bool end_stream = _header_end_stream;
+    // the block has to be decoded even if the stream is dropped, to keep
+    // the dynamic table in sync with the peer's
+    auto headers = _decoder.decode(_header_block);
+    _header_block.clear();
+
+    if (stream_id <= _last_stream_id) {
+        auto i = _streams.find(stream_id);
+        if (i == _streams.end()) {
+            // trailers may be in flight when we reset the stream, but the
+            // peer cannot open or reuse a closed stream (RFC 9113, 5.1.1)
+            if (std::find(_reset_streams.begin(), _reset_streams.end(), stream_id) != _reset_streams.end()) {
+                return make_ready_future<>();
+            }
+            throw connection_error(error_code::protocol_error, "HEADERS on a closed stream");
+        }
+        auto s = i->second;
+        if (s->remote_closed) {
+            return reset_stream(stream_id, error_code::stream_closed);
+        }
+        // trailers; their fields are dropped
+        if (!end_stream) {
+            return reset_stream(stream_id, error_code::protocol_error);
+        }
+        return handle_data(flag_end_stream, stream_id, temporary_buffer<char>());
+    }
+
+    _last_stream_id = stream_id;
+    ++_server._requests_served;
+    if (_running_handlers >= max_concurrent_streams && _reset_handlers >= max_concurrent_streams / 2) {
+        // the peer resets streams faster than their handlers complete
+        // ("rapid reset", CVE-2023-44487)
+        throw connection_error(error_code::enhance_your_calm, "Too many streams reset while being handled");
+    }
+    if (_peer_goaway || _streams.size() >= max_concurrent_streams || _running_handlers >= max_concurrent_streams) {
+        return reset_stream(stream_id, error_code::refused_stream);
+    }
+    if (!headers) {
+        auto s = make_stream(stream_id, nullptr);
+        s->too_large = true;
+        reply_error(s, reply::status_type::bad_request, "Header list too large");
+        return make_ready_future<>();
+    }
+    if (headers->size() > header_map::max_request_fields) {
+        auto s = make_stream(stream_id, nullptr);
+        s->too_large = true;
+        reply_error(s, reply::status_type::request_header_fields_too_large, "Too many header fields");
+        return make_ready_future<>();
+    }
+    auto req = make_request(std::move(*headers));
+    if (!req) {
+        return reset_stream(stream_id, error_code::protocol_error);
+    }
+    auto s = make_stream(stream_id, std::move(req));
+    s->remote_closed = end_stream;
+    if (end_stream || _server._content_streaming) {
+        dispatch(std::move(s));
+        return make_ready_future<>();
+    }
+    auto limit = _server.get_content_length_limit();
+    if (s->req->content_length > limit) {
+        s->too_large = true;
+        reply_error(s, reply::status_type::payload_too_large, format("Content length limit ({}) exceeded: {}", limit, s->req->content_length));
+    }
+    return make_ready_future<>();
+}
+
+std::unique_ptr<request> http2_connection::make_request(std::vector<header_field> headers) {
+    auto req = std::make_unique<request>();
+    sstring scheme;
+    sstring authority;
+    bool pseudo_done = false;
+    for (auto& h : headers) {
+        auto& name = h.first;
+        if (!name.empty() && name[0] == ':') {
+            sstring* field;
+            if (pseudo_done) {
+                return nullptr;
+            } else if (name == ":method") {
+                field = &req->_method;
+            } else if (name == ":path") {
+                field = &req->_url;
+            } else if (name == ":scheme") {
+                field = &scheme;
+            } else if (name == ":authority") {
+                field = &authority;
+            } else {
+                return nullptr;
+            }
+            if (!field->empty()) {
+                return nullptr;
+            }
+            *field = std::move(h.second);
+            continue;
+        }
+        pseudo_done = true;
+        if (std::any_of(name.begin(), name.end(), [] (char c) { return c >= 'A' && c <= 'Z'; })) {
+            return nullptr;
+        }
+        if (is_connection_specific(name) || (name == "te" && h.second != "trailers")) {
+            return nullptr;
+        }
+        auto i = req->_headers.find(name);
+        if (i == req->_headers.end()) {
+            req->_headers.emplace_back(std::move(h.first), std::move(h.second));
+        } else {
+            // RFC 7540, section 8.1.2.5: cookie crumbs are joined with "; "
+            i->second += name == "cookie" ? "; " : ",";
+            i->second += h.second;
+        }
+    }
+    if (req->_method.empty() || req->_url.empty() || (scheme.empty() && req->_method != "CONNECT")) {
+        return nullptr;
+    }
+    if (!authority.empty() && !req->_headers.count("Host")) {
+        req->_headers["Host"] = std::move(authority);
+    }
+    req->_version = "2.0";
+    req->http_version_major = 2;
+    req->http_version_minor = 0;
+    req->content_type_class = request::ctclass::other;
+    req->content_length = strtol(req->get_header("Content-Length").c_str(), nullptr, 10);
+    if (_server._credentials) {
+        req->protocol_name = "https";
+    }
+    return req;
+}
+
+lw_shared_ptr<http2_connection::stream> http2_connection::make_stream(uint32_t id, std::unique_ptr<request> req) {
+    auto s = make_lw_shared<stream>();
+    s->id = id;
+    s->req = std::move(req);
+    s->send_window = _peer_initial_window;
+    s->recv_window = default_window;
+    _streams.emplace(id, s);
+    return s;
+}
+
+future<> http2_connection::handle_data(uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    if (!stream_id) {
+        throw connection_error(error_code::protocol_error, "DATA on stream 0");
+    }
+    if (stream_id > _last_stream_id) {
+        throw connection_error(error_code::protocol_error, "DATA on an idle stream");
+    }
+    // padding counts too
+    auto size = payload.size();
+    if (int64_t(size) > _recv_window) {
+        throw connection_error(error_code::flow_control_error, "Connection window exceeded");
+    }
+    _recv_window -= size;
+    _recv_unacked += size;
+    if (!strip_padding(flags, payload)) {
+        throw connection_error(error_code::protocol_error, "Invalid padding");
+    }
+    future<> credit = make_ready_future<>();
+    if (_recv_unacked >= connection_window / 2) {
+        temporary_buffer<char> buf(4);
+        write_be<uint32_t>(buf.get_write(), _recv_unacked);
+        _recv_window += _recv_unacked;
+        _recv_unacked = 0;
+        credit = write_frame(frame_type::window_update, 0, 0, std::move(buf));
+    }
+    auto i = _streams.find(stream_id);
+    if (i == _streams.end()) {
+        // closed already
+        return credit;
+    }
+    auto s = i->second;
+    if (s->remote_closed) {
+        return credit.then([this, stream_id] {
+            return reset_stream(stream_id, error_code::stream_closed);
+        });
+    }
+    if (int64_t(size) > s->recv_window) {
+        return credit.then([this, stream_id] {
+            return reset_stream(stream_id, error_code::flow_control_error);
+        });
+    }
+    s->recv_window -= size;
+    // padding is consumed right away
+    credit_stream(*s, size - payload.size());
+    s->remote_closed = flags & flag_end_stream;
+    if (_server._content_streaming) {
+        if (!payload.empty()) {
+            s->body_queue.push_back(std::move(payload));
+        }
+        s->body_cond.broadcast();
+    } else {
+        // the body is kept in memory anyway, no point in waiting for the
+        // handler to credit the peer
+        credit_stream(*s, payload.size());
+        if (!s->too_large) {
+            s->body_size += payload.size();
+            if (!payload.empty()) {
+                s->body.push_back(std::move(payload));
+            }
+            auto limit = _server.get_content_length_limit();
+            if (s->body_size > limit) {
+                s->too_large = true;
+                s->body.clear();
+                reply_error(s, reply::status_type::payload_too_large, format("Content length limit ({}) exceeded", limit));
+            } else if (s->remote_closed) {
+                auto& content = s->req->content;
+                content = uninitialized_string(s->body_size);
+                auto p = content.data();
+                for (auto& b : s->body) {
+                    p = std::copy_n(b.get(), b.size(), p);
+                }
+                s->body.clear();
+                dispatch(s);
+            }
+        }
+    }
+    return credit.then([this, s] {
+        return maybe_send_credit(*s);
+    });
+}
+
+void http2_connection::credit_stream(stream& s, size_t n) {
+    s.unacked += n;
+}
+
+future<> http2_connection::maybe_send_credit(stream& s) {
+    // no point in crediting a stream that is done sending
+    if (s.remote_closed || s.closed || s.unacked < default_window / 2) {
+        return make_ready_future<>();
+    }
+    temporary_buffer<char> buf(4);
+    write_be<uint32_t>(buf.get_write(), s.unacked);
+    s.recv_window += s.unacked;
+    s.unacked = 0;
+    return write_frame(frame_type::window_update, 0, s.id, std::move(buf));
+}
+
+void http2_connection::dispatch(lw_shared_ptr<stream> s) {
+    auto req = std::move(s->req);
+    if (_server._content_streaming) {
+        s->content = input_stream<char>(data_source(std::make_unique<body_source_impl>(*this, *s)));
+        req->content_stream = &s->content;
+    }
+    run_stream(std::move(s), [this, req = std::move(req)] () mutable {
+        auto resp = std::make_unique<reply>();
+        resp->_headers["Server"] = "Seastar httpd";
+        resp->_headers["Date"] = _server._date;
+        sstring url = connection::set_query_param(*req);
+        if (!_server._compression) {
+            return _server._routes.handle(url, std::move(req), std::move(resp));
+        }
+        auto accept_encoding = req->get_header("Accept-Encoding");
+        return _server._routes.handle(url, std::move(req), std::move(resp)).then([this, accept_encoding = std::move(accept_encoding)] (std::unique_ptr<reply> rep) {
+            compress_reply(*rep, accept_encoding, *_server._compression);
+            return rep;
+        });
+    });
+}
+
+void http2_connection::reply_error(lw_shared_ptr<stream> s, reply::status_type status, const sstring& msg) {
+    auto rep = std::make_unique<reply>();
+    rep->set_status(status, msg);
+    rep->_headers["Server"] = "Seastar httpd";
+    rep->_headers["Date"] = _server._date;
+    run_stream(std::move(s), [rep = std::move(rep)] () mutable {
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    });
+}
+
+void http2_connection::run_stream(lw_shared_ptr<stream> s, noncopyable_function<future<std::unique_ptr<reply>> ()> handle) {
+    (void)with_gate(_gate, [this, s, handle = std::move(handle)] () mutable {
+        s->running = true;
+        ++_running_handlers;
+        return futurize_invoke(handle).then([this, s] (std::unique_ptr<reply> rep) {
+            return send_reply(s, std::move(rep));
+        }).handle_exception([this, s] (std::exception_ptr ep) {
+            if (s->closed) {
+                // the peer gave up on the stream, or the connection is gone
+                return make_ready_future<>();
+            }
+            ++_server._respond_errors;
+            hlogger.debug("HTTP/2 stream {} error: {}", s->id, ep);
+            s->closed = true;
+            return reset_stream(s->id, error_code::internal_error);
+        }).finally([this, s] {
+            s->running = false;
+            --_running_handlers;
+            if (s->peer_reset) {
+                --_reset_handlers;
+            }
+            return close_stream(s);
+        });
+    }).handle_exception([] (std::exception_ptr ep) {
+        hlogger.debug("HTTP/2 reset failed: {}", ep);
+    });
+}
+
+future<> http2_connection::send_reply(lw_shared_ptr<stream> s, std::unique_ptr<reply> rep) {
+    std::string block;
+    _encoder.encode(block, ":status", to_sstring(int(rep->_status)));
+    bool has_body = rep->_body_writer || !rep->_content.empty();
+    if (!rep->_body_writer) {
+        rep->_headers["Content-Length"] = to_sstring(rep->_content.size());
+    }
+    for (auto& h : rep->_headers) {
+        sstring name = h.first;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (!is_connection_specific(name)) {
+            _encoder.encode(block, name, h.second);
+        }
+    }
+    return write_header_block(s->id, std::move(block), !has_body).then([this, s, has_body, rep = std::move(rep)] () mutable {
+        if (!has_body) {
+            return make_ready_future<>();
+        }
+        if (!rep->_body_writer) {
+            temporary_buffer<char> buf(rep->_content.data(), rep->_content.size());
+            return send_data(s, std::move(buf), true);
+        }
+        auto out = output_stream<char>(data_sink(std::make_unique<data_sink_impl>(*this, s)), _peer_max_frame_size, true);
+        return rep->_body_writer(std::move(out)).then([this, s, rep = std::move(rep)] {
+            return send_data(s, temporary_buffer<char>(), true);
+        });
+    });
+}
+
+future<> http2_connection::send_data(lw_shared_ptr<stream> s, temporary_buffer<char> buf, bool end_stream) {
+    return do_with(std::move(buf), [this, s, end_stream] (temporary_buffer<char>& buf) {
+        return repeat([this, s, end_stream, &buf] {
+            return _send_cond.wait([this, s, &buf] {
+                // an empty frame that ends the stream needs no credit
+                return s->closed || _closed || buf.empty() || (s->send_window > 0 && _send_window > 0);
+            }).then([this, s, end_stream, &buf] {
+                if (s->closed || _closed) {
+                    throw stream_closed_error();
+                }
+                size_t n = std::min<size_t>({buf.size(), size_t(std::max<int64_t>(s->send_window, 0)),
+                        size_t(std::max<int64_t>(_send_window, 0)), _peer_max_frame_size});
+                s->send_window -= n;
+                _send_window -= n;
+                auto chunk = buf.share(0, n);
+                buf.trim_front(n);
+                bool last = buf.empty();
+                return write_frame(frame_type::data, last && end_stream ? flag_end_stream : 0, s->id, std::move(chunk)).then([last] {
+                    return last ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        });
+    });
+}
+
+future<> http2_connection::close_stream(lw_shared_ptr<stream> s) {
+    _streams.erase(s->id);
+    s->body_queue.clear();
+    if (s->closed) {
+        return make_ready_future<>();
+    }
+    s->closed = true;
+    if (s->remote_closed || _closed) {
+        return make_ready_future<>();
+    }
+    // the reply is complete, tell the peer to stop sending the request
+    return reset_stream(s->id, error_code::no_error);
+}
+
+future<> http2_connection::reset_stream(uint32_t stream_id, error_code code) {
+    auto i = _streams.find(stream_id);
+    if (i != _streams.end()) {
+        auto s = i->second;
+        _streams.erase(i);
+        s->closed = true;
+        s->body_cond.broadcast();
+        _send_cond.broadcast();
+    }
+    if (_reset_streams.size() == max_concurrent_streams) {
+        _reset_streams.pop_front();
+    }
+    _reset_streams.push_back(stream_id);
+    temporary_buffer<char> buf(4);
+    write_be<uint32_t>(buf.get_write(), uint32_t(code));
+    return write_frame(frame_type::rst_stream, 0, stream_id, std::move(buf));
+}
+
+void http2_connection::close_all() {
+    _closed = true;
+    for (auto& s : _streams) {
+        s.second->closed = true;
+        s.second->body_cond.broadcast();
+    }
+    _send_cond.broadcast();
+}
+
+future<> http2_connection::put_frame(frame_type type, uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    char header[frame_header_size];
+    write_be<uint32_t>(header, (uint32_t(payload.size()) << 8) | uint8_t(type));
+    header[4] = flags;
+    write_be<uint32_t>(header + 5, stream_id);
+    return _out.write(header, sizeof(header)).then([this, payload = std::move(payload)] {
+        return _out.write(payload.get(), payload.size());
+    });
+}
+
+future<> http2_connection::write_frame(frame_type type, uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    return with_semaphore(_write_sem, 1, [this, type, flags, stream_id, payload = std::move(payload)] () mutable {
+        return put_frame(type, flags, stream_id, std::move(payload)).then([this] {
+            // frames queued behind this one share the flush
+            return _write_sem.waiters() ? make_ready_future<>() : _out.flush();
+        });
+    });
+}
+
+future<> http2_connection::write_header_block(uint32_t stream_id, std::string block, bool end_stream) {
+    return with_semaphore(_write_sem, 1, [this, stream_id, block = std::move(block), end_stream] {
+        return do_with(size_t(0), [this, stream_id, &block, end_stream] (size_t& pos) {
+            return repeat([this, stream_id, &block, end_stream, &pos] {
+                auto n = std::min(block.size() - pos, _peer_max_frame_size);
+                bool first = pos == 0;
+                bool last = pos + n == block.size();
+                uint8_t flags = (first && end_stream ? flag_end_stream : 0) | (last ? flag_end_headers : 0);
+                temporary_buffer<char> payload(block.data() + pos, n);
+                pos += n;
+                return put_frame(first ? frame_type::headers : frame_type::continuation, flags, stream_id, std::move(payload)).then([last] {
+                    return last ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        }).then([this] {
+            return _write_sem.waiters() ? make_ready_future<>() : _out.flush();
+        });
+    });
+}
+
+future<> http2_connection::write_goaway(error_code code) {
+    temporary_buffer<char> buf(8);
+    write_be<uint32_t>(buf.get_write(), _last_stream_id);
+    write_be<uint32_t>(buf.get_write() + 4, uint32_t(code));
+    return write_frame(frame_type::goaway, 0, 0, std::move(buf));
+}
+
+}
+
+}
@@ -37,6 +37,8 @@
 #include <vector>
 #include <seastar/http/httpd.hh>
 #include <seastar/http/reply.hh>
+#include <seastar/http/internal/content_source.hh>
+#include <seastar/http/internal/http2.hh>
 #include <seastar/util/log.hh>
 
 using namespace std::chrono_literals;
@@ -82,7 +84,7 @@ future<> connection::do_response_loop() {
 
 future<> connection::start_response() {
     if (_resp->_body_writer) {
-        return _resp->write_reply_to_connection(*this).then_wrapped([this] (auto f) {
+        return _resp->write_reply_to_connection(*this, _server._common_headers).then_wrapped([this] (auto f) {
             if (f.failed()) {
                 // In case of an error during the write close the connection
                 _server._respond_errors++;
@@ -92,6 +94,9 @@ future<> connection::start_response() {
                 f.ignore_ready_future();
                 return make_ready_future<>();
             }
+            if (_resp->_body_length) {
+                return make_ready_future<>();
+            }
             return _write_buf.write("0\r\n\r\n", 5);
         }).then_wrapped([this ] (auto f) {
             if (f.failed()) {
@@ -118,15 +123,14 @@ future<> connection::start_response() {
             return make_ready_future<>();
         });
     }
-    set_headers(*_resp);
-    _resp->_headers["Content-Length"] = to_sstring(
-            _resp->_content.size());
-    return _write_buf.write(_resp->_response_line.data(),
-            _resp->_response_line.size()).then([this] {
-        return _resp->write_reply_headers(*this);
-    }).then([this] {
-        return _write_buf.write("\r\n", 2);
-    }).then([this] {
+    // informational, 204 and 304 replies have no body (RFC 7230, section 3.3.2)
+    if (int(_resp->_status) >= 200 && _resp->_status != reply::status_type::no_content
+            && _resp->_status != reply::status_type::not_modified) {
+        _resp->_headers["Content-Length"] = to_sstring(
+                _resp->_content.size());
+    }
+    auto head = _resp->serialize_head(_server._common_headers);
+    return _write_buf.write(head.get(), head.size()).then([this] {
         return write_body();
     }).then([this] {
         return _write_buf.flush();
@@ -179,31 +183,101 @@ future<> connection::read() {
         f.ignore_ready_future();
         return _replies.push_eventually( {});
     }).finally([this] {
-        return _read_buf.close();
+        // with HTTP/2, or another protocol, the stream lives on
+        return _http2 || _switch_protocols ? make_ready_future<>() : _read_buf.close();
     });
 }
 
-// Check if the request has a body, and if so read it. This function modifies
-// the request object with the newly read body, and returns the object for
-// further processing.
-// FIXME: reading the entire request body into a string req->_content is a
-// bad idea, because it may be very big. Instead, we should present to the
-// handler a req->_content_stream, an input stream that reads from the request
-// body - via a specialized input streams which reads exactly up to
-// Content-Length or decodes chunked-encoding.
-// FIXME: We currently support the case that there is a "Content-Length:"
-// header - chunked encoding is not yet supported.
-static future<std::unique_ptr<httpd::request>>
-read_request_body(input_stream<char>& buf, std::unique_ptr<httpd::request> req) {
-    if (!req->content_length) {
+// Sets up _req_body for the request's body, if it has one. With content
+// streaming the handler reads it from there, otherwise it is read into
+// req->content now. A chunked body that turns out to be longer than the
+// content length limit is only read up to just past the limit, the caller
+// has to check. A malformed chunked body fails with bad_request_exception.
+future<std::unique_ptr<httpd::request>> connection::read_request_body(std::unique_ptr<httpd::request> req) {
+    bool chunked = req->is_chunked();
+    _req_body.reset();
+    if (!chunked && !req->content_length) {
         return make_ready_future<std::unique_ptr<httpd::request>>(std::move(req));
     }
-    return buf.read_exactly(req->content_length).then([req = std::move(req)] (temporary_buffer<char> body) mutable {
-        req->content = seastar::to_sstring(std::move(body));
+    if (_server._content_streaming) {
+        if (chunked) {
+            _req_body.emplace(data_source(std::make_unique<internal::chunked_source_impl>(_read_buf)));
+        } else {
+            _req_body.emplace(data_source(std::make_unique<internal::content_length_source_impl>(_read_buf, req->content_length)));
+        }
+        req->content_stream = &*_req_body;
         return make_ready_future<std::unique_ptr<httpd::request>>(std::move(req));
+    }
+    if (!chunked) {
+        return _read_buf.read_exactly(req->content_length).then([req = std::move(req)] (temporary_buffer<char> body) mutable {
+            req->content = seastar::to_sstring(std::move(body));
+            return make_ready_future<std::unique_ptr<httpd::request>>(std::move(req));
+        });
+    }
+    _req_body.emplace(data_source(std::make_unique<internal::chunked_source_impl>(_read_buf)));
+    return do_with(std::move(req), std::vector<temporary_buffer<char>>(), size_t(0),
+            [this] (std::unique_ptr<httpd::request>& req, std::vector<temporary_buffer<char>>& bufs, size_t& size) {
+        return repeat([this, &bufs, &size] {
+            if (size > _server.get_content_length_limit()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return _req_body->read().then([&bufs, &size] (temporary_buffer<char> buf) {
+                if (buf.empty()) {
+                    return stop_iteration::yes;
+                }
+                size += buf.size();
+                bufs.push_back(std::move(buf));
+                return stop_iteration::no;
+            });
+        }).then([&req, &bufs, &size] {
+            req->content = uninitialized_string(size);
+            auto p = req->content.data();
+            for (auto&& b : bufs) {
+                p = std::copy_n(b.get(), b.size(), p);
+            }
+            return std::move(req);
+        });
+    });
+}
+
+// Skips whatever the handler left unread of a streamed request body, so the
+// next request can be parsed.
+future<> connection::skip_request_body() {
+    if (!_server._content_streaming || !_req_body) {
+        return make_ready_future<>();
+    }
+    return repeat([this] {
+        return _req_body->read().then([] (temporary_buffer<char> buf) {
+            return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+        });
     });
 }
 
+// An HTTP/1.1 request asking to switch to HTTP/2 (RFC 7540, section 3.2)
+static bool is_h2c_upgrade(const request& req) {
+    if (req._version != "1.1" || req.get_header("HTTP2-Settings").empty()) {
+        return false;
+    }
+    auto upgrade = req.get_header("Upgrade");
+    std::transform(upgrade.begin(), upgrade.end(), upgrade.begin(), ::tolower);
+    size_t pos = 0;
+    while (pos < upgrade.size()) {
+        auto end = std::min(upgrade.find(',', pos), upgrade.size());
+        auto token = std::string_view(upgrade).substr(pos, end - pos);
+        while (!token.empty() && token.front() == ' ') {
+            token.remove_prefix(1);
+        }
+        while (!token.empty() && token.back() == ' ') {
+            token.remove_suffix(1);
+        }
+        if (token == "h2c") {
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
 void connection::generate_error_reply_and_close(std::unique_ptr<httpd::request> req, reply::status_type status, const sstring& msg) {
     auto resp = std::make_unique<reply>();
     // TODO: Handle HTTP/2.0 when it releases
@@ -231,25 +305,56 @@ future<> connection::read_one() {
                 // we might have failed to parse even the version
                 req->_version = "1.1";
             }
-            generate_error_reply_and_close(std::move(req), reply::status_type::bad_request, "Can't parse the request");
+            if (_parser.too_many_fields()) {
+                generate_error_reply_and_close(std::move(req), reply::status_type::request_header_fields_too_large, "Too many header fields");
+            } else {
+                generate_error_reply_and_close(std::move(req), reply::status_type::bad_request, "Can't parse the request");
+            }
             return make_ready_future<>();
         }
 
+        if (_server._http2 && req->_method == "PRI" && req->_url == "*" && req->_version == "2.0") {
+            // The HTTP/2 connection preface parses as a request without
+            // headers, what remains of it follows
+            auto rest = http2_connection::preface.substr(18);
+            return _read_buf.read_exactly(rest.size()).then([this, rest] (temporary_buffer<char> buf) {
+                _done = true;
+                _http2 = std::string_view(buf.get(), buf.size()) == rest;
+            });
+        }
+
         size_t content_length_limit = _server.get_content_length_limit();
-        sstring length_header = req->get_header("Content-Length");
-        req->content_length = strtol(length_header.c_str(), nullptr, 10);
+        // with chunked transfer encoding Content-Length must be ignored
+        // (RFC 7230, section 3.3.3)
+        if (!req->is_chunked()) {
+            sstring length_header = req->get_header("Content-Length");
+            req->content_length = strtol(length_header.c_str(), nullptr, 10);
+        }
 
-        if (req->content_length > content_length_limit) {
+        if (req->content_length > content_length_limit && !_server._content_streaming) {
             auto msg = format("Content length limit ({}) exceeded: {}", content_length_limit, req->content_length);
             generate_error_reply_and_close(std::move(req), reply::status_type::payload_too_large, std::move(msg));
             return make_ready_future<>();
         }
 
+        if (_server._http2 && !_server._credentials && !req->content_length && !req->is_chunked() && is_h2c_upgrade(*req)) {
+            // the request is answered over HTTP/2, on stream 1
+            _upgrade_settings = req->get_header("HTTP2-Settings");
+            _upgrade_req = std::move(req);
+            _http2 = true;
+            _done = true;
+            return _replies.not_full().then([this] {
+                auto resp = std::make_unique<reply>();
+                resp->add_header("Connection", "Upgrade").add_header("Upgrade", "h2c");
+                resp->set_version("1.1").set_status(reply::status_type::switching_protocols).done();
+                _replies.push(std::move(resp));
+            });
+        }
+
         auto maybe_reply_continue = [this, req = std::move(req)] () mutable {
             if (req->_version == "1.1" && request::case_insensitive_cmp()(req->get_header("Expect"), "100-continue")){
                 return _replies.not_full().then([req = std::move(req), this] () mutable {
                     auto continue_reply = std::make_unique<reply>();
-                    set_headers(*continue_reply);
                     continue_reply->set_version(req->_version);
                     continue_reply->set_status(reply::status_type::continue_).done();
                     this->_replies.push(std::move(continue_reply));
@@ -261,11 +366,29 @@ future<> connection::read_one() {
         };
 
         return maybe_reply_continue().then([this] (std::unique_ptr<httpd::request> req) {
-            return read_request_body(_read_buf, std::move(req)).then([this] (std::unique_ptr<httpd::request> req) {
+            auto version = req->_version;
+            return read_request_body(std::move(req)).then_wrapped([this, version = std::move(version)] (future<std::unique_ptr<httpd::request>> f) {
+                std::unique_ptr<httpd::request> req;
+                try {
+                    req = f.get0();
+                } catch (bad_request_exception& e) {
+                    // the rest of the stream cannot be parsed
+                    auto bad = std::make_unique<httpd::request>();
+                    bad->_version = version;
+                    generate_error_reply_and_close(std::move(bad), reply::status_type::bad_request, e.what());
+                    return make_ready_future<>();
+                }
+                auto content_length_limit = _server.get_content_length_limit();
+                if (req->content.size() > content_length_limit) {
+                    auto msg = format("Content length limit ({}) exceeded", content_length_limit);
+                    generate_error_reply_and_close(std::move(req), reply::status_type::payload_too_large, std::move(msg));
+                    return make_ready_future<>();
+                }
                 return _replies.not_full().then([req = std::move(req), this] () mutable {
                     return generate_reply(std::move(req));
-                }).then([this](bool done) {
+                }).then([this] (bool done) {
                     _done = done;
+                    return done ? make_ready_future<>() : skip_request_body();
                 });
             });
         });
@@ -273,9 +396,28 @@ future<> connection::read_one() {
 }
 
 future<> connection::process() {
+    if (_server._http2 && _server._credentials) {
+        // over TLS, HTTP/2 is negotiated in the handshake
+        return tls::get_alpn_protocol(_fd).then_wrapped([this] (future<std::optional<sstring>> f) {
+            if (f.failed()) {
+                _server._read_errors++;
+                hlogger.debug("TLS handshake failed: {}", f.get_exception());
+                return close_streams();
+            }
+            auto protocol = f.get0();
+            if (protocol && *protocol == "h2") {
+                return process_http2(true);
+            }
+            return process_http1();
+        });
+    }
+    return process_http1();
+}
+
+future<> connection::process_http1() {
     // Launch read and write "threads" simultaneously:
     return when_all(read(), respond()).then(
-            [] (std::tuple<future<>, future<>> joined) {
+            [this] (std::tuple<future<>, future<>> joined) {
         try {
             std::get<0>(joined).get();
         } catch (...) {
@@ -286,30 +428,45 @@ future<> connection::process() {
         } catch (...) {
             hlogger.debug("Response exception encountered: {}", std::current_exception());
         }
+        if (_http2) {
+            // the preface was read already, unless this is an upgrade
+            return process_http2(bool(_upgrade_req));
+        }
+        if (_switch_protocols) {
+            return _switch_protocols(_read_buf, _write_buf).then_wrapped([this] (future<> f) {
+                if (f.failed()) {
+                    hlogger.debug("Switched protocol failed: {}", f.get_exception());
+                }
+                return close_streams();
+            });
+        }
         return make_ready_future<>();
     });
 }
-void connection::shutdown() {
-    _fd.shutdown_input();
-    _fd.shutdown_output();
+
+future<> connection::close_streams() {
+    return _write_buf.close().handle_exception([] (std::exception_ptr ep) {
+        hlogger.debug("Close exception encountered: {}", ep);
+    }).finally([this] {
+        return _read_buf.close();
+    });
 }
 
-future<> connection::write_reply_headers(
-        std::unordered_map<sstring, sstring>::iterator hi) {
-    if (hi == _resp->_headers.end()) {
-        return make_ready_future<>();
-    }
-    return _write_buf.write(hi->first.data(), hi->first.size()).then(
-            [this] {
-                return _write_buf.write(": ", 2);
-            }).then([hi, this] {
-        return _write_buf.write(hi->second.data(), hi->second.size());
-    }).then([this] {
-        return _write_buf.write("\r\n", 2);
-    }).then([hi, this] () mutable {
-        return write_reply_headers(++hi);
+future<> connection::process_http2(bool read_preface) {
+    _http2 = true;
+    auto h2 = std::make_unique<http2_connection>(_server, _read_buf, _write_buf);
+    auto f = h2->process(read_preface, std::move(_upgrade_req), std::move(_upgrade_settings));
+    return f.then_wrapped([this, h2 = std::move(h2)] (future<> f) {
+        if (f.failed()) {
+            hlogger.debug("HTTP/2 connection failed: {}", f.get_exception());
+        }
+        return close_streams();
     });
 }
+void connection::shutdown() {
+    _fd.shutdown_input();
+    _fd.shutdown_output();
+}
 
 short connection::hex_to_byte(char c) {
     if (c >='a' && c <= 'z') {
@@ -374,7 +531,7 @@ future<> connection::respond() {
             _server._respond_errors++;
         }
         f.ignore_ready_future();
-        return _write_buf.close();
+        return _http2 || _switch_protocols ? make_ready_future<>() : _write_buf.close();
     });
 }
 
@@ -383,11 +540,6 @@ future<> connection::write_body() {
             _resp->_content.size());
 }
 
-void connection::set_headers(reply& resp) {
-    resp._headers["Server"] = "Seastar httpd";
-    resp._headers["Date"] = _server._date;
-}
-
 future<bool> connection::generate_reply(std::unique_ptr<request> req) {
     auto resp = std::make_unique<reply>();
     bool conn_keep_alive = false;
@@ -417,10 +569,18 @@ future<bool> connection::generate_reply(std::unique_ptr<request> req) {
     }
     sstring url = set_query_param(*req.get());
     sstring version = req->_version;
-    set_headers(*resp);
+    sstring accept_encoding = _server._compression ? req->get_header("Accept-Encoding") : "";
     return _server._routes.handle(url, std::move(req), std::move(resp)).
     // Caller guarantees enough room
-    then([this, should_close, version = std::move(version)](std::unique_ptr<reply> rep) {
+    then([this, should_close, version = std::move(version), accept_encoding = std::move(accept_encoding)](std::unique_ptr<reply> rep) mutable {
+        if (_server._compression) {
+            compress_reply(*rep, accept_encoding, *_server._compression);
+        }
+        if (rep->_upgrade) {
+            // no more requests, what follows the reply is another protocol
+            _switch_protocols = std::move(rep->_upgrade);
+            should_close = true;
+        }
         rep->set_version(version).done();
         this->_replies.push(std::move(rep));
         return make_ready_future<bool>(should_close);
@@ -439,7 +599,34 @@ void http_server::set_content_length_limit(size_t limit) {
     _content_length_limit = limit;
 }
 
+void http_server::set_content_streaming(bool b) {
+    _content_streaming = b;
+}
+
+bool http_server::get_content_streaming() const {
+    return _content_streaming;
+}
+
+void http_server::set_http2(bool b) {
+    _http2 = b;
+}
+
+bool http_server::get_http2() const {
+    return _http2;
+}
+
+void http_server::set_compression(compression_options options) {
+    _compression = std::move(options);
+}
+
+const std::optional<compression_options>& http_server::get_compression() const {
+    return _compression;
+}
+
 future<> http_server::listen(socket_address addr, listen_options lo) {
+    if (_credentials && _http2) {
+        _credentials->set_alpn_protocols({"h2", "http/1.1"});
+    }
     if (_credentials) {
         _listeners.push_back(seastar::tls::listen(_credentials, addr, lo));
     } else {
@@ -531,6 +718,10 @@ sstring http_server::http_date() {
         tm.tm_hour, tm.tm_min, tm.tm_sec);
 }
 
+sstring http_server::common_headers(const sstring& date) {
+    return "Server: Seastar httpd\r\nDate: " + date + "\r\n";
+}
+
 
 future<> http_server_control::start(const sstring& name) {
     return _server_dist->start(name);
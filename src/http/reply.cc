@@ -32,6 +32,7 @@
 #include <seastar/core/print.hh>
 #include <seastar/http/httpd.hh>
 #include <seastar/core/loop.hh>
+#include <algorithm>
 
 namespace seastar {
 
@@ -40,10 +41,12 @@ namespace httpd {
 namespace status_strings {
 
 const sstring continue_ = " 100 Continue\r\n";
+const sstring switching_protocols = " 101 Switching Protocols\r\n";
 const sstring ok = " 200 OK\r\n";
 const sstring created = " 201 Created\r\n";
 const sstring accepted = " 202 Accepted\r\n";
 const sstring no_content = " 204 No Content\r\n";
+const sstring partial_content = " 206 Partial Content\r\n";
 const sstring multiple_choices = " 300 Multiple Choices\r\n";
 const sstring moved_permanently = " 301 Moved Permanently\r\n";
 const sstring moved_temporarily = " 302 Moved Temporarily\r\n";
@@ -54,6 +57,9 @@ const sstring forbidden = " 403 Forbidden\r\n";
 const sstring not_found = " 404 Not Found\r\n";
 const sstring length_required = " 411 Length Required\r\n";
 const sstring payload_too_large = " 413 Payload Too Large\r\n";
+const sstring range_not_satisfiable = " 416 Range Not Satisfiable\r\n";
+const sstring upgrade_required = " 426 Upgrade Required\r\n";
+const sstring request_header_fields_too_large = " 431 Request Header Fields Too Large\r\n";
 const sstring internal_server_error = " 500 Internal Server Error\r\n";
 const sstring not_implemented = " 501 Not Implemented\r\n";
 const sstring bad_gateway = " 502 Bad Gateway\r\n";
@@ -63,6 +69,8 @@ static const sstring& to_string(reply::status_type status) {
     switch (status) {
     case reply::status_type::continue_:
         return continue_;
+    case reply::status_type::switching_protocols:
+        return switching_protocols;
     case reply::status_type::ok:
         return ok;
     case reply::status_type::created:
@@ -71,6 +79,8 @@ static const sstring& to_string(reply::status_type status) {
         return accepted;
     case reply::status_type::no_content:
         return no_content;
+    case reply::status_type::partial_content:
+        return partial_content;
     case reply::status_type::multiple_choices:
         return multiple_choices;
     case reply::status_type::moved_permanently:
@@ -91,6 +101,12 @@ static const sstring& to_string(reply::status_type status) {
         return length_required;
     case reply::status_type::payload_too_large:
         return payload_too_large;
+    case reply::status_type::range_not_satisfiable:
+        return range_not_satisfiable;
+    case reply::status_type::upgrade_required:
+        return upgrade_required;
+    case reply::status_type::request_header_fields_too_large:
+        return request_header_fields_too_large;
     case reply::status_type::internal_server_error:
         return internal_server_error;
     case reply::status_type::not_implemented:
@@ -150,33 +166,122 @@ static output_stream<char> make_http_chunked_output_stream(output_stream<char>&
     return output_stream<char>(http_chunked_data_sink(out), 32000, true);
 }
 
+// Passes a body of a known length on to the connection as is, making sure
+// it is of that length, as the connection cannot be used otherwise.
+class http_content_length_data_sink_impl : public data_sink_impl {
+    output_stream<char>& _out;
+    size_t _remain;
+public:
+    http_content_length_data_sink_impl(output_stream<char>& out, size_t length) : _out(out), _remain(length) {
+    }
+    virtual future<> put(net::packet data) override {
+        if (data.len() > _remain) {
+            return make_exception_future<>(std::runtime_error("reply body longer than its content length"));
+        }
+        _remain -= data.len();
+        return _out.write(std::move(data));
+    }
+    using data_sink_impl::put;
+    virtual future<> put(temporary_buffer<char> buf) override {
+        return put(net::packet(std::move(buf)));
+    }
+    virtual future<> close() override {
+        if (_remain) {
+            return make_exception_future<>(std::runtime_error("reply body shorter than its content length"));
+        }
+        return make_ready_future<>();
+    }
+};
+
+static output_stream<char> make_http_content_length_output_stream(output_stream<char>& out, size_t length) {
+    return output_stream<char>(data_sink(std::make_unique<http_content_length_data_sink_impl>(out, length)), 32000, true);
+}
+
 
 void reply::write_body(const sstring& content_type, noncopyable_function<future<>(output_stream<char>&&)>&& body_writer) {
     set_content_type(content_type);
     _body_writer  = std::move(body_writer);
 }
 
+void reply::write_body(const sstring& content_type, size_t length, noncopyable_function<future<>(output_stream<char>&&)>&& body_writer) {
+    set_content_type(content_type);
+    _headers["Content-Length"] = to_sstring(length);
+    _body_writer  = std::move(body_writer);
+    _body_length = length;
+}
+
 void reply::write_body(const sstring& content_type, const sstring& content) {
     _content = content;
     done(content_type);
 }
 
-future<> reply::write_reply_to_connection(connection& con) {
+future<> reply::write_reply_to_connection(connection& con, std::string_view common_headers) {
+    if (_body_length) {
+        // copied and zero-copy writes cannot be mixed before a flush, so
+        // the head is not copied either
+        return con.out().write(serialize_head(common_headers)).then([this, &con] {
+            return _body_writer(make_http_content_length_output_stream(con.out(), *_body_length));
+        });
+    }
     add_header("Transfer-Encoding", "chunked");
-    return con.out().write(response_line()).then([this, &con] () mutable {
-        return write_reply_headers(con);
-    }).then([&con] () mutable {
-        return con.out().write("\r\n", 2);
-    }).then([this, &con] () mutable {
+    auto head = serialize_head(common_headers);
+    return con.out().write(head.get(), head.size()).then([this, &con] () mutable {
         return _body_writer(make_http_chunked_output_stream(con.out()));
     });
 
 }
 
-future<> reply::write_reply_headers(connection& con) {
-    return do_for_each(_headers, [&con](auto& h) {
-        return con.out().write(h.first + ": " + h.second + "\r\n");
-    });
+temporary_buffer<char> reply::serialize_head(std::string_view common_headers) const {
+    auto& status = status_strings::to_string(_status);
+    size_t size = 5 + _version.size() + status.size() + 2;
+    std::vector<std::string_view> set_by_handler;
+    for (auto& h : _headers) {
+        size += h.first.size() + h.second.size() + 4;
+        if (header_map::name_equal(h.first, "Server") || header_map::name_equal(h.first, "Date")) {
+            set_by_handler.push_back(h.first);
+        }
+    }
+    // the common fields, one per line, but for those the handler set
+    auto for_each_common = [&] (auto&& f) {
+        for (auto lines = common_headers; !lines.empty();) {
+            auto end = lines.find('\n');
+            auto line = lines.substr(0, end == std::string_view::npos ? end : end + 1);
+            lines.remove_prefix(line.size());
+            auto name = line.substr(0, line.find(':'));
+            if (std::none_of(set_by_handler.begin(), set_by_handler.end(), [name] (std::string_view n) {
+                    return header_map::name_equal(n, name); })) {
+                f(line);
+            }
+        }
+    };
+    if (set_by_handler.empty()) {
+        size += common_headers.size();
+    } else {
+        for_each_common([&size] (std::string_view line) {
+            size += line.size();
+        });
+    }
+    temporary_buffer<char> head(size);
+    auto p = head.get_write();
+    auto put = [&p] (std::string_view s) {
+        p = std::copy(s.begin(), s.end(), p);
+    };
+    put("HTTP/");
+    put(_version);
+    put(status);
+    if (set_by_handler.empty()) {
+        put(common_headers);
+    } else {
+        for_each_common(put);
+    }
+    for (auto& h : _headers) {
+        put(h.first);
+        put(": ");
+        put(h.second);
+        put("\r\n");
+    }
+    put("\r\n");
+    return head;
 }
 
 }
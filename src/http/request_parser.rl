@@ -75,15 +75,24 @@ action checkpoint {
     g.mark_start(p);
 }
 
+action count_field {
+    if (++_fields > header_map::max_request_fields) {
+        _too_many_fields = true;
+        fbreak;
+    }
+}
+
 action assign_field {
-    if (_req->_headers.count(_field_name)) {
+    auto i = _req->_headers.find(_field_name);
+    if (i != _req->_headers.end()) {
         // RFC 7230, section 3.2.2.  Field Parsing:
         // A recipient MAY combine multiple header fields with the same field name into one
         // "field-name: field-value" pair, without changing the semantics of the message,
         // by appending each subsequent field value to the combined field value in order, separated by a comma.
-        _req->_headers[_field_name] += sstring(",") + std::move(_value);
+        i->second.append(",", 1);
+        i->second.append(_value.data(), _value.size());
     } else {
-        _req->_headers[_field_name] = std::move(_value);
+        _req->_headers.emplace_back(_field_name, std::move(_value));
     }
 }
 
@@ -92,7 +101,9 @@ action extend_field  {
     // A server that receives an obs-fold in a request message that is not
     // within a message/http container MUST either reject the message [...]
     // or replace each received obs-fold with one or more SP octets [...]
-    _req->_headers[_field_name] += sstring(" ") + std::move(_value);
+    auto& v = _req->_headers[_field_name];
+    v.append(" ", 1);
+    v.append(_value.data(), _value.size());
 }
 
 action done {
@@ -122,8 +133,8 @@ field_content = (field_vchars sp_ht*)*;
 field = tchar+ >mark %store_field_name;
 value = field_content >mark %no_mark_store_value;
 start_line = ((operation sp uri sp http_version) -- crlf) crlf;
-header_1st = (field ':' sp_ht* value crlf) %assign_field;
-header_cont = (sp_ht+ value crlf) %extend_field;
+header_1st = (field >count_field ':' sp_ht* value crlf) %assign_field;
+header_cont = (sp_ht+ >count_field value crlf) %extend_field;
 header = header_1st header_cont*;
 main := start_line header* (crlf @done);
 
@@ -141,11 +152,15 @@ public:
     sstring _field_name;
     sstring _value;
     state _state;
+    size_t _fields;
+    bool _too_many_fields;
 public:
     void init() {
         init_base();
         _req.reset(new httpd::request());
         _state = state::eof;
+        _fields = 0;
+        _too_many_fields = false;
         %% write init;
     }
     char* parse(char* p, char* pe, char* eof) {
@@ -163,7 +178,9 @@ public:
 #ifdef __clang__
 #pragma clang diagnostic pop
 #endif
-        if (!done) {
+        if (_too_many_fields) {
+            _state = state::error;
+        } else if (!done) {
             if (p == eof) {
                 _state = state::eof;
             } else if (p != pe) {
@@ -185,6 +202,10 @@ public:
     bool failed() const {
         return _state == state::error;
     }
+    // failed because of more than header_map::max_request_fields fields
+    bool too_many_fields() const {
+        return _too_many_fields;
+    }
 };
 
 }
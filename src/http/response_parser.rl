@@ -20,6 +20,7 @@
  */
 
 #include <seastar/core/ragel.hh>
+#include <seastar/http/request.hh>
 #include <memory>
 #include <unordered_map>
 
@@ -27,7 +28,8 @@ namespace seastar {
 
 struct http_response {
     sstring _version;
-    std::unordered_map<sstring, sstring> _headers;
+    int _status = 0;
+    httpd::header_map _headers;
 };
 
 %% machine http_response;
@@ -44,20 +46,40 @@ action store_version {
     _rsp->_version = str();
 }
 
+action store_status {
+    _rsp->_status = std::stoi(str());
+}
+
 action store_field_name {
     _field_name = str();
 }
 
-action store_value {
-    _value = str();
+action no_mark_store_value {
+    _value = get_str();
+    g.mark_start(nullptr);
+}
+
+action checkpoint {
+    // marks the candidate end of the value, see request_parser.rl
+    g.mark_end(p);
+    g.mark_start(p);
 }
 
 action assign_field {
-    _rsp->_headers[_field_name] = std::move(_value);
+    auto i = _rsp->_headers.find(_field_name);
+    if (i != _rsp->_headers.end()) {
+        // RFC 7230, section 3.2.2: fields of the same name are combined
+        i->second.append(",", 1);
+        i->second.append(_value.data(), _value.size());
+    } else {
+        _rsp->_headers.emplace_back(_field_name, std::move(_value));
+    }
 }
 
 action extend_field  {
-    _rsp->_headers[_field_name] += sstring(" ") + std::move(_value);
+    auto& v = _rsp->_headers[_field_name];
+    v.append(" ", 1);
+    v.append(_value.data(), _value.size());
 }
 
 action done {
@@ -78,11 +100,16 @@ sp_ht = sp | ht;
 
 http_version = 'HTTP/' (digit '.' digit) >mark %store_version;
 
+obs_text = 0x80..0xFF;
+field_vchars = (graph | obs_text)+ %checkpoint;
+field_content = (field_vchars sp_ht*)*;
+
 field = tchar+ >mark %store_field_name;
-value = any* >mark %store_value;
-start_line = http_version space digit digit digit space (any - cr - lf)* crlf;
-header_1st = (field sp_ht* ':' value :> crlf) %assign_field;
-header_cont = (sp_ht+ value sp_ht* crlf) %extend_field;
+value = field_content >mark %no_mark_store_value;
+status_code = (digit digit digit) >mark %store_status;
+start_line = http_version space status_code space (any - cr - lf)* crlf;
+header_1st = (field sp_ht* ':' sp_ht* value crlf) %assign_field;
+header_cont = (sp_ht+ value crlf) %extend_field;
 header = header_1st header_cont*;
 main := start_line header* :> (crlf @done);
 
@@ -23,6 +23,10 @@
 #include <seastar/http/reply.hh>
 #include <seastar/http/exception.hh>
 #include <seastar/http/json_path.hh>
+#include <seastar/core/metrics.hh>
+#include <algorithm>
+#include <limits>
+#include <typeinfo>
 
 namespace seastar {
 
@@ -30,6 +34,236 @@ namespace httpd {
 
 using namespace std;
 
+// The match rules of one operation type, indexed by their string and
+// parameter matchers in a compressed radix tree. Walking the tree along the
+// url finds every matching rule in about the time it takes to match one,
+// where the earliest added of them wins, as when the rules are tried in
+// order. Rules that cannot be indexed are still tried in order, up to the
+// best rule found in the tree.
+class route_tree {
+    struct rule_entry {
+        routes::rule_cookie cookie;
+        handler_base* handler;
+        // the parameter names, in url order
+        std::vector<sstring> params;
+    };
+
+    struct node {
+        // the url characters matched on the way to this node
+        sstring prefix;
+        std::vector<std::unique_ptr<node>> children;
+        // a parameter up to the next slash, starting here
+        std::unique_ptr<node> param;
+        // rules ending here
+        std::vector<rule_entry> ends;
+        // rules ending with a parameter that takes the rest of the url
+        std::vector<rule_entry> remainders;
+        // the earliest rule in the subtree, to skip subtrees that cannot win
+        routes::rule_cookie min_cookie = std::numeric_limits<routes::rule_cookie>::max();
+    };
+
+    struct token {
+        sstring str;
+        bool param;
+        bool entire_path;
+    };
+
+    struct match_state {
+        const sstring& url;
+        // start and end of the parameters matched so far
+        std::vector<std::pair<size_t, size_t>> values;
+        const rule_entry* best = nullptr;
+        std::vector<std::pair<size_t, size_t>> best_values;
+        routes::rule_cookie best_cookie = std::numeric_limits<routes::rule_cookie>::max();
+    };
+
+    node _root;
+    // rules with other matchers
+    std::vector<std::pair<routes::rule_cookie, match_rule*>> _linear;
+public:
+    explicit route_tree(const std::map<routes::rule_cookie, match_rule*>& rules) {
+        for (auto& r : rules) {
+            if (!insert(r.first, *r.second)) {
+                _linear.emplace_back(r.first, r.second);
+            }
+        }
+    }
+
+    // the handler of the earliest rule matching the url, with its cookie
+    handler_base* get(const sstring& url, parameters& params, routes::rule_cookie& cookie) const {
+        match_state st{url};
+        visit(_root, 0, st);
+        for (auto& r : _linear) {
+            if (r.first > st.best_cookie) {
+                break;
+            }
+            handler_base* handler = r.second->get(url, params);
+            if (handler != nullptr) {
+                cookie = r.first;
+                return handler;
+            }
+            params.clear();
+        }
+        if (!st.best) {
+            return nullptr;
+        }
+        for (size_t i = 0; i < st.best_values.size(); i++) {
+            auto& v = st.best_values[i];
+            params.set(st.best->params[i], url.substr(v.first, v.second - v.first));
+        }
+        cookie = st.best_cookie;
+        return st.best->handler;
+    }
+private:
+    // Turns the rule into literals and parameters, joining adjacent
+    // literals. Fails for rules the tree cannot match exactly like
+    // match_rule::get() does.
+    static bool tokenize(const match_rule& rule, std::vector<token>& tokens) {
+        if (rule.matchers().empty()) {
+            return false;
+        }
+        for (auto m : rule.matchers()) {
+            if (!tokens.empty() && tokens.back().entire_path) {
+                return false;
+            }
+            if (typeid(*m) == typeid(str_matcher)) {
+                auto& str = static_cast<str_matcher*>(m)->str();
+                if (str.empty()) {
+                    return false;
+                }
+                if (!tokens.empty()) {
+                    // a literal that follows another one, or a parameter,
+                    // can only match after a slash
+                    if (str[0] != '/') {
+                        return false;
+                    }
+                    if (!tokens.back().param) {
+                        tokens.back().str += str;
+                        continue;
+                    }
+                }
+                tokens.push_back(token{str, false, false});
+            } else if (typeid(*m) == typeid(param_matcher)) {
+                auto p = static_cast<param_matcher*>(m);
+                tokens.push_back(token{p->name(), true, p->entire_path()});
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool insert(routes::rule_cookie cookie, const match_rule& rule) {
+        std::vector<token> tokens;
+        if (!tokenize(rule, tokens)) {
+            return false;
+        }
+        rule_entry entry{cookie, rule.handler(), {}};
+        node* n = &_root;
+        n->min_cookie = std::min(n->min_cookie, cookie);
+        for (auto& t : tokens) {
+            if (!t.param) {
+                n = insert_literal(n, t.str, cookie);
+                continue;
+            }
+            entry.params.push_back(t.str);
+            if (t.entire_path) {
+                n->remainders.push_back(std::move(entry));
+                return true;
+            }
+            if (!n->param) {
+                n->param = std::make_unique<node>();
+            }
+            n = n->param.get();
+            n->min_cookie = std::min(n->min_cookie, cookie);
+        }
+        n->ends.push_back(std::move(entry));
+        return true;
+    }
+
+    static node* insert_literal(node* n, const sstring& str, routes::rule_cookie cookie) {
+        size_t i = 0;
+        while (i < str.size()) {
+            auto it = std::find_if(n->children.begin(), n->children.end(), [c = str[i]] (auto& child) {
+                return child->prefix[0] == c;
+            });
+            if (it == n->children.end()) {
+                auto child = std::make_unique<node>();
+                child->prefix = str.substr(i);
+                child->min_cookie = cookie;
+                n->children.push_back(std::move(child));
+                return n->children.back().get();
+            }
+            auto& prefix = (*it)->prefix;
+            size_t common = 0;
+            while (common < prefix.size() && i + common < str.size() && prefix[common] == str[i + common]) {
+                common++;
+            }
+            if (common < prefix.size()) {
+                // split the child where the new literal leaves it
+                auto mid = std::make_unique<node>();
+                mid->prefix = prefix.substr(0, common);
+                mid->min_cookie = (*it)->min_cookie;
+                (*it)->prefix = prefix.substr(common);
+                mid->children.push_back(std::move(*it));
+                *it = std::move(mid);
+            }
+            n = it->get();
+            n->min_cookie = std::min(n->min_cookie, cookie);
+            i += common;
+        }
+        return n;
+    }
+
+    void consider(const rule_entry& e, match_state& st) const {
+        if (e.cookie < st.best_cookie) {
+            st.best = &e;
+            st.best_cookie = e.cookie;
+            st.best_values = st.values;
+        }
+    }
+
+    // pos is where the url continues after the node's prefix
+    void visit(const node& n, size_t pos, match_state& st) const {
+        if (n.min_cookie >= st.best_cookie) {
+            return;
+        }
+        const sstring& url = st.url;
+        size_t len = url.size();
+        // what a literal matched so far must be followed by
+        bool boundary = pos == 0 || pos == len || url[pos] == '/';
+        if (pos == len || (pos + 1 == len && url[pos] == '/')) {
+            for (auto& e : n.ends) {
+                consider(e, st);
+            }
+        }
+        if (boundary && !n.remainders.empty()) {
+            st.values.emplace_back(pos, len);
+            for (auto& e : n.remainders) {
+                consider(e, st);
+            }
+            st.values.pop_back();
+        }
+        if (n.param && boundary && pos < len) {
+            size_t end = url.find('/', pos + 1);
+            if (end == sstring::npos) {
+                end = len;
+            }
+            st.values.emplace_back(pos, end);
+            visit(*n.param, end, st);
+            st.values.pop_back();
+        }
+        if (pos < len) {
+            for (auto& child : n.children) {
+                if (child->prefix[0] == url[pos] && url.compare(pos, child->prefix.size(), child->prefix) == 0) {
+                    visit(*child, pos + child->prefix.size(), st);
+                    break;
+                }
+            }
+        }
+    }
+};
+
 void verify_param(const request& req, const sstring& param) {
     if (req.get_query_param(param) == "") {
         throw missing_param_exception(param);
@@ -81,31 +315,145 @@ std::unique_ptr<reply> routes::exception_reply(std::exception_ptr eptr) {
 }
 
 future<std::unique_ptr<reply> > routes::handle(const sstring& path, std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
-    handler_base* handler = get_handler(str2type(req->_method),
-            normalize_url(path), req->param);
-    if (handler != nullptr) {
-        try {
-            for (auto& i : handler->_mandatory_param) {
-                verify_param(*req.get(), i);
-            }
-            auto r =  handler->handle(path, std::move(req), std::move(rep));
-            return r.handle_exception(_general_handler);
-        } catch (const redirect_exception& _e) {
-            rep.reset(new reply());
-            rep->add_header("Location", _e.url).set_status(_e.status()).done(
-                    "json");
-        } catch (...) {
-            rep = exception_reply(std::current_exception());
-        }
-    } else {
+    auto type = str2type(req->_method);
+    auto match = find_route(type, normalize_url(path), req->param);
+    handler_base* handler = match.handler;
+    if (handler == nullptr) {
         rep.reset(new reply());
         json_exception ex(not_found_exception("Not found"));
         rep->set_status(reply::status_type::not_found, ex.to_json()).done(
                 "json");
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }
+    // the statistics of the route that matched, whatever other routes
+    // share its handler
+    lw_shared_ptr<route_metrics> m;
+    if (match.url) {
+        auto i = _route_metrics[type].find(*match.url);
+        if (i != _route_metrics[type].end()) {
+            m = i->second;
+        }
+    } else {
+        auto i = _rule_metrics[type].find(match.cookie);
+        if (i != _rule_metrics[type].end()) {
+            m = i->second;
+        }
+    }
+    if (!m) {
+        return call_handler(handler, path, std::move(req), std::move(rep));
+    }
+    m->stats.requests++;
+    auto start = std::chrono::steady_clock::now();
+    return call_handler(handler, path, std::move(req), std::move(rep)).then([m = std::move(m), start] (std::unique_ptr<reply> rep) {
+        m->stats.add(*rep, std::chrono::steady_clock::now() - start);
+        return rep;
+    });
+}
+
+future<std::unique_ptr<reply>> routes::call_handler(handler_base* handler, const sstring& path,
+        std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+    try {
+        for (auto& i : handler->_mandatory_param) {
+            verify_param(*req.get(), i);
+        }
+        auto r =  handler->handle(path, std::move(req), std::move(rep));
+        return r.handle_exception(_general_handler);
+    } catch (const redirect_exception& _e) {
+        rep.reset(new reply());
+        rep->add_header("Location", _e.url).set_status(_e.status()).done(
+                "json");
+    } catch (...) {
+        rep = exception_reply(std::current_exception());
     }
     return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
 }
 
+void route_stats::add(const reply& rep, std::chrono::steady_clock::duration l) {
+    auto status_class = int(rep._status) / 100;
+    if (status_class >= 1 && status_class <= 5) {
+        replies[status_class - 1]++;
+    }
+    latency.add(l);
+}
+
+// the path of a rule for metrics, with its parameters in braces
+static sstring rule_path(const match_rule& rule) {
+    sstring path;
+    for (auto m : rule.matchers()) {
+        if (auto str = dynamic_cast<const str_matcher*>(m)) {
+            path += str->str();
+        } else if (auto param = dynamic_cast<const param_matcher*>(m)) {
+            path += "/{" + param->name() + "}";
+        } else {
+            path += "/*";
+        }
+    }
+    return path;
+}
+
+lw_shared_ptr<routes::route_metrics> routes::register_route(operation_type type, const sstring& path) {
+    auto i = _route_metrics[type].find(path);
+    if (i == _route_metrics[type].end()) {
+        // nothing is left behind if the metrics cannot be registered
+        auto m = make_lw_shared<route_metrics>();
+        m->path = path;
+        if (_metrics_name) {
+            add_metrics(type, *m);
+        }
+        i = _route_metrics[type].emplace(path, std::move(m)).first;
+    }
+    i->second->registrations++;
+    return i->second;
+}
+
+void routes::unregister_route(operation_type type, const sstring& path) {
+    auto m = _route_metrics[type].find(path);
+    if (m != _route_metrics[type].end() && --m->second->registrations == 0) {
+        // a request in progress may still hold the statistics, but a new
+        // route with the path must be able to register its metrics
+        m->second->metrics.clear();
+        _route_metrics[type].erase(m);
+    }
+}
+
+void routes::add_metrics(operation_type type, route_metrics& m) {
+    namespace sm = seastar::metrics;
+    static auto service_label = sm::label("service");
+    static auto method_label = sm::label("method");
+    static auto route_label = sm::label("route");
+    static auto status_label = sm::label("status");
+    std::vector<sm::label_instance> labels{service_label(*_metrics_name), method_label(type2str(type)), route_label(m.path)};
+    auto& stats = m.stats;
+    std::vector<sm::metric_definition> defs;
+    defs.emplace_back(sm::make_derive("route_requests", [&stats] { return stats.requests; },
+            sm::description("The total number of requests passed to the route's handler"), labels));
+    for (size_t c = 0; c < stats.replies.size(); c++) {
+        auto reply_labels = labels;
+        reply_labels.push_back(status_label(format("{}xx", c + 1)));
+        defs.emplace_back(sm::make_derive("route_replies", [&stats, c] { return stats.replies[c]; },
+                sm::description("The total number of replies of the route, by status class"), reply_labels));
+    }
+    defs.emplace_back(sm::make_histogram("route_latency", sm::description("Time the route's handler took to produce a reply, in microseconds"), labels,
+            [&stats] { return stats.latency.to_metrics_histogram(); }));
+    m.metrics.add_group("httpd", defs);
+}
+
+void routes::enable_metrics(const sstring& name) {
+    _metrics_name = name;
+    for (auto& by_type : _route_metrics) {
+        auto type = operation_type(&by_type - _route_metrics);
+        for (auto& m : by_type) {
+            m.second->metrics.clear();
+            add_metrics(type, *m.second);
+        }
+    }
+}
+
+const route_stats* routes::get_stats(operation_type type, const sstring& path) const {
+    auto i = _route_metrics[type].find(path);
+    return i == _route_metrics[type].end() ? nullptr : &i->second->stats;
+}
+
 sstring routes::normalize_url(const sstring& url) {
     if (url.length() < 2 || url.at(url.length() - 1) != '/') {
         return url;
@@ -115,19 +463,47 @@ sstring routes::normalize_url(const sstring& url) {
 
 handler_base* routes::get_handler(operation_type type, const sstring& url,
         parameters& params) {
-    handler_base* handler = get_exact_match(type, url);
-    if (handler != nullptr) {
-        return handler;
+    return find_route(type, url, params).handler;
+}
+
+routes::route_match routes::find_route(operation_type type, const sstring& url, parameters& params) {
+    route_match match;
+    auto i = _map[type].find(url);
+    if (i != _map[type].end()) {
+        match.handler = i->second;
+        match.url = &i->first;
+        return match;
     }
 
-    for (auto&& rule : _rules[type]) {
-        handler = rule.second->get(url, params);
-        if (handler != nullptr) {
-            return handler;
-        }
-        params.clear();
+    if (_rules[type].empty()) {
+        return match;
+    }
+    if (!_rule_trees[type]) {
+        _rule_trees[type] = std::make_unique<route_tree>(_rules[type]);
     }
-    return nullptr;
+    match.handler = _rule_trees[type]->get(url, params, match.cookie);
+    return match;
+}
+
+routes& routes::add(match_rule* rule, operation_type type) {
+    add_cookie(rule, type);
+    return *this;
+}
+
+routes::rule_cookie routes::add_cookie(match_rule* rule, operation_type type) {
+    auto path = rule_path(*rule);
+    auto m = register_route(type, path);
+    auto pos = _rover++;
+    try {
+        _rule_metrics[type].emplace(pos, std::move(m));
+        _rules[type][pos] = rule;
+    } catch (...) {
+        _rule_metrics[type].erase(pos);
+        unregister_route(type, path);
+        throw;
+    }
+    _rule_trees[type].reset();
+    return pos;
 }
 
 routes& routes::add(operation_type type, const url& url,
@@ -154,7 +530,11 @@ static auto delete_rule_from(operation_type type, Key& key, Map& map) {
 }
 
 handler_base* routes::drop(operation_type type, const sstring& url) {
-    return delete_rule_from(type, url, _map);
+    auto handler = delete_rule_from(type, url, _map);
+    if (handler) {
+        unregister_route(type, url);
+    }
+    return handler;
 }
 
 routes& routes::put(operation_type type, const sstring& url, handler_base* handler) {
@@ -162,11 +542,23 @@ routes& routes::put(operation_type type, const sstring& url, handler_base* handl
     if (it.second == false) {
         throw std::runtime_error(format("Handler for {} already exists.", url));
     }
+    try {
+        register_route(type, url);
+    } catch (...) {
+        _map[type].erase(it.first);
+        throw;
+    }
     return *this;
 }
 
 match_rule* routes::del_cookie(rule_cookie cookie, operation_type type) {
-    return delete_rule_from(type, cookie, _rules);
+    _rule_trees[type].reset();
+    auto rule = delete_rule_from(type, cookie, _rules);
+    if (rule) {
+        _rule_metrics[type].erase(cookie);
+        unregister_route(type, rule_path(*rule));
+    }
+    return rule;
 }
 
 void routes::add_alias(const path_description& old_path, const path_description& new_path) {
@@ -0,0 +1,524 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#include <seastar/http/internal/websocket.hh>
+#include <seastar/http/internal/header_value.hh>
+#include <seastar/http/websocket.hh>
+#include <seastar/http/request.hh>
+#include <seastar/http/reply.hh>
+#include <seastar/core/byteorder.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/util/log.hh>
+#include <cryptopp/sha.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+
+namespace seastar {
+
+namespace httpd {
+
+extern logger hlogger;
+
+namespace {
+
+using internal::trim;
+
+// RFC 6455, section 1.3
+constexpr std::string_view websocket_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+sstring base64_encode(const unsigned char* data, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    sstring ret;
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t n = uint32_t(data[i]) << 16;
+        if (i + 1 < size) {
+            n |= uint32_t(data[i + 1]) << 8;
+        }
+        if (i + 2 < size) {
+            n |= data[i + 2];
+        }
+        char out[4] = { alphabet[(n >> 18) & 63], alphabet[(n >> 12) & 63], alphabet[(n >> 6) & 63], alphabet[n & 63] };
+        if (i + 1 >= size) {
+            out[2] = '=';
+        }
+        if (i + 2 >= size) {
+            out[3] = '=';
+        }
+        ret.append(out, 4);
+    }
+    return ret;
+}
+
+// Whether a peer may close with a code (RFC 6455, section 7.4): the ones
+// defined or registered with IANA, less those that must not be sent in a
+// close frame, and the ones for libraries and applications.
+bool valid_close_code(uint16_t code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+// Calls f with each element of a comma separated header value, trimmed,
+// until it returns true.
+template <typename Func>
+bool any_element(std::string_view value, Func&& f) {
+    while (!value.empty()) {
+        auto comma = value.find(',');
+        auto element = trim(value.substr(0, comma));
+        value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+        if (!element.empty() && f(element)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool has_token(std::string_view value, std::string_view token) {
+    return any_element(value, [token] (std::string_view element) {
+        return header_map::name_equal(element, token);
+    });
+}
+
+// Whether one of the permessage-deflate offers of a Sec-WebSocket-Extensions
+// header (RFC 7692, section 7.1) can be accepted. The reply always declares
+// no context takeover, for both sides, so messages are compressed on their
+// own and the window size the client would like us to use is the only
+// parameter that could be a problem.
+bool accept_deflate(std::string_view extensions) {
+    return any_element(extensions, [] (std::string_view offer) {
+        auto semicolon = offer.find(';');
+        if (!header_map::name_equal(trim(offer.substr(0, semicolon)), "permessage-deflate")) {
+            return false;
+        }
+        while (semicolon != std::string_view::npos) {
+            offer.remove_prefix(semicolon + 1);
+            semicolon = offer.find(';');
+            auto param = trim(offer.substr(0, semicolon));
+            auto eq = param.find('=');
+            auto name = trim(param.substr(0, eq));
+            if (name == "server_max_window_bits") {
+                // only the default window is used
+                auto value = eq == std::string_view::npos ? std::string_view() : trim(param.substr(eq + 1));
+                if (value != "15" && value != "\"15\"") {
+                    return false;
+                }
+            } else if (name != "server_no_context_takeover" && name != "client_no_context_takeover"
+                    && name != "client_max_window_bits") {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+// The zlib streams for permessage-deflate. Without context takeover every
+// message is compressed on its own, and whole, so a connection keeps no
+// state between messages, and the streams of the shard are reset and
+// reused instead.
+class deflate_streams {
+    z_stream _deflater{};
+    z_stream _inflater{};
+public:
+    deflate_streams() {
+        if (deflateInit2(&_deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::bad_alloc();
+        }
+        if (inflateInit2(&_inflater, -MAX_WBITS) != Z_OK) {
+            deflateEnd(&_deflater);
+            throw std::bad_alloc();
+        }
+    }
+    ~deflate_streams() {
+        deflateEnd(&_deflater);
+        inflateEnd(&_inflater);
+    }
+
+    static deflate_streams& local() {
+        static thread_local deflate_streams streams;
+        return streams;
+    }
+
+    // the compressed message, without the empty block that ends it
+    // (RFC 7692, section 7.2.1)
+    temporary_buffer<char> deflate(const std::vector<temporary_buffer<char>>& message, size_t size) {
+        deflateReset(&_deflater);
+        temporary_buffer<char> out(deflateBound(&_deflater, size) + 16);
+        _deflater.next_out = reinterpret_cast<Bytef*>(out.get_write());
+        _deflater.avail_out = out.size();
+        for (size_t i = 0; i < message.size(); i++) {
+            _deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(message[i].get()));
+            _deflater.avail_in = message[i].size();
+            auto flush = i + 1 == message.size() ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+            auto ret = ::deflate(&_deflater, flush);
+            if ((ret != Z_OK && ret != Z_BUF_ERROR) || _deflater.avail_in) {
+                throw std::runtime_error("deflate failed");
+            }
+        }
+        if (message.empty() && ::deflate(&_deflater, Z_SYNC_FLUSH) != Z_OK) {
+            throw std::runtime_error("deflate failed");
+        }
+        out.trim(out.size() - _deflater.avail_out - 4);
+        return out;
+    }
+
+    temporary_buffer<char> inflate(temporary_buffer<char> message, size_t max_size) {
+        static const char tail[] = { 0, 0, '\xff', '\xff' };
+        inflateReset(&_inflater);
+        std::vector<temporary_buffer<char>> out;
+        size_t size = 0;
+        for (auto in : { std::string_view(message.get(), message.size()), std::string_view(tail, sizeof(tail)) }) {
+            _inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+            _inflater.avail_in = in.size();
+            do {
+                temporary_buffer<char> buf(std::max<size_t>(in.size() * 4, 4096));
+                _inflater.next_out = reinterpret_cast<Bytef*>(buf.get_write());
+                _inflater.avail_out = buf.size();
+                auto ret = ::inflate(&_inflater, Z_SYNC_FLUSH);
+                if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+                    throw websocket::protocol_error(websocket_connection::invalid_payload, "bad compressed message");
+                }
+                buf.trim(buf.size() - _inflater.avail_out);
+                size += buf.size();
+                if (size > max_size) {
+                    throw websocket::protocol_error(websocket_connection::message_too_big, "message too big");
+                }
+                if (!buf.empty()) {
+                    out.push_back(std::move(buf));
+                }
+                if (ret == Z_BUF_ERROR || ret == Z_STREAM_END) {
+                    break;
+                }
+            } while (_inflater.avail_in || _inflater.avail_out == 0);
+        }
+        if (out.size() == 1) {
+            return std::move(out.front());
+        }
+        temporary_buffer<char> ret(size);
+        auto p = ret.get_write();
+        for (auto& b : out) {
+            p = std::copy(b.begin(), b.end(), p);
+        }
+        return ret;
+    }
+};
+
+}
+
+// Each buffer is a message.
+class websocket_connection::source_impl : public data_source_impl {
+    websocket_connection& _conn;
+public:
+    explicit source_impl(websocket_connection& conn) : _conn(conn) {
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        return _conn.read_message();
+    }
+};
+
+// Each put() sends a message.
+class websocket_connection::sink_impl : public data_sink_impl {
+    websocket_connection& _conn;
+public:
+    explicit sink_impl(websocket_connection& conn) : _conn(conn) {
+    }
+    using data_sink_impl::put;
+    virtual future<> put(net::packet p) override {
+        return _conn.send_message(std::move(p));
+    }
+    virtual future<> close() override {
+        return _conn.send_close(normal_closure);
+    }
+};
+
+sstring websocket_connection::accept_key(std::string_view key) {
+    sstring s = uninitialized_string(key.size() + websocket_guid.size());
+    std::copy(websocket_guid.begin(), websocket_guid.end(), std::copy(key.begin(), key.end(), s.data()));
+    unsigned char digest[CryptoPP::SHA1::DIGESTSIZE];
+    CryptoPP::SHA1().CalculateDigest(digest, reinterpret_cast<const unsigned char*>(s.data()), s.size());
+    return base64_encode(digest, sizeof(digest));
+}
+
+future<> websocket_connection::process(std::unique_ptr<request> req, const websocket_handler::session_function& session) {
+    return futurize_invoke(session, std::move(req),
+            data_source(std::make_unique<source_impl>(*this)),
+            data_sink(std::make_unique<sink_impl>(*this))).then_wrapped([this] (future<> f) {
+        uint16_t code = normal_closure;
+        if (f.failed()) {
+            hlogger.debug("WebSocket session failed: {}", f.get_exception());
+            code = internal_error;
+        }
+        return send_close(code);
+    });
+}
+
+future<websocket_connection::frame_header> websocket_connection::read_frame_header() {
+    return _in.read_exactly(2).then([this] (temporary_buffer<char> b) {
+        if (b.size() < 2) {
+            throw connection_closed();
+        }
+        frame_header h;
+        h.fin = b[0] & 0x80;
+        h.rsv = (b[0] >> 4) & 7;
+        h.op = opcode(b[0] & 0x0f);
+        // frames from the client must be masked (RFC 6455, section 5.1)
+        if (!(b[1] & 0x80)) {
+            throw websocket::protocol_error(protocol_error, "unmasked frame");
+        }
+        uint8_t length = b[1] & 0x7f;
+        size_t extended = length == 126 ? 2 : length == 127 ? 8 : 0;
+        return _in.read_exactly(extended + sizeof(h.mask)).then([h, length, extended] (temporary_buffer<char> b) mutable {
+            if (b.size() < extended + sizeof(h.mask)) {
+                throw connection_closed();
+            }
+            h.length = extended == 2 ? read_be<uint16_t>(b.get()) : extended == 8 ? read_be<uint64_t>(b.get()) : length;
+            std::copy_n(b.get() + extended, sizeof(h.mask), h.mask);
+            return h;
+        });
+    });
+}
+
+future<temporary_buffer<char>> websocket_connection::read_payload(const frame_header& h) {
+    if (!h.length) {
+        return make_ready_future<temporary_buffer<char>>();
+    }
+    return _in.read_exactly(h.length).then([mask = h] (temporary_buffer<char> buf) {
+        if (buf.size() < mask.length) {
+            throw connection_closed();
+        }
+        auto p = buf.get_write();
+        for (size_t i = 0; i < buf.size(); i++) {
+            p[i] ^= mask.mask[i & 3];
+        }
+        return buf;
+    });
+}
+
+future<bool> websocket_connection::handle_control(opcode op, temporary_buffer<char> payload) {
+    switch (op) {
+    case opcode::ping: {
+        std::vector<temporary_buffer<char>> pong;
+        pong.push_back(std::move(payload));
+        return write_frame(opcode::pong, false, std::move(pong)).then([] {
+            return false;
+        });
+    }
+    case opcode::close: {
+        _close_received = true;
+        if (payload.size() == 1) {
+            throw websocket::protocol_error(protocol_error, "bad close frame");
+        }
+        if (payload.size() >= 2 && !valid_close_code(read_be<uint16_t>(payload.get()))) {
+            throw websocket::protocol_error(protocol_error, "bad close code");
+        }
+        // echo the code, or the lack of one (RFC 6455, section 5.5.1)
+        if (_close_sent) {
+            return make_ready_future<bool>(true);
+        }
+        _close_sent = true;
+        payload.trim(std::min<size_t>(payload.size(), 2));
+        std::vector<temporary_buffer<char>> close;
+        close.push_back(std::move(payload));
+        return write_frame(opcode::close, false, std::move(close)).then([] {
+            return true;
+        });
+    }
+    default:
+        return make_ready_future<bool>(false);
+    }
+}
+
+future<temporary_buffer<char>> websocket_connection::read_message() {
+    if (_close_received) {
+        return make_ready_future<temporary_buffer<char>>();
+    }
+    struct message {
+        std::vector<temporary_buffer<char>> fragments;
+        size_t size = 0;
+        bool started = false;
+        bool compressed = false;
+    };
+    return do_with(message(), [this] (message& m) {
+        return repeat_until_value([this, &m] {
+            return read_frame_header().then([this, &m] (frame_header h) {
+                bool control = uint8_t(h.op) & 8;
+                if (control) {
+                    if (!h.fin || h.rsv || h.length > 125 || h.op > opcode::pong) {
+                        throw websocket::protocol_error(protocol_error, "bad control frame");
+                    }
+                } else {
+                    if (h.op > opcode::binary || (h.op == opcode::continuation) != m.started) {
+                        throw websocket::protocol_error(protocol_error, "unexpected data frame");
+                    }
+                    // only the first frame of a message can be compressed
+                    if ((h.rsv & 3) || ((h.rsv & 4) && (!_deflate || m.started))) {
+                        throw websocket::protocol_error(protocol_error, "bad reserved bits");
+                    }
+                    if (h.length > _options.max_message_size - m.size) {
+                        throw websocket::protocol_error(message_too_big, "message too big");
+                    }
+                }
+                return read_payload(h).then([this, &m, h, control] (temporary_buffer<char> payload) {
+                    if (control) {
+                        return handle_control(h.op, std::move(payload)).then([] (bool closed) {
+                            return closed ? std::make_optional(temporary_buffer<char>()) : std::nullopt;
+                        });
+                    }
+                    if (!m.started) {
+                        m.started = true;
+                        m.compressed = h.rsv & 4;
+                    }
+                    m.size += payload.size();
+                    if (!payload.empty()) {
+                        m.fragments.push_back(std::move(payload));
+                    }
+                    if (!h.fin) {
+                        return make_ready_future<std::optional<temporary_buffer<char>>>();
+                    }
+                    temporary_buffer<char> msg;
+                    if (m.fragments.size() == 1) {
+                        msg = std::move(m.fragments.front());
+                    } else if (m.size) {
+                        msg = temporary_buffer<char>(m.size);
+                        auto p = msg.get_write();
+                        for (auto& f : m.fragments) {
+                            p = std::copy(f.begin(), f.end(), p);
+                        }
+                    }
+                    if (m.compressed) {
+                        msg = deflate_streams::local().inflate(std::move(msg), _options.max_message_size);
+                    }
+                    return make_ready_future<std::optional<temporary_buffer<char>>>(std::move(msg));
+                });
+            });
+        });
+    }).handle_exception([this] (std::exception_ptr ep) {
+        try {
+            std::rethrow_exception(ep);
+        } catch (connection_closed&) {
+            _close_received = true;
+            _close_sent = true;
+            return make_ready_future<temporary_buffer<char>>();
+        } catch (websocket::protocol_error& e) {
+            // fail the connection (RFC 6455, section 7.1.7)
+            _close_received = true;
+            return send_close(e.code()).then_wrapped([ep] (future<> f) {
+                f.ignore_ready_future();
+                return make_exception_future<temporary_buffer<char>>(ep);
+            });
+        } catch (...) {
+            return make_exception_future<temporary_buffer<char>>(ep);
+        }
+    });
+}
+
+future<> websocket_connection::send_message(net::packet p) {
+    if (_close_sent) {
+        return make_exception_future<>(std::runtime_error("WebSocket connection closed"));
+    }
+    auto op = _options.type == websocket::message_type::text ? opcode::text : opcode::binary;
+    auto size = p.len();
+    auto fragments = p.release();
+    if (_deflate && size >= _options.deflate_min_size) {
+        std::vector<temporary_buffer<char>> compressed;
+        compressed.push_back(deflate_streams::local().deflate(fragments, size));
+        return write_frame(op, true, std::move(compressed));
+    }
+    return write_frame(op, false, std::move(fragments));
+}
+
+future<> websocket_connection::send_close(uint16_t code) {
+    if (_close_sent) {
+        return make_ready_future<>();
+    }
+    _close_sent = true;
+    temporary_buffer<char> payload(2);
+    write_be<uint16_t>(payload.get_write(), code);
+    std::vector<temporary_buffer<char>> close;
+    close.push_back(std::move(payload));
+    return write_frame(opcode::close, false, std::move(close));
+}
+
+future<> websocket_connection::write_frame(opcode op, bool compressed, std::vector<temporary_buffer<char>> payload) {
+    uint64_t length = 0;
+    for (auto& b : payload) {
+        length += b.size();
+    }
+    // frames from the server are not masked
+    temporary_buffer<char> header(10);
+    auto h = header.get_write();
+    h[0] = 0x80 | (compressed ? 0x40 : 0) | uint8_t(op);
+    if (length < 126) {
+        h[1] = length;
+        header.trim(2);
+    } else if (length <= 0xffff) {
+        h[1] = 126;
+        write_be<uint16_t>(h + 2, length);
+        header.trim(4);
+    } else {
+        h[1] = 127;
+        write_be<uint64_t>(h + 2, length);
+    }
+    payload.insert(payload.begin(), std::move(header));
+    return with_semaphore(_write_sem, 1, [this, payload = std::move(payload)] () mutable {
+        return do_with(std::move(payload), [this] (std::vector<temporary_buffer<char>>& payload) {
+            return do_for_each(payload, [this] (temporary_buffer<char>& b) {
+                return _out.write(b.get(), b.size());
+            });
+        }).then([this] {
+            // frames queued behind this one share the flush
+            return _write_sem.waiters() ? make_ready_future<>() : _out.flush();
+        });
+    });
+}
+
+future<std::unique_ptr<reply>> websocket_handler::handle(const sstring& path,
+        std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+    // the opening handshake (RFC 6455, section 4.2)
+    auto key = req->get_header("Sec-WebSocket-Key");
+    if (req->_version != "1.1" || req->_method != "GET" || !has_token(req->get_header("Upgrade"), "websocket")
+            || !has_token(req->get_header("Connection"), "upgrade") || key.size() != 24) {
+        rep->set_status(reply::status_type::bad_request, "Not a WebSocket handshake").done("txt");
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }
+    if (req->get_header("Sec-WebSocket-Version") != "13") {
+        rep->add_header("Sec-WebSocket-Version", "13");
+        rep->set_status(reply::status_type::upgrade_required, "Unsupported WebSocket version").done("txt");
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }
+    rep->set_status(reply::status_type::switching_protocols);
+    rep->add_header("Upgrade", "websocket").add_header("Connection", "Upgrade");
+    rep->add_header("Sec-WebSocket-Accept", websocket_connection::accept_key(key));
+    bool deflate = _options.deflate && accept_deflate(req->get_header("Sec-WebSocket-Extensions"));
+    if (deflate) {
+        rep->add_header("Sec-WebSocket-Extensions", "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+    }
+    // the session may outlive the handler's registration
+    rep->switch_protocols([session = _session, options = _options, req = std::move(req), deflate]
+            (input_stream<char>& in, output_stream<char>& out) mutable {
+        auto conn = std::make_unique<websocket_connection>(in, out, std::move(options), deflate);
+        auto f = conn->process(std::move(req), session);
+        return f.finally([conn = std::move(conn), session = std::move(session)] {});
+    });
+    return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+}
+
+}
+
+}
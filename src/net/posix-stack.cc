@@ -20,14 +20,20 @@
  */
 
 #include <random>
+#include <mutex>
 
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sched.h>
+#include <linux/bpf.h>
 #include <linux/if.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <net/route.h>
 
 #include <seastar/core/loop.hh>
+#include <seastar/core/metrics.hh>
 #include <seastar/core/reactor.hh>
 #include <seastar/net/posix-stack.hh>
 #include <seastar/net/net.hh>
@@ -37,6 +43,7 @@
 #include <seastar/util/std-compat.hh>
 #include <netinet/tcp.h>
 #include <netinet/sctp.h>
+#include <linux/tls.h>
 
 namespace std {
 
@@ -91,6 +98,44 @@ class posix_connected_socket_operations {
     }
 };
 
+namespace {
+
+// Per shard accounting of memory held in posix_data_source_impl receive
+// buffers, exported as metrics. Buffers are only counted while a budget is
+// set; one freed on another shard returns its size to the allocating shard.
+struct receive_buffer_accounting {
+    size_t budget = 0;
+    size_t allocated = 0;
+    uint64_t probes = 0;
+    uint64_t clamped = 0;
+    metrics::metric_groups metrics;
+
+    receive_buffer_accounting() {
+        namespace sm = seastar::metrics;
+        metrics.add_group("posix_network", {
+            sm::make_gauge("receive_buffer_bytes", [this] { return allocated; },
+                    sm::description("Memory currently held in socket receive buffers, counted while a budget is set")),
+            sm::make_gauge("receive_buffer_budget_bytes", [this] { return budget; },
+                    sm::description("Limit on memory held in socket receive buffers, 0 if unlimited")),
+            sm::make_derive("receive_buffer_probes", probes,
+                    sm::description("Total number of receive buffers sized by querying the bytes queued in the kernel")),
+            sm::make_derive("receive_buffer_budget_clamps", clamped,
+                    sm::description("Total number of receive buffers shrunk because the budget was exhausted")),
+        });
+    }
+};
+
+receive_buffer_accounting& get_receive_buffer_accounting() {
+    static thread_local receive_buffer_accounting acct;
+    return acct;
+}
+
+}
+
+void set_receive_buffer_memory_budget(size_t bytes) {
+    get_receive_buffer_accounting().budget = bytes;
+}
+
 thread_local posix_ap_server_socket_impl::sockets_map_t posix_ap_server_socket_impl::sockets{};
 thread_local posix_ap_server_socket_impl::conn_map_t posix_ap_server_socket_impl::conn_q{};
 
@@ -248,6 +293,31 @@ class posix_connected_socket_impl final : public connected_socket_impl {
     int get_sockopt(int level, int optname, void* data, size_t len) const override {
         return _ops->get_sockopt(_fd.get_file_desc(), level, optname, data, len);
     }
+    future<> send_tls_record(uint8_t content_type, temporary_buffer<char> payload) override {
+        // The record type is passed to the kernel TLS layer as ancillary data;
+        // the payload becomes a single record of that type.
+        struct tls_record {
+            temporary_buffer<char> payload;
+            iovec iov;
+            msghdr msg = {};
+            char control[CMSG_SPACE(sizeof(uint8_t))] = {};
+        };
+        auto rec = std::make_unique<tls_record>();
+        rec->payload = std::move(payload);
+        rec->iov = { rec->payload.get_write(), rec->payload.size() };
+        rec->msg.msg_iov = &rec->iov;
+        rec->msg.msg_iovlen = 1;
+        rec->msg.msg_control = rec->control;
+        rec->msg.msg_controllen = sizeof(rec->control);
+        auto* cmsg = CMSG_FIRSTHDR(&rec->msg);
+        cmsg->cmsg_level = SOL_TLS;
+        cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint8_t));
+        *CMSG_DATA(cmsg) = content_type;
+        rec->msg.msg_controllen = cmsg->cmsg_len;
+        auto& msg = rec->msg;
+        return _fd.sendmsg(&msg).then([rec = std::move(rec)] (size_t) {});
+    }
     friend class posix_server_socket_impl;
     friend class posix_ap_server_socket_impl;
     friend class posix_reuseport_server_socket_impl;
@@ -469,6 +539,9 @@ posix_server_socket_impl::accept() {
                 return _conntrack.get_handle(ntoh(sa.as_posix_sockaddr_in().sin_port) % smp::count);
             case server_socket::load_balancing_algorithm::fixed:
                 return _conntrack.get_handle(_fixed_cpu);
+            case server_socket::load_balancing_algorithm::incoming_cpu:
+                // no per-shard listening sockets to steer to
+                return _conntrack.get_handle();
             default: abort();
             }
         } ();
@@ -549,6 +622,153 @@ posix_reuseport_server_socket_impl::abort_accept() {
     _lfd.abort_reader();
 }
 
+// The kernel side of load_balancing_algorithm::incoming_cpu: a
+// REUSEPORT_SOCKARRAY map holding the listening socket of each shard,
+// indexed by the CPU it runs on, and an SK_REUSEPORT program selecting
+// from it by the CPU processing the incoming SYN. One per listening
+// address (i.e. reuseport group), shared across shards.
+class reuseport_cpu_steering {
+    socket_address _sa;
+    file_desc _map;
+    file_desc _prog;
+
+    static int bpf(int cmd, bpf_attr& attr) {
+        return ::syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+    }
+    static file_desc create_map() {
+        bpf_attr attr = {};
+        attr.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+        attr.key_size = sizeof(uint32_t);
+        attr.value_size = sizeof(uint64_t);
+        attr.max_entries = ::get_nprocs_conf();
+        auto fd = bpf(BPF_MAP_CREATE, attr);
+        throw_system_error_on(fd == -1, "bpf(BPF_MAP_CREATE)");
+        return file_desc::from_fd(fd);
+    }
+    static file_desc load_program(int map_fd) {
+        auto insn = [](uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+            bpf_insn i = {};
+            i.code = code;
+            i.dst_reg = dst;
+            i.src_reg = src;
+            i.off = off;
+            i.imm = imm;
+            return i;
+        };
+        enum { r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10 };
+        bpf_insn prog[] = {
+            // r6 = ctx
+            insn(BPF_ALU64 | BPF_MOV | BPF_X, r6, r1, 0, 0),
+            // *(u32*)(fp - 4) = bpf_get_smp_processor_id()
+            insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_smp_processor_id),
+            insn(BPF_STX | BPF_MEM | BPF_W, r10, r0, -4, 0),
+            // bpf_sk_select_reuseport(ctx, map, fp - 4, 0)
+            insn(BPF_ALU64 | BPF_MOV | BPF_X, r1, r6, 0, 0),
+            insn(BPF_LD | BPF_DW | BPF_IMM, r2, BPF_PSEUDO_MAP_FD, 0, map_fd),
+            insn(0, 0, 0, 0, 0),
+            insn(BPF_ALU64 | BPF_MOV | BPF_X, r3, r10, 0, 0),
+            insn(BPF_ALU64 | BPF_ADD | BPF_K, r3, 0, 0, -4),
+            insn(BPF_ALU64 | BPF_MOV | BPF_K, r4, 0, 0, 0),
+            insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport),
+            // return SK_PASS. if nothing was selected (no shard on this
+            // cpu), the kernel falls back to picking a socket by hash.
+            insn(BPF_ALU64 | BPF_MOV | BPF_K, r0, 0, 0, SK_PASS),
+            insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        };
+        static const char license[] = "Apache-2.0";
+        bpf_attr attr = {};
+        attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+        attr.insns = reinterpret_cast<uintptr_t>(prog);
+        attr.insn_cnt = std::size(prog);
+        attr.license = reinterpret_cast<uintptr_t>(license);
+        auto fd = bpf(BPF_PROG_LOAD, attr);
+        throw_system_error_on(fd == -1, "bpf(BPF_PROG_LOAD)");
+        return file_desc::from_fd(fd);
+    }
+    // the groups in use, by address. shards listen concurrently, from
+    // their own threads.
+    struct registry {
+        std::mutex mutex;
+        std::unordered_map<socket_address, std::weak_ptr<reuseport_cpu_steering>> groups;
+    };
+    static registry& get_registry() {
+        static registry r;
+        return r;
+    }
+public:
+    explicit reuseport_cpu_steering(socket_address sa)
+        : _sa(std::move(sa))
+        , _map(create_map())
+        , _prog(load_program(_map.get()))
+    {}
+    ~reuseport_cpu_steering() {
+        auto& r = get_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        auto i = r.groups.find(_sa);
+        // a new group may have taken the address over already
+        if (i != r.groups.end() && i->second.expired()) {
+            r.groups.erase(i);
+        }
+    }
+    // Adds a listening socket of the group, receiving connections for `cpu`
+    void add(file_desc& fd, uint32_t cpu) {
+        uint64_t value = fd.get();
+        bpf_attr attr = {};
+        attr.map_fd = _map.get();
+        attr.key = reinterpret_cast<uintptr_t>(&cpu);
+        attr.value = reinterpret_cast<uintptr_t>(&value);
+        attr.flags = BPF_ANY;
+        throw_system_error_on(bpf(BPF_MAP_UPDATE_ELEM, attr) == -1, "bpf(BPF_MAP_UPDATE_ELEM)");
+        // attaches to the whole group. same program every time, so
+        // it does not matter which shard does it last.
+        fd.setsockopt(SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, _prog.get());
+    }
+
+    // The group of the sockets listening on sa, which lives as long as
+    // any of them does.
+    static std::shared_ptr<reuseport_cpu_steering> get(const socket_address& sa) {
+        auto& r = get_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        auto& weak = r.groups[sa];
+        auto res = weak.lock();
+        if (!res) {
+            res = std::make_shared<reuseport_cpu_steering>(sa);
+            weak = res;
+        }
+        return res;
+    }
+};
+
+void
+posix_reuseport_server_socket_impl::steer_by_incoming_cpu() {
+    auto cpu = ::sched_getcpu();
+    if (cpu < 0) {
+        return;
+    }
+    auto& fd = _lfd.get_file_desc();
+    try {
+        // Linux 6.2+ prefers the group member with a matching SO_INCOMING_CPU
+        // on its own. Older kernels ignore it.
+        fd.setsockopt(SOL_SOCKET, SO_INCOMING_CPU, cpu);
+    } catch (...) {
+    }
+    try {
+        auto steering = reuseport_cpu_steering::get(_sa);
+        steering->add(fd, cpu);
+        _steering = std::move(steering);
+    } catch (...) {
+        // no bpf (privileges, kernel). rely on the above.
+    }
+}
+
+std::unique_ptr<posix_reuseport_server_socket_impl>
+posix_reuseport_server_socket_impl::listen_by_incoming_cpu(int protocol, socket_address sa, listen_options opt,
+        std::pmr::polymorphic_allocator<char>* allocator) {
+    auto ssi = std::make_unique<posix_reuseport_server_socket_impl>(protocol, sa, engine().posix_listen(sa, opt), allocator);
+    ssi->steer_by_incoming_cpu();
+    return ssi;
+}
+
 socket_address posix_reuseport_server_socket_impl::local_address() const {
     return _lfd.get_file_desc().get_address();
 }
@@ -574,19 +794,53 @@ future<temporary_buffer<char>>
 posix_data_source_impl::get() {
     return _fd.read_some(static_cast<internal::buffer_allocator*>(this)).then([this] (temporary_buffer<char> b) {
         if (b.size() >= _config.buffer_size) {
-            _config.buffer_size *= 2;
+            // A probed read may have been far larger than the estimate; jump
+            // straight to its size rather than doubling from the minimum.
+            _config.buffer_size = std::max<size_t>(_config.buffer_size * 2, b.size());
             _config.buffer_size = std::min(_config.buffer_size, _config.max_buffer_size);
         } else if (b.size() <= _config.buffer_size / 4) {
             _config.buffer_size /= 2;
             _config.buffer_size = std::max(_config.buffer_size, _config.min_buffer_size);
         }
+        _probe_readable = _config.buffer_size <= _config.min_buffer_size;
         return b;
     });
 }
 
 temporary_buffer<char>
 posix_data_source_impl::allocate_buffer() {
-    return make_temporary_buffer<char>(_buffer_allocator, _config.buffer_size);
+    auto& acct = get_receive_buffer_accounting();
+    size_t size = _config.buffer_size;
+    int queued = 0;
+    // Only called once the fd is readable, so a zero answer means either EOF
+    // or a failed speculation; either way the minimum buffer is enough.
+    if (_probe_readable && ::ioctl(_fd.get_file_desc().get(), FIONREAD, &queued) == 0) {
+        ++acct.probes;
+        size = std::clamp<size_t>(queued, _config.min_buffer_size, _config.max_buffer_size);
+    }
+    if (!acct.budget) {
+        return make_temporary_buffer<char>(_buffer_allocator, size);
+    }
+    if (acct.allocated + size > acct.budget) {
+        auto left = acct.budget > acct.allocated ? acct.budget - acct.allocated : 0;
+        auto clamped = std::max<size_t>(left, _config.min_buffer_size);
+        if (clamped < size) {
+            size = clamped;
+            ++acct.clamped;
+        }
+    }
+    auto buf = make_temporary_buffer<char>(_buffer_allocator, size);
+    acct.allocated += size;
+    auto p = buf.get_write();
+    return temporary_buffer<char>(p, size, make_deleter(buf.release(), [owner = this_shard_id(), size] {
+        if (owner == this_shard_id()) {
+            get_receive_buffer_accounting().allocated -= size;
+        } else {
+            (void)smp::submit_to(owner, [size] {
+                get_receive_buffer_accounting().allocated -= size;
+            });
+        }
+    }));
 }
 
 future<> posix_data_source_impl::close() {
@@ -631,6 +885,9 @@ posix_data_sink_impl::close() {
 
 posix_network_stack::posix_network_stack(boost::program_options::variables_map opts, std::pmr::polymorphic_allocator<char>* allocator)
         : _reuseport(engine().posix_reuseport_available()), _allocator(allocator) {
+    if (opts.count("receive-buffer-budget")) {
+        set_receive_buffer_memory_budget(opts["receive-buffer-budget"].as<size_t>());
+    }
 }
 
 server_socket
@@ -644,6 +901,9 @@ posix_network_stack::listen(socket_address sa, listen_options opt) {
         return server_socket(std::make_unique<posix_server_socket_impl>(0, sa, engine().posix_listen(sa, opt), opt.lba, opt.fixed_cpu, _allocator));
     }
     auto protocol = static_cast<int>(opt.proto);
+    if (opt.lba == server_socket::load_balancing_algorithm::incoming_cpu) {
+        return server_socket(posix_reuseport_server_socket_impl::listen_by_incoming_cpu(protocol, sa, opt, _allocator));
+    }
     return _reuseport ?
         server_socket(std::make_unique<posix_reuseport_server_socket_impl>(protocol, sa, engine().posix_listen(sa, opt), _allocator))
         :
@@ -669,6 +929,9 @@ posix_ap_network_stack::listen(socket_address sa, listen_options opt) {
         return server_socket(std::make_unique<posix_ap_server_socket_impl>(0, sa, _allocator));
     }
     auto protocol = static_cast<int>(opt.proto);
+    if (opt.lba == server_socket::load_balancing_algorithm::incoming_cpu) {
+        return server_socket(posix_reuseport_server_socket_impl::listen_by_incoming_cpu(protocol, sa, opt, _allocator));
+    }
     return _reuseport ?
         server_socket(std::make_unique<posix_reuseport_server_socket_impl>(protocol, sa, engine().posix_listen(sa, opt), _allocator))
         :
@@ -840,8 +1103,18 @@ posix_udp_channel::receive() {
     });
 }
 
+static boost::program_options::options_description posix_stack_options() {
+    boost::program_options::options_description opts("POSIX networking stack options");
+    opts.add_options()
+        ("receive-buffer-budget",
+                boost::program_options::value<size_t>()->default_value(0),
+                "per-shard limit on memory held in socket receive buffers, in bytes (0 for unlimited)")
+        ;
+    return opts;
+}
+
 void register_posix_stack() {
-    register_network_stack("posix", boost::program_options::options_description(),
+    register_network_stack("posix", posix_stack_options(),
         [](boost::program_options::variables_map ops) {
             return smp::main_thread() ? posix_network_stack::create(ops)
                                       : posix_ap_network_stack::create(ops);
@@ -0,0 +1,546 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#include <seastar/net/shm_socket.hh>
+#include <seastar/net/stack.hh>
+#include <seastar/core/reactor.hh>
+#include <seastar/core/internal/pollable_fd.hh>
+#include <seastar/core/posix.hh>
+#include <seastar/core/align.hh>
+#include <seastar/core/bitops.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/condition-variable.hh>
+#include <seastar/core/shared_ptr.hh>
+#include <seastar/core/print.hh>
+
+#include <atomic>
+#include <array>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace seastar {
+
+namespace net {
+
+namespace {
+
+// The shared segment starts with this header, followed by the two ring
+// buffers (server to client first), each starting on a page boundary.
+struct shm_ring_state {
+    // bytes produced so far, only written by the producer
+    alignas(64) std::atomic<uint64_t> head{0};
+    // bytes consumed so far, only written by the consumer
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint32_t> producer_closed{0};
+    std::atomic<uint32_t> consumer_closed{0};
+};
+
+struct shm_endpoint_state {
+    // set by an endpoint before it waits for its doorbell, cleared by
+    // the peer when it rings the doorbell
+    alignas(64) std::atomic<uint32_t> sleeping{0};
+};
+
+enum shm_side : unsigned {
+    server_side = 0,
+    client_side = 1,
+};
+
+struct shm_segment_header {
+    shm_ring_state rings[2];            // indexed by the producing side
+    shm_endpoint_state endpoints[2];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+        "shared memory rings need address-free atomics");
+
+// Sent by the server over the unix socket, along with the descriptors of
+// the segment and of both doorbells.
+struct shm_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ring_size;
+};
+
+constexpr uint32_t shm_magic = 0x53484d52; // "SHMR"
+constexpr uint32_t shm_version = 1;
+constexpr size_t shm_hello_fds = 3;
+constexpr size_t shm_page_size = 4096;
+constexpr size_t max_read_size = 128 * 1024;
+constexpr size_t max_ring_size = size_t(1) << 30;
+
+// Ring sizes are powers of two, so that positions wrap around cleanly, and
+// at least a page, so that each ring starts on a page boundary.
+bool valid_ring_size(uint64_t ring_size) {
+    return ring_size >= shm_page_size && ring_size <= max_ring_size && !(ring_size & (ring_size - 1));
+}
+
+size_t rings_offset() {
+    return align_up(sizeof(shm_segment_header), shm_page_size);
+}
+
+size_t segment_size(size_t ring_size) {
+    return rings_offset() + 2 * ring_size;
+}
+
+struct shm_handshake {
+    shm_hello hello{};
+    iovec iov;
+    msghdr msg{};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * shm_hello_fds)];
+
+    shm_handshake() {
+        iov.iov_base = &hello;
+        iov.iov_len = sizeof(hello);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+    }
+    void set_fds(const std::array<int, shm_hello_fds>& fds) {
+        auto c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * shm_hello_fds);
+        std::memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * shm_hello_fds);
+    }
+    std::vector<file_desc> get_fds() {
+        std::vector<file_desc> fds;
+        for (auto c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            auto n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n; i++) {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+                fds.push_back(file_desc::from_fd(fd));
+            }
+        }
+        return fds;
+    }
+};
+
+// One end of a shared memory connection. Owned by the shard that created
+// it; kept alive by its users and by its two background fibers, which
+// stop() terminates.
+class shm_channel {
+    mmap_area _segment;
+    shm_segment_header* _header;
+    char* _rings[2];
+    size_t _ring_size;
+    shm_side _side;
+    pollable_fd _doorbell;
+    file_desc _peer_doorbell;
+    // the unix socket the connection was established over; the peer never
+    // writes to it, so it only becomes readable once the peer is gone
+    pollable_fd _control;
+    condition_variable _cond;
+    bool _input_shutdown = false;
+    bool _output_shutdown = false;
+    bool _peer_gone = false;
+    bool _stopped = false;
+    uint64_t _doorbell_value = 0;
+    char _control_byte = 0;
+public:
+    shm_channel(mmap_area segment, size_t ring_size, shm_side side, file_desc doorbell, file_desc peer_doorbell, pollable_fd control)
+        : _segment(std::move(segment))
+        , _header(reinterpret_cast<shm_segment_header*>(_segment.get()))
+        , _rings{_segment.get() + rings_offset(), _segment.get() + rings_offset() + ring_size}
+        , _ring_size(ring_size)
+        , _side(side)
+        , _doorbell(std::move(doorbell))
+        , _peer_doorbell(std::move(peer_doorbell))
+        , _control(std::move(control)) {
+    }
+
+    void start(lw_shared_ptr<shm_channel> self) {
+        (void)repeat([this] {
+            return _doorbell.read_some(reinterpret_cast<char*>(&_doorbell_value), sizeof(_doorbell_value)).then([this] (size_t) {
+                _cond.broadcast();
+                return _stopped ? stop_iteration::yes : stop_iteration::no;
+            });
+        }).handle_exception([] (std::exception_ptr) {}).finally([self] {});
+        (void)_control.read_some(&_control_byte, 1).then_wrapped([this] (future<size_t> f) {
+            f.ignore_ready_future();
+            _peer_gone = true;
+            _cond.broadcast();
+        }).finally([self] {});
+    }
+
+    void stop() {
+        _stopped = true;
+        shutdown_input();
+        shutdown_output();
+        _doorbell.abort_reader();
+        _control.abort_reader();
+    }
+
+    void shutdown_input() {
+        if (!_input_shutdown) {
+            _input_shutdown = true;
+            in_ring().consumer_closed.store(1);
+            notify_peer();
+            _cond.broadcast();
+        }
+    }
+
+    void shutdown_output() {
+        if (!_output_shutdown) {
+            _output_shutdown = true;
+            out_ring().producer_closed.store(1);
+            notify_peer();
+            _cond.broadcast();
+        }
+    }
+
+    future<temporary_buffer<char>> read() {
+        return wait([this] { return readable() || input_done(); }).then([this] {
+            auto& r = in_ring();
+            auto tail = r.tail.load(std::memory_order_relaxed);
+            auto available = r.head.load() - tail;
+            if (_input_shutdown) {
+                return temporary_buffer<char>();
+            }
+            // head is written by the peer, so it is not to be trusted
+            if (available > _ring_size) {
+                fail("shared memory connection peer produced more than the ring holds");
+            }
+            auto n = std::min<uint64_t>(available, max_read_size);
+            if (!n) {
+                return temporary_buffer<char>();
+            }
+            temporary_buffer<char> buf(n);
+            copy_from_ring(in_data(), tail, buf.get_write(), n);
+            r.tail.store(tail + n);
+            notify_peer();
+            return buf;
+        });
+    }
+
+    future<> write(net::packet p) {
+        return do_with(std::move(p), size_t(0), size_t(0), [this] (net::packet& p, size_t& frag, size_t& offset) {
+            return repeat([this, &p, &frag, &offset] {
+                if (frag == p.nr_frags()) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                return wait([this] { return writable() || output_done(); }).then([this, &p, &frag, &offset] {
+                    if (output_done()) {
+                        throw std::system_error(EPIPE, std::system_category());
+                    }
+                    auto& r = out_ring();
+                    auto head = r.head.load(std::memory_order_relaxed);
+                    // tail is written by the peer, so it is not to be trusted
+                    auto used = head - r.tail.load();
+                    if (used > _ring_size) {
+                        fail("shared memory connection peer consumed more than was produced");
+                    }
+                    auto space = _ring_size - used;
+                    while (space && frag != p.nr_frags()) {
+                        auto& f = p.frag(frag);
+                        auto n = std::min(space, f.size - offset);
+                        copy_to_ring(out_data(), head, f.base + offset, n);
+                        head += n;
+                        space -= n;
+                        offset += n;
+                        if (offset == f.size) {
+                            ++frag;
+                            offset = 0;
+                        }
+                    }
+                    r.head.store(head);
+                    notify_peer();
+                    return stop_iteration::no;
+                });
+            });
+        });
+    }
+
+private:
+    shm_ring_state& in_ring() {
+        return _header->rings[1 - _side];
+    }
+    shm_ring_state& out_ring() {
+        return _header->rings[_side];
+    }
+    char* in_data() {
+        return _rings[1 - _side];
+    }
+    char* out_data() {
+        return _rings[_side];
+    }
+
+    bool readable() {
+        auto& r = in_ring();
+        return r.head.load() != r.tail.load(std::memory_order_relaxed);
+    }
+    bool writable() {
+        // a tail past head makes this true too, so that write() notices
+        auto& r = out_ring();
+        return r.head.load(std::memory_order_relaxed) - r.tail.load() != _ring_size;
+    }
+    bool input_done() {
+        return _input_shutdown || _peer_gone || in_ring().producer_closed.load();
+    }
+    bool output_done() {
+        return _output_shutdown || _peer_gone || out_ring().consumer_closed.load();
+    }
+
+    void copy_from_ring(const char* ring, uint64_t pos, char* dst, size_t n) {
+        auto offset = pos % _ring_size;
+        auto first = std::min(n, _ring_size - offset);
+        std::memcpy(dst, ring + offset, first);
+        std::memcpy(dst + first, ring, n - first);
+    }
+    void copy_to_ring(char* ring, uint64_t pos, const char* src, size_t n) {
+        auto offset = pos % _ring_size;
+        auto first = std::min(n, _ring_size - offset);
+        std::memcpy(ring + offset, src, first);
+        std::memcpy(ring, src + first, n - first);
+    }
+
+    [[noreturn]] void fail(const char* what) {
+        shutdown_input();
+        shutdown_output();
+        throw std::runtime_error(what);
+    }
+
+    void notify_peer() {
+        if (_header->endpoints[1 - _side].sleeping.exchange(0)) {
+            uint64_t one = 1;
+            // cannot block: the counter would have to overflow first
+            (void)::write(_peer_doorbell.get(), &one, sizeof(one));
+        }
+    }
+
+    // Waits until pred() holds. Our sleeping flag is raised before
+    // re-checking, so that the peer rings the doorbell for any update it
+    // makes after that check.
+    template <typename Pred>
+    future<> wait(Pred pred) {
+        return _cond.wait([this, pred = std::move(pred)] {
+            if (pred()) {
+                return true;
+            }
+            _header->endpoints[_side].sleeping.store(1);
+            return pred();
+        });
+    }
+};
+
+// Stops the channel once the socket and both streams are gone.
+class shm_channel_handle {
+    lw_shared_ptr<shm_channel> _channel;
+public:
+    explicit shm_channel_handle(lw_shared_ptr<shm_channel> ch) : _channel(std::move(ch)) {}
+    ~shm_channel_handle() {
+        _channel->stop();
+    }
+    shm_channel& channel() {
+        return *_channel;
+    }
+};
+
+class shm_data_source_impl final : public data_source_impl {
+    lw_shared_ptr<shm_channel_handle> _h;
+public:
+    explicit shm_data_source_impl(lw_shared_ptr<shm_channel_handle> h) : _h(std::move(h)) {}
+    future<temporary_buffer<char>> get() override {
+        return _h->channel().read();
+    }
+    future<> close() override {
+        _h->channel().shutdown_input();
+        return make_ready_future<>();
+    }
+};
+
+class shm_data_sink_impl final : public data_sink_impl {
+    lw_shared_ptr<shm_channel_handle> _h;
+public:
+    explicit shm_data_sink_impl(lw_shared_ptr<shm_channel_handle> h) : _h(std::move(h)) {}
+    future<> put(net::packet p) override {
+        return _h->channel().write(std::move(p));
+    }
+    future<> close() override {
+        _h->channel().shutdown_output();
+        return make_ready_future<>();
+    }
+};
+
+class shm_connected_socket_impl final : public connected_socket_impl {
+    lw_shared_ptr<shm_channel_handle> _h;
+public:
+    explicit shm_connected_socket_impl(lw_shared_ptr<shm_channel_handle> h) : _h(std::move(h)) {}
+    data_source source() override {
+        return data_source(std::make_unique<shm_data_source_impl>(_h));
+    }
+    data_sink sink() override {
+        return data_sink(std::make_unique<shm_data_sink_impl>(_h));
+    }
+    void shutdown_input() override {
+        _h->channel().shutdown_input();
+    }
+    void shutdown_output() override {
+        _h->channel().shutdown_output();
+    }
+    // there is no Nagle or keepalive to speak of, accept and ignore
+    void set_nodelay(bool nodelay) override {}
+    bool get_nodelay() const override {
+        return true;
+    }
+    void set_keepalive(bool keepalive) override {}
+    bool get_keepalive() const override {
+        return false;
+    }
+    void set_keepalive_parameters(const keepalive_params&) override {}
+    keepalive_params get_keepalive_parameters() const override {
+        return tcp_keepalive_params{std::chrono::seconds(0), std::chrono::seconds(0), 0};
+    }
+    void set_sockopt(int level, int optname, const void* data, size_t len) override {
+        throw std::runtime_error("Setting custom socket options is not supported for shared memory connections");
+    }
+    int get_sockopt(int level, int optname, void* data, size_t len) const override {
+        throw std::runtime_error("Getting custom socket options is not supported for shared memory connections");
+    }
+};
+
+connected_socket make_shm_connected_socket(mmap_area segment, size_t ring_size, shm_side side, file_desc doorbell, file_desc peer_doorbell, pollable_fd control) {
+    auto ch = make_lw_shared<shm_channel>(std::move(segment), ring_size, side, std::move(doorbell), std::move(peer_doorbell), std::move(control));
+    ch->start(ch);
+    auto h = make_lw_shared<shm_channel_handle>(std::move(ch));
+    return connected_socket(std::make_unique<shm_connected_socket_impl>(std::move(h)));
+}
+
+class shm_server_socket_impl final : public server_socket_impl {
+    pollable_fd _listener;
+    socket_address _sa;
+    size_t _ring_size;
+public:
+    shm_server_socket_impl(pollable_fd listener, socket_address sa, size_t ring_size)
+        : _listener(std::move(listener)), _sa(std::move(sa)), _ring_size(ring_size) {
+    }
+    future<accept_result> accept() override {
+        return _listener.accept().then([ring_size = _ring_size] (std::tuple<pollable_fd, socket_address> fd_sa) {
+            auto control = std::move(std::get<0>(fd_sa));
+            auto sa = std::move(std::get<1>(fd_sa));
+            auto size = segment_size(ring_size);
+            int mfd = ::memfd_create("seastar-shm-rpc", MFD_CLOEXEC);
+            throw_system_error_on(mfd == -1, "memfd_create");
+            auto segment_fd = file_desc::from_fd(mfd);
+            segment_fd.truncate(size);
+            auto segment = segment_fd.map_shared_rw(size, 0);
+            new (segment.get()) shm_segment_header();
+            auto server_doorbell = file_desc::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            auto client_doorbell = file_desc::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            auto hs = std::make_unique<shm_handshake>();
+            hs->hello = shm_hello{shm_magic, shm_version, ring_size};
+            hs->set_fds({segment_fd.get(), server_doorbell.get(), client_doorbell.get()});
+            auto f = control.sendmsg(&hs->msg);
+            return f.then([hs = std::move(hs), control, sa = std::move(sa), ring_size,
+                    segment_fd = std::move(segment_fd), segment = std::move(segment),
+                    server_doorbell = std::move(server_doorbell), client_doorbell = std::move(client_doorbell)] (size_t n) mutable {
+                if (n != sizeof(shm_hello)) {
+                    throw std::runtime_error("short write of shared memory connection handshake");
+                }
+                // the client has its own copies of the segment and doorbell
+                // descriptors now; we only need to ring its doorbell
+                return accept_result{make_shm_connected_socket(std::move(segment), ring_size, server_side,
+                        std::move(server_doorbell), std::move(client_doorbell), std::move(control)), std::move(sa)};
+            });
+        });
+    }
+    void abort_accept() override {
+        _listener.abort_reader();
+    }
+    socket_address local_address() const override {
+        return _sa;
+    }
+};
+
+class shm_socket_impl final : public socket_impl {
+    pollable_fd _fd;
+public:
+    future<connected_socket> connect(socket_address sa, socket_address local, transport proto) override {
+        if (!sa.is_af_unix()) {
+            return make_exception_future<connected_socket>(std::invalid_argument("shared memory connections need a unix domain address"));
+        }
+        _fd = engine().make_pollable_fd(sa, 0);
+        return engine().posix_connect(_fd, sa, socket_address()).then([fd = _fd] () mutable {
+            auto hs = std::make_unique<shm_handshake>();
+            auto f = fd.recvmsg(&hs->msg);
+            return f.then([fd, hs = std::move(hs)] (size_t n) mutable {
+                auto fds = hs->get_fds();
+                if (n != sizeof(shm_hello) || hs->hello.magic != shm_magic || fds.size() != shm_hello_fds) {
+                    throw std::runtime_error("bad shared memory connection handshake");
+                }
+                if (hs->hello.version != shm_version) {
+                    throw std::runtime_error(format("unsupported shared memory connection version {}", hs->hello.version));
+                }
+                auto ring_size = hs->hello.ring_size;
+                if (!valid_ring_size(ring_size)) {
+                    throw std::runtime_error(format("bad shared memory connection ring size {}", ring_size));
+                }
+                // touching pages past the end of the segment would be fatal
+                if (fds[0].size() < segment_size(ring_size)) {
+                    throw std::runtime_error("shared memory connection segment is too small");
+                }
+                auto segment = fds[0].map_shared_rw(segment_size(ring_size), 0);
+                return make_shm_connected_socket(std::move(segment), ring_size, client_side,
+                        std::move(fds[2]), std::move(fds[1]), std::move(fd));
+            });
+        });
+    }
+    void set_reuseaddr(bool reuseaddr) override {}
+    bool get_reuseaddr() const override {
+        return false;
+    }
+    void shutdown() override {
+        if (_fd) {
+            _fd.shutdown(SHUT_RDWR);
+        }
+    }
+};
+
+}
+
+server_socket shm_listen(socket_address sa, shm_listen_options opts) {
+    if (!sa.is_af_unix()) {
+        throw std::invalid_argument("shared memory connections need a unix domain address");
+    }
+    if (opts.ring_size > max_ring_size) {
+        throw std::invalid_argument(format("shared memory ring size {} is over the maximum of {}", opts.ring_size, max_ring_size));
+    }
+    auto ring_size = size_t(1) << log2ceil(std::max(opts.ring_size, shm_page_size));
+    return server_socket(std::make_unique<shm_server_socket_impl>(engine().posix_listen(sa), sa, ring_size));
+}
+
+::seastar::socket make_shm_socket() {
+    return ::seastar::socket(std::make_unique<shm_socket_impl>());
+}
+
+}
+
+}
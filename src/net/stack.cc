@@ -141,6 +141,11 @@ net::connected_socket_impl::source(connected_socket_input_stream_config csisc) {
     return source();
 }
 
+future<>
+net::connected_socket_impl::send_tls_record(uint8_t content_type, temporary_buffer<char> payload) {
+    return make_exception_future<>(std::system_error(ENOTSUP, std::system_category()));
+}
+
 socket::~socket()
 {}
 
@@ -22,6 +22,8 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #include <system_error>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
 
 #include <seastar/core/loop.hh>
 #include <seastar/core/reactor.hh>
@@ -33,6 +35,8 @@
 #include <seastar/core/timer.hh>
 #include <seastar/core/print.hh>
 #include <seastar/core/with_timeout.hh>
+#include <seastar/core/with_scheduling_group.hh>
+#include <seastar/core/metrics.hh>
 #include <seastar/net/tls.hh>
 #include <seastar/net/stack.hh>
 #include <seastar/util/std-compat.hh>
@@ -49,6 +53,9 @@ class net::get_impl {
     static std::unique_ptr<connected_socket_impl> get(connected_socket s) {
         return std::move(s._csi);
     }
+    static connected_socket_impl* maybe_get_ptr(connected_socket& s) {
+        return s._csi.get();
+    }
 };
 
 class blob_wrapper: public gnutls_datum_t {
@@ -136,6 +143,37 @@ class gnutls_error_category : public std::error_category {
 
 static const gnutls_error_category glts_errorc;
 
+namespace {
+
+// Per shard handshake accounting, exported as metrics.
+struct tls_stats {
+    uint64_t full_handshakes[2] = {};
+    uint64_t resumed_handshakes[2] = {};
+    metrics::metric_groups metrics;
+
+    tls_stats() {
+        namespace sm = seastar::metrics;
+        static auto role = sm::label("role");
+        for (auto t : { tls::session_type::CLIENT, tls::session_type::SERVER }) {
+            auto i = size_t(t);
+            auto role_label = role(t == tls::session_type::CLIENT ? "client" : "server");
+            metrics.add_group("tls", {
+                sm::make_derive("full_handshakes", full_handshakes[i],
+                        sm::description("Total number of completed full TLS handshakes"), {role_label}),
+                sm::make_derive("resumed_handshakes", resumed_handshakes[i],
+                        sm::description("Total number of completed TLS handshakes resuming a previous session"), {role_label}),
+            });
+        }
+    }
+};
+
+tls_stats& get_tls_stats() {
+    static thread_local tls_stats stats;
+    return stats;
+}
+
+}
+
 // Checks a gnutls return value.
 // < 0 -> error.
 static void gtls_chk(int res) {
@@ -392,6 +430,78 @@ class tls::certificate_credentials::impl: public gnutlsobj {
     void set_dn_verification_callback(dn_callback cb) {
         _dn_callback = std::move(cb);
     }
+    void set_kernel_tls_offload(bool enable) {
+        _kernel_tls = enable;
+    }
+    bool get_kernel_tls_offload() const {
+        return _kernel_tls;
+    }
+    void set_alpn_protocols(std::vector<sstring> protocols) {
+        _alpn_protocols = std::move(protocols);
+    }
+    void enable_session_tickets(const blob& key, std::chrono::seconds lifetime) {
+        // gnutls only accepts keys generated by gnutls_session_ticket_key_generate
+        static constexpr size_t ticket_key_size = 64;
+        if (key.size() != ticket_key_size) {
+            throw std::invalid_argument("Invalid session ticket key size");
+        }
+        _ticket_key = sstring(key.data(), key.size());
+        _ticket_lifetime = lifetime;
+    }
+    void disable_session_tickets() {
+        _ticket_key = {};
+    }
+    void set_handshake_scheduling_group(scheduling_group sg) {
+        _handshake_sg = sg;
+    }
+    void set_max_concurrent_handshakes(size_t n, std::chrono::milliseconds timeout) {
+        // handshakes in progress keep the semaphore they got their turn
+        // from, and return their units to it
+        _handshake_sem = n ? make_lw_shared<semaphore>(n) : nullptr;
+        _handshake_timeout = timeout;
+    }
+    // Runs func (the handshake) subject to the handshake scheduling
+    // group and concurrency limit, if any. With a limit, abort is called
+    // if func does not complete in time, and must make it fail, so that
+    // a stalled peer gives its turn up.
+    template<typename Func, typename Abort>
+    future<> run_handshake(Func func, Abort abort) {
+        auto run = [this, func = std::move(func), abort = std::move(abort)]() mutable {
+            if (auto sem = _handshake_sem) {
+                return with_semaphore(*sem, 1, [timeout = _handshake_timeout, func = std::move(func), abort = std::move(abort)] () mutable {
+                    auto deadline = std::make_unique<timer<>>(std::move(abort));
+                    deadline->arm(timeout);
+                    return func().finally([deadline = std::move(deadline)] {});
+                }).finally([sem] {});
+            }
+            return func();
+        };
+        if (_handshake_sg) {
+            return with_scheduling_group(*_handshake_sg, std::move(run));
+        }
+        return run();
+    }
+    // client side cache of resumption data, by server name
+    void set_session_cache_size(size_t size) {
+        _session_cache_size = size;
+        while (_session_cache.size() > size) {
+            _session_cache.erase(_session_cache.begin());
+        }
+    }
+    const sstring* get_cached_session(const sstring& name) const {
+        auto i = _session_cache.find(name);
+        return i != _session_cache.end() ? &i->second : nullptr;
+    }
+    void cache_session(const sstring& name, sstring data) {
+        if (_session_cache_size == 0) {
+            return;
+        }
+        if (_session_cache.size() >= _session_cache_size && !_session_cache.count(name)) {
+            // no point in being clever. any entry will do.
+            _session_cache.erase(_session_cache.begin());
+        }
+        _session_cache[name] = std::move(data);
+    }
 private:
     friend class credentials_builder;
     friend class session;
@@ -413,6 +523,15 @@ class tls::certificate_credentials::impl: public gnutlsobj {
     std::unique_ptr<std::remove_pointer_t<gnutls_priority_t>, void(*)(gnutls_priority_t)> _priority;
     client_auth _client_auth = client_auth::NONE;
     bool _load_system_trust = false;
+    bool _kernel_tls = false;
+    std::vector<sstring> _alpn_protocols;
+    sstring _ticket_key;
+    std::chrono::seconds _ticket_lifetime {};
+    size_t _session_cache_size = 0;
+    std::unordered_map<sstring, sstring> _session_cache;
+    std::optional<scheduling_group> _handshake_sg;
+    lw_shared_ptr<semaphore> _handshake_sem;
+    std::chrono::milliseconds _handshake_timeout{};
     semaphore _system_trust_sem {1};
     dn_callback _dn_callback;
 };
@@ -492,6 +611,18 @@ void tls::certificate_credentials::set_dn_verification_callback(dn_callback cb)
     _impl->set_dn_verification_callback(std::move(cb));
 }
 
+void tls::certificate_credentials::set_kernel_tls_offload(bool enable) {
+    _impl->set_kernel_tls_offload(enable);
+}
+
+void tls::certificate_credentials::set_session_cache_size(size_t size) {
+    _impl->set_session_cache_size(size);
+}
+
+void tls::certificate_credentials::set_alpn_protocols(std::vector<sstring> protocols) {
+    _impl->set_alpn_protocols(std::move(protocols));
+}
+
 tls::server_credentials::server_credentials()
 #if GNUTLS_VERSION_NUMBER < 0x030600
     : server_credentials(dh_params{})
@@ -514,6 +645,32 @@ void tls::server_credentials::set_client_auth(client_auth ca) {
     _impl->set_client_auth(ca);
 }
 
+void tls::server_credentials::enable_session_tickets(const blob& key, std::chrono::seconds lifetime) {
+    _impl->enable_session_tickets(key, lifetime);
+}
+
+void tls::server_credentials::disable_session_tickets() {
+    _impl->disable_session_tickets();
+}
+
+void tls::server_credentials::set_handshake_scheduling_group(scheduling_group sg) {
+    _impl->set_handshake_scheduling_group(sg);
+}
+
+void tls::server_credentials::set_max_concurrent_handshakes(size_t n, std::chrono::milliseconds timeout) {
+    _impl->set_max_concurrent_handshakes(n, timeout);
+}
+
+sstring tls::generate_session_ticket_key() {
+    gnutlsobj init;
+    gnutls_datum_t key;
+    gtls_chk(gnutls_session_ticket_key_generate(&key));
+    sstring res(reinterpret_cast<const char*>(key.data), key.size);
+    gnutls_memset(key.data, 0, key.size);
+    gnutls_free(key.data);
+    return res;
+}
+
 static const sstring dh_level_key = "dh_level";
 static const sstring x509_trust_key = "x509_trust";
 static const sstring x509_crl_key = "x509_crl";
@@ -616,6 +773,34 @@ void tls::credentials_builder::set_priority_string(const sstring& prio) {
     _priority = prio;
 }
 
+void tls::credentials_builder::set_kernel_tls_offload(bool enable) {
+    _kernel_tls = enable;
+}
+
+void tls::credentials_builder::enable_session_tickets(std::chrono::seconds lifetime) {
+    // generated here, so that all copies of the builder, i.e. typically
+    // all shards, end up with the same key.
+    _ticket_key = generate_session_ticket_key();
+    _ticket_lifetime = lifetime;
+}
+
+void tls::credentials_builder::set_session_cache_size(size_t size) {
+    _session_cache_size = size;
+}
+
+void tls::credentials_builder::set_alpn_protocols(std::vector<sstring> protocols) {
+    _alpn_protocols = std::move(protocols);
+}
+
+void tls::credentials_builder::set_handshake_scheduling_group(scheduling_group sg) {
+    _handshake_sg = sg;
+}
+
+void tls::credentials_builder::set_max_concurrent_handshakes(size_t n, std::chrono::milliseconds timeout) {
+    _max_concurrent_handshakes = n;
+    _handshake_timeout = timeout;
+}
+
 template<typename Blobs, typename Visitor>
 static void visit_blobs(Blobs& blobs, Visitor&& visitor) {
     auto visit = [&](const sstring& key, auto* vt) {
@@ -663,6 +848,16 @@ void tls::credentials_builder::apply_to(certificate_credentials& creds) const {
     }
 
     creds._impl->set_client_auth(_client_auth);
+    creds._impl->set_kernel_tls_offload(_kernel_tls);
+    creds._impl->set_session_cache_size(_session_cache_size);
+    creds._impl->set_alpn_protocols(_alpn_protocols);
+    if (!_ticket_key.empty()) {
+        creds._impl->enable_session_tickets(blob(_ticket_key), _ticket_lifetime);
+    }
+    if (_handshake_sg) {
+        creds._impl->set_handshake_scheduling_group(*_handshake_sg);
+    }
+    creds._impl->set_max_concurrent_handshakes(_max_concurrent_handshakes, _handshake_timeout);
 }
 
 shared_ptr<tls::certificate_credentials> tls::credentials_builder::build_certificate_credentials() const {
@@ -936,10 +1131,42 @@ class session : public enable_lw_shared_from_this<session> {
             gtls_chk(gnutls_priority_set(*this, prio));
         }
 
+        if (!_creds->_alpn_protocols.empty()) {
+            // gnutls copies the names
+            std::vector<gnutls_datum_t> protocols;
+            for (auto& p : _creds->_alpn_protocols) {
+                protocols.push_back(blob_wrapper(p));
+            }
+            gtls_chk(gnutls_alpn_set_protocols(*this, protocols.data(), protocols.size(),
+                    _type == type::SERVER ? GNUTLS_ALPN_SERVER_PRECEDENCE : 0));
+        }
+
         gnutls_transport_set_ptr(*this, this);
         gnutls_transport_set_vec_push_function(*this, &vec_push_wrapper);
         gnutls_transport_set_pull_function(*this, &pull_wrapper);
 
+        if (_type == type::SERVER && !_creds->_ticket_key.empty()) {
+            blob_wrapper key(_creds->_ticket_key);
+            gtls_chk(gnutls_session_ticket_enable_server(*this, &key));
+            // gnutls derives the actual ticket encryption key from the
+            // master key and current time, rotating it every expiration
+            // period. Since all shards share the master key, they rotate
+            // in lock step and accept each other's tickets.
+            gnutls_db_set_cache_expiration(*this, _creds->_ticket_lifetime.count());
+        }
+        if (_type == type::CLIENT && !_hostname.empty()) {
+            auto data = _creds->get_cached_session(_hostname);
+            if (data) {
+                // failure just means full handshake
+                gnutls_session_set_data(*this, data->data(), data->size());
+            }
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+            // TLS 1.3 tickets arrive after the handshake
+            gnutls_handshake_set_hook_function(*this, GNUTLS_HANDSHAKE_NEW_SESSION_TICKET,
+                    GNUTLS_HOOK_POST, &new_session_ticket_wrapper);
+#endif
+        }
+
         // This would be nice, because we preferably want verification to
         // abort hand shake so peer immediately knows we bailed...
 #if GNUTLS_VERSION_NUMBER >= 0x030406
@@ -1010,12 +1237,26 @@ class session : public enable_lw_shared_from_this<session> {
                 verify();
             }
             _connected = true;
+            handshake_done();
             // make sure we reset output_pending
-            return wait_for_output();
+            return wait_for_output().then([this] {
+                // all handshake records are now with the socket, so
+                // the kernel can take over the record layer from here.
+                maybe_enable_ktls();
+            });
         } catch (...) {
             return make_exception_future<>(std::current_exception());
         }
     }
+    future<std::optional<sstring>> get_alpn_protocol() {
+        return handshake().then([me = shared_from_this()] {
+            gnutls_datum_t proto;
+            if (gnutls_alpn_get_selected_protocol(*me, &proto) != GNUTLS_E_SUCCESS) {
+                return std::optional<sstring>();
+            }
+            return std::optional<sstring>(sstring(reinterpret_cast<const char*>(proto.data), proto.size));
+        });
+    }
     future<> handshake() {
         // maybe load system certificates before handshake, in case we
         // have not done so yet...
@@ -1026,12 +1267,151 @@ class session : public enable_lw_shared_from_this<session> {
         }
         // acquire both semaphores to sync both read & write
         return with_semaphore(_in_sem, 1, [this] {
-            return with_semaphore(_out_sem, 1, [this] {
-                return do_handshake();
+            if (_connected) {
+                // someone else got here first
+                return make_ready_future<>();
+            }
+            return _creds->run_handshake([this] {
+                return with_semaphore(_out_sem, 1, [this] {
+                    return do_handshake();
+                });
+            }, [this] {
+                // wakes up the handshake, if waiting for the peer
+                _handshake_timed_out = true;
+                _sock->shutdown_input();
+                _sock->shutdown_output();
+            }).handle_exception([this] (std::exception_ptr ep) {
+                if (_handshake_timed_out) {
+                    return make_exception_future<>(std::system_error(ETIMEDOUT, std::system_category(), "TLS handshake timed out"));
+                }
+                return make_exception_future<>(std::move(ep));
             });
         });
     }
 
+    void handshake_done() {
+        auto& stats = get_tls_stats();
+        auto i = size_t(_type == type::CLIENT ? session_type::CLIENT : session_type::SERVER);
+        if (gnutls_session_is_resumed(*this)) {
+            ++stats.resumed_handshakes[i];
+        } else {
+            ++stats.full_handshakes[i];
+        }
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+        if (gnutls_protocol_get_version(*this) == GNUTLS_TLS1_3) {
+            return; // see new_session_ticket_wrapper
+        }
+#endif
+        cache_session_data();
+    }
+    void cache_session_data() {
+        if (_type != type::CLIENT || _hostname.empty()) {
+            return;
+        }
+        gnutls_datum_t data;
+        if (gnutls_session_get_data2(*this, &data) == GNUTLS_E_SUCCESS) {
+            _creds->cache_session(_hostname, sstring(reinterpret_cast<const char*>(data.data), data.size));
+            gnutls_free(data.data);
+        }
+    }
+
+    union ktls_crypto_info {
+        tls_crypto_info info;
+        tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+        tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+    };
+
+    // Fills in kernel TLS parameters from the current gnutls write state.
+    // Returns the size of the filled in struct, or zero if the negotiated
+    // protocol/cipher cannot be handled by the kernel.
+    size_t get_ktls_crypto_info(ktls_crypto_info& ci) {
+        uint16_t version;
+        switch (gnutls_protocol_get_version(*this)) {
+        case GNUTLS_TLS1_2:
+            version = TLS_1_2_VERSION;
+            break;
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+        case GNUTLS_TLS1_3:
+            version = TLS_1_3_VERSION;
+            break;
+#endif
+        default:
+            return 0;
+        }
+
+        gnutls_datum_t mac_key, iv, cipher_key;
+        unsigned char seq[8];
+        gtls_chk(gnutls_record_get_state(*this, 0, &mac_key, &iv, &cipher_key, seq));
+
+        auto fill = [&](auto& info, uint16_t cipher_type) -> size_t {
+            constexpr size_t salt_size = sizeof(info.salt);
+            constexpr size_t iv_size = sizeof(info.iv);
+            if (cipher_key.size != sizeof(info.key)) {
+                return 0;
+            }
+            if (iv.size == salt_size + iv_size) {
+                // full nonce (TLS 1.3, or chacha20 in TLS 1.2)
+                std::copy_n(iv.data, salt_size, info.salt);
+                std::copy_n(iv.data + salt_size, iv_size, info.iv);
+            } else if (iv.size == salt_size && iv_size == sizeof(seq)) {
+                // TLS 1.2 AES-GCM: implicit salt, explicit nonce is the sequence number
+                std::copy_n(iv.data, salt_size, info.salt);
+                std::copy_n(seq, iv_size, info.iv);
+            } else {
+                return 0;
+            }
+            info.info.version = version;
+            info.info.cipher_type = cipher_type;
+            std::copy_n(cipher_key.data, sizeof(info.key), info.key);
+            std::copy_n(seq, sizeof(info.rec_seq), info.rec_seq);
+            return sizeof(info);
+        };
+
+        switch (gnutls_cipher_get(*this)) {
+        case GNUTLS_CIPHER_AES_128_GCM:
+            return fill(ci.aes_gcm_128, TLS_CIPHER_AES_GCM_128);
+        case GNUTLS_CIPHER_AES_256_GCM:
+            return fill(ci.aes_gcm_256, TLS_CIPHER_AES_GCM_256);
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        case GNUTLS_CIPHER_CHACHA20_POLY1305:
+            return fill(ci.chacha20_poly1305, TLS_CIPHER_CHACHA20_POLY1305);
+#endif
+        default:
+            return 0;
+        }
+    }
+
+    // Hands the negotiated transmit keys to the kernel (kTLS) so that
+    // record encryption for outgoing data happens in the kernel and
+    // writes go straight to the socket. Receiving stays in gnutls, since
+    // the kernel reports non-data records (alerts, post-handshake messages)
+    // only as ancillary data which our sources do not look at.
+    // Falls back silently to userspace encryption if the stack, the kernel
+    // or the negotiated cipher does not support it.
+    void maybe_enable_ktls() {
+        if (!_creds->get_kernel_tls_offload() || _ktls_tx) {
+            return;
+        }
+        try {
+            ktls_crypto_info ci = {};
+            auto size = get_ktls_crypto_info(ci);
+            if (size == 0) {
+                return;
+            }
+            static constexpr char ulp_name[] = "tls";
+            socket().set_sockopt(SOL_TCP, TCP_ULP, ulp_name, sizeof(ulp_name));
+            // An installed ULP without keys just passes data through,
+            // so failing here leaves the connection usable.
+            socket().set_sockopt(SOL_TLS, TLS_TX, &ci, size);
+            _ktls_tx = true;
+        } catch (...) {
+            // not supported. keep doing it in userspace.
+        }
+    }
+
     size_t in_avail() const {
         return _input.size();
     }
@@ -1069,6 +1449,18 @@ class session : public enable_lw_shared_from_this<session> {
             return GNUTLS_E_CERTIFICATE_ERROR;
         }
     }
+#endif
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+    static int new_session_ticket_wrapper(gnutls_session_t gs, unsigned, unsigned, unsigned, const gnutls_datum_t*) {
+        try {
+            if (gnutls_protocol_get_version(gs) == GNUTLS_TLS1_3) {
+                from_transport_ptr(gnutls_transport_get_ptr(gs))->cache_session_data();
+            }
+        } catch (...) {
+            // only an optimization
+        }
+        return 0;
+    }
 #endif
     static ssize_t vec_push_wrapper(gnutls_transport_ptr_t ptr, const giovec_t * iov, int iovcnt) {
         return from_transport_ptr(ptr)->vec_push(iov, iovcnt);
@@ -1174,6 +1566,11 @@ class session : public enable_lw_shared_from_this<session> {
                     // Our input buffer should be empty now, so just go again
                     return do_get();
                 case GNUTLS_E_REHANDSHAKE:
+                    if (_ktls_tx) {
+                        // gnutls no longer owns the write state, so we cannot
+                        // renegotiate. Ignoring the request is allowed.
+                        return do_get();
+                    }
                     // server requests new HS. must release semaphore, so set new state
                     // and return nada.
                     _connected = false;
@@ -1231,6 +1628,12 @@ class session : public enable_lw_shared_from_this<session> {
                return put(std::move(p));
             });
         }
+        if (_ktls_tx) {
+            // kernel does the record encryption
+            return with_semaphore(_out_sem, 1, [this, p = std::move(p)]() mutable {
+                return _out.put(std::move(p));
+            });
+        }
         auto i = p.fragments().begin();
         auto e = p.fragments().end();
         return with_semaphore(_out_sem, 1, std::bind(&session::do_put, this, i, e)).finally([p = std::move(p)] {});
@@ -1252,6 +1655,13 @@ class session : public enable_lw_shared_from_this<session> {
         return n;
     }
     ssize_t vec_push(const giovec_t * iov, int iovcnt) {
+        if (_ktls_tx) {
+            // gnutls wants to write a record (e.g. a TLS 1.3 key update
+            // response) using its own, now stale, write state. The kernel
+            // would wrap it as data, so fail the session instead.
+            gnutls_transport_set_errno(*this, EIO);
+            return -1;
+        }
         if (!_output_pending.available()) {
             gnutls_transport_set_errno(*this, EAGAIN);
             return -1;
@@ -1301,6 +1711,19 @@ class session : public enable_lw_shared_from_this<session> {
         if (_error || !_connected) {
             return make_ready_future();
         }
+        if (_ktls_tx) {
+            // gnutls cannot encrypt the alert with the kernel's sequence
+            // numbers, so send close_notify (warning level) through kTLS.
+            static constexpr uint8_t alert_record_type = 21;
+            static constexpr char close_notify[] = { 1, 0 };
+            return wait_for_output().then([this] {
+                return socket().send_tls_record(alert_record_type,
+                        temporary_buffer<char>(close_notify, sizeof(close_notify)));
+            }).handle_exception([this](auto ep) {
+                _error = true;
+                return make_exception_future(ep);
+            });
+        }
         auto res = gnutls_bye(*this, GNUTLS_SHUT_WR);
         if (res < 0) {
             switch (res) {
@@ -1404,6 +1827,8 @@ class session : public enable_lw_shared_from_this<session> {
     bool _shutdown = false;
     bool _connected = false;
     bool _error = false;
+    bool _ktls_tx = false;
+    bool _handshake_timed_out = false;
 
     future<> _output_pending;
     buf_type _input;
@@ -1602,6 +2027,14 @@ future<connected_socket> tls::wrap_server(shared_ptr<server_credentials> cred, c
     return make_ready_future<connected_socket>(std::move(sock));
 }
 
+future<std::optional<sstring>> tls::get_alpn_protocol(connected_socket& s) {
+    auto impl = dynamic_cast<tls_connected_socket_impl*>(net::get_impl::maybe_get_ptr(s));
+    if (!impl) {
+        return make_ready_future<std::optional<sstring>>();
+    }
+    return impl->_session->get_alpn_protocol();
+}
+
 server_socket tls::listen(shared_ptr<server_credentials> creds, socket_address sa, listen_options opts) {
     return listen(std::move(creds), seastar::listen(sa, opts));
 }
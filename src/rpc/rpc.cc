@@ -1,7 +1,11 @@
 #include <seastar/rpc/rpc.hh>
+#include "rpc/stream_mux.hh"
 #include <seastar/core/align.hh>
 #include <seastar/core/seastar.hh>
+#include <seastar/core/sleep.hh>
+#include <seastar/core/bitops.hh>
 #include <seastar/core/print.hh>
+#include <seastar/core/metrics.hh>
 #include <seastar/core/future-util.hh>
 #include <seastar/util/defer.hh>
 #include <boost/range/adaptor/map.hpp>
@@ -64,6 +68,91 @@ namespace rpc {
       }
   }
 
+  temporary_buffer<char> share_rcv_buf(rcv_buf& buf, const char* p, size_t size) {
+      auto share_from = [p, size] (temporary_buffer<char>& b) -> std::optional<temporary_buffer<char>> {
+          if (p >= b.get() && p + size <= b.get() + b.size()) {
+              return b.share(p - b.get(), size);
+          }
+          return std::nullopt;
+      };
+      if (auto* one = std::get_if<temporary_buffer<char>>(&buf.bufs)) {
+          if (auto r = share_from(*one)) {
+              return std::move(*r);
+          }
+      } else {
+          for (auto&& b : std::get<std::vector<temporary_buffer<char>>>(buf.bufs)) {
+              if (auto r = share_from(b)) {
+                  return std::move(*r);
+              }
+          }
+      }
+      throw std::logic_error("rpc: shared range is not within the received buffer");
+  }
+
+  fragmented_bytes::fragmented_bytes(temporary_buffer<char> buf) : _size(buf.size()) {
+      if (_size) {
+          _fragments.push_back(std::move(buf));
+      }
+  }
+
+  fragmented_bytes::fragmented_bytes(std::vector<temporary_buffer<char>> fragments) : _fragments(std::move(fragments)) {
+      _fragments.erase(std::remove_if(_fragments.begin(), _fragments.end(), [] (auto& f) { return f.empty(); }), _fragments.end());
+      for (auto&& f : _fragments) {
+          _size += f.size();
+      }
+  }
+
+  fragmented_bytes fragmented_bytes::share() {
+      std::vector<temporary_buffer<char>> fragments;
+      fragments.reserve(_fragments.size());
+      for (auto&& f : _fragments) {
+          fragments.push_back(f.share());
+      }
+      return fragmented_bytes(std::move(fragments));
+  }
+
+  temporary_buffer<char> fragmented_bytes::linearize() {
+      if (_fragments.empty()) {
+          return temporary_buffer<char>();
+      }
+      if (_fragments.size() == 1) {
+          return _fragments.front().share();
+      }
+      temporary_buffer<char> ret(_size);
+      auto p = ret.get_write();
+      for (auto&& f : _fragments) {
+          p = std::copy(f.begin(), f.end(), p);
+      }
+      return ret;
+  }
+
+  bool fragmented_bytes::operator==(const fragmented_bytes& x) const noexcept {
+      if (_size != x._size) {
+          return false;
+      }
+      // compare fragment by fragment, the two sides may be split differently
+      auto a = _fragments.begin();
+      auto b = x._fragments.begin();
+      size_t a_pos = 0, b_pos = 0;
+      while (a != _fragments.end()) {
+          auto n = std::min(a->size() - a_pos, b->size() - b_pos);
+          if (!std::equal(a->get() + a_pos, a->get() + a_pos + n, b->get() + b_pos)) {
+              return false;
+          }
+          a_pos += n;
+          b_pos += n;
+          if (a_pos == a->size()) {
+              ++a;
+              a_pos = 0;
+          }
+          if (b_pos == b->size()) {
+              ++b;
+              b_pos = 0;
+          }
+      }
+      return true;
+  }
+
   // Make a copy of a remote buffer. No data is actually copied, only pointers and
   // a deleter of a new buffer takes care of deleting the original buffer
   template<typename T> // T is either snd_buf or rcv_buf
@@ -93,11 +182,84 @@ namespace rpc {
   template snd_buf make_shard_local_buffer_copy(foreign_ptr<std::unique_ptr<snd_buf>>);
   template rcv_buf make_shard_local_buffer_copy(foreign_ptr<std::unique_ptr<rcv_buf>>);
 
-  snd_buf connection::compress(snd_buf buf) {
+  // Set in the compression header of frames that are sent as is; the rest
+  // of the header is the frame size.
+  static constexpr uint32_t uncompressed_frame_flag = 1u << 31;
+
+  static snd_buf prepend_compression_header(snd_buf buf, uint32_t header) {
+      temporary_buffer<char> h(4);
+      write_le<uint32_t>(h.get_write(), header);
+      std::vector<temporary_buffer<char>> bufs;
+      if (auto one = std::get_if<temporary_buffer<char>>(&buf.bufs)) {
+          bufs.reserve(2);
+          bufs.push_back(std::move(h));
+          bufs.push_back(std::move(*one));
+      } else {
+          auto& old = std::get<std::vector<temporary_buffer<char>>>(buf.bufs);
+          bufs.reserve(old.size() + 1);
+          bufs.push_back(std::move(h));
+          std::move(old.begin(), old.end(), std::back_inserter(bufs));
+      }
+      return snd_buf(std::move(bufs), buf.size + 4);
+  }
+
+  connection::verb_compression& connection::get_verb_compression(uint64_t verb) {
+      if (_last_verb_compression < _verb_compression.size() && _verb_compression[_last_verb_compression].verb == verb) {
+          return _verb_compression[_last_verb_compression];
+      }
+      auto i = std::find_if(_verb_compression.begin(), _verb_compression.end(), [verb] (const verb_compression& vc) {
+          return vc.verb == verb;
+      });
+      if (i == _verb_compression.end()) {
+          i = _verb_compression.emplace(_verb_compression.end(), verb);
+      }
+      _last_verb_compression = i - _verb_compression.begin();
+      return *i;
+  }
+
+  std::unordered_map<uint64_t, stats::compression_stats> connection::get_compression_stats() const {
+      std::unordered_map<uint64_t, stats::compression_stats> res;
+      for (auto& vc : _verb_compression) {
+          res.emplace(vc.verb, vc.accounting);
+      }
+      return res;
+  }
+
+  bool connection::should_compress(verb_compression& vc, size_t size) {
+      if (!_uncompressed_frames_negotiated || !_adaptive_compression.enabled) {
+          return true;
+      }
+      if (size < _adaptive_compression.min_size) {
+          return false;
+      }
+      if (vc.ratio > _adaptive_compression.max_ratio && ++vc.skipped < _adaptive_compression.probe_interval) {
+          return false;
+      }
+      vc.skipped = 0;
+      return true;
+  }
+
+  snd_buf connection::compress(snd_buf buf, uint64_t verb) {
       if (_compressor) {
+          auto& vc = get_verb_compression(verb);
+          auto& cs = vc.accounting;
+          auto size = buf.size;
+          if (!should_compress(vc, size)) {
+              ++cs.bypassed;
+              return prepend_compression_header(std::move(buf), size | uncompressed_frame_flag);
+          }
+          auto start = std::chrono::steady_clock::now();
           buf = _compressor->compress(4, std::move(buf));
+          cs.wall_time += std::chrono::steady_clock::now() - start;
           static_assert(snd_buf::chunk_size >= 4, "send buffer chunk size is too small");
           write_le<uint32_t>(buf.front().get_write(), buf.size - 4);
+          ++cs.compressed;
+          cs.uncompressed_bytes += size;
+          cs.compressed_bytes += buf.size - 4;
+          if (_adaptive_compression.enabled && size) {
+              auto ratio = double(buf.size - 4) / size;
+              vc.ratio = vc.ratio ? 0.75 * vc.ratio + 0.25 * ratio : ratio;
+          }
           return buf;
       }
       return buf;
@@ -117,6 +279,111 @@ namespace rpc {
       }
   }
 
+  connection::outgoing_queue::iterator connection::outgoing_queue::push(unsigned group, float shares, snd_buf buf, uint64_t verb) {
+      auto& g = _groups[group];
+      if (g.entries.empty()) {
+          // an idle group does not save up time to burst with later
+          g.vtime = std::max(g.vtime, _vtime);
+          g.shares = shares;
+      }
+      g.entries.emplace_back(std::move(buf), verb);
+      _size++;
+      return std::prev(g.entries.end());
+  }
+
+  void connection::outgoing_queue::erase(unsigned group, iterator it) {
+      _groups[group].entries.erase(it);
+      _size--;
+  }
+
+  connection::outgoing_entry connection::outgoing_queue::pop() {
+      group_queue* next = nullptr;
+      for (auto& g : _groups) {
+          if (!g.entries.empty() && (!next || g.vtime < next->vtime)) {
+              next = &g;
+          }
+      }
+      auto d = std::move(next->entries.front());
+      next->entries.pop_front();
+      _size--;
+      _vtime = next->vtime;
+      next->vtime += d.buf.size / next->shares;
+      return d;
+  }
+
+  void connection::outgoing_queue::clear() {
+      for (auto& g : _groups) {
+          g.entries.clear();
+      }
+      _size = 0;
+  }
+
+  // Removes the next entry from the outgoing queue and prepares its frame
+  // for the wire.
+  template<connection::outgoing_queue_type QueueType>
+  connection::outgoing_entry connection::pop_outgoing() {
+      auto d = _outgoing_queue.pop();
+      d.t.cancel(); // cancel timeout timer
+      if (d.pcancel) {
+          d.pcancel->cancel_send = std::function<void()>(); // request is no longer cancellable
+      }
+      if (QueueType == outgoing_queue_type::request) {
+          static_assert(snd_buf::chunk_size >= 8, "send buffer chunk size is too small");
+          if (_timeout_negotiated) {
+              auto expire = d.t.get_timeout();
+              uint64_t left = 0;
+              if (expire != typename timer<rpc_clock_type>::time_point()) {
+                  left = std::chrono::duration_cast<std::chrono::milliseconds>(expire - timer<rpc_clock_type>::clock::now()).count();
+              }
+              write_le<uint64_t>(d.buf.front().get_write(), left);
+          } else {
+              d.buf.front().trim_front(8);
+              d.buf.size -= 8;
+          }
+      }
+      d.buf = compress(std::move(d.buf), d.verb);
+      return d;
+  }
+
+  // Writes queued frames until the queue is drained (after waiting for
+  // the batching window once) or max_bytes is reached, then flushes them
+  // all at once. Entries are kept alive until the flush completes, so
+  // their senders are only notified once the data is on the wire.
+  template<connection::outgoing_queue_type QueueType>
+  future<> connection::send_batch() {
+      return do_with(std::vector<outgoing_entry>(), size_t(0), false, [this] (std::vector<outgoing_entry>& batch, size_t& bytes, bool& waited) {
+          return repeat([this, &batch, &bytes, &waited] {
+              if (bytes >= _write_batching.max_bytes) {
+                  return make_ready_future<stop_iteration>(stop_iteration::yes);
+              }
+              if (_outgoing_queue.empty()) {
+                  if (waited || batch.empty() || _write_batching.window == std::chrono::microseconds(0)) {
+                      return make_ready_future<stop_iteration>(stop_iteration::yes);
+                  }
+                  waited = true;
+                  return sleep(_write_batching.window).then([] {
+                      return stop_iteration::no;
+                  });
+              }
+              batch.push_back(pop_outgoing<QueueType>());
+              bytes += batch.back().buf.size;
+              return send_buffer(std::move(batch.back().buf)).then([this] {
+                  _stats.sent_messages++;
+                  return stop_iteration::no;
+              });
+          }).then([this, &batch] {
+              if (batch.empty()) {
+                  return make_ready_future<>();
+              }
+              _stats.write_batches++;
+              _stats.write_batch_sizes[std::min<size_t>(log2floor(batch.size()), _stats.write_batch_sizes.size() - 1)]++;
+              return _write_buf.flush();
+          }).finally([&batch] {
+              batch.clear();
+          });
+      });
+  }
+
   template<connection::outgoing_queue_type QueueType>
   void connection::send_loop() {
       _send_loop_stopped = do_until([this] { return _error; }, [this] {
@@ -127,29 +394,14 @@ namespace rpc {
               if (_outgoing_queue.empty()) {
                   return make_ready_future();
               }
-              auto d = std::move(_outgoing_queue.front());
-              _outgoing_queue.pop_front();
-              d.t.cancel(); // cancel timeout timer
-              if (d.pcancel) {
-                  d.pcancel->cancel_send = std::function<void()>(); // request is no longer cancellable
+              if (_write_batching.enabled) {
+                  return send_batch<QueueType>();
               }
-              if (QueueType == outgoing_queue_type::request) {
-                  static_assert(snd_buf::chunk_size >= 8, "send buffer chunk size is too small");
-                  if (_timeout_negotiated) {
-                      auto expire = d.t.get_timeout();
-                      uint64_t left = 0;
-                      if (expire != typename timer<rpc_clock_type>::time_point()) {
-                          left = std::chrono::duration_cast<std::chrono::milliseconds>(expire - timer<rpc_clock_type>::clock::now()).count();
-                      }
-                      write_le<uint64_t>(d.buf.front().get_write(), left);
-                  } else {
-                      d.buf.front().trim_front(8);
-                      d.buf.size -= 8;
-                  }
-              }
-              d.buf = compress(std::move(d.buf));
+              auto d = pop_outgoing<QueueType>();
               auto f = send_buffer(std::move(d.buf)).then([this] {
                   _stats.sent_messages++;
+                  _stats.write_batches++;
+                  _stats.write_batch_sizes[0]++;
                   return _write_buf.flush();
               });
               return f.finally([d = std::move(d)] {});
@@ -208,32 +460,47 @@ namespace rpc {
       });
   }
 
-  future<> connection::send(snd_buf buf, std::optional<rpc_clock_type::time_point> timeout, cancellable* cancel) {
+  future<> connection::send(snd_buf buf, std::optional<rpc_clock_type::time_point> timeout, cancellable* cancel, uint64_t verb) {
       if (!_error) {
           if (timeout && *timeout <= rpc_clock_type::now()) {
               return make_ready_future<>();
           }
-          _outgoing_queue.emplace_back(std::move(buf));
-          auto deleter = [this, it = std::prev(_outgoing_queue.cend())] {
-              _outgoing_queue.erase(it);
+          unsigned group = 0;
+          float shares = 1;
+          // stream frames are sent without waiting for each other and must
+          // not be reordered, whichever group they are sent from
+          if (_fair_outgoing_queue && !_is_stream && verb != stream_mux_verb) {
+              auto sg = current_scheduling_group();
+              group = internal::scheduling_group_index(sg);
+              shares = sg.get_shares();
+          }
+          auto it = _outgoing_queue.push(group, shares, std::move(buf), verb);
+          auto deleter = [this, group, it] {
+              _outgoing_queue.erase(group, it);
           };
           if (timeout) {
-              auto& t = _outgoing_queue.back().t;
+              auto& t = it->t;
               t.set_callback(deleter);
               t.arm(timeout.value());
           }
           if (cancel) {
               cancel->cancel_send = std::move(deleter);
-              cancel->send_back_pointer = &_outgoing_queue.back().pcancel;
-              _outgoing_queue.back().pcancel = cancel;
+              cancel->send_back_pointer = &it->pcancel;
+              it->pcancel = cancel;
           }
           _outgoing_queue_cond.signal();
-          return _outgoing_queue.back().p->get_future();
+          return it->p->get_future();
       } else {
           return make_exception_future<>(closed_error());
       }
   }
 
+  connection::~connection() {
+      if (_stream_mux) {
+          _stream_mux->abort();
+      }
+  }
+
   void connection::abort() {
       if (!_error) {
           _error = true;
@@ -377,12 +644,18 @@ namespace rpc {
               }
               auto ptr = compress_header.get();
               auto size = read_le<uint32_t>(ptr);
+              if (_uncompressed_frames_negotiated && (size & uncompressed_frame_flag)) {
+                  // the peer skipped compression, the frame follows as is
+                  return read_frame<FrameType>(info, in);
+              }
               return read_rcv_buf(in, size).then([this, size, &compressor, info] (rcv_buf compressed_data) {
                   if (compressed_data.size != size) {
                       _logger(info, format("unexpected eof on a {} while reading compressed data: expected {:d} got {:d}", FrameType::role(), size, compressed_data.size));
                       return FrameType::empty_value();
                   }
+                  auto start = std::chrono::steady_clock::now();
                   auto eb = compressor->decompress(std::move(compressed_data));
+                  _stats.decompression_time += std::chrono::steady_clock::now() - start;
                   net::packet p;
                   auto* one = std::get_if<temporary_buffer<char>>(&eb.bufs);
                   if (one) {
@@ -537,10 +810,18 @@ namespace rpc {
           case protocol_features::TIMEOUT:
               _timeout_negotiated = true;
               break;
+          case protocol_features::UNCOMPRESSED_FRAMES:
+              _uncompressed_frames_negotiated = true;
+              break;
           case protocol_features::CONNECTION_ID: {
               _id = deserialize_connection_id(e.second);
               break;
           }
+          case protocol_features::STREAM_MULTIPLEX: {
+              auto [window, max_chunk] = stream_mux::deserialize_options(e.second);
+              _stream_mux = std::make_shared<stream_mux>(*this, true, window, max_chunk);
+              break;
+          }
           default:
               // nothing to do
               ;
@@ -640,6 +921,13 @@ namespace rpc {
       }
   }
 
+  socket client::stream_socket(socket s) {
+      if (_stream_mux && _stream_mux->is_open()) {
+          return _stream_mux->make_socket();
+      }
+      return s;
+  }
+
   void client::deregister_this_stream() {
       if (_parent) {
           _parent->_streams.erase(_id);
@@ -649,6 +937,9 @@ namespace rpc {
   client::client(const logger& l, void* s, client_options ops, socket socket, const socket_address& addr, const socket_address& local)
   : rpc::connection(l, s), _socket(std::move(socket)), _server_addr(addr), _options(ops) {
        _socket.set_reuseaddr(ops.reuseaddr);
+       _adaptive_compression = ops.adaptive_compression;
+       _write_batching = ops.write_batching;
+       _fair_outgoing_queue = ops.fair_outgoing_queue;
       // Run client in the background.
       // Communicate result via _stopped.
       // The caller has to call client::stop() to synchronize.
@@ -663,6 +954,7 @@ namespace rpc {
           feature_map features;
           if (_options.compressor_factory) {
               features[protocol_features::COMPRESS] = _options.compressor_factory->supported();
+              features[protocol_features::UNCOMPRESSED_FRAMES] = "";
           }
           if (_options.send_timeout_data) {
               features[protocol_features::TIMEOUT] = "";
@@ -673,6 +965,10 @@ namespace rpc {
           if (!_options.isolation_cookie.empty()) {
               features[protocol_features::ISOLATION] = _options.isolation_cookie;
           }
+          if (_options.stream_multiplexing.enabled) {
+              features[protocol_features::STREAM_MULTIPLEX] = stream_mux::serialize_options(
+                      _options.stream_multiplexing.window, _options.stream_multiplexing.max_chunk);
+          }
 
           return send_negotiation_frame(std::move(features)).then([this] {
                return negotiate_protocol(_read_buf);
@@ -690,6 +986,8 @@ namespace rpc {
                       auto it = _outstanding.find(std::abs(msg_id));
                       if (!data) {
                           _error = true;
+                      } else if (msg_id == 0 && _stream_mux) {
+                          _stream_mux->receive(std::move(data.value()));
                       } else if (it != _outstanding.end()) {
                           auto handler = std::move(it->second);
                           _outstanding.erase(it);
@@ -725,6 +1023,9 @@ namespace rpc {
           }
           _error = true;
           _stream_queue.abort(std::make_exception_ptr(stream_closed()));
+          if (_stream_mux) {
+              _stream_mux->abort();
+          }
           return stop_send_loop().then_wrapped([this] (future<> f) {
               f.ignore_ready_future();
               _outstanding.clear();
@@ -776,6 +1077,13 @@ namespace rpc {
               _timeout_negotiated = true;
               ret[protocol_features::TIMEOUT] = "";
               break;
+          case protocol_features::UNCOMPRESSED_FRAMES:
+              // features are processed in order, so COMPRESS was already negotiated
+              if (_compressor) {
+                  _uncompressed_frames_negotiated = true;
+                  ret[protocol_features::UNCOMPRESSED_FRAMES] = "";
+              }
+              break;
           case protocol_features::STREAM_PARENT: {
               if (!_server._options.streaming_domain) {
                   f = make_exception_future<>(std::runtime_error("streaming is not configured for the server"));
@@ -806,6 +1114,21 @@ namespace rpc {
               ret.emplace(e);
               break;
           }
+          case protocol_features::STREAM_MULTIPLEX: {
+              // channels become stream connections of their own, which need
+              // the streaming domain to find their parent
+              if (_server._options.streaming_domain && !_is_stream) {
+                  // the client goes by what we reply with
+                  auto [window, max_chunk] = stream_mux::deserialize_options(e.second);
+                  window = std::min(window, _server._options.max_stream_window);
+                  max_chunk = std::min(max_chunk, _server._options.max_stream_chunk);
+                  _stream_mux = std::make_shared<stream_mux>(*this, false, window, max_chunk, [this] (connected_socket fd) {
+                      _server.add_connection(std::move(fd), peer_address());
+                  });
+                  ret[protocol_features::STREAM_MULTIPLEX] = stream_mux::serialize_options(window, max_chunk);
+              }
+              break;
+          }
           default:
               // nothing to do
               ;
@@ -877,13 +1200,59 @@ namespace rpc {
       }
   }
 
+  future<resource_permit>
+  server::connection::wait_for_resources_or_shed(size_t memory_consumed, rpc_clock_type::time_point timeout) {
+      auto& sem = _server._resources_available;
+      auto now = rpc_clock_type::now();
+      if (timeout <= now) {
+          _stats.shed_expired++;
+          return make_exception_future<resource_permit>(semaphore_timed_out());
+      }
+      bool queued = sem.waiters() || sem.available_units() < ssize_t(memory_consumed);
+      if (!queued) {
+          _server.sample_queue_wait(now, rpc_clock_type::duration(0));
+          return get_units(sem, memory_consumed, timeout);
+      }
+      if (timeout - now < _server.queue_wait_estimate(now)) {
+          _stats.shed_overloaded++;
+          return make_exception_future<resource_permit>(overloaded_error());
+      }
+      return get_units(sem, memory_consumed, timeout).then_wrapped([this, now] (future<resource_permit> f) {
+          if (f.failed()) {
+              // waited as long as the client allowed, which says nothing
+              // about how long the queue takes
+              _stats.shed_timed_out++;
+          } else {
+              auto end = rpc_clock_type::now();
+              _server.sample_queue_wait(end, end - now);
+          }
+          return f;
+      });
+  }
+
+  void server::connection::send_overloaded_reply(std::optional<rpc_clock_type::time_point> timeout, int64_t msg_id, uint64_t verb) {
+      // the reply is small and takes no resources, there are none to spare
+      snd_buf data(20);
+      static_assert(snd_buf::chunk_size >= 20, "send buffer chunk size is too small");
+      auto p = data.front().get_write() + 12;
+      write_le<uint32_t>(p, uint32_t(exception_type::OVERLOADED));
+      write_le<uint32_t>(p + 4, uint32_t(0));
+      // This is safe since connection::stop() will wait for background work.
+      (void)try_with_gate(_server._reply_gate, [this, timeout, msg_id, verb, data = std::move(data)] () mutable {
+          auto c = shared_from_this();
+          return respond(-msg_id, std::move(data), timeout, verb).handle_exception([c = std::move(c), msg_id] (std::exception_ptr eptr) {
+              c->get_logger()(c->info(), msg_id, format("got exception while replying to a shed message: {}", eptr));
+          });
+      }).handle_exception_type([] (gate_closed_exception&) {/* ignore */});
+  }
+
   future<>
-  server::connection::respond(int64_t msg_id, snd_buf&& data, std::optional<rpc_clock_type::time_point> timeout) {
+  server::connection::respond(int64_t msg_id, snd_buf&& data, std::optional<rpc_clock_type::time_point> timeout, uint64_t verb) {
       static_assert(snd_buf::chunk_size >= 12, "send buffer chunk size is too small");
       auto p = data.front().get_write();
       write_le<int64_t>(p, msg_id);
       write_le<uint32_t>(p + 8, data.size - 12);
-      return send(std::move(data), timeout);
+      return send(std::move(data), timeout, nullptr, verb);
   }
 
 future<> server::connection::send_unknown_verb_reply(std::optional<rpc_clock_type::time_point> timeout, int64_t msg_id, uint64_t type) {
@@ -929,6 +1298,10 @@ future<> server::connection::send_unknown_verb_reply(std::optional<rpc_clock_typ
                       if (expire && *expire) {
                           timeout = relative_timeout_to_absolute(std::chrono::milliseconds(*expire));
                       }
+                      if (type == stream_mux_verb && _stream_mux) {
+                          _stream_mux->receive(std::move(data.value()));
+                          return make_ready_future<>();
+                      }
                       auto h = _server._proto->get_handler(type);
                       if (!h) {
                           return send_unknown_verb_reply(timeout, msg_id, type);
@@ -955,6 +1328,9 @@ future<> server::connection::send_unknown_verb_reply(std::optional<rpc_clock_typ
           _fd.shutdown_input();
           _error = true;
           _stream_queue.abort(std::make_exception_ptr(stream_closed()));
+          if (_stream_mux) {
+              _stream_mux->abort();
+          }
           return stop_send_loop().then_wrapped([this] (future<> f) {
               f.ignore_ready_future();
               _server._conns.erase(get_connection_id());
@@ -974,6 +1350,9 @@ future<> server::connection::send_unknown_verb_reply(std::optional<rpc_clock_typ
   server::connection::connection(server& s, connected_socket&& fd, socket_address&& addr, const logger& l, void* serializer, connection_id id)
       : rpc::connection(std::move(fd), l, serializer, id), _server(s) {
       _info.addr = std::move(addr);
+      _adaptive_compression = _server._options.adaptive_compression;
+      _write_batching = _server._options.write_batching;
+      _fair_outgoing_queue = _server._options.fair_outgoing_queue;
   }
 
   future<> server::connection::deregister_this_stream() {
@@ -994,6 +1373,43 @@ future<> server::connection::send_unknown_verb_reply(std::optional<rpc_clock_typ
 
   thread_local std::unordered_map<streaming_domain_type, server*> server::_servers;
 
+  verb_stats& verb_metrics::get(uint64_t verb) {
+      auto it = _verbs.find(verb);
+      if (it != _verbs.end()) {
+          return *it->second;
+      }
+      auto& vs = *_verbs.emplace(verb, std::make_unique<verb_stats>()).first->second;
+      namespace sm = seastar::metrics;
+      static auto protocol_label = sm::label("protocol");
+      static auto verb_label = sm::label("verb");
+      std::vector<sm::label_instance> labels{protocol_label(_name), verb_label(verb)};
+      _metrics.add_group("rpc", {
+          sm::make_histogram("server_queue_wait_latency", sm::description("Time requests waited for memory before their handler ran, in microseconds"), labels,
+                  [&vs] { return vs.queue_wait.to_metrics_histogram(); }),
+          sm::make_histogram("server_handler_latency", sm::description("Time handlers took to produce a reply, in microseconds"), labels,
+                  [&vs] { return vs.handler.to_metrics_histogram(); }),
+          sm::make_histogram("client_round_trip_latency", sm::description("Time from sending a request until its reply arrived, in microseconds"), labels,
+                  [&vs] { return vs.round_trip.to_metrics_histogram(); }),
+          sm::make_gauge("server_in_flight", sm::description("Number of handlers currently running"), labels,
+                  [&vs] { return vs.server_in_flight; }),
+          sm::make_gauge("client_in_flight", sm::description("Number of requests waiting for a reply"), labels,
+                  [&vs] { return vs.client_in_flight; }),
+      });
+      return vs;
+  }
+
+  const verb_stats* verb_metrics::find(uint64_t verb) const {
+      auto it = _verbs.find(verb);
+      return it != _verbs.end() ? it->second.get() : nullptr;
+  }
+
+  void protocol_base::enable_verb_metrics(sstring name) {
+      if (_verb_metrics) {
+          throw std::logic_error("rpc verb metrics are already enabled");
+      }
+      _verb_metrics = std::make_unique<verb_metrics>(std::move(name));
+  }
+
   server::server(protocol_base* proto, const socket_address& addr, resource_limits limits)
       : server(proto, seastar::listen(addr, listen_options{true}), limits, server_options{})
   {}
@@ -1018,23 +1434,26 @@ future<> server::connection::send_unknown_verb_reply(std::optional<rpc_clock_typ
           : server(proto, std::move(ss), limits, opts)
   {}
 
+  rpc_clock_type::duration server::queue_wait_estimate(rpc_clock_type::time_point now) const {
+      auto halvings = (now - _queue_wait_sampled) / queue_wait_half_life;
+      if (halvings <= 0) {
+          return _queue_wait_estimate;
+      }
+      return halvings < 32 ? _queue_wait_estimate / (int64_t(1) << halvings) : rpc_clock_type::duration(0);
+  }
+
+  void server::sample_queue_wait(rpc_clock_type::time_point now, rpc_clock_type::duration waited) {
+      _queue_wait_estimate = (queue_wait_estimate(now) * 7 + waited) / 8;
+      _queue_wait_sampled = now;
+  }
+
   void server::accept() {
       // Run asynchronously in background.
       // Communicate result via __ss_stopped.
       // The caller has to call server::stop() to synchronize.
       (void)keep_doing([this] () mutable {
           return _ss.accept().then([this] (accept_result ar) mutable {
-              auto fd = std::move(ar.connection);
-              auto addr = std::move(ar.remote_address);
-              fd.set_nodelay(_options.tcp_nodelay);
-              connection_id id = _options.streaming_domain ?
-                      connection_id::make_id(_next_client_id++, uint16_t(this_shard_id())) :
-                      connection_id::make_invalid_id(_next_client_id++);
-              auto conn = _proto->make_server_connection(*this, std::move(fd), std::move(addr), id);
-              auto r = _conns.emplace(id, conn);
-              assert(r.second);
-              // Process asynchronously in background.
-              (void)conn->process();
+              add_connection(std::move(ar.connection), std::move(ar.remote_address));
           });
       }).then_wrapped([this] (future<>&& f){
           try {
@@ -1046,6 +1465,18 @@ future<> server::connection::send_unknown_verb_reply(std::optional<rpc_clock_typ
       });
   }
 
+  void server::add_connection(connected_socket fd, socket_address addr) {
+      fd.set_nodelay(_options.tcp_nodelay);
+      connection_id id = _options.streaming_domain ?
+              connection_id::make_id(_next_client_id++, uint16_t(this_shard_id())) :
+              connection_id::make_invalid_id(_next_client_id++);
+      auto conn = _proto->make_server_connection(*this, std::move(fd), std::move(addr), id);
+      auto r = _conns.emplace(id, conn);
+      assert(r.second);
+      // Process asynchronously in background.
+      (void)conn->process();
+  }
+
   future<> server::stop() {
       _ss.abort_accept();
       _resources_available.broken();
@@ -0,0 +1,402 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#include "rpc/stream_mux.hh"
+#include <seastar/core/loop.hh>
+#include <seastar/core/print.hh>
+
+namespace seastar {
+
+namespace rpc {
+
+using namespace net;
+
+stream_channel::stream_channel(stream_mux& mux, uint64_t id, size_t window)
+        : _mux(&mux), _id(id), _window(window), _send_credits(window) {
+}
+
+stream_channel::~stream_channel() {
+    if (_mux) {
+        _mux->remove(_id);
+        // tell the peer unless both directions were closed cleanly
+        if (!_peer_gone && !(_rcv_eof && _output_shut)) {
+            (void)_mux->send(mux_op::abort, _id, 0).handle_exception([] (std::exception_ptr) {});
+        }
+    }
+}
+
+future<temporary_buffer<char>> stream_channel::read() {
+    return _rcv_cond.wait([this] { return !_rcv.empty() || _rcv_eof || _input_shut || !_mux; }).then([this] {
+        if (!_mux && !_rcv_eof) {
+            throw closed_error();
+        }
+        if (_rcv.empty()) {
+            return temporary_buffer<char>();
+        }
+        auto b = std::move(_rcv.front());
+        _rcv.pop_front();
+        _rcv_buffered -= b.size();
+        _rcv_unacked += b.size();
+        // return credit in batches, not for every buffer, but all of it once
+        // the reader caught up: the sender may be waiting for a whole chunk
+        if (_rcv_unacked >= _window / 2 || _rcv.empty()) {
+            return_credit();
+        }
+        return b;
+    });
+}
+
+future<> stream_channel::write(net::packet p) {
+    if (!_mux || _output_shut || _peer_gone) {
+        return make_exception_future<>(closed_error());
+    }
+    auto size = p.len();
+    return write_chunks(p.release(), size);
+}
+
+future<> stream_channel::write_chunks(std::vector<temporary_buffer<char>> bufs, size_t size) {
+    return do_with(std::move(bufs), size, size_t(0), [this, self = shared_from_this()] (std::vector<temporary_buffer<char>>& bufs, size_t& left, size_t& next) {
+        return do_until([&left] { return left == 0; }, [this, &bufs, &left, &next] {
+            if (!_mux || _output_shut) {
+                return make_exception_future<>(closed_error());
+            }
+            auto n = std::min({left, _mux->max_chunk(), _window});
+            return _send_credits.wait(n).then([this, &bufs, &left, &next, n] {
+                if (!_mux) {
+                    return make_exception_future<>(closed_error());
+                }
+                std::vector<temporary_buffer<char>> chunk;
+                size_t taken = 0;
+                while (taken < n) {
+                    auto& b = bufs[next];
+                    auto k = std::min(b.size(), n - taken);
+                    if (k) {
+                        chunk.push_back(b.share(0, k));
+                        b.trim_front(k);
+                        taken += k;
+                    }
+                    if (b.empty()) {
+                        ++next;
+                    }
+                }
+                left -= n;
+                // waiting for the chunk to be written before queueing the
+                // next one is what lets other channels and rpc messages in
+                return _mux->send(mux_op::data, _id, n, std::move(chunk), n);
+            });
+        });
+    });
+}
+
+void stream_channel::return_credit() {
+    if (_rcv_unacked && _mux && !_peer_gone && !_rcv_eof) {
+        (void)_mux->send(mux_op::credit, _id, _rcv_unacked).handle_exception([] (std::exception_ptr) {});
+    }
+    _rcv_unacked = 0;
+}
+
+void stream_channel::shutdown_input() {
+    _input_shut = true;
+    _rcv.clear();
+    // whatever arrives from now on is dropped, don't let the sender stall
+    _rcv_unacked += std::exchange(_rcv_buffered, 0);
+    return_credit();
+    _rcv_cond.broadcast();
+}
+
+void stream_channel::shutdown_output() {
+    if (_output_shut) {
+        return;
+    }
+    _output_shut = true;
+    if (_mux && !_peer_gone) {
+        (void)_mux->send(mux_op::close, _id, 0).handle_exception([] (std::exception_ptr) {});
+    }
+}
+
+void stream_channel::on_data(std::vector<temporary_buffer<char>> bufs, size_t size) {
+    if (_rcv_buffered + _rcv_unacked + size > _window) {
+        throw std::runtime_error(format("rpc stream channel {} exceeded its flow control window", _id));
+    }
+    if (_input_shut) {
+        _rcv_unacked += size;
+        return_credit();
+        return;
+    }
+    for (auto&& b : bufs) {
+        _rcv.push_back(std::move(b));
+    }
+    _rcv_buffered += size;
+    _rcv_cond.signal();
+}
+
+void stream_channel::on_credit(uint32_t bytes) {
+    _send_credits.signal(bytes);
+}
+
+void stream_channel::on_close() {
+    _rcv_eof = true;
+    _rcv_cond.broadcast();
+}
+
+void stream_channel::on_abort() {
+    _peer_gone = true;
+    _rcv_eof = true;
+    _rcv_cond.broadcast();
+    _send_credits.broken(std::make_exception_ptr(closed_error()));
+}
+
+void stream_channel::detach() {
+    _mux = nullptr;
+    _rcv_cond.broadcast();
+    _send_credits.broken(std::make_exception_ptr(closed_error()));
+}
+
+class stream_channel_source_impl final : public data_source_impl {
+    lw_shared_ptr<stream_channel> _ch;
+public:
+    explicit stream_channel_source_impl(lw_shared_ptr<stream_channel> ch) : _ch(std::move(ch)) {}
+    future<temporary_buffer<char>> get() override {
+        return _ch->read();
+    }
+    future<> close() override {
+        _ch->shutdown_input();
+        return make_ready_future<>();
+    }
+};
+
+class stream_channel_sink_impl final : public data_sink_impl {
+    lw_shared_ptr<stream_channel> _ch;
+public:
+    explicit stream_channel_sink_impl(lw_shared_ptr<stream_channel> ch) : _ch(std::move(ch)) {}
+    future<> put(net::packet p) override {
+        return _ch->write(std::move(p));
+    }
+    future<> close() override {
+        _ch->shutdown_output();
+        return make_ready_future<>();
+    }
+};
+
+class stream_channel_connected_socket_impl final : public connected_socket_impl {
+    lw_shared_ptr<stream_channel> _ch;
+public:
+    explicit stream_channel_connected_socket_impl(lw_shared_ptr<stream_channel> ch) : _ch(std::move(ch)) {}
+    data_source source() override {
+        return data_source(std::make_unique<stream_channel_source_impl>(_ch));
+    }
+    data_sink sink() override {
+        return data_sink(std::make_unique<stream_channel_sink_impl>(_ch));
+    }
+    void shutdown_input() override {
+        _ch->shutdown_input();
+    }
+    void shutdown_output() override {
+        _ch->shutdown_output();
+    }
+    // the parent connection's settings apply, accept and ignore
+    void set_nodelay(bool nodelay) override {}
+    bool get_nodelay() const override {
+        return true;
+    }
+    void set_keepalive(bool keepalive) override {}
+    bool get_keepalive() const override {
+        return false;
+    }
+    void set_keepalive_parameters(const keepalive_params&) override {}
+    keepalive_params get_keepalive_parameters() const override {
+        return tcp_keepalive_params{std::chrono::seconds(0), std::chrono::seconds(0), 0};
+    }
+    void set_sockopt(int level, int optname, const void* data, size_t len) override {
+        throw std::runtime_error("Setting custom socket options is not supported for multiplexed rpc streams");
+    }
+    int get_sockopt(int level, int optname, void* data, size_t len) const override {
+        throw std::runtime_error("Getting custom socket options is not supported for multiplexed rpc streams");
+    }
+};
+
+connected_socket make_stream_channel_socket(lw_shared_ptr<stream_channel> ch) {
+    return connected_socket(std::make_unique<stream_channel_connected_socket_impl>(std::move(ch)));
+}
+
+class stream_channel_socket_impl final : public socket_impl {
+    std::shared_ptr<stream_mux> _mux;
+    lw_shared_ptr<stream_channel> _ch;
+public:
+    explicit stream_channel_socket_impl(std::shared_ptr<stream_mux> mux) : _mux(std::move(mux)) {}
+    future<connected_socket> connect(socket_address sa, socket_address local, transport proto) override {
+        try {
+            _ch = _mux->open();
+            return make_ready_future<connected_socket>(make_stream_channel_socket(_ch));
+        } catch (...) {
+            return current_exception_as_future<connected_socket>();
+        }
+    }
+    void set_reuseaddr(bool reuseaddr) override {}
+    bool get_reuseaddr() const override {
+        return false;
+    }
+    void shutdown() override {
+        if (_ch) {
+            _ch->shutdown_input();
+            _ch->shutdown_output();
+        }
+    }
+};
+
+stream_mux::stream_mux(connection& conn, bool is_client, size_t window, size_t max_chunk, std::function<void (connected_socket)> on_open)
+        : _conn(&conn), _is_client(is_client), _window(window)
+        // a chunk has to fit in the credit the receiver returns in one batch
+        , _max_chunk(std::min(max_chunk, std::max<size_t>(window / 2, 1)))
+        , _on_open(std::move(on_open)) {
+}
+
+stream_mux::~stream_mux() {
+    abort();
+}
+
+socket stream_mux::make_socket() {
+    return socket(std::make_unique<stream_channel_socket_impl>(shared_from_this()));
+}
+
+lw_shared_ptr<stream_channel> stream_mux::open() {
+    if (!_conn) {
+        throw closed_error();
+    }
+    auto id = _next_id++;
+    auto ch = make_lw_shared<stream_channel>(*this, id, _window);
+    _channels.emplace(id, ch.get());
+    (void)send(mux_op::open, id, 0).handle_exception([] (std::exception_ptr) {});
+    return ch;
+}
+
+void stream_mux::receive(rcv_buf data) {
+    if (data.size < mux_frame_header_size) {
+        throw std::runtime_error("rpc stream multiplexing frame is too short");
+    }
+    auto in = make_deserializer_stream(data);
+    char header[mux_frame_header_size];
+    in.read(header, sizeof(header));
+    auto op = mux_op(header[0]);
+    auto id = read_le<uint64_t>(header + 1);
+    auto value = read_le<uint32_t>(header + 9);
+
+    if (op == mux_op::open) {
+        if (_is_client || !_on_open || _channels.count(id)) {
+            throw std::runtime_error(format("unexpected rpc stream channel {} open", id));
+        }
+        auto ch = make_lw_shared<stream_channel>(*this, id, _window);
+        _channels.emplace(id, ch.get());
+        _on_open(make_stream_channel_socket(std::move(ch)));
+        return;
+    }
+    auto it = _channels.find(id);
+    if (it == _channels.end()) {
+        // already closed on this side
+        return;
+    }
+    auto ch = it->second;
+    switch (op) {
+    case mux_op::data: {
+        fragment_sharer sharer{data};
+        auto size = in.size();
+        in.copy_to(sharer);
+        ch->on_data(std::move(sharer.fragments), size);
+        break;
+    }
+    case mux_op::credit:
+        ch->on_credit(value);
+        break;
+    case mux_op::close:
+        ch->on_close();
+        break;
+    case mux_op::abort:
+        ch->on_abort();
+        break;
+    default:
+        throw std::runtime_error(format("unknown rpc stream multiplexing operation {:d}", unsigned(op)));
+    }
+}
+
+future<> stream_mux::send(mux_op op, uint64_t channel, uint32_t value, std::vector<temporary_buffer<char>> data, size_t size) {
+    if (!_conn) {
+        return make_exception_future<>(closed_error());
+    }
+    // same layout as any other request or response frame, see
+    // send_helper() and server::connection::respond()
+    size_t head_space = _is_client ? 28 : 12;
+    uint32_t frame_size = mux_frame_header_size + size;
+    temporary_buffer<char> header(head_space + mux_frame_header_size);
+    auto p = header.get_write();
+    if (_is_client) {
+        // the first 8 bytes are for the timeout, filled in by the send loop
+        write_le<uint64_t>(p + 8, stream_mux_verb);
+        write_le<int64_t>(p + 16, 0);
+        write_le<uint32_t>(p + 24, frame_size);
+    } else {
+        write_le<int64_t>(p, 0);
+        write_le<uint32_t>(p + 8, frame_size);
+    }
+    p += head_space;
+    *p = char(op);
+    write_le<uint64_t>(p + 1, channel);
+    write_le<uint32_t>(p + 9, value);
+
+    snd_buf buf;
+    if (data.empty()) {
+        buf = snd_buf(std::move(header));
+    } else {
+        data.insert(data.begin(), std::move(header));
+        buf = snd_buf(std::move(data), head_space + frame_size);
+    }
+    return _conn->send(std::move(buf), {}, nullptr, stream_mux_verb);
+}
+
+void stream_mux::abort() {
+    _conn = nullptr;
+    auto channels = std::exchange(_channels, {});
+    for (auto&& c : channels) {
+        c.second->detach();
+    }
+}
+
+sstring stream_mux::serialize_options(size_t window, size_t max_chunk) {
+    sstring s = uninitialized_string(8);
+    write_le<uint32_t>(s.data(), window);
+    write_le<uint32_t>(s.data() + 4, max_chunk);
+    return s;
+}
+
+std::pair<size_t, size_t> stream_mux::deserialize_options(const sstring& s) {
+    if (s.size() != 8) {
+        throw std::runtime_error("bad rpc stream multiplexing options");
+    }
+    auto window = read_le<uint32_t>(s.data());
+    auto max_chunk = read_le<uint32_t>(s.data() + 4);
+    if (!window || !max_chunk) {
+        throw std::runtime_error("bad rpc stream multiplexing options");
+    }
+    return {window, max_chunk};
+}
+
+}
+
+}
@@ -0,0 +1,140 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#pragma once
+
+#include <seastar/rpc/rpc.hh>
+#include <seastar/core/condition-variable.hh>
+#include <seastar/core/circular_buffer.hh>
+#include <seastar/net/stack.hh>
+
+namespace seastar {
+
+namespace rpc {
+
+// Stream channels carried over an rpc connection, see
+// client_options::stream_multiplexing.
+//
+// Each channel behaves like a connected socket of its own, over which a
+// stream connection is negotiated and run exactly as over a real one. Its
+// data travels in frames of the parent connection: requests with the
+// reserved verb stream_mux_verb from the client, responses with message id
+// 0 from the server, whose payload is a mux_frame_header followed by the
+// data (see doc/rpc.md).
+//
+// A channel may have at most `window` bytes the receiver has not consumed
+// yet in flight; the receiver returns credit as its reader consumes data.
+// Data is sent at most `max_chunk` bytes at a time, and a channel only
+// queues its next chunk once the previous one was written, so channels
+// and ordinary rpc messages take turns on the connection.
+
+constexpr uint64_t stream_mux_verb = std::numeric_limits<uint64_t>::max() - 1;
+
+enum class mux_op : uint8_t {
+    open = 0,   // client opened a channel
+    data = 1,   // channel data follows
+    credit = 2, // value is the number of bytes consumed by the receiver
+    close = 3,  // sender will send no more data (half close)
+    abort = 4,  // sender is gone, no more data will be sent or received
+};
+
+// op (1), channel id (8), value (4)
+constexpr size_t mux_frame_header_size = 13;
+
+class stream_mux;
+
+class stream_channel : public enable_lw_shared_from_this<stream_channel> {
+    stream_mux* _mux;
+    uint64_t _id;
+    size_t _window;
+    circular_buffer<temporary_buffer<char>> _rcv;
+    size_t _rcv_buffered = 0;
+    size_t _rcv_unacked = 0;
+    bool _rcv_eof = false;
+    bool _input_shut = false;
+    bool _output_shut = false;
+    bool _peer_gone = false;
+    condition_variable _rcv_cond;
+    semaphore _send_credits;
+public:
+    stream_channel(stream_mux& mux, uint64_t id, size_t window);
+    ~stream_channel();
+    uint64_t id() const {
+        return _id;
+    }
+
+    future<temporary_buffer<char>> read();
+    future<> write(net::packet p);
+    void shutdown_input();
+    void shutdown_output();
+
+    // called by the mux
+    void on_data(std::vector<temporary_buffer<char>> bufs, size_t size);
+    void on_credit(uint32_t bytes);
+    void on_close();
+    void on_abort();
+    void detach();
+private:
+    void return_credit();
+    future<> write_chunks(std::vector<temporary_buffer<char>> bufs, size_t size);
+};
+
+class stream_mux : public std::enable_shared_from_this<stream_mux> {
+    connection* _conn;
+    bool _is_client;
+    size_t _window;
+    size_t _max_chunk;
+    uint64_t _next_id = 1;
+    std::unordered_map<uint64_t, stream_channel*> _channels;
+    std::function<void (connected_socket)> _on_open;
+public:
+    // on_open is called on the server for every channel the client opens
+    stream_mux(connection& conn, bool is_client, size_t window, size_t max_chunk, std::function<void (connected_socket)> on_open = {});
+    ~stream_mux();
+
+    size_t max_chunk() const {
+        return _max_chunk;
+    }
+    bool is_open() const {
+        return _conn;
+    }
+
+    // client side: opens a new channel
+    socket make_socket();
+    lw_shared_ptr<stream_channel> open();
+    // handles a frame sent with stream_mux_verb or message id 0
+    void receive(rcv_buf data);
+    future<> send(mux_op op, uint64_t channel, uint32_t value, std::vector<temporary_buffer<char>> data = {}, size_t size = 0);
+    void remove(uint64_t channel) {
+        _channels.erase(channel);
+    }
+    // fails all channels, called when the parent connection goes away
+    void abort();
+
+    static sstring serialize_options(size_t window, size_t max_chunk);
+    static std::pair<size_t, size_t> deserialize_options(const sstring& s);
+};
+
+connected_socket make_stream_channel_socket(lw_shared_ptr<stream_channel> ch);
+
+}
+
+}
@@ -0,0 +1,329 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB
+ */
+
+#include <seastar/rpc/zstd_compressor.hh>
+#include <seastar/core/print.hh>
+
+#include <boost/algorithm/string.hpp>
+
+#include <zstd.h>
+#include <zdict.h>
+
+namespace seastar {
+namespace rpc {
+
+namespace {
+
+struct cctx_deleter {
+    void operator()(ZSTD_CCtx* ctx) const noexcept {
+        ZSTD_freeCCtx(ctx);
+    }
+};
+
+struct dctx_deleter {
+    void operator()(ZSTD_DCtx* ctx) const noexcept {
+        ZSTD_freeDCtx(ctx);
+    }
+};
+
+struct cdict_deleter {
+    void operator()(ZSTD_CDict* dict) const noexcept {
+        ZSTD_freeCDict(dict);
+    }
+};
+
+struct ddict_deleter {
+    void operator()(ZSTD_DDict* dict) const noexcept {
+        ZSTD_freeDDict(dict);
+    }
+};
+
+size_t check_zstd(size_t ret, const char* what) {
+    if (ZSTD_isError(ret)) {
+        throw std::runtime_error(format("RPC frame ZSTD {} failure: {}", what, ZSTD_getErrorName(ret)));
+    }
+    return ret;
+}
+
+}
+
+struct zstd_dictionary::impl {
+    temporary_buffer<char> content;
+    uint32_t id;
+    std::unique_ptr<ZSTD_DDict, ddict_deleter> ddict;
+};
+
+struct zstd_compressor::prepared_dictionary {
+    zstd_dictionary dictionary;
+    sstring name;
+    std::unique_ptr<ZSTD_CDict, cdict_deleter> cdict;
+};
+
+zstd_dictionary::zstd_dictionary(temporary_buffer<char> content) {
+    auto id = ZSTD_getDictID_fromDict(content.get(), content.size());
+    if (!id) {
+        throw std::invalid_argument("not a zstd dictionary");
+    }
+    auto ddict = std::unique_ptr<ZSTD_DDict, ddict_deleter>(ZSTD_createDDict(content.get(), content.size()));
+    if (!ddict) {
+        throw std::bad_alloc();
+    }
+    _impl = std::make_shared<impl>(impl{std::move(content), id, std::move(ddict)});
+}
+
+zstd_dictionary zstd_dictionary::train(const std::vector<temporary_buffer<char>>& samples, size_t max_size) {
+    std::vector<char> all;
+    std::vector<size_t> sizes;
+    sizes.reserve(samples.size());
+    for (auto&& s : samples) {
+        all.insert(all.end(), s.begin(), s.end());
+        sizes.push_back(s.size());
+    }
+    temporary_buffer<char> dict(max_size);
+    auto size = ZDICT_trainFromBuffer(dict.get_write(), dict.size(), all.data(), sizes.data(), sizes.size());
+    if (ZDICT_isError(size)) {
+        throw std::runtime_error(format("zstd dictionary training failed: {}", ZDICT_getErrorName(size)));
+    }
+    dict.trim(size);
+    return zstd_dictionary(std::move(dict));
+}
+
+uint32_t zstd_dictionary::id() const {
+    return _impl->id;
+}
+
+const temporary_buffer<char>& zstd_dictionary::content() const {
+    return _impl->content;
+}
+
+static const sstring zstd_name = "ZSTD";
+
+zstd_compressor::factory::factory(int level, std::vector<zstd_dictionary> dictionaries, size_t max_decompressed_size)
+        : _level(level), _max_decompressed_size(max_decompressed_size) {
+    std::vector<sstring> names;
+    for (auto&& d : dictionaries) {
+        auto& content = d.content();
+        auto cdict = std::unique_ptr<ZSTD_CDict, cdict_deleter>(ZSTD_createCDict(content.get(), content.size(), level));
+        if (!cdict) {
+            throw std::bad_alloc();
+        }
+        auto name = format("ZSTD_DICT_{:08x}", d.id());
+        names.push_back(name);
+        _dictionaries.push_back(std::make_shared<prepared_dictionary>(prepared_dictionary{std::move(d), std::move(name), std::move(cdict)}));
+    }
+    names.push_back(zstd_name);
+    _features = boost::algorithm::join(names, ",");
+}
+
+const sstring& zstd_compressor::factory::supported() const {
+    return _features;
+}
+
+std::unique_ptr<rpc::compressor> zstd_compressor::factory::negotiate(sstring feature, bool is_server) const {
+    // feature may be a single name or, when this factory is used without
+    // multi_algo_compressor_factory, the peer's whole list
+    std::vector<sstring> names;
+    boost::split(names, feature, boost::is_any_of(","));
+    for (auto&& n : names) {
+        if (n == zstd_name) {
+            return std::make_unique<zstd_compressor>(_level, nullptr, _max_decompressed_size);
+        }
+        for (auto&& d : _dictionaries) {
+            if (n == d->name) {
+                return std::make_unique<zstd_compressor>(_level, d, _max_decompressed_size);
+            }
+        }
+    }
+    return nullptr;
+}
+
+zstd_compressor::zstd_compressor(int level, std::shared_ptr<const prepared_dictionary> dictionary, size_t max_decompressed_size)
+        : _level(level), _max_decompressed_size(max_decompressed_size), _dictionary(std::move(dictionary)) {
+}
+
+sstring zstd_compressor::name() const {
+    return _dictionary ? _dictionary->name : zstd_name;
+}
+
+// Calls fn for each fragment of a snd_buf or rcv_buf, telling it whether it
+// is the last one.
+template <typename Buf, typename Func>
+static void for_each_fragment(Buf& data, Func&& fn) {
+    if (auto one = std::get_if<temporary_buffer<char>>(&data.bufs)) {
+        fn(one->get(), one->size(), true);
+        return;
+    }
+    auto& bufs = std::get<std::vector<temporary_buffer<char>>>(data.bufs);
+    if (bufs.empty()) {
+        fn(nullptr, 0, true);
+        return;
+    }
+    for (auto i = bufs.begin(); i != bufs.end(); ++i) {
+        fn(i->get(), i->size(), std::next(i) == bufs.end());
+    }
+}
+
+snd_buf zstd_compressor::compress(size_t head_space, snd_buf data) {
+    static thread_local auto ctx = std::unique_ptr<ZSTD_CCtx, cctx_deleter>(ZSTD_createCCtx());
+
+    check_zstd(ZSTD_CCtx_reset(ctx.get(), ZSTD_reset_session_and_parameters), "reset");
+    if (_dictionary) {
+        check_zstd(ZSTD_CCtx_refCDict(ctx.get(), _dictionary->cdict.get()), "dictionary");
+    } else {
+        check_zstd(ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_compressionLevel, _level), "level");
+    }
+    // Also makes zstd record the size in the frame header, which lets the
+    // receiver size its buffers exactly.
+    check_zstd(ZSTD_CCtx_setPledgedSrcSize(ctx.get(), data.size), "size");
+
+    // The whole output is guaranteed to fit in head_space + bound, so we
+    // never allocate more than that in total.
+    size_t left = head_space + ZSTD_compressBound(data.size);
+    std::vector<temporary_buffer<char>> dst_buffers;
+    ZSTD_outBuffer out{nullptr, 0, 0};
+    size_t total_size = 0;
+
+    auto next_output = [&] {
+        if (!dst_buffers.empty()) {
+            dst_buffers.back().trim(out.pos);
+            total_size += out.pos;
+        }
+        auto size = left ? std::min(left, snd_buf::chunk_size) : snd_buf::chunk_size;
+        dst_buffers.emplace_back(size);
+        left -= std::min(left, size);
+        out = ZSTD_outBuffer{dst_buffers.back().get_write(), size, 0};
+    };
+    next_output();
+    out.pos = head_space;
+
+    for_each_fragment(data, [&] (const char* ptr, size_t size, bool last) {
+        ZSTD_inBuffer in{ptr, size, 0};
+        auto mode = last ? ZSTD_e_end : ZSTD_e_continue;
+        size_t pending;
+        do {
+            if (out.pos == out.size) {
+                next_output();
+            }
+            pending = check_zstd(ZSTD_compressStream2(ctx.get(), &out, &in, mode), "compression");
+        } while (last ? pending != 0 : in.pos != in.size);
+    });
+
+    dst_buffers.back().trim(out.pos);
+    total_size += out.pos;
+
+    if (dst_buffers.size() == 1) {
+        return snd_buf(std::move(dst_buffers.front()));
+    }
+    return snd_buf(std::move(dst_buffers), total_size);
+}
+
+rcv_buf zstd_compressor::decompress(rcv_buf data) {
+    if (!data.size) {
+        return rcv_buf();
+    }
+
+    static thread_local auto ctx = std::unique_ptr<ZSTD_DCtx, dctx_deleter>(ZSTD_createDCtx());
+
+    check_zstd(ZSTD_DCtx_reset(ctx.get(), ZSTD_reset_session_and_parameters), "reset");
+    if (_dictionary) {
+        check_zstd(ZSTD_DCtx_refDDict(ctx.get(), _dictionary->dictionary.get_impl().ddict.get()), "dictionary");
+    }
+
+    auto too_large = [this] {
+        return std::runtime_error(format("RPC frame ZSTD decompression failure: frame exceeds {} bytes", _max_decompressed_size));
+    };
+
+    // Size output buffers from the frame header when we can; it is only a
+    // hint, a lying peer just costs us extra allocations.
+    size_t expected = 0;
+    auto one = std::get_if<temporary_buffer<char>>(&data.bufs);
+    auto& first = one ? *one : std::get<std::vector<temporary_buffer<char>>>(data.bufs).front();
+    auto content_size = ZSTD_getFrameContentSize(first.get(), first.size());
+    if (content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size != ZSTD_CONTENTSIZE_ERROR) {
+        if (content_size > _max_decompressed_size) {
+            throw too_large();
+        }
+        expected = content_size;
+    }
+
+    std::vector<temporary_buffer<char>> dst_buffers;
+    ZSTD_outBuffer out{nullptr, 0, 0};
+    size_t total_size = 0;
+
+    // Output buffers add up to at most one byte past the limit, so that
+    // a frame of exactly the limit is told apart from a larger one.
+    auto next_output = [&] {
+        if (!dst_buffers.empty()) {
+            dst_buffers.back().trim(out.pos);
+            total_size += out.pos;
+        }
+        if (total_size > _max_decompressed_size) {
+            throw too_large();
+        }
+        auto size = expected > total_size ? std::min(expected - total_size, snd_buf::chunk_size) : snd_buf::chunk_size;
+        if (_max_decompressed_size - total_size < size) {
+            size = _max_decompressed_size - total_size + 1;
+        }
+        dst_buffers.emplace_back(size);
+        out = ZSTD_outBuffer{dst_buffers.back().get_write(), size, 0};
+    };
+    next_output();
+
+    size_t pending = 1;
+    for_each_fragment(data, [&] (const char* ptr, size_t size, bool) {
+        ZSTD_inBuffer in{ptr, size, 0};
+        while (in.pos != in.size) {
+            if (out.pos == out.size) {
+                next_output();
+            }
+            pending = check_zstd(ZSTD_decompressStream(ctx.get(), &out, &in), "decompression");
+        }
+    });
+    // Flush whatever did not fit in the output buffers yet.
+    while (pending) {
+        if (out.pos == out.size) {
+            next_output();
+        }
+        auto before = out.pos;
+        ZSTD_inBuffer in{nullptr, 0, 0};
+        pending = check_zstd(ZSTD_decompressStream(ctx.get(), &out, &in), "decompression");
+        if (pending && out.pos == before) {
+            throw std::runtime_error("RPC frame ZSTD decompression failure: truncated frame");
+        }
+    }
+
+    dst_buffers.back().trim(out.pos);
+    total_size += out.pos;
+    if (total_size > _max_decompressed_size) {
+        throw too_large();
+    }
+    if (dst_buffers.size() > 1 && dst_buffers.back().empty()) {
+        dst_buffers.pop_back();
+    }
+
+    if (dst_buffers.size() == 1) {
+        return rcv_buf(std::move(dst_buffers.front()));
+    }
+    return rcv_buf(std::move(dst_buffers), total_size);
+}
+
+}
+}
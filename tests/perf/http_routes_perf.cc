@@ -0,0 +1,121 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2020 ScyllaDB Ltd.
+ */
+
+#include <seastar/testing/perf_tests.hh>
+#include <seastar/http/routes.hh>
+#include <seastar/http/matchrules.hh>
+#include <seastar/core/print.hh>
+
+using namespace seastar;
+using namespace httpd;
+
+namespace {
+
+class dummy_handler : public handler_base {
+public:
+    virtual future<std::unique_ptr<reply>> handle(const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep) override {
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }
+};
+
+}
+
+// A REST API of a few hundred endpoints, registered the way
+// path_description does it: a literal prefix followed by parameters and
+// more literals.
+struct http_routes {
+    static constexpr unsigned resources = 100;
+    routes r;
+    // kept for the linear baseline, owned by r
+    std::vector<match_rule*> rules;
+    sstring first_url = "/api/v1/resource0/17";
+    sstring last_url = format("/api/v1/resource{}/17/items/3/details", resources - 1);
+    sstring remainder_url = "/files/some/deep/path/to/a/file.txt";
+    sstring missing_url = "/api/v1/missing/17";
+
+    http_routes() {
+        for (unsigned i = 0; i < resources; i++) {
+            auto prefix = format("/api/v1/resource{}", i);
+            add(&(new match_rule(new dummy_handler()))->add_str(prefix).add_param("id"));
+            add(&(new match_rule(new dummy_handler()))->add_str(prefix).add_param("id").add_str("/items"));
+            add(&(new match_rule(new dummy_handler()))->add_str(prefix).add_param("id").add_str("/items").add_param("item").add_str("/details"));
+        }
+        add(&(new match_rule(new dummy_handler()))->add_str("/files").add_param("path", true));
+        // the first lookup builds the index
+        parameters params;
+        r.get_handler(GET, first_url, params);
+    }
+
+    void add(match_rule* rule) {
+        rules.push_back(rule);
+        r.add(rule, GET);
+    }
+
+    handler_base* lookup(const sstring& url) {
+        parameters params;
+        auto h = r.get_handler(GET, url, params);
+        perf_tests::do_not_optimize(params);
+        return h;
+    }
+
+    // what routes::get_handler used to do
+    handler_base* linear_lookup(const sstring& url) {
+        parameters params;
+        for (auto rule : rules) {
+            auto h = rule->get(url, params);
+            if (h) {
+                perf_tests::do_not_optimize(params);
+                return h;
+            }
+            params.clear();
+        }
+        return nullptr;
+    }
+};
+
+PERF_TEST_F(http_routes, first_rule) {
+    perf_tests::do_not_optimize(lookup(first_url));
+}
+
+PERF_TEST_F(http_routes, last_rule) {
+    perf_tests::do_not_optimize(lookup(last_url));
+}
+
+PERF_TEST_F(http_routes, remainder) {
+    perf_tests::do_not_optimize(lookup(remainder_url));
+}
+
+PERF_TEST_F(http_routes, not_found) {
+    perf_tests::do_not_optimize(lookup(missing_url));
+}
+
+PERF_TEST_F(http_routes, linear_first_rule) {
+    perf_tests::do_not_optimize(linear_lookup(first_url));
+}
+
+PERF_TEST_F(http_routes, linear_last_rule) {
+    perf_tests::do_not_optimize(linear_lookup(last_url));
+}
+
+PERF_TEST_F(http_routes, linear_not_found) {
+    perf_tests::do_not_optimize(linear_lookup(missing_url));
+}
@@ -20,9 +20,18 @@
  */
 
 #include <random>
+#include <unistd.h>
 
+#include <boost/range/irange.hpp>
+#include <boost/iterator/counting_iterator.hpp>
+
+#include <seastar/rpc/rpc.hh>
 #include <seastar/rpc/lz4_compressor.hh>
 #include <seastar/rpc/lz4_fragmented_compressor.hh>
+#include <seastar/rpc/zstd_compressor.hh>
+#include <seastar/net/shm_socket.hh>
+#include <seastar/net/unix_address.hh>
+#include <seastar/core/loop.hh>
 
 #include <seastar/testing/perf_tests.hh>
 
@@ -260,3 +269,311 @@ PERF_TEST_F(lz4_fragmented, large_zeroed_buffer_decompress) {
         compressor().decompress(large_compressed_buffer_zeroes())
     );
 }
+
+struct serializer {
+};
+
+template <typename Output>
+inline void write(serializer, Output& out, const sstring& v) {
+    auto size = uint32_t(v.size());
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.write(v.c_str(), v.size());
+}
+
+template <typename Input>
+inline sstring read(serializer, Input& in, seastar::rpc::type<sstring>) {
+    uint32_t size;
+    in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    sstring ret = uninitialized_string(size);
+    in.read(ret.data(), size);
+    return ret;
+}
+
+struct unix_socket_transport {
+    static constexpr const char* name = "unix";
+    static seastar::server_socket listen(seastar::socket_address sa) {
+        return seastar::listen(sa);
+    }
+    static seastar::socket make_socket() {
+        return seastar::make_socket();
+    }
+};
+
+struct shm_transport {
+    static constexpr const char* name = "shm";
+    static seastar::server_socket listen(seastar::socket_address sa) {
+        return seastar::net::shm_listen(sa);
+    }
+    static seastar::socket make_socket() {
+        return seastar::net::make_shm_socket();
+    }
+};
+
+struct rpc_setup {
+    seastar::rpc::client_options client_options;
+    seastar::rpc::server_options server_options;
+    seastar::rpc::resource_limits limits;
+    unsigned clients = 1;
+};
+
+// An rpc server and clients on the same shard, talking over a local
+// transport. Nothing in the transports depends on the peer being in another
+// process, so this measures the cost of rpc itself without the noise of a
+// second process.
+template <typename Transport>
+class rpc_loopback {
+protected:
+    using proto_type = seastar::rpc::protocol<serializer>;
+    using bytes_sink = seastar::rpc::sink<seastar::rpc::fragmented_bytes>;
+    using bytes_source = seastar::rpc::source<seastar::rpc::fragmented_bytes>;
+    static constexpr size_t pipeline_depth = 64;
+    static constexpr size_t stream_chunk_size = 64 * 1024;
+    static constexpr size_t stream_burst = 64;
+    static inline unsigned _instance = 0;
+
+    seastar::socket_address _addr;
+    proto_type _proto{serializer{}};
+    std::unique_ptr<proto_type::server> _server;
+    std::vector<std::unique_ptr<proto_type::client>> _clients;
+    std::function<seastar::future<sstring> (proto_type::client&, const sstring&)> _echo;
+    std::optional<bytes_sink> _sink;
+    seastar::future<> _stream_done = seastar::make_ready_future<>();
+    seastar::rpc::fragmented_bytes _chunk;
+
+public:
+    // runs in a seastar thread
+    explicit rpc_loopback(rpc_setup setup = {}) {
+        _addr = seastar::socket_address(seastar::unix_domain_addr(std::string(1, '\0') + "seastar_rpc_perf_"
+                + Transport::name + "_" + std::to_string(::getpid()) + "_" + std::to_string(_instance++)));
+        _proto.register_handler(1, [] (sstring s) {
+            return s;
+        });
+        _proto.register_handler(2, [this] (bytes_source source) {
+            _stream_done = seastar::repeat([source] () mutable {
+                return source().then([] (auto data) {
+                    return data ? seastar::stop_iteration::no : seastar::stop_iteration::yes;
+                });
+            });
+        });
+        _server = std::make_unique<proto_type::server>(_proto, setup.server_options, Transport::listen(_addr), setup.limits);
+        for (unsigned i = 0; i < setup.clients; i++) {
+            _clients.push_back(std::make_unique<proto_type::client>(_proto, setup.client_options, Transport::make_socket(), _addr));
+        }
+        _echo = _proto.make_client<sstring (sstring)>(1);
+        temporary_buffer<char> chunk(stream_chunk_size);
+        std::fill_n(chunk.get_write(), chunk.size(), 'x');
+        _chunk = seastar::rpc::fragmented_bytes(std::move(chunk));
+    }
+    ~rpc_loopback() {
+        if (_sink) {
+            _sink->close().get();
+            _stream_done.get();
+        }
+        for (auto&& c : _clients) {
+            c->stop().get();
+        }
+        _server->stop().get();
+    }
+
+    seastar::future<> round_trip(const sstring& msg) {
+        return _echo(*_clients.front(), msg).discard_result();
+    }
+    // keeps pipeline_depth requests in flight on every client
+    seastar::future<size_t> pipelined(const sstring& msg) {
+        return seastar::parallel_for_each(_clients, [this, &msg] (auto& c) {
+            return seastar::parallel_for_each(boost::irange<size_t>(0, pipeline_depth), [this, &c, &msg] (size_t) {
+                return _echo(*c, msg).discard_result();
+            });
+        }).then([this] {
+            return pipeline_depth * _clients.size();
+        });
+    }
+    // pushes stream_burst chunks of stream_chunk_size bytes through a
+    // stream; the stream's flow control keeps the sender from running
+    // ahead of the receiver
+    seastar::future<size_t> stream() {
+        auto open = _sink ? seastar::make_ready_future<>() : _clients.front()->make_stream_sink<serializer, seastar::rpc::fragmented_bytes>(Transport::make_socket()).then([this] (bytes_sink sink) {
+            _sink.emplace(std::move(sink));
+            return _proto.make_client<void (bytes_sink)>(2)(*_clients.front(), *_sink);
+        });
+        return open.then([this] {
+            return seastar::do_for_each(boost::counting_iterator<size_t>(0), boost::counting_iterator<size_t>(stream_burst), [this] (size_t) {
+                return (*_sink)(_chunk.share());
+            }).then([this] {
+                return _sink->flush();
+            });
+        }).then([] {
+            return stream_burst;
+        });
+    }
+};
+
+template <size_t Size>
+struct payload {
+    static const sstring& get() {
+        static const sstring data(Size, 'x');
+        return data;
+    }
+};
+
+// Latency of a single echo round trip by payload size.
+
+using unix_socket_rpc = rpc_loopback<unix_socket_transport>;
+
+PERF_TEST_F(unix_socket_rpc, round_trip_16) {
+    return round_trip(payload<16>::get());
+}
+
+PERF_TEST_F(unix_socket_rpc, round_trip_1k) {
+    return round_trip(payload<1024>::get());
+}
+
+PERF_TEST_F(unix_socket_rpc, round_trip_64k) {
+    return round_trip(payload<64 * 1024>::get());
+}
+
+PERF_TEST_F(unix_socket_rpc, round_trip_1m) {
+    return round_trip(payload<1024 * 1024>::get());
+}
+
+PERF_TEST_F(unix_socket_rpc, pipelined_128) {
+    return pipelined(payload<128>::get());
+}
+
+PERF_TEST_F(unix_socket_rpc, stream_64k) {
+    return stream();
+}
+
+using shm_rpc = rpc_loopback<shm_transport>;
+
+PERF_TEST_F(shm_rpc, round_trip_16) {
+    return round_trip(payload<16>::get());
+}
+
+PERF_TEST_F(shm_rpc, round_trip_1k) {
+    return round_trip(payload<1024>::get());
+}
+
+PERF_TEST_F(shm_rpc, round_trip_64k) {
+    return round_trip(payload<64 * 1024>::get());
+}
+
+PERF_TEST_F(shm_rpc, round_trip_1m) {
+    return round_trip(payload<1024 * 1024>::get());
+}
+
+PERF_TEST_F(shm_rpc, pipelined_128) {
+    return pipelined(payload<128>::get());
+}
+
+PERF_TEST_F(shm_rpc, stream_64k) {
+    return stream();
+}
+
+// Throughput with many connections from the same shard.
+
+struct concurrent_clients_rpc : rpc_loopback<unix_socket_transport> {
+    concurrent_clients_rpc() : rpc_loopback(rpc_setup{{}, {}, {}, 16}) {}
+};
+
+PERF_TEST_F(concurrent_clients_rpc, pipelined_128) {
+    return pipelined(payload<128>::get());
+}
+
+PERF_TEST_F(concurrent_clients_rpc, pipelined_64k) {
+    return pipelined(payload<64 * 1024>::get());
+}
+
+// Cost of each compressor; the payloads are trivially compressible, so
+// these measure the compressors' overhead more than their gains.
+
+template <typename Factory>
+rpc_setup with_compressor() {
+    static Factory factory;
+    rpc_setup setup;
+    setup.client_options.compressor_factory = &factory;
+    setup.server_options.compressor_factory = &factory;
+    return setup;
+}
+
+struct lz4_rpc : rpc_loopback<unix_socket_transport> {
+    lz4_rpc() : rpc_loopback(with_compressor<seastar::rpc::lz4_compressor::factory>()) {}
+};
+
+PERF_TEST_F(lz4_rpc, round_trip_1k) {
+    return round_trip(payload<1024>::get());
+}
+
+PERF_TEST_F(lz4_rpc, round_trip_1m) {
+    return round_trip(payload<1024 * 1024>::get());
+}
+
+PERF_TEST_F(lz4_rpc, stream_64k) {
+    return stream();
+}
+
+struct lz4_fragmented_rpc : rpc_loopback<unix_socket_transport> {
+    lz4_fragmented_rpc() : rpc_loopback(with_compressor<seastar::rpc::lz4_fragmented_compressor::factory>()) {}
+};
+
+PERF_TEST_F(lz4_fragmented_rpc, round_trip_1k) {
+    return round_trip(payload<1024>::get());
+}
+
+PERF_TEST_F(lz4_fragmented_rpc, round_trip_1m) {
+    return round_trip(payload<1024 * 1024>::get());
+}
+
+PERF_TEST_F(lz4_fragmented_rpc, stream_64k) {
+    return stream();
+}
+
+struct zstd_rpc : rpc_loopback<unix_socket_transport> {
+    zstd_rpc() : rpc_loopback(with_compressor<seastar::rpc::zstd_compressor::factory>()) {}
+};
+
+PERF_TEST_F(zstd_rpc, round_trip_1k) {
+    return round_trip(payload<1024>::get());
+}
+
+PERF_TEST_F(zstd_rpc, round_trip_1m) {
+    return round_trip(payload<1024 * 1024>::get());
+}
+
+PERF_TEST_F(zstd_rpc, stream_64k) {
+    return stream();
+}
+
+// Connections isolated into their own scheduling group, which moves every
+// handler invocation out of the default group.
+
+class isolated_rpc_group {
+protected:
+    seastar::scheduling_group _sg = seastar::create_scheduling_group("rpc_perf", 100).get0();
+public:
+    ~isolated_rpc_group() {
+        seastar::destroy_scheduling_group(_sg).get();
+    }
+    rpc_setup setup() {
+        rpc_setup setup;
+        setup.client_options.isolation_cookie = "isolated";
+        setup.limits.isolate_connection = [sg = _sg] (sstring) {
+            seastar::rpc::isolation_config cfg;
+            cfg.sched_group = sg;
+            return cfg;
+        };
+        return setup;
+    }
+};
+
+struct isolated_rpc : isolated_rpc_group, rpc_loopback<unix_socket_transport> {
+    isolated_rpc() : rpc_loopback(setup()) {}
+};
+
+PERF_TEST_F(isolated_rpc, round_trip_16) {
+    return round_trip(payload<16>::get());
+}
+
+PERF_TEST_F(isolated_rpc, pipelined_128) {
+    return pipelined(payload<128>::get());
+}
@@ -1,7 +1,14 @@
 #include <seastar/core/reactor.hh>
+#include <seastar/core/sharded.hh>
+#include <seastar/core/sleep.hh>
+#include <seastar/core/thread.hh>
+#include <seastar/core/with_timeout.hh>
 #include <seastar/testing/test_case.hh>
+#include <seastar/testing/thread_test_case.hh>
 #include <seastar/testing/test_runner.hh>
 #include <seastar/net/ip.hh>
+#include <seastar/net/posix-stack.hh>
+#include <seastar/util/defer.hh>
 
 using namespace seastar;
 using namespace net;
@@ -72,3 +79,101 @@ SEASTAR_TEST_CASE(test_accept_after_abort) {
         });
     });
 }
+
+namespace {
+
+class counting_acceptor {
+    server_socket _listener;
+    std::vector<connected_socket> _connections;
+    future<> _done = make_ready_future<>();
+public:
+    counting_acceptor(socket_address sa, listen_options lo)
+        : _listener(engine().net().listen(sa, lo)) {
+        _done = keep_doing([this] {
+            return _listener.accept().then([this] (accept_result ar) {
+                _connections.push_back(std::move(ar.connection));
+            });
+        }).handle_exception([] (std::exception_ptr) {});
+    }
+    size_t accepted() const {
+        return _connections.size();
+    }
+    future<> stop() {
+        _listener.abort_accept();
+        return std::move(_done);
+    }
+};
+
+}
+
+SEASTAR_THREAD_TEST_CASE(test_incoming_cpu_load_balancing) {
+    std::default_random_engine& rnd = testing::local_random_engine;
+    auto distr = std::uniform_int_distribution<uint16_t>(12000, 65000);
+    auto sa = make_ipv4_address({"127.0.0.1", distr(rnd)});
+    listen_options lo;
+    lo.reuse_address = true;
+    lo.lba = server_socket::load_balancing_algorithm::incoming_cpu;
+
+    sharded<counting_acceptor> acceptors;
+    acceptors.start(sa, lo).get();
+
+    // whichever shard gets them, all connections must be accepted.
+    constexpr size_t nr_connections = 16;
+    std::vector<connected_socket> clients;
+    for (size_t i = 0; i < nr_connections; ++i) {
+        clients.push_back(connect(sa).get0());
+    }
+    auto accepted = [&acceptors] {
+        return acceptors.map_reduce0(std::mem_fn(&counting_acceptor::accepted), size_t(0), std::plus<size_t>());
+    };
+    with_timeout(timer<>::clock::now() + std::chrono::seconds(10), repeat([&accepted] {
+        return accepted().then([] (size_t n) {
+            if (n >= nr_connections) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return sleep(std::chrono::milliseconds(1)).then([] {
+                return stop_iteration::no;
+            });
+        });
+    })).get();
+    BOOST_REQUIRE_EQUAL(accepted().get0(), nr_connections);
+
+    acceptors.stop().get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_receive_buffer_memory_budget) {
+    std::default_random_engine& rnd = testing::local_random_engine;
+    auto distr = std::uniform_int_distribution<uint16_t>(12000, 65000);
+    auto sa = make_ipv4_address({"127.0.0.1", distr(rnd)});
+    listen_options lo;
+    lo.reuse_address = true;
+    auto listener = engine().net().listen(sa, lo);
+    auto accepted = listener.accept();
+    auto client = connect(sa).get0();
+    auto server = accepted.get0().connection;
+
+    constexpr size_t budget = 4096;
+    constexpr size_t total = 256 * 1024;
+    set_receive_buffer_memory_budget(budget);
+    auto reset_budget = defer([] { set_receive_buffer_memory_budget(0); });
+
+    auto writer = async([&server] {
+        auto out = server.output();
+        for (size_t written = 0; written < total; written += 4096) {
+            out.write(sstring(4096, 'x')).get();
+        }
+        out.close().get();
+    });
+
+    // Buffers are dropped as soon as they are read, so each one may use the
+    // whole budget but never more.
+    auto in = client.input();
+    size_t received = 0;
+    while (auto buf = in.read().get0()) {
+        BOOST_REQUIRE_LE(buf.size(), budget);
+        received += buf.size();
+    }
+    BOOST_REQUIRE_EQUAL(received, total);
+    writer.get();
+    in.close().get();
+}
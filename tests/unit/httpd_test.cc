@@ -3,6 +3,7 @@
  */
 
 #include <seastar/http/httpd.hh>
+#include <seastar/http/client.hh>
 #include <seastar/http/handlers.hh>
 #include <seastar/http/matcher.hh>
 #include <seastar/http/matchrules.hh>
@@ -10,16 +11,27 @@
 #include <seastar/http/routes.hh>
 #include <seastar/http/exception.hh>
 #include <seastar/http/transformers.hh>
+#include <seastar/http/file_handler.hh>
+#include <seastar/http/compression.hh>
+#include <seastar/http/function_handlers.hh>
+#include <seastar/http/websocket.hh>
+#include <seastar/core/byteorder.hh>
 #include <seastar/core/do_with.hh>
 #include <seastar/core/loop.hh>
 #include <seastar/core/when_all.hh>
 #include <seastar/testing/test_case.hh>
 #include <seastar/testing/thread_test_case.hh>
 #include "loopback_socket.hh"
+#include "tmpdir.hh"
 #include <boost/algorithm/string.hpp>
 #include <seastar/core/thread.hh>
 #include <seastar/util/noncopyable_function.hh>
 #include <seastar/http/json_path.hh>
+#include <seastar/http/internal/hpack.hh>
+#include <seastar/http/internal/http2.hh>
+#include <fstream>
+#include <map>
+#include <random>
 #include <sstream>
 
 using namespace seastar;
@@ -244,6 +256,156 @@ SEASTAR_TEST_CASE(test_routes) {
     });
 }
 
+SEASTAR_THREAD_TEST_CASE(test_route_stats) {
+    routes route;
+    route.enable_metrics("route_stats_test");
+    auto ok = new function_handler([] (const_req req) {
+        return "ok";
+    }, "txt");
+    auto bad = new function_handler([] (const_req req) -> sstring {
+        throw bad_param_exception("bad");
+    }, "txt");
+    route.put(GET, "/ok", ok);
+    route.add(GET, url("/bad").remainder("path"), bad);
+    // a handler registered with a second path counts its requests there
+    route.put(GET, "/also_ok", ok);
+
+    auto handle = [&route] (sstring path) {
+        return int(route.handle(path, std::make_unique<request>(), std::make_unique<reply>()).get0()->_status);
+    };
+    BOOST_REQUIRE_EQUAL(handle("/ok"), int(reply::status_type::ok));
+    BOOST_REQUIRE_EQUAL(handle("/also_ok"), int(reply::status_type::ok));
+    BOOST_REQUIRE_EQUAL(handle("/also_ok"), int(reply::status_type::ok));
+    BOOST_REQUIRE_EQUAL(handle("/bad/x"), int(reply::status_type::bad_request));
+    BOOST_REQUIRE_EQUAL(handle("/missing"), int(reply::status_type::not_found));
+
+    auto ok_stats = route.get_stats(GET, "/ok");
+    BOOST_REQUIRE(ok_stats);
+    BOOST_REQUIRE_EQUAL(ok_stats->requests, 1);
+    BOOST_REQUIRE_EQUAL(ok_stats->replies[1], 1);
+    BOOST_REQUIRE_EQUAL(ok_stats->latency.count(), 1);
+    auto also_ok_stats = route.get_stats(GET, "/also_ok");
+    BOOST_REQUIRE(also_ok_stats);
+    BOOST_REQUIRE_EQUAL(also_ok_stats->requests, 2);
+    BOOST_REQUIRE_EQUAL(also_ok_stats->replies[1], 2);
+    auto bad_stats = route.get_stats(GET, "/bad/{path}");
+    BOOST_REQUIRE(bad_stats);
+    BOOST_REQUIRE_EQUAL(bad_stats->requests, 1);
+    BOOST_REQUIRE_EQUAL(bad_stats->replies[3], 1);
+    BOOST_REQUIRE(!route.get_stats(POST, "/ok"));
+
+    // dropping a path leaves the others of the handler alone
+    route.drop(GET, "/ok");
+    BOOST_REQUIRE(!route.get_stats(GET, "/ok"));
+    BOOST_REQUIRE_EQUAL(handle("/also_ok"), int(reply::status_type::ok));
+    BOOST_REQUIRE_EQUAL(also_ok_stats->requests, 3);
+    route.drop(GET, "/also_ok");
+    BOOST_REQUIRE(!route.get_stats(GET, "/also_ok"));
+    // the metrics of the path were unregistered with it
+    route.put(GET, "/ok", ok);
+    BOOST_REQUIRE_EQUAL(route.get_stats(GET, "/ok")->requests, 0);
+}
+
+SEASTAR_TEST_CASE(test_routes_rule_matching) {
+    routes route;
+    auto h1 = new handl();
+    auto h2 = new handl();
+    auto h3 = new handl();
+    auto h4 = new handl();
+    auto h5 = new handl();
+    route.add(&(new match_rule(h1))->add_str("/api/users").add_param("id"), GET);
+    route.add(&(new match_rule(h2))->add_str("/api/users").add_param("id").add_str("/items").add_param("item"), GET);
+    route.add(&(new match_rule(h3))->add_str("/api/users/me"), GET);
+    route.add(&(new match_rule(h4))->add_str("/api").add_param("path", true), GET);
+    route.add(&(new match_rule(h5))->add_str("/api/user"), GET);
+
+    httpd::handler_base* nl = nullptr;
+    parameters params;
+    BOOST_REQUIRE_EQUAL(route.get_handler(GET, "/api/users/17", params), h1);
+    BOOST_REQUIRE_EQUAL(params["id"], "17");
+    params.clear();
+    BOOST_REQUIRE_EQUAL(route.get_handler(GET, "/api/users/17/items/3", params), h2);
+    BOOST_REQUIRE_EQUAL(params["id"], "17");
+    BOOST_REQUIRE_EQUAL(params["item"], "3");
+    params.clear();
+    // an earlier rule wins over a more specific one
+    BOOST_REQUIRE_EQUAL(route.get_handler(GET, "/api/users/me", params), h1);
+    BOOST_REQUIRE_EQUAL(params["id"], "me");
+    params.clear();
+    BOOST_REQUIRE_EQUAL(route.get_handler(GET, "/api/user", params), h4);
+    BOOST_REQUIRE_EQUAL(params.path("path"), "/user");
+    params.clear();
+    BOOST_REQUIRE_EQUAL(route.get_handler(GET, "/api", params), h4);
+    BOOST_REQUIRE_EQUAL(params.path("path"), "");
+    params.clear();
+    BOOST_REQUIRE_EQUAL(route.get_handler(GET, "/apix", params), nl);
+    BOOST_REQUIRE_EQUAL(route.get_handler(POST, "/api/users/17", params), nl);
+
+    // a rule removed and added again goes last
+    auto r1 = route.del_cookie(0, GET);
+    route.add(r1, GET);
+    BOOST_REQUIRE_EQUAL(route.get_handler(GET, "/api/users/me", params), h3);
+    return make_ready_future<>();
+}
+
+// a matcher the routes cannot index
+class even_length_matcher : public matcher {
+public:
+    virtual size_t match(const sstring& url, size_t ind, parameters& param) override {
+        return (url.size() - ind) % 2 ? sstring::npos : url.size();
+    }
+};
+
+SEASTAR_TEST_CASE(test_routes_match_in_order) {
+    // any set of rules matches like trying them one by one
+    std::mt19937 rng(1);
+    const char* literals[] = {"/a", "/b", "/ab", "/a/b", "/abc", "a", "/"};
+    for (int round = 0; round < 500; round++) {
+        routes route;
+        std::vector<match_rule*> rules;
+        for (int r = 0; r < 8; r++) {
+            auto rule = new match_rule(new handl());
+            for (unsigned k = 0, n = rng() % 4; k < n; k++) {
+                auto t = rng() % 7;
+                if (t < 4) {
+                    rule->add_str(literals[rng() % std::size(literals)]);
+                } else if (t < 6) {
+                    rule->add_param(format("p{}", k), rng() % 4 == 0);
+                } else {
+                    rule->add_matcher(new even_length_matcher());
+                }
+            }
+            rules.push_back(rule);
+            route.add(rule, GET);
+        }
+        for (int u = 0; u < 50; u++) {
+            sstring url;
+            for (unsigned i = 0, len = rng() % 8; i < len; i++) {
+                url += sstring(1, "/abx"[rng() % 4]);
+            }
+            parameters expected_params;
+            httpd::handler_base* expected = nullptr;
+            for (auto rule : rules) {
+                expected = rule->get(url, expected_params);
+                if (expected) {
+                    break;
+                }
+                expected_params.clear();
+            }
+            parameters params;
+            BOOST_REQUIRE_EQUAL(route.get_handler(GET, url, params), expected);
+            for (unsigned k = 0; k < 4; k++) {
+                auto name = format("p{}", k);
+                BOOST_REQUIRE_EQUAL(params.exists(name), expected_params.exists(name));
+                if (params.exists(name)) {
+                    BOOST_REQUIRE_EQUAL(params.path(name), expected_params.path(name));
+                }
+            }
+        }
+    }
+    return make_ready_future<>();
+}
+
 SEASTAR_TEST_CASE(test_json_path) {
     shared_ptr<bool> res1 = make_shared<bool>(false);
     shared_ptr<bool> res2 = make_shared<bool>(false);
@@ -862,6 +1024,78 @@ SEASTAR_TEST_CASE(test_unparsable_request) {
     });
 }
 
+SEASTAR_TEST_CASE(test_too_many_header_fields) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        loopback_socket_impl lsi(lcf);
+        httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+        future<> client = seastar::async([&lsi] {
+            connected_socket c_socket = lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).get0();
+            input_stream<char> input(c_socket.input());
+            output_stream<char> output(c_socket.output());
+
+            sstring fields;
+            for (size_t i = 0; i < header_map::max_request_fields; i++) {
+                fields += format("X-Field-{}: {}\r\n", i, i);
+            }
+            output.write(sstring("GET /test HTTP/1.1\r\n") + fields + "\r\n").get();
+            output.flush().get();
+            auto resp = input.read().get0();
+            BOOST_REQUIRE_NE(std::string(resp.get(), resp.size()).find("200 OK"), std::string::npos);
+
+            output.write(sstring("GET /test HTTP/1.1\r\n") + fields + "Host: test\r\n\r\n").get();
+            output.flush().get();
+            resp = input.read().get0();
+            BOOST_REQUIRE_NE(std::string(resp.get(), resp.size()).find("431 Request Header Fields Too Large"), std::string::npos);
+
+            input.close().get();
+            output.close().get();
+        });
+
+        auto handler = new json_test_handler(json::stream_object("hello"));
+        server._routes.put(GET, "/test", handler);
+        server.do_accepts(0).get();
+
+        client.get();
+        server.stop().get();
+    });
+}
+
+// the server's own Server and Date fields give way to the handler's
+SEASTAR_THREAD_TEST_CASE(test_handler_server_header) {
+    loopback_connection_factory lcf;
+    http_server server("test");
+    loopback_socket_impl lsi(lcf);
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+    future<> client = seastar::async([&lsi] {
+        connected_socket c_socket = lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).get0();
+        input_stream<char> input(c_socket.input());
+        output_stream<char> output(c_socket.output());
+
+        output.write(sstring("GET /server HTTP/1.1\r\nHost: test\r\n\r\n")).get();
+        output.flush().get();
+        auto resp = input.read().get0();
+        auto head = std::string(resp.get(), resp.size());
+        BOOST_REQUIRE_NE(head.find("\r\nServer: custom\r\n"), std::string::npos);
+        BOOST_REQUIRE_EQUAL(head.find("Seastar httpd"), std::string::npos);
+        BOOST_REQUIRE_NE(head.find("\r\nDate: "), std::string::npos);
+
+        input.close().get();
+        output.close().get();
+    });
+
+    server._routes.put(GET, "/server", new function_handler([] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+        rep->_headers["Server"] = "custom";
+        rep->write_body("txt", sstring("ok"));
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }, "txt"));
+    server.do_accepts(0).get();
+
+    client.get();
+    server.stop().get();
+}
+
 SEASTAR_TEST_CASE(case_insensitive_header) {
     std::unique_ptr<seastar::httpd::request> req = std::make_unique<seastar::httpd::request>();
     req->_headers["conTEnt-LengtH"] = "17";
@@ -887,3 +1121,784 @@ SEASTAR_THREAD_TEST_CASE(multiple_connections) {
     server.stop().get();
     lcf.destroy_all_shards().get();
 }
+
+// replies with the request body, read from the content stream if there is
+// one, or only with its first buffer if the request says so
+class body_echo_handler : public handler_base {
+public:
+    virtual future<std::unique_ptr<reply>> handle(const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep) override {
+        if (!req->content_stream) {
+            rep->write_body("txt", "[" + req->content + "]");
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        }
+        bool first_only = req->get_query_param("first") == "1";
+        return do_with(std::move(req), sstring(), [rep = std::move(rep), first_only] (std::unique_ptr<request>& req, sstring& body) mutable {
+            return repeat([&req, &body, first_only] {
+                return req->content_stream->read().then([&body, first_only] (temporary_buffer<char> buf) {
+                    body.append(buf.get(), buf.size());
+                    return stop_iteration(buf.empty() || first_only);
+                });
+            }).then([&body, rep = std::move(rep)] () mutable {
+                rep->write_body("txt", "[" + body + "]");
+                return std::move(rep);
+            });
+        });
+    }
+};
+
+static void check_body_requests(bool streaming, std::vector<std::pair<sstring, sstring>> requests) {
+    loopback_connection_factory lcf;
+    http_server server("test");
+    server.set_content_length_limit(11);
+    server.set_content_streaming(streaming);
+    loopback_socket_impl lsi(lcf);
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+
+    future<> client = seastar::async([&lsi, &requests] {
+        connected_socket c_socket = lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).get0();
+        input_stream<char> input(c_socket.input());
+        output_stream<char> output(c_socket.output());
+
+        for (auto&& [req, expected] : requests) {
+            output.write(req).get();
+            output.flush().get();
+            auto resp = input.read().get0();
+            BOOST_REQUIRE_NE(std::string(resp.get(), resp.size()).find(expected), std::string::npos);
+        }
+
+        input.close().get();
+        output.close().get();
+    });
+
+    server._routes.put(POST, "/test", new body_echo_handler());
+    server.do_accepts(0).get();
+
+    client.get();
+    server.stop().get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_chunked_request_body) {
+    check_body_requests(false, {
+        {"POST /test HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "4\r\nWiki\r\n5;name=value\r\npedia\r\n0\r\nX-Trailer: x\r\n\r\n", "[Wikipedia]"},
+        {"POST /test HTTP/1.1\r\nHost: test\r\nContent-Length: 5\r\n\r\nhello", "[hello]"},
+        // Content-Length is ignored with chunked encoding
+        {"POST /test HTTP/1.1\r\nHost: test\r\nContent-Length: 100\r\nTransfer-Encoding: Chunked\r\n\r\n"
+                "3\r\nabc\r\n0\r\n\r\n", "[abc]"},
+        {"POST /test HTTP/1.1\r\nHost: test\r\n\r\n", "[]"},
+        {"POST /test HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "8\r\nxxxxxxxx\r\n8\r\nxxxxxxxx\r\n0\r\n\r\n", "413 Payload Too Large"},
+    });
+    check_body_requests(false, {
+        {"POST /test HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "zz\r\nWiki\r\n0\r\n\r\n", "400 Bad Request"},
+    });
+}
+
+SEASTAR_THREAD_TEST_CASE(test_streamed_request_body) {
+    check_body_requests(true, {
+        {"POST /test HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "4\r\nWiki\r\n5\r\npedia\r\n0\r\n\r\n", "[Wikipedia]"},
+        // no content length limit with streaming
+        {"POST /test HTTP/1.1\r\nHost: test\r\nContent-Length: 16\r\n\r\n0123456789abcdef", "[0123456789abcdef]"},
+        // the unread rest of the body is skipped
+        {"POST /test?first=1 HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "3\r\nabc\r\n3\r\ndef\r\n0\r\n\r\n", "[abc]"},
+        // no body, no stream
+        {"POST /test HTTP/1.1\r\nHost: test\r\n\r\n", "[]"},
+        {"POST /test HTTP/1.1\r\nHost: test\r\nContent-Length: 2\r\n\r\nok", "[ok]"},
+    });
+}
+
+SEASTAR_TEST_CASE(test_hpack) {
+    auto unhex = [] (const char* s) {
+        std::string r;
+        for (; *s; s += 2) {
+            r.push_back(char(std::stoi(std::string(s, 2), nullptr, 16)));
+        }
+        return r;
+    };
+    // RFC 7541, appendix C.4: requests with Huffman coding
+    hpack_decoder dec;
+    auto h = dec.decode(unhex("828684418cf1e3c2e5f23a6ba0ab90f4ff"));
+    BOOST_REQUIRE(h);
+    BOOST_REQUIRE_EQUAL(h->size(), 4);
+    BOOST_REQUIRE_EQUAL((*h)[0].first, ":method");
+    BOOST_REQUIRE_EQUAL((*h)[0].second, "GET");
+    BOOST_REQUIRE_EQUAL((*h)[3].first, ":authority");
+    BOOST_REQUIRE_EQUAL((*h)[3].second, "www.example.com");
+    BOOST_REQUIRE_EQUAL(dec.table_size(), 57);
+    h = dec.decode(unhex("828684be5886a8eb10649cbf"));
+    BOOST_REQUIRE(h);
+    BOOST_REQUIRE_EQUAL(h->size(), 5);
+    BOOST_REQUIRE_EQUAL((*h)[3].second, "www.example.com");
+    BOOST_REQUIRE_EQUAL((*h)[4].first, "cache-control");
+    BOOST_REQUIRE_EQUAL((*h)[4].second, "no-cache");
+    BOOST_REQUIRE_EQUAL(dec.table_size(), 110);
+    h = dec.decode(unhex("828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"));
+    BOOST_REQUIRE(h);
+    BOOST_REQUIRE_EQUAL((*h)[4].first, "custom-key");
+    BOOST_REQUIRE_EQUAL((*h)[4].second, "custom-value");
+    BOOST_REQUIRE_EQUAL(dec.table_size(), 164);
+
+    BOOST_REQUIRE_THROW(dec.decode(unhex("ff")), hpack_error);
+
+    std::string all;
+    for (int c = 0; c < 256; ++c) {
+        all.push_back(char(c));
+    }
+    auto encoded = huffman_encode(all);
+    BOOST_REQUIRE_EQUAL(encoded.size(), huffman_encoded_size(all));
+    BOOST_REQUIRE_EQUAL(huffman_decode(encoded), sstring(all));
+
+    hpack_encoder enc;
+    std::string block;
+    enc.encode(block, ":status", "200");
+    enc.encode(block, "content-type", "text/plain");
+    enc.encode(block, "x-custom", all);
+    h = hpack_decoder().decode(block);
+    BOOST_REQUIRE(h);
+    BOOST_REQUIRE_EQUAL(h->size(), 3);
+    BOOST_REQUIRE_EQUAL((*h)[0].second, "200");
+    BOOST_REQUIRE_EQUAL((*h)[1].second, "text/plain");
+    BOOST_REQUIRE_EQUAL((*h)[2].second, sstring(all));
+    return make_ready_future<>();
+}
+
+static void write_http2_frame(output_stream<char>& out, http2_connection::frame_type type, uint8_t flags, uint32_t stream_id, std::string_view payload) {
+    char hdr[http2_connection::frame_header_size] = {
+        char(payload.size() >> 16), char(payload.size() >> 8), char(payload.size()),
+        char(type), char(flags),
+        char(stream_id >> 24), char(stream_id >> 16), char(stream_id >> 8), char(stream_id),
+    };
+    out.write(hdr, sizeof(hdr)).get();
+    out.write(payload.data(), payload.size()).get();
+}
+
+struct http2_test_frame {
+    http2_connection::frame_type type;
+    uint8_t flags;
+    uint32_t stream_id;
+    sstring payload;
+};
+
+static http2_test_frame read_http2_frame(input_stream<char>& in) {
+    auto hdr = in.read_exactly(http2_connection::frame_header_size).get0();
+    BOOST_REQUIRE_EQUAL(hdr.size(), http2_connection::frame_header_size);
+    auto p = reinterpret_cast<const uint8_t*>(hdr.get());
+    size_t len = (size_t(p[0]) << 16) | (size_t(p[1]) << 8) | p[2];
+    uint32_t id = ((uint32_t(p[5]) << 24) | (uint32_t(p[6]) << 16) | (uint32_t(p[7]) << 8) | p[8]) & 0x7fffffff;
+    auto payload = in.read_exactly(len).get0();
+    BOOST_REQUIRE_EQUAL(payload.size(), len);
+    return {http2_connection::frame_type(p[3]), p[4], id, sstring(payload.get(), payload.size())};
+}
+
+SEASTAR_THREAD_TEST_CASE(test_http2_prior_knowledge) {
+    using ft = http2_connection::frame_type;
+    constexpr uint8_t end_stream = 0x1;
+    constexpr uint8_t end_headers = 0x4;
+
+    loopback_connection_factory lcf;
+    http_server server("test");
+    server.set_http2(true);
+    loopback_socket_impl lsi(lcf);
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+
+    future<> client = seastar::async([&lsi] {
+        connected_socket c_socket = lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).get0();
+        input_stream<char> input(c_socket.input());
+        output_stream<char> output(c_socket.output());
+
+        output.write(http2_connection::preface.data(), http2_connection::preface.size()).get();
+        write_http2_frame(output, ft::settings, 0, 0, "");
+        hpack_encoder enc;
+        // two requests in flight at once, the second one with a body
+        for (uint32_t id : {1, 3}) {
+            std::string block;
+            enc.encode(block, ":method", id == 1 ? "GET" : "POST");
+            enc.encode(block, ":scheme", "http");
+            enc.encode(block, ":path", "/test");
+            enc.encode(block, ":authority", "test");
+            write_http2_frame(output, ft::headers, end_headers | (id == 1 ? end_stream : 0), id, block);
+        }
+        write_http2_frame(output, ft::data, 0, 3, "hello ");
+        write_http2_frame(output, ft::data, end_stream, 3, "http2");
+        output.flush().get();
+
+        std::map<uint32_t, sstring> bodies;
+        std::map<uint32_t, sstring> statuses;
+        hpack_decoder dec;
+        unsigned done = 0;
+        while (done < 2) {
+            auto f = read_http2_frame(input);
+            if (f.type == ft::headers) {
+                BOOST_REQUIRE(f.flags & end_headers);
+                auto h = dec.decode(f.payload);
+                BOOST_REQUIRE(h);
+                BOOST_REQUIRE_EQUAL((*h)[0].first, ":status");
+                statuses[f.stream_id] = (*h)[0].second;
+            } else if (f.type == ft::data) {
+                bodies[f.stream_id] += f.payload;
+            }
+            if ((f.type == ft::headers || f.type == ft::data) && (f.flags & end_stream)) {
+                ++done;
+            }
+        }
+        BOOST_REQUIRE_EQUAL(statuses[1], "200");
+        BOOST_REQUIRE_EQUAL(bodies[1], "[]");
+        BOOST_REQUIRE_EQUAL(statuses[3], "200");
+        BOOST_REQUIRE_EQUAL(bodies[3], "[hello http2]");
+
+        write_http2_frame(output, ft::goaway, 0, 0, std::string_view("\0\0\0\0\0\0\0\0", 8));
+        output.flush().get();
+        input.close().get();
+        output.close().get();
+    });
+
+    server._routes.put(GET, "/test", new body_echo_handler());
+    server._routes.put(POST, "/test", new body_echo_handler());
+    server.do_accepts(0).get();
+
+    client.get();
+    server.stop().get();
+}
+
+// replies once released
+class blocking_handler : public handler_base {
+    semaphore& _release;
+public:
+    explicit blocking_handler(semaphore& release) : _release(release) {
+    }
+    virtual future<std::unique_ptr<reply>> handle(const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep) override {
+        return _release.wait().then([rep = std::move(rep)] () mutable {
+            return std::move(rep);
+        });
+    }
+};
+
+SEASTAR_THREAD_TEST_CASE(test_http2_stream_abuse) {
+    using ft = http2_connection::frame_type;
+    using ec = http2_connection::error_code;
+    constexpr uint8_t end_stream = 0x1;
+    constexpr uint8_t end_headers = 0x4;
+
+    loopback_connection_factory lcf;
+    http_server server("test");
+    server.set_http2(true);
+    loopback_socket_impl lsi(lcf);
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+    semaphore release(0);
+
+    auto connect = [&lsi] {
+        connected_socket c_socket = lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).get0();
+        auto input = c_socket.input();
+        auto output = c_socket.output();
+        output.write(http2_connection::preface.data(), http2_connection::preface.size()).get();
+        write_http2_frame(output, ft::settings, 0, 0, "");
+        return std::make_tuple(std::move(c_socket), std::move(input), std::move(output));
+    };
+    auto request_block = [] (hpack_encoder& enc) {
+        std::string block;
+        enc.encode(block, ":method", "GET");
+        enc.encode(block, ":scheme", "http");
+        enc.encode(block, ":path", "/block");
+        enc.encode(block, ":authority", "test");
+        return block;
+    };
+    auto wait_for_goaway = [] (input_stream<char>& input) {
+        while (true) {
+            auto f = read_http2_frame(input);
+            if (f.type == ft::goaway) {
+                BOOST_REQUIRE_EQUAL(f.payload.size(), 8);
+                return ec(read_be<uint32_t>(f.payload.data() + 4));
+            }
+        }
+    };
+
+    future<> client = seastar::async([&] {
+        {
+            // streams reset right away, while their handlers still run
+            auto [c_socket, input, output] = connect();
+            hpack_encoder enc;
+            for (uint32_t id = 1; id < 2 * 4 * http2_connection::max_concurrent_streams; id += 2) {
+                write_http2_frame(output, ft::headers, end_headers | end_stream, id, request_block(enc));
+                write_http2_frame(output, ft::rst_stream, 0, id, std::string_view("\0\0\0\x8", 4));
+            }
+            output.flush().get();
+            BOOST_REQUIRE_EQUAL(int(wait_for_goaway(input)), int(ec::enhance_your_calm));
+            release.signal(2 * 4 * http2_connection::max_concurrent_streams);
+            input.close().get();
+            output.close().get();
+        }
+        {
+            // a stream id that was skipped, so is closed
+            auto [c_socket, input, output] = connect();
+            hpack_encoder enc;
+            write_http2_frame(output, ft::headers, end_headers | end_stream, 5, request_block(enc));
+            write_http2_frame(output, ft::headers, end_headers | end_stream, 3, request_block(enc));
+            output.flush().get();
+            BOOST_REQUIRE_EQUAL(int(wait_for_goaway(input)), int(ec::protocol_error));
+            release.signal(1);
+            input.close().get();
+            output.close().get();
+        }
+    });
+
+    server._routes.put(GET, "/block", new blocking_handler(release));
+    server.do_accepts(0).get();
+
+    client.get();
+    server.stop().get();
+}
+
+// connects to the test server, which only accepts connections on shard 0
+class loopback_http_connection_factory : public http::connection_factory {
+    loopback_connection_factory& _lcf;
+    std::vector<std::unique_ptr<loopback_socket_impl>> _sockets;
+public:
+    explicit loopback_http_connection_factory(loopback_connection_factory& lcf) : _lcf(lcf) {
+    }
+    virtual future<connected_socket> make() override {
+        while ((_lcf.next_shard() + 1) % smp::count) {
+        }
+        _sockets.push_back(std::make_unique<loopback_socket_impl>(_lcf));
+        return _sockets.back()->connect(socket_address(ipv4_addr()), socket_address(ipv4_addr()));
+    }
+};
+
+SEASTAR_THREAD_TEST_CASE(test_http_client) {
+    loopback_connection_factory lcf;
+    http_server server("test");
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+    server._routes.put(GET, "/json", new json_test_handler(json::stream_object("hello")));
+    server._routes.put(GET, "/test", new body_echo_handler());
+    server._routes.put(POST, "/test", new body_echo_handler());
+    server.do_accepts(0).get();
+
+    http::client_options options;
+    options.host = "test";
+    http::client client(std::make_unique<loopback_http_connection_factory>(lcf), options);
+
+    for (int i = 0; i < 3; ++i) {
+        auto rsp = client.make_request(http::request("GET", "/test")).get0();
+        BOOST_REQUIRE_EQUAL(rsp.status, 200);
+        BOOST_REQUIRE_EQUAL(rsp.content, "[]");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("content-length"), "2");
+    }
+
+    // a chunked response
+    auto rsp = client.make_request(http::request("GET", "/json")).get0();
+    BOOST_REQUIRE_EQUAL(rsp.status, 200);
+    BOOST_REQUIRE_NE(rsp.content.find("hello"), sstring::npos);
+
+    http::request post("POST", "/test");
+    post.content = "abc";
+    rsp = client.make_request(std::move(post)).get0();
+    BOOST_REQUIRE_EQUAL(rsp.content, "[abc]");
+
+    // a chunked request
+    http::request req("POST", "/test");
+    req.body_writer = [] (output_stream<char>& out) {
+        return out.write("hello ").then([&out] {
+            return out.flush();
+        }).then([&out] {
+            return out.write("world");
+        });
+    };
+    rsp = client.make_request(std::move(req)).get0();
+    BOOST_REQUIRE_EQUAL(rsp.content, "[hello world]");
+
+    // the body is streamed to the handler, the unread rest is skipped
+    sstring first;
+    post = http::request("POST", "/test");
+    post.content = "0123456789";
+    client.make_request(std::move(post), [&first] (const http::response& rsp, input_stream<char>& body) {
+        BOOST_REQUIRE_EQUAL(rsp.status, 200);
+        return body.read_exactly(3).then([&first] (temporary_buffer<char> buf) {
+            first = sstring(buf.get(), buf.size());
+        });
+    }).get();
+    BOOST_REQUIRE_EQUAL(first, "[01");
+
+    rsp = client.make_request(http::request("GET", "/missing")).get0();
+    BOOST_REQUIRE_EQUAL(rsp.status, 404);
+
+    // all on one keep-alive connection
+    BOOST_REQUIRE_EQUAL(client.total_new_connections(), 1);
+    BOOST_REQUIRE_EQUAL(client.idle_connections(), 1);
+
+    client.close().get();
+    server.stop().get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_http_client_pipelining) {
+    loopback_connection_factory lcf;
+    http_server server("test");
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+    server._routes.put(POST, "/test", new body_echo_handler());
+    server.do_accepts(0).get();
+
+    http::client_options options;
+    options.host = "test";
+    options.max_connections = 1;
+    options.pipeline_depth = 4;
+    http::client client(std::make_unique<loopback_http_connection_factory>(lcf), options);
+
+    std::vector<future<http::response>> responses;
+    for (int i = 0; i < 16; ++i) {
+        http::request req("POST", "/test");
+        req.content = to_sstring(i);
+        responses.push_back(client.make_request(std::move(req)));
+    }
+    for (int i = 0; i < 16; ++i) {
+        auto rsp = responses[i].get0();
+        BOOST_REQUIRE_EQUAL(rsp.status, 200);
+        BOOST_REQUIRE_EQUAL(rsp.content, "[" + to_sstring(i) + "]");
+    }
+    BOOST_REQUIRE_EQUAL(client.total_new_connections(), 1);
+
+    client.close().get();
+    server.stop().get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_file_handler) {
+    tmpdir dir;
+    sstring small, large;
+    for (int i = 0; i < 100; ++i) {
+        small += to_sstring(i % 10);
+    }
+    for (int i = 0; i < 100000; ++i) {
+        large += to_sstring(i % 7);
+    }
+    std::ofstream(dir.path() / "small.txt") << small;
+    std::ofstream(dir.path() / "large.txt") << large;
+
+    loopback_connection_factory lcf;
+    http_server server("test");
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+    auto handler = new directory_handler(sstring(dir.path().native()));
+    handler->enable_cache(1024, 512);
+    server._routes.add(GET, url("/files").remainder("path"), handler);
+    server.do_accepts(0).get();
+
+    http::client_options options;
+    options.host = "test";
+    http::client client(std::make_unique<loopback_http_connection_factory>(lcf), options);
+    auto get = [&client] (sstring path, std::vector<std::pair<sstring, sstring>> headers = {}) {
+        http::request req("GET", std::move(path));
+        for (auto& h : headers) {
+            req.add_header(h.first, h.second);
+        }
+        return client.make_request(std::move(req)).get0();
+    };
+
+    for (auto& [name, content] : { std::make_pair("/files/small.txt", small), std::make_pair("/files/large.txt", large) }) {
+        auto rsp = get(name);
+        BOOST_REQUIRE_EQUAL(rsp.status, 200);
+        BOOST_REQUIRE_EQUAL(rsp.content, content);
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Length"), to_sstring(content.size()));
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Type"), "text/plain");
+        auto etag = rsp.get_header("ETag");
+        BOOST_REQUIRE(!etag.empty());
+
+        rsp = get(name, {{"If-None-Match", "\"x\", W/" + etag}});
+        BOOST_REQUIRE_EQUAL(rsp.status, 304);
+        BOOST_REQUIRE_EQUAL(rsp.content, "");
+
+        rsp = get(name, {{"Range", "bytes=10-19"}});
+        BOOST_REQUIRE_EQUAL(rsp.status, 206);
+        BOOST_REQUIRE_EQUAL(rsp.content, content.substr(10, 10));
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Range"), format("bytes 10-19/{}", content.size()));
+
+        rsp = get(name, {{"Range", "bytes=-5"}});
+        BOOST_REQUIRE_EQUAL(rsp.status, 206);
+        BOOST_REQUIRE_EQUAL(rsp.content, content.substr(content.size() - 5));
+
+        rsp = get(name, {{"Range", "bytes=95-"}, {"If-Range", etag}});
+        BOOST_REQUIRE_EQUAL(rsp.status, 206);
+        BOOST_REQUIRE_EQUAL(rsp.content, content.substr(95));
+
+        // a range of another version of the file is not sent
+        rsp = get(name, {{"Range", "bytes=0-1"}, {"If-Range", "\"old\""}});
+        BOOST_REQUIRE_EQUAL(rsp.status, 200);
+        BOOST_REQUIRE_EQUAL(rsp.content, content);
+
+        rsp = get(name, {{"Range", format("bytes={}-", content.size())}});
+        BOOST_REQUIRE_EQUAL(rsp.status, 416);
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Range"), format("bytes */{}", content.size()));
+    }
+
+    // only the small file is cached, and read once
+    BOOST_REQUIRE_EQUAL(handler->get_cache()->size(), small.size());
+    BOOST_REQUIRE_EQUAL(handler->get_cache()->misses(), 1);
+    BOOST_REQUIRE_EQUAL(handler->get_cache()->hits(), 6);
+
+    BOOST_REQUIRE_EQUAL(get("/files/missing.txt").status, 404);
+
+    client.close().get();
+    server.stop().get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_compression) {
+    const std::vector<httpd::content_encoding> all = { content_encoding::zstd, content_encoding::gzip, content_encoding::deflate };
+    BOOST_REQUIRE(select_content_encoding("", all) == content_encoding::identity);
+    BOOST_REQUIRE(select_content_encoding("gzip, deflate", all) == content_encoding::gzip);
+    BOOST_REQUIRE(select_content_encoding("deflate;q=0.5, gzip;q=0.4", all) == content_encoding::deflate);
+    BOOST_REQUIRE(select_content_encoding("*", all) == content_encoding::zstd);
+    BOOST_REQUIRE(select_content_encoding("*, zstd;q=0", all) == content_encoding::gzip);
+    BOOST_REQUIRE(select_content_encoding("br, identity", all) == content_encoding::identity);
+
+    tmpdir dir;
+    sstring text;
+    for (int i = 0; i < 1000; ++i) {
+        text += "compressible ";
+    }
+    std::ofstream(dir.path() / "page.txt") << text;
+    std::ofstream(dir.path() / "page.txt.gz") << "precompressed";
+
+    loopback_connection_factory lcf;
+    http_server server("test");
+    server.set_compression({});
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+    server._routes.put(GET, "/text", new function_handler([&text] (const_req req) {
+        return text;
+    }, "txt"));
+    sstring large;
+    for (int i = 0; i < 10; ++i) {
+        large += text;
+    }
+    server._routes.put(GET, "/large", new function_handler([&large] (const_req req) {
+        return large;
+    }, "txt"));
+    server._routes.put(GET, "/short", new function_handler([] (const_req req) {
+        return sstring("short");
+    }, "txt"));
+    server._routes.put(GET, "/stream", new function_handler([&text] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+        rep->write_body("txt", [&text] (output_stream<char>&& out) {
+            return do_with(std::move(out), [&text] (output_stream<char>& out) {
+                return out.write(text).then([&out] {
+                    return out.close();
+                });
+            });
+        });
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }, "txt"));
+    server._routes.add(GET, url("/files").remainder("path"),
+            (new directory_handler(sstring(dir.path().native())))->set_precompressed(true));
+    server.do_accepts(0).get();
+
+    http::client_options options;
+    options.host = "test";
+    http::client client(std::make_unique<loopback_http_connection_factory>(lcf), options);
+    auto get = [&client] (sstring path, sstring accept_encoding) {
+        http::request req("GET", std::move(path));
+        if (!accept_encoding.empty()) {
+            req.add_header("Accept-Encoding", accept_encoding);
+        }
+        return client.make_request(std::move(req)).get0();
+    };
+    auto starts_with = [] (const sstring& s, std::string_view magic) {
+        return s.size() >= magic.size() && std::string_view(s.data(), magic.size()) == magic;
+    };
+    const std::string_view gzip_magic = "\x1f\x8b";
+    const std::string_view zstd_magic = "\x28\xb5\x2f\xfd";
+
+    auto rsp = get("/text", "");
+    BOOST_REQUIRE_EQUAL(rsp.content, text);
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Vary"), "Accept-Encoding");
+
+    rsp = get("/text", "gzip");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "gzip");
+    BOOST_REQUIRE(starts_with(rsp.content, gzip_magic));
+    BOOST_REQUIRE_LT(rsp.content.size(), text.size());
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Length"), to_sstring(rsp.content.size()));
+
+    rsp = get("/text", "gzip, zstd");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "zstd");
+    BOOST_REQUIRE(starts_with(rsp.content, zstd_magic));
+
+    // too large to be compressed in one go, so it is streamed
+    rsp = get("/large", "zstd");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "zstd");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Transfer-Encoding"), "chunked");
+    BOOST_REQUIRE(starts_with(rsp.content, zstd_magic));
+    BOOST_REQUIRE_LT(rsp.content.size(), text.size());
+
+    // too small to be worth it
+    rsp = get("/short", "gzip");
+    BOOST_REQUIRE_EQUAL(rsp.content, "short");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "");
+
+    rsp = get("/stream", "gzip");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "gzip");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Transfer-Encoding"), "chunked");
+    BOOST_REQUIRE(starts_with(rsp.content, gzip_magic));
+    BOOST_REQUIRE_LT(rsp.content.size(), text.size());
+
+    rsp = get("/files/page.txt", "gzip");
+    BOOST_REQUIRE_EQUAL(rsp.content, "precompressed");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "gzip");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Type"), "text/plain");
+
+    // compressed on the fly instead
+    rsp = get("/files/page.txt", "deflate");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "deflate");
+    BOOST_REQUIRE_EQUAL(rsp.get_header("Vary"), "Accept-Encoding");
+
+    rsp = get("/files/page.txt", "");
+    BOOST_REQUIRE_EQUAL(rsp.content, text);
+
+    client.close().get();
+    server.stop().get();
+}
+
+// a frame from the client, which must be masked
+static void write_websocket_frame(output_stream<char>& out, uint8_t first, std::string_view payload) {
+    static constexpr char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    BOOST_REQUIRE_LT(payload.size(), 126);
+    std::string frame{char(first), char(0x80 | payload.size())};
+    frame.append(mask, sizeof(mask));
+    for (size_t i = 0; i < payload.size(); i++) {
+        frame.push_back(payload[i] ^ mask[i % 4]);
+    }
+    out.write(frame.data(), frame.size()).get();
+    out.flush().get();
+}
+
+struct websocket_test_frame {
+    uint8_t first;
+    sstring payload;
+};
+
+static websocket_test_frame read_websocket_frame(input_stream<char>& in) {
+    auto hdr = in.read_exactly(2).get0();
+    BOOST_REQUIRE_EQUAL(hdr.size(), 2);
+    // frames from the server are not masked
+    BOOST_REQUIRE_EQUAL(hdr[1] & 0x80, 0);
+    size_t len = hdr[1] & 0x7f;
+    BOOST_REQUIRE_LT(len, 126);
+    auto payload = in.read_exactly(len).get0();
+    BOOST_REQUIRE_EQUAL(payload.size(), len);
+    return {uint8_t(hdr[0]), sstring(payload.get(), payload.size())};
+}
+
+SEASTAR_THREAD_TEST_CASE(test_websocket) {
+    constexpr uint8_t fin = 0x80;
+    constexpr uint8_t rsv1 = 0x40;
+    constexpr uint8_t text = 0x1;
+    constexpr uint8_t close = 0x8;
+    constexpr uint8_t ping = 0x9;
+    constexpr uint8_t pong = 0xa;
+
+    loopback_connection_factory lcf;
+    http_server server("test");
+    loopback_socket_impl lsi(lcf);
+    httpd::http_server_tester::listeners(server).emplace_back(lcf.get_server_socket());
+
+    future<> client = seastar::async([&lsi] {
+        connected_socket c_socket = lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).get0();
+        input_stream<char> input(c_socket.input());
+        output_stream<char> output(c_socket.output());
+
+        auto request = [&] (sstring headers) {
+            output.write(sstring("GET /ws HTTP/1.1\r\nHost: test\r\n") + headers + "\r\n").get();
+            output.flush().get();
+            auto resp = input.read().get0();
+            return std::string(resp.get(), resp.size());
+        };
+        sstring upgrade = "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n";
+
+        BOOST_REQUIRE_NE(request("").find("400 Bad Request"), std::string::npos);
+        auto resp = request(upgrade + "Sec-WebSocket-Version: 8\r\n");
+        BOOST_REQUIRE_NE(resp.find("426 Upgrade Required"), std::string::npos);
+        BOOST_REQUIRE_NE(resp.find("Sec-WebSocket-Version: 13"), std::string::npos);
+
+        // the example of RFC 6455, section 1.3
+        resp = request(upgrade + "Sec-WebSocket-Version: 13\r\nSec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n");
+        BOOST_REQUIRE_NE(resp.find("101 Switching Protocols"), std::string::npos);
+        BOOST_REQUIRE_NE(resp.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kZGzzhZK+xOo4=\r\n"), std::string::npos);
+        BOOST_REQUIRE_NE(resp.find("permessage-deflate"), std::string::npos);
+
+        write_websocket_frame(output, fin | text, "hello");
+        auto f = read_websocket_frame(input);
+        BOOST_REQUIRE_EQUAL(f.first, fin | text);
+        BOOST_REQUIRE_EQUAL(f.payload, "hello");
+
+        write_websocket_frame(output, fin | ping, "ping");
+        f = read_websocket_frame(input);
+        BOOST_REQUIRE_EQUAL(f.first, fin | pong);
+        BOOST_REQUIRE_EQUAL(f.payload, "ping");
+
+        // a ping between the fragments of a message is answered first
+        write_websocket_frame(output, text, "frag");
+        write_websocket_frame(output, fin | ping, "");
+        write_websocket_frame(output, fin, "ments");
+        f = read_websocket_frame(input);
+        BOOST_REQUIRE_EQUAL(f.first, fin | pong);
+        f = read_websocket_frame(input);
+        BOOST_REQUIRE_EQUAL(f.first, fin | text);
+        BOOST_REQUIRE_EQUAL(f.payload, "fragments");
+
+        // "Hello" compressed, from RFC 7692, section 7.2.3.1; the echo is
+        // too short to be compressed
+        write_websocket_frame(output, fin | rsv1 | text, std::string_view("\xf2\x48\xcd\xc9\xc9\x07\x00", 7));
+        f = read_websocket_frame(input);
+        BOOST_REQUIRE_EQUAL(f.first, fin | text);
+        BOOST_REQUIRE_EQUAL(f.payload, "Hello");
+
+        std::string long_message(100, 'a');
+        write_websocket_frame(output, fin | text, long_message);
+        f = read_websocket_frame(input);
+        BOOST_REQUIRE_EQUAL(f.first, fin | rsv1 | text);
+        BOOST_REQUIRE_LT(f.payload.size(), long_message.size());
+
+        write_websocket_frame(output, fin | close, std::string_view("\x03\xe8", 2));
+        f = read_websocket_frame(input);
+        BOOST_REQUIRE_EQUAL(f.first, fin | close);
+        BOOST_REQUIRE_EQUAL(f.payload, sstring("\x03\xe8", 2));
+        // and the server closes the connection
+        BOOST_REQUIRE(input.read().get0().empty());
+
+        input.close().get();
+        output.close().get();
+
+        // a close code that must not be sent (1005) fails the connection
+        c_socket = lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).get0();
+        input = input_stream<char>(c_socket.input());
+        output = output_stream<char>(c_socket.output());
+        resp = request(upgrade + "Sec-WebSocket-Version: 13\r\n");
+        BOOST_REQUIRE_NE(resp.find("101 Switching Protocols"), std::string::npos);
+        write_websocket_frame(output, fin | close, std::string_view("\x03\xed", 2));
+        f = read_websocket_frame(input);
+        BOOST_REQUIRE_EQUAL(f.first, fin | close);
+        BOOST_REQUIRE_EQUAL(f.payload, sstring("\x03\xea", 2));
+        BOOST_REQUIRE(input.read().get0().empty());
+
+        input.close().get();
+        output.close().get();
+    });
+
+    websocket::options options;
+    options.type = websocket::message_type::text;
+    server._routes.put(GET, "/ws", new websocket_handler([] (std::unique_ptr<request> req, data_source in, data_sink out) {
+        return do_with(std::move(in), std::move(out), [] (data_source& in, data_sink& out) {
+            return repeat([&in, &out] {
+                return in.get().then([&out] (temporary_buffer<char> msg) {
+                    if (msg.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return out.put(std::move(msg)).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            });
+        });
+    }, options));
+    server.do_accepts(0).get();
+
+    client.get();
+    server.stop().get();
+}
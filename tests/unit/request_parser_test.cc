@@ -72,3 +72,36 @@ SEASTAR_TEST_CASE(test_header_parsing) {
     }
     return make_ready_future<>();
 }
+
+SEASTAR_TEST_CASE(test_header_order_and_case) {
+    sstring msg = "GET /hello HTTP/1.1\r\nHost: test\r\nAccept: a\r\nX-Folded: x\r\n y\r\naccept: b\r\n z\r\n\r\n";
+    http_request_parser parser;
+    parser.init();
+    BOOST_REQUIRE(parser(temporary_buffer<char>(msg.c_str(), msg.size())).get0().has_value());
+    BOOST_REQUIRE(!parser.failed());
+    auto req = parser.get_parsed_request();
+
+    std::vector<std::pair<sstring, sstring>> expected = {
+        { "Host", "test" },
+        { "Accept", "a,b z" },
+        { "X-Folded", "x y" },
+    };
+    BOOST_REQUIRE_EQUAL(req->_headers.size(), expected.size());
+    auto it = req->_headers.begin();
+    for (auto& e : expected) {
+        BOOST_REQUIRE_EQUAL(it->first, e.first);
+        BOOST_REQUIRE_EQUAL(it->second, e.second);
+        ++it;
+    }
+    BOOST_REQUIRE_EQUAL(req->get_header("ACCEPT"), "a,b z");
+    BOOST_REQUIRE_EQUAL(req->_headers.count("x-folded"), 1u);
+    BOOST_REQUIRE_EQUAL(req->_headers.count("X-Fold"), 0u);
+
+    req->_headers["host"] = "other";
+    BOOST_REQUIRE_EQUAL(req->_headers.begin()->second, "other");
+    BOOST_REQUIRE(!req->_headers.emplace("HOST", "ignored").second);
+    BOOST_REQUIRE_EQUAL(req->_headers.erase("accept"), 1u);
+    BOOST_REQUIRE_EQUAL(req->_headers.size(), 2u);
+    BOOST_REQUIRE_EQUAL(req->get_header("Accept"), "");
+    return make_ready_future<>();
+}
@@ -25,15 +25,23 @@
 #include <seastar/rpc/lz4_compressor.hh>
 #include <seastar/rpc/lz4_fragmented_compressor.hh>
 #include <seastar/rpc/multi_algo_compressor_factory.hh>
+#include <seastar/rpc/zstd_compressor.hh>
+#include <seastar/net/shm_socket.hh>
+#include <seastar/net/unix_address.hh>
 #include <seastar/testing/test_case.hh>
 #include <seastar/testing/thread_test_case.hh>
 #include <seastar/testing/test_runner.hh>
+#include <seastar/core/reactor.hh>
 #include <seastar/core/thread.hh>
 #include <seastar/core/sleep.hh>
 #include <seastar/core/distributed.hh>
 #include <seastar/core/loop.hh>
+#include <seastar/core/with_scheduling_group.hh>
 #include <seastar/util/defer.hh>
 #include <seastar/util/log.hh>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 
 using namespace seastar;
 
@@ -685,6 +693,38 @@ SEASTAR_THREAD_TEST_CASE(test_rpc_scheduling_connection_based_compatibility) {
     }).get();
 }
 
+SEASTAR_THREAD_TEST_CASE(test_rpc_fair_outgoing_queue) {
+    auto bulk_sg = create_scheduling_group("bulk", 10).get0();
+    auto bulk_sg_kill = defer([&] { destroy_scheduling_group(bulk_sg).get(); });
+    rpc::client_options co;
+    co.fair_outgoing_queue = true;
+    rpc_test_env<>::do_with_thread(rpc_test_config(), co, [bulk_sg] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        constexpr int nr_bulk = 200;
+        int bulk_received = 0;
+        env.register_handler(1, [&bulk_received] (sstring payload) {
+            bulk_received++;
+        }).get();
+        env.register_handler(2, [&bulk_received] {
+            return bulk_received;
+        }).get();
+        auto bulk = env.proto().make_client<void (sstring)>(1);
+        auto probe = env.proto().make_client<int ()>(2);
+
+        auto payload = sstring(64 * 1024, 'x');
+        std::vector<future<>> fs;
+        with_scheduling_group(bulk_sg, [&] {
+            for (int i = 0; i < nr_bulk; i++) {
+                fs.push_back(bulk(c1, payload));
+            }
+        }).get();
+        // queued behind the bulk frames, but must not wait for all of them
+        auto seen = probe(c1).get0();
+        when_all_succeed(fs.begin(), fs.end()).get();
+        BOOST_REQUIRE_LT(seen, nr_bulk);
+        BOOST_REQUIRE_EQUAL(bulk_received, nr_bulk);
+    }).get();
+}
+
 void test_compressor(std::function<std::unique_ptr<seastar::rpc::compressor>()> compressor_factory) {
     using namespace seastar::rpc;
 
@@ -939,6 +979,509 @@ SEASTAR_THREAD_TEST_CASE(test_lz4_fragmented_compressor) {
     test_compressor([] { return std::make_unique<rpc::lz4_fragmented_compressor>(); });
 }
 
+static rpc::zstd_dictionary make_test_zstd_dictionary() {
+    // Repetitive, slightly varying messages, like the ones a dictionary is for.
+    std::vector<temporary_buffer<char>> samples;
+    for (int i = 0; i < 1000; i++) {
+        auto msg = format("{{\"verb\": \"mutation\", \"keyspace\": \"ks{}\", \"table\": \"t{}\", \"timestamp\": {}}}", i % 7, i % 13, i * 7919);
+        samples.emplace_back(msg.data(), msg.size());
+    }
+    return rpc::zstd_dictionary::train(samples, 4096);
+}
+
+SEASTAR_THREAD_TEST_CASE(test_zstd_compressor) {
+    test_compressor([] { return std::make_unique<rpc::zstd_compressor>(); });
+}
+
+SEASTAR_THREAD_TEST_CASE(test_zstd_decompressed_size_limit) {
+    // A megabyte of zeros compresses to a few dozen bytes.
+    auto make_frame = [] (size_t size) {
+        auto buf = temporary_buffer<char>(size);
+        std::fill_n(buf.get_write(), size, 0);
+        return rpc::zstd_compressor().compress(0, rpc::snd_buf(std::move(buf)));
+    };
+    auto to_rcv_buf = [] (rpc::snd_buf buf) {
+        auto& tb = std::get<temporary_buffer<char>>(buf.bufs);
+        return rpc::rcv_buf(std::move(tb));
+    };
+    auto limited = rpc::zstd_compressor(rpc::zstd_compressor::default_level, nullptr, 64 * 1024);
+    BOOST_REQUIRE_EQUAL(limited.decompress(to_rcv_buf(make_frame(64 * 1024))).size, 64 * 1024);
+    BOOST_REQUIRE_THROW(limited.decompress(to_rcv_buf(make_frame(64 * 1024 + 1))), std::runtime_error);
+    BOOST_REQUIRE_THROW(limited.decompress(to_rcv_buf(make_frame(1024 * 1024))), std::runtime_error);
+}
+
+SEASTAR_THREAD_TEST_CASE(test_zstd_compressor_with_dictionary) {
+    auto factory = rpc::zstd_compressor::factory(rpc::zstd_compressor::default_level, {make_test_zstd_dictionary()});
+    test_compressor([&factory] { return factory.negotiate(factory.supported(), true); });
+}
+
+SEASTAR_THREAD_TEST_CASE(test_zstd_dictionary_negotiation) {
+    auto dict = make_test_zstd_dictionary();
+    auto with_dict = rpc::zstd_compressor::factory(rpc::zstd_compressor::default_level, {dict});
+    auto without_dict = rpc::zstd_compressor::factory();
+    auto dict_name = format("ZSTD_DICT_{:08x}", dict.id());
+
+    BOOST_REQUIRE_EQUAL(with_dict.supported(), dict_name + ",ZSTD");
+    BOOST_REQUIRE_EQUAL(with_dict.negotiate(with_dict.supported(), true)->name(), dict_name);
+    // A peer that does not have the dictionary falls back to plain zstd.
+    BOOST_REQUIRE_EQUAL(without_dict.negotiate(with_dict.supported(), true)->name(), "ZSTD");
+    BOOST_REQUIRE_EQUAL(with_dict.negotiate(without_dict.supported(), false)->name(), "ZSTD");
+
+    rpc::multi_algo_compressor_factory server({&with_dict});
+    rpc::multi_algo_compressor_factory client({&with_dict});
+    rpc_test_config cfg;
+    cfg.server_options.compressor_factory = &server;
+    rpc::client_options co;
+    co.compressor_factory = &client;
+    rpc_test_env<>::do_with_thread(cfg, co, [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        env.register_handler(1, [] (sstring s) {
+            return make_ready_future<sstring>(s + s);
+        }).get();
+        auto twice = env.proto().make_client<sstring (sstring)>(1);
+        auto msg = sstring("{\"verb\": \"mutation\", \"keyspace\": \"ks1\"}");
+        BOOST_REQUIRE_EQUAL(twice(c1, msg).get0(), msg + msg);
+    }).get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_adaptive_compression) {
+    auto factory = rpc::lz4_compressor::factory();
+    rpc_test_config cfg;
+    cfg.server_options.compressor_factory = &factory;
+    rpc::client_options co;
+    co.compressor_factory = &factory;
+    co.adaptive_compression.enabled = true;
+    co.adaptive_compression.min_size = 128;
+    co.adaptive_compression.probe_interval = 4;
+    rpc_test_env<>::do_with_thread(cfg, co, [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        for (int verb : {1, 2, 3}) {
+            env.register_handler(verb, [] (sstring s) {
+                return uint64_t(s.size());
+            }).get();
+        }
+        auto random = env.proto().make_client<uint64_t (sstring)>(1);
+        auto text = env.proto().make_client<uint64_t (sstring)>(2);
+        auto small = env.proto().make_client<uint64_t (sstring)>(3);
+
+        auto& eng = testing::local_random_engine;
+        auto dist = std::uniform_int_distribution<char>();
+        auto random_payload = sstring(sstring::initialized_later(), 4096);
+        std::generate(random_payload.begin(), random_payload.end(), [&] { return dist(eng); });
+        auto text_payload = sstring(4096, 'a');
+        auto small_payload = sstring(16, 'a');
+
+        for (int i = 0; i < 9; i++) {
+            BOOST_REQUIRE_EQUAL(random(c1, random_payload).get0(), random_payload.size());
+            BOOST_REQUIRE_EQUAL(text(c1, text_payload).get0(), text_payload.size());
+            BOOST_REQUIRE_EQUAL(small(c1, small_payload).get0(), small_payload.size());
+        }
+
+        auto stats = c1.get_compression_stats();
+        // incompressible: the first frame is sampled, then one in four bypassed frames is re-sampled
+        BOOST_REQUIRE_EQUAL(stats[1].compressed, 3);
+        BOOST_REQUIRE_EQUAL(stats[1].bypassed, 6);
+        BOOST_REQUIRE_GT(stats[1].ratio(), 0.9);
+        BOOST_REQUIRE_EQUAL(stats[2].compressed, 9);
+        BOOST_REQUIRE_EQUAL(stats[2].bypassed, 0);
+        BOOST_REQUIRE_LT(stats[2].ratio(), 0.1);
+        BOOST_REQUIRE_EQUAL(stats[3].compressed, 0);
+        BOOST_REQUIRE_EQUAL(stats[3].bypassed, 9);
+    }).get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_write_batching) {
+    rpc_test_config cfg;
+    rpc::client_options co;
+    co.write_batching.enabled = true;
+    co.write_batching.window = std::chrono::milliseconds(1);
+    rpc_test_env<>::do_with_thread(cfg, co, [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        int received = 0;
+        env.register_handler(1, [&received] (int x) {
+            received++;
+            return rpc::no_wait;
+        }).get();
+        env.register_handler(2, [&received] {
+            return received;
+        }).get();
+        auto notify = env.proto().make_client<rpc::no_wait_type (int)>(1);
+        auto count = env.proto().make_client<int ()>(2);
+
+        const int messages = 100;
+        std::vector<future<>> fs;
+        for (int i = 0; i < messages; i++) {
+            fs.push_back(notify(c1, i));
+        }
+        when_all_succeed(fs.begin(), fs.end()).get();
+        BOOST_REQUIRE_EQUAL(count(c1).get0(), messages);
+
+        auto stats = c1.get_stats();
+        // the notifications were all queued before the connection got to
+        // send any of them, so they should have gone out in very few writes
+        BOOST_REQUIRE_LT(stats.write_batches, messages / 10);
+        BOOST_REQUIRE_EQUAL(boost::accumulate(stats.write_batch_sizes, rpc::stats::counter_type(0)), stats.write_batches);
+    }).get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_verb_metrics) {
+    rpc_test_env<>::do_with_thread(rpc_test_config(), [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        env.proto().enable_verb_metrics("test");
+        env.register_handler(1, [] (int a, int b) {
+            return sleep(std::chrono::milliseconds(10)).then([a, b] {
+                return a + b;
+            });
+        }).get();
+        auto sum = env.proto().make_client<int (int, int)>(1);
+        for (int i = 0; i < 3; i++) {
+            BOOST_REQUIRE_EQUAL(sum(c1, i, 1).get0(), i + 1);
+        }
+
+        auto vs = env.proto().get_verb_metrics()->find(1);
+        BOOST_REQUIRE(vs);
+        BOOST_REQUIRE_EQUAL(vs->round_trip.count(), 3);
+        BOOST_REQUIRE_EQUAL(vs->handler.count(), 3);
+        BOOST_REQUIRE_EQUAL(vs->queue_wait.count(), 3);
+        BOOST_REQUIRE_EQUAL(vs->server_in_flight, 0);
+        BOOST_REQUIRE_EQUAL(vs->client_in_flight, 0);
+        BOOST_REQUIRE(vs->handler.sum() >= std::chrono::milliseconds(30));
+        BOOST_REQUIRE(vs->round_trip.sum() >= vs->handler.sum());
+        BOOST_REQUIRE(!env.proto().get_verb_metrics()->find(2));
+
+        auto h = vs->handler.to_metrics_histogram();
+        BOOST_REQUIRE_EQUAL(h.sample_count, 3);
+        BOOST_REQUIRE_EQUAL(h.buckets.back().count, 3);
+        // 10ms is way above the lowest buckets
+        BOOST_REQUIRE_EQUAL(h.buckets[10].count, 0);
+    }).get();
+}
+
+// Whether a dropped request was shed as overloaded, which the server
+// replies to, rather than left to time out.
+static bool shed_as_overloaded(future<> f) {
+    try {
+        f.get();
+    } catch (rpc::overloaded_error&) {
+        return true;
+    } catch (rpc::timeout_error&) {
+        return false;
+    }
+    BOOST_FAIL("the request was not dropped");
+    return false;
+}
+
+SEASTAR_THREAD_TEST_CASE(test_load_shedding) {
+    rpc_test_config cfg;
+    // room for a single request at a time
+    cfg.resource_limits = {60, 1, 100};
+    cfg.server_options.load_shedding = true;
+    rpc::client_options co;
+    co.send_timeout_data = true;
+    rpc_test_env<>::do_with_thread(cfg, co, [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        int started = 0;
+        semaphore release(0);
+        env.register_handler(1, [&] {
+            started++;
+            return release.wait();
+        }).get();
+        auto block = env.proto().make_client<void ()>(1);
+
+        auto first = block(c1, std::chrono::seconds(10));
+        while (started < 1) {
+            thread::yield();
+        }
+        // waits for the first request to finish
+        auto second = block(c1, std::chrono::seconds(10));
+        sleep(std::chrono::milliseconds(100)).get();
+        release.signal();
+        first.get();
+        while (started < 2) {
+            thread::yield();
+        }
+        // the server now expects a queued request to wait for a while, so
+        // one with a short deadline is not even queued
+        auto overloaded = shed_as_overloaded(block(c1, std::chrono::milliseconds(5)));
+        // queued, but gives up at its deadline
+        BOOST_REQUIRE_THROW(block(c1, std::chrono::milliseconds(50)).get(), rpc::timeout_error);
+        release.signal();
+        second.get();
+        BOOST_REQUIRE_EQUAL(started, 2);
+
+        rpc::stats stats;
+        env.server().foreach_connection([&stats] (const rpc::server::connection& c) {
+            stats = c.get_stats();
+        });
+        BOOST_REQUIRE_EQUAL(stats.shed_timed_out, 1);
+        // normally shed as overloaded, but may have arrived too late
+        BOOST_REQUIRE_EQUAL(stats.shed_overloaded + stats.shed_expired, 1);
+        BOOST_REQUIRE_EQUAL(stats.shed_overloaded, overloaded ? 1 : 0);
+    }).get();
+}
+
+// The estimate of the queueing time must not keep the server shedding
+// requests once an overload has passed.
+SEASTAR_THREAD_TEST_CASE(test_load_shedding_recovers) {
+    rpc_test_config cfg;
+    cfg.resource_limits = {60, 1, 100};
+    cfg.server_options.load_shedding = true;
+    rpc::client_options co;
+    co.send_timeout_data = true;
+    rpc_test_env<>::do_with_thread(cfg, co, [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        int started = 0;
+        semaphore release(0);
+        env.register_handler(1, [&] {
+            started++;
+            return release.wait();
+        }).get();
+        auto block = env.proto().make_client<void ()>(1);
+        auto wait_started = [&] (int n) {
+            while (started < n) {
+                thread::yield();
+            }
+        };
+
+        // an overload, during which a request queues for a second
+        auto first = block(c1, std::chrono::seconds(10));
+        wait_started(1);
+        auto queued = block(c1, std::chrono::seconds(10));
+        sleep(std::chrono::seconds(1)).get();
+        release.signal();
+        first.get();
+        wait_started(2);
+        auto overloaded = shed_as_overloaded(block(c1, std::chrono::milliseconds(50)));
+        release.signal();
+        queued.get();
+
+        // once the backlog is gone, requests that only queue briefly are
+        // served again
+        sleep(std::chrono::seconds(1)).get();
+        auto holder = block(c1, std::chrono::seconds(10));
+        wait_started(3);
+        auto brief = block(c1, std::chrono::milliseconds(50));
+        sleep(std::chrono::milliseconds(5)).get();
+        release.signal(2);
+        holder.get();
+        brief.get();
+        BOOST_REQUIRE_EQUAL(started, 4);
+
+        rpc::stats stats;
+        env.server().foreach_connection([&stats] (const rpc::server::connection& c) {
+            stats = c.get_stats();
+        });
+        BOOST_REQUIRE_EQUAL(stats.shed_overloaded + stats.shed_expired, 1);
+        BOOST_REQUIRE_EQUAL(stats.shed_overloaded, overloaded ? 1 : 0);
+        BOOST_REQUIRE_EQUAL(stats.shed_timed_out, 0);
+    }).get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_fragmented_bytes) {
+    rpc_test_env<>::do_with_thread(rpc_test_config(), [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        env.register_handler(1, [] (int a, rpc::fragmented_bytes b, int c) {
+            return rpc::tuple<int, rpc::fragmented_bytes>(a + c, std::move(b));
+        }).get();
+        auto echo = env.proto().make_client<rpc::tuple<int, rpc::fragmented_bytes> (int, rpc::fragmented_bytes, int)>(1);
+
+        std::vector<temporary_buffer<char>> fragments;
+        for (char c : {'a', 'b', 'c'}) {
+            temporary_buffer<char> f(100 * 1024);
+            std::fill_n(f.get_write(), f.size(), c);
+            fragments.push_back(std::move(f));
+        }
+        rpc::fragmented_bytes payload(std::move(fragments));
+        auto [sum, received] = echo(c1, 1, payload, 2).get0();
+        BOOST_REQUIRE_EQUAL(sum, 3);
+        BOOST_REQUIRE_EQUAL(received.size(), 300 * 1024);
+        BOOST_REQUIRE(received == payload);
+        auto flat = received.linearize();
+        BOOST_REQUIRE_EQUAL(flat.size(), received.size());
+        BOOST_REQUIRE_EQUAL(flat[150 * 1024], 'b');
+
+        auto [sum2, empty] = echo(c1, 3, rpc::fragmented_bytes(), 4).get0();
+        BOOST_REQUIRE_EQUAL(sum2, 7);
+        BOOST_REQUIRE(empty.empty());
+        BOOST_REQUIRE(empty.fragments().empty());
+    }).get();
+}
+
+// a socket that must not be used, see test_stream_multiplexing
+class unused_socket_impl : public ::net::socket_impl {
+public:
+    virtual future<connected_socket> connect(socket_address sa, socket_address local, transport proto = transport::TCP) override {
+        return make_exception_future<connected_socket>(std::runtime_error("stream did not use the parent connection"));
+    }
+    virtual void set_reuseaddr(bool reuseaddr) override {}
+    virtual bool get_reuseaddr() const override { return false; };
+    virtual void shutdown() override {}
+};
+
+static void test_stream_multiplexing_with(size_t client_window, size_t server_max_window) {
+    rpc_test_config cfg;
+    cfg.server_options.streaming_domain = rpc::streaming_domain_type(1);
+    cfg.server_options.max_stream_window = server_max_window;
+    rpc::client_options co;
+    co.stream_multiplexing.enabled = true;
+    co.stream_multiplexing.window = client_window;
+    co.stream_multiplexing.max_chunk = 1024;
+    rpc_test_env<>::do_with_thread(cfg, co, [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        env.register_handler(1, [] (int a, int b) {
+            return a + b;
+        }).get();
+        semaphore release(0);
+        int received = 0;
+        future<> server_done = make_ready_future<>();
+        env.register_handler(2, [&] (rpc::source<sstring> source) {
+            // don't read anything until told to, so the sender runs out of window
+            server_done = release.wait().then([source, &received] () mutable {
+                return repeat([source, &received] () mutable {
+                    return source().then([&received] (std::optional<std::tuple<sstring>> data) {
+                        if (!data) {
+                            return stop_iteration::yes;
+                        }
+                        received++;
+                        return stop_iteration::no;
+                    });
+                });
+            });
+        }).get();
+        auto sum = env.proto().make_client<int (int, int)>(1);
+        auto bulk = env.proto().make_client<void (rpc::sink<sstring>)>(2);
+
+        auto sink = c1.make_stream_sink<serializer, sstring>(seastar::socket(std::make_unique<unused_socket_impl>())).get0();
+        bulk(c1, sink).get();
+        auto writer = seastar::async([sink] () mutable {
+            for (int i = 0; i < 32; i++) {
+                sink(sstring(1000, 'x')).get();
+            }
+            sink.flush().get();
+        });
+        // the stalled stream must not hold up ordinary messages
+        for (int i = 0; i < 10; i++) {
+            BOOST_REQUIRE_EQUAL(sum(c1, i, 1).get0(), i + 1);
+        }
+        BOOST_REQUIRE_EQUAL(received, 0);
+        // the window is too small for all the data
+        BOOST_REQUIRE(!writer.available());
+        release.signal();
+        writer.get();
+        sink.close().get();
+        server_done.get();
+        BOOST_REQUIRE_EQUAL(received, 32);
+    }).get();
+}
+
+// A small write leaves the sender short of a whole window of credit; the
+// receiver must return it even though it is less than it batches.
+SEASTAR_THREAD_TEST_CASE(test_stream_multiplexing_small_then_large) {
+    rpc_test_config cfg;
+    cfg.server_options.streaming_domain = rpc::streaming_domain_type(1);
+    rpc::client_options co;
+    co.stream_multiplexing.enabled = true;
+    co.stream_multiplexing.window = 64 * 1024;
+    co.stream_multiplexing.max_chunk = 64 * 1024;
+    rpc_test_env<>::do_with_thread(cfg, co, [] (rpc_test_env<>& env, test_rpc_proto::client& c1) {
+        std::vector<size_t> received;
+        future<> server_done = make_ready_future<>();
+        env.register_handler(1, [&] (rpc::source<sstring> source) {
+            server_done = repeat([source, &received] () mutable {
+                return source().then([&received] (std::optional<std::tuple<sstring>> data) {
+                    if (!data) {
+                        return stop_iteration::yes;
+                    }
+                    received.push_back(std::get<0>(*data).size());
+                    return stop_iteration::no;
+                });
+            });
+        }).get();
+        auto bulk = env.proto().make_client<void (rpc::sink<sstring>)>(1);
+
+        auto sink = c1.make_stream_sink<serializer, sstring>(seastar::socket(std::make_unique<unused_socket_impl>())).get0();
+        bulk(c1, sink).get();
+        sink(sstring(100, 'x')).get();
+        sink.flush().get();
+        sink(sstring(64 * 1024, 'x')).get();
+        sink.flush().get();
+        sink.close().get();
+        server_done.get();
+        BOOST_REQUIRE_EQUAL(received.size(), 2);
+        BOOST_REQUIRE_EQUAL(received[1], 64 * 1024);
+    }).get();
+}
+
+SEASTAR_THREAD_TEST_CASE(test_stream_multiplexing) {
+    test_stream_multiplexing_with(4096, rpc::server_options().max_stream_window);
+    // a window larger than the server accepts is lowered to its maximum
+    test_stream_multiplexing_with(1024 * 1024, 4096);
+}
+
+SEASTAR_THREAD_TEST_CASE(test_rpc_over_shared_memory) {
+    auto addr = socket_address(unix_domain_addr(std::string(1, '\0') + "seastar_rpc_test_shm_" + std::to_string(::getpid())));
+    net::shm_listen_options lo;
+    lo.ring_size = 64 * 1024;
+    test_rpc_proto proto(serializer{});
+    test_rpc_proto::server server(proto, net::shm_listen(addr, lo));
+    auto stop_server = defer([&server] { server.stop().get(); });
+    proto.register_handler(1, [] (sstring s) {
+        return s + s;
+    });
+    test_rpc_proto::client client(proto, rpc::client_options{}, net::make_shm_socket(), addr);
+    auto stop_client = defer([&client] { client.stop().get(); });
+    auto twice = proto.make_client<sstring (sstring)>(1);
+
+    BOOST_REQUIRE_EQUAL(twice(client, "hello").get0(), "hellohello");
+    // larger than the rings, so both sides have to wait for each other
+    auto large = sstring(1024 * 1024, 'x');
+    BOOST_REQUIRE_EQUAL(twice(client, large).get0(), large + large);
+    std::vector<future<sstring>> fs;
+    for (int i = 0; i < 100; i++) {
+        fs.push_back(twice(client, format("msg{}", i)));
+    }
+    for (int i = 0; i < 100; i++) {
+        BOOST_REQUIRE_EQUAL(fs[i].get0(), format("msg{}msg{}", i, i));
+    }
+}
+
+// A server that hands the client a segment that does not match the ring
+// size it announces must not get it to map or touch memory it cannot.
+SEASTAR_THREAD_TEST_CASE(test_shared_memory_bad_hello) {
+    // the layout of the server's hello
+    struct hello {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t ring_size;
+    };
+    auto addr = socket_address(unix_domain_addr(std::string(1, '\0') + "seastar_rpc_test_shm_hello_" + std::to_string(::getpid())));
+    auto listener = engine().posix_listen(addr);
+    auto try_connect = [&] (uint64_t ring_size, size_t segment_size) {
+        auto sock = net::make_shm_socket();
+        auto connected = sock.connect(addr);
+        auto control = std::get<0>(listener.accept().get0());
+        int mfd = ::memfd_create("seastar-shm-rpc-test", MFD_CLOEXEC);
+        BOOST_REQUIRE_NE(mfd, -1);
+        auto segment_fd = file_desc::from_fd(mfd);
+        segment_fd.truncate(segment_size);
+        auto doorbell1 = file_desc::eventfd(0, EFD_CLOEXEC);
+        auto doorbell2 = file_desc::eventfd(0, EFD_CLOEXEC);
+        hello h{0x53484d52, 1, ring_size};
+        iovec iov{&h, sizeof(h)};
+        int fds[] = {segment_fd.get(), doorbell1.get(), doorbell2.get()};
+        alignas(cmsghdr) char control_buf[CMSG_SPACE(sizeof(fds))];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control_buf;
+        msg.msg_controllen = sizeof(control_buf);
+        auto c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(fds));
+        std::memcpy(CMSG_DATA(c), fds, sizeof(fds));
+        BOOST_REQUIRE_EQUAL(control.sendmsg(&msg).get0(), sizeof(h));
+        BOOST_REQUIRE_THROW(connected.get(), std::runtime_error);
+    };
+    try_connect(0, 1 << 20);
+    try_connect(3 * 4096, 1 << 20);
+    try_connect(uint64_t(1) << 40, 1 << 20);
+    // a segment too small for the rings
+    try_connect(64 * 1024, 4096);
+}
+
 // Test reproducing issue #671: If timeout is time_point::max(), translating
 // it to relative timeout in the sender and then back in the receiver, when
 // these calculations happen across a millisecond boundary, overflowed the
@@ -29,10 +29,14 @@
 #include <seastar/core/loop.hh>
 #include <seastar/core/sharded.hh>
 #include <seastar/core/thread.hh>
+#include <seastar/core/sleep.hh>
 #include <seastar/core/gate.hh>
 #include <seastar/core/temporary_buffer.hh>
 #include <seastar/core/iostream.hh>
+#include <seastar/core/metrics_api.hh>
+#include <seastar/core/posix.hh>
 #include <seastar/util/std-compat.hh>
+#include <seastar/util/defer.hh>
 #include <seastar/net/tls.hh>
 #include <seastar/net/dns.hh>
 #include <seastar/net/inet_address.hh>
@@ -43,6 +47,8 @@
 #include "tmpdir.hh"
 
 #include <gnutls/gnutls.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
 
 #if 0
 
@@ -314,14 +320,16 @@ class echoserver {
     size_t _size;
     std::exception_ptr _ex;
 public:
-    echoserver(size_t message_size, bool use_dh_params = true)
+    echoserver(size_t message_size, bool use_dh_params = true, bool kernel_tls = false)
             : _certs(
                     use_dh_params 
                         ? ::make_shared<tls::server_credentials>(::make_shared<tls::dh_params>())
                         : ::make_shared<tls::server_credentials>()
                     )
             , _size(message_size)
-    {}
+    {
+        _certs->set_kernel_tls_offload(kernel_tls);
+    }
 
     future<> listen(socket_address addr, sstring crtfile, sstring keyfile, tls::client_auth ca = tls::client_auth::NONE, sstring trust = {}) {
         _certs->set_client_auth(ca);
@@ -390,7 +398,8 @@ static future<> run_echo_test(sstring message,
                 sstring client_key = {},
                 bool do_read = true,
                 bool use_dh_params = true,
-                tls::dn_callback distinguished_name_callback = {}
+                tls::dn_callback distinguished_name_callback = {},
+                bool kernel_tls = false
 )
 {
     static const auto port = 4711;
@@ -402,6 +411,8 @@ static future<> run_echo_test(sstring message,
 
     assert(do_read || loops == 1);
 
+    certs->set_kernel_tls_offload(kernel_tls);
+
     future<> f = make_ready_future();
 
     if (!client_crt.empty() && !client_key.empty()) {
@@ -414,7 +425,7 @@ static future<> run_echo_test(sstring message,
     return f.then([=] {
         return certs->set_x509_trust_file(trust, tls::x509_crt_format::PEM);
     }).then([=] {
-        return server->start(msg->size(), use_dh_params).then([=]() {
+        return server->start(msg->size(), use_dh_params, kernel_tls).then([=]() {
             sstring server_trust;
             if (ca != tls::client_auth::NONE) {
                 server_trust = trust;
@@ -535,6 +546,66 @@ SEASTAR_TEST_CASE(test_large_message_x509_client_server) {
     return run_echo_test(std::move(msg), 20, "tests/unit/catest.pem", "test.scylladb.org");
 }
 
+// Whether the tls ULP can be installed on a TCP connection, loading the
+// kernel module if need be.
+static bool kernel_has_tls_ulp() {
+    auto listener = file_desc::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC);
+    socket_address sa(ipv4_addr("127.0.0.1", 0));
+    listener.bind(sa.u.sa, sizeof(sa.u.in));
+    listener.listen(1);
+    auto bound = listener.get_address();
+    auto client = file_desc::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC);
+    client.connect(bound.u.sa, sizeof(bound.u.in));
+    static constexpr char ulp_name[] = "tls";
+    return ::setsockopt(client.get(), SOL_TCP, TCP_ULP, ulp_name, sizeof(ulp_name)) == 0;
+}
+
+SEASTAR_THREAD_TEST_CASE(test_kernel_tls_x509_client_server) {
+    if (!kernel_has_tls_ulp()) {
+        BOOST_TEST_MESSAGE("Skipping kTLS test: the kernel has no tls module");
+        return;
+    }
+    sstring msg = uninitialized_string(512 * 1024);
+    for (size_t i = 0; i < msg.size(); ++i) {
+        msg[i] = '0' + char(i % 30);
+    }
+    run_echo_test(msg, 20, "tests/unit/catest.pem", "test.scylladb.org",
+        "tests/unit/test.crt", "tests/unit/test.key", tls::client_auth::NONE,
+        {}, {}, true, true, {}, /* kernel_tls */ true
+    ).get();
+
+    // The test certificate negotiates an AES-GCM cipher the kernel
+    // supports, so the transmit side must really have been offloaded.
+    auto addr = ::make_ipv4_address({0x7f000001, 4711});
+    seastar::sharded<echoserver> server;
+    server.start(msg.size(), true, true).get();
+    auto stop_server = defer([&server] () noexcept {
+        server.stop().get();
+    });
+    server.invoke_on_all(&echoserver::listen, addr, sstring("tests/unit/test.crt"), sstring("tests/unit/test.key"),
+            tls::client_auth::NONE, sstring()).get();
+
+    auto certs = ::make_shared<tls::certificate_credentials>();
+    certs->set_kernel_tls_offload(true);
+    certs->set_x509_trust_file("tests/unit/catest.pem", tls::x509_crt_format::PEM).get();
+    auto s = tls::connect(certs, addr, "test.scylladb.org").get0();
+    auto in = s.input();
+    auto out = s.output();
+    out.write(msg).get();
+    out.flush().get();
+    auto buf = in.read_exactly(msg.size()).get0();
+    BOOST_REQUIRE(std::string_view(buf.get(), buf.size()) == std::string_view(msg));
+
+    char ulp[16] = {};
+    s.get_sockopt(SOL_TCP, TCP_ULP, ulp, sizeof(ulp));
+    BOOST_REQUIRE_EQUAL(std::string_view(ulp), "tls");
+    // the ULP is installed before the keys, which it can outlive
+    tls_crypto_info info = {};
+    BOOST_REQUIRE_NO_THROW(s.get_sockopt(SOL_TLS, TLS_TX, &info, sizeof(info)));
+    BOOST_REQUIRE_NE(info.cipher_type, 0);
+    out.close().get();
+}
+
 SEASTAR_TEST_CASE(test_simple_x509_client_server_fail_client_auth) {
     // Make sure we load our own auth trust pem file, otherwise our certs
     // will not validate
@@ -683,6 +754,200 @@ SEASTAR_THREAD_TEST_CASE(test_close_timout) {
     sem.wait(2 * iterations).get();
 }
 
+static int64_t get_handshake_count(sstring name, sstring role) {
+    namespace smi = seastar::metrics::impl;
+    auto all_metrics = smi::get_values();
+    const auto& all_metadata = *all_metrics->metadata;
+    for (size_t i = 0; i < all_metadata.size(); ++i) {
+        if (all_metadata[i].mf.name != "tls_" + name) {
+            continue;
+        }
+        for (size_t j = 0; j < all_metadata[i].metrics.size(); ++j) {
+            if (all_metadata[i].metrics[j].id.labels().at("role") == role) {
+                return all_metrics->values[i][j].i();
+            }
+        }
+    }
+    return 0;
+}
+
+SEASTAR_THREAD_TEST_CASE(test_session_resumption) {
+    tls::credentials_builder b;
+
+    b.set_x509_key_file("tests/unit/test.crt", "tests/unit/test.key", tls::x509_crt_format::PEM).get();
+    b.set_x509_trust_file("tests/unit/catest.pem", tls::x509_crt_format::PEM).get();
+    b.set_dh_level();
+    b.set_session_cache_size(16);
+    b.enable_session_tickets();
+
+    auto creds = b.build_certificate_credentials();
+    auto serv = b.build_server_credentials();
+
+    auto full = get_handshake_count("full_handshakes", "client");
+    auto resumed = get_handshake_count("resumed_handshakes", "client");
+
+    for (int i = 0; i < 3; ++i) {
+        auto b1 = ::make_lw_shared<loopback_buffer>(nullptr, loopback_buffer::type::SERVER_TX);
+        auto b2 = ::make_lw_shared<loopback_buffer>(nullptr, loopback_buffer::type::CLIENT_TX);
+        auto ss = tls::wrap_server(serv, connected_socket(std::make_unique<loopback_connected_socket_impl>(b1, b2))).get0();
+        auto cs = tls::wrap_client(creds, connected_socket(std::make_unique<loopback_connected_socket_impl>(b2, b1)), "test.scylladb.org").get0();
+
+        auto cout = cs.output();
+        auto cin = cs.input();
+        auto sout = ss.output();
+        auto sin = ss.input();
+
+        // ping-pong, so that the client also gets to see any
+        // post-handshake session tickets.
+        cout.write("apa").get();
+        auto f = cout.flush();
+        BOOST_REQUIRE_EQUAL(sin.read_exactly(3).get0().size(), 3u);
+        f.get();
+        sout.write("bepa").get();
+        auto f2 = sout.flush();
+        BOOST_REQUIRE_EQUAL(cin.read_exactly(4).get0().size(), 4u);
+        f2.get();
+
+        cout.close().get();
+        sout.close().get();
+    }
+
+    BOOST_REQUIRE_EQUAL(get_handshake_count("full_handshakes", "client") - full, 1);
+    BOOST_REQUIRE_EQUAL(get_handshake_count("resumed_handshakes", "client") - resumed, 2);
+}
+
+SEASTAR_THREAD_TEST_CASE(test_handshake_scheduling_group_and_limit) {
+    auto sg = create_scheduling_group("tls_handshakes", 100).get0();
+    auto destroy_sg = defer([sg] { destroy_scheduling_group(sg).get(); });
+
+    tls::credentials_builder b;
+
+    b.set_x509_key_file("tests/unit/test.crt", "tests/unit/test.key", tls::x509_crt_format::PEM).get();
+    b.set_x509_trust_file("tests/unit/catest.pem", tls::x509_crt_format::PEM).get();
+    b.set_dh_level();
+    b.set_client_auth(tls::client_auth::REQUIRE);
+
+    // limits only on the server side. client handshakes waiting for
+    // server handshakes waiting for client handshakes would deadlock.
+    auto creds = b.build_certificate_credentials();
+
+    b.set_handshake_scheduling_group(sg);
+    b.set_max_concurrent_handshakes(1);
+
+    auto serv = b.build_server_credentials();
+
+    size_t handshakes = 0;
+    serv->set_dn_verification_callback([&](tls::session_type, sstring, sstring) {
+        BOOST_REQUIRE(current_scheduling_group() == sg);
+        ++handshakes;
+    });
+
+    constexpr size_t connections = 8;
+
+    parallel_for_each(boost::irange(size_t(0), connections), [&](size_t) {
+        return async([&] {
+            auto b1 = ::make_lw_shared<loopback_buffer>(nullptr, loopback_buffer::type::SERVER_TX);
+            auto b2 = ::make_lw_shared<loopback_buffer>(nullptr, loopback_buffer::type::CLIENT_TX);
+            auto ss = tls::wrap_server(serv, connected_socket(std::make_unique<loopback_connected_socket_impl>(b1, b2))).get0();
+            auto cs = tls::wrap_client(creds, connected_socket(std::make_unique<loopback_connected_socket_impl>(b2, b1)), "test.scylladb.org").get0();
+
+            auto cout = cs.output();
+            auto sin = ss.input();
+
+            cout.write("apa").get();
+            auto f = cout.flush();
+            BOOST_REQUIRE_EQUAL(sin.read_exactly(3).get0().size(), 3u);
+            f.get();
+            cout.close().get();
+        });
+    }).get();
+
+    BOOST_REQUIRE_EQUAL(handshakes, connections);
+}
+
+SEASTAR_THREAD_TEST_CASE(test_handshake_limit_and_timeout) {
+    tls::credentials_builder b;
+
+    b.set_x509_key_file("tests/unit/test.crt", "tests/unit/test.key", tls::x509_crt_format::PEM).get();
+    b.set_x509_trust_file("tests/unit/catest.pem", tls::x509_crt_format::PEM).get();
+    b.set_dh_level();
+
+    auto creds = b.build_certificate_credentials();
+    b.set_max_concurrent_handshakes(1, std::chrono::milliseconds(500));
+    auto serv = b.build_server_credentials();
+
+    // a server side session whose peer never says a word, and that peer
+    auto connect_stalled = [&] {
+        auto b1 = ::make_lw_shared<loopback_buffer>(nullptr, loopback_buffer::type::SERVER_TX);
+        auto b2 = ::make_lw_shared<loopback_buffer>(nullptr, loopback_buffer::type::CLIENT_TX);
+        auto ss = tls::wrap_server(serv, connected_socket(std::make_unique<loopback_connected_socket_impl>(b1, b2))).get0();
+        auto peer = connected_socket(std::make_unique<loopback_connected_socket_impl>(b2, b1));
+        return std::make_pair(std::move(ss), std::move(peer));
+    };
+    // sends "apa" over a new connection, once the server handshake is done
+    auto send = [&] (connected_socket& ss, connected_socket& cs) {
+        auto b1 = ::make_lw_shared<loopback_buffer>(nullptr, loopback_buffer::type::SERVER_TX);
+        auto b2 = ::make_lw_shared<loopback_buffer>(nullptr, loopback_buffer::type::CLIENT_TX);
+        ss = tls::wrap_server(serv, connected_socket(std::make_unique<loopback_connected_socket_impl>(b1, b2))).get0();
+        cs = tls::wrap_client(creds, connected_socket(std::make_unique<loopback_connected_socket_impl>(b2, b1)), "test.scylladb.org").get0();
+        return async([&ss, &cs] {
+            auto sin = ss.input();
+            auto cout = cs.output();
+            cout.write("apa").get();
+            auto f = cout.flush();
+            BOOST_REQUIRE_EQUAL(sin.read_exactly(3).get0().size(), 3u);
+            f.get();
+            cout.close().get();
+        });
+    };
+
+    {
+        auto [stalled, peer] = connect_stalled();
+        auto stalled_in = stalled.input();
+        auto stalled_read = stalled_in.read();
+        sleep(std::chrono::milliseconds(10)).get();
+
+        connected_socket ss, cs;
+        auto sent = send(ss, cs);
+        sleep(std::chrono::milliseconds(100)).get();
+        // one handshake at a time
+        BOOST_REQUIRE(!sent.available());
+        // the next one runs once the first one is over
+        auto peer_out = peer.output();
+        peer_out.close().get();
+        BOOST_REQUIRE_THROW(stalled_read.get(), std::exception);
+        sent.get();
+    }
+    {
+        auto [stalled, peer] = connect_stalled();
+        auto stalled_in = stalled.input();
+        auto stalled_read = stalled_in.read();
+        sleep(std::chrono::milliseconds(10)).get();
+
+        // the stalled handshake gives its turn up after the timeout
+        connected_socket ss, cs;
+        auto start = std::chrono::steady_clock::now();
+        send(ss, cs).get();
+        BOOST_REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(400));
+        BOOST_REQUIRE_THROW(stalled_read.get(), std::system_error);
+    }
+    {
+        auto [stalled, peer] = connect_stalled();
+        auto stalled_in = stalled.input();
+        auto stalled_read = stalled_in.read();
+        sleep(std::chrono::milliseconds(10)).get();
+
+        // a new limit applies to new handshakes, the one holding the old
+        // limit's turn finishes with it
+        serv->set_max_concurrent_handshakes(1, std::chrono::seconds(10));
+        connected_socket ss, cs;
+        send(ss, cs).get();
+        auto peer_out = peer.output();
+        peer_out.close().get();
+        BOOST_REQUIRE_THROW(stalled_read.get(), std::exception);
+    }
+}
+
 SEASTAR_THREAD_TEST_CASE(test_reload_certificates) {
     tmpdir tmp;
 